@@ -0,0 +1,266 @@
+/*! \file format_bench.c
+ *
+ * Host benchmark of the util_format formatters against chprintf
+ *
+ * Formats the same arrays the way util_messages used to, one chprintf per
+ * element and separator, and the way it does now, util_format into a
+ * chunk buffer written with one streamWrite per chunk. Both write to the
+ * same RAM stream, a stand in for the shell response buffer. The outputs
+ * are compared first, a mismatch fails the run.
+ *
+ * ./format_bench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hal.h"
+#include "chprintf.h"
+#include "util_format.h"
+
+#define ARRAY_COUNT   64
+#define OUTPUT_SIZE   2048
+#define CHUNK_SIZE    64
+#define ELEMENT_MAX   (UTIL_FORMAT_INT32_MAX + 1)
+
+#define NELEMS(x) (sizeof(x) / sizeof((x)[0]))
+
+/*! \brief RAM stream that wraps around, like the response buffer
+ */
+typedef struct {
+  const struct BaseSequentialStreamVMT * vmt;
+  uint8_t buffer[OUTPUT_SIZE];
+  size_t length;
+} ram_stream_t;
+
+static size_t ram_write(void * ip, const uint8_t * bp, size_t n)
+{
+  ram_stream_t * rp = (ram_stream_t *)ip;
+
+  if( rp->length + n > sizeof(rp->buffer) )
+  {
+    rp->length = 0;
+  }
+  memcpy(&rp->buffer[rp->length], bp, n);
+  rp->length += n;
+
+  return n;
+}
+
+static size_t ram_read(void * ip, uint8_t * bp, size_t n)
+{
+  (void)ip;
+  (void)bp;
+  (void)n;
+
+  return 0;
+}
+
+static msg_t ram_put(void * ip, uint8_t b)
+{
+  ram_stream_t * rp = (ram_stream_t *)ip;
+
+  if( rp->length == sizeof(rp->buffer) )
+  {
+    rp->length = 0;
+  }
+  rp->buffer[rp->length++] = b;
+
+  return MSG_OK;
+}
+
+static msg_t ram_get(void * ip)
+{
+  (void)ip;
+
+  return MSG_RESET;
+}
+
+static const struct BaseSequentialStreamVMT ram_vmt = {
+  ram_write, ram_read, ram_put, ram_get
+};
+
+static ram_stream_t ram = { &ram_vmt, {0}, 0 };
+
+typedef enum {
+  KIND_UINT,
+  KIND_INT,
+  KIND_HEX8,
+  KIND_HEX16,
+  KIND_HEX32
+} kind_t;
+
+typedef struct {
+  const char * name;
+  kind_t kind;
+  uint8_t bits;               // element width
+  const char * format;        // chprintf format of one element
+} bench_case_t;
+
+static const bench_case_t cases[] = {
+  { "uint16_array",     KIND_UINT,  16, "%u" },
+  { "uint32_array",     KIND_UINT,  32, "%u" },
+  { "int16_array",      KIND_INT,   16, "%d" },
+  { "hex_uint8_array",  KIND_HEX8,   8, "%02X" },
+  { "hex_uint16_array", KIND_HEX16, 16, "%04X" },
+  { "hex_uint32_array", KIND_HEX32, 32, "%08X" },
+};
+
+static uint32_t data[NELEMS(cases)][ARRAY_COUNT];
+
+static const uint32_t edges[] = {
+  0, 1, 9, 10, 99, 100, 999, 1000, 9999, 10000, 99999, 100000,
+  999999999, 1000000000, 0x7fffffff, 0x80000000, 0xffffffff
+};
+
+/*! \brief digit count edges, then pseudo random values over the full range
+ * of each element type
+ */
+static void fill_data(void)
+{
+  uint32_t seed = 12345;
+
+  for( size_t c = 0; c < NELEMS(cases); c++ )
+  {
+    for( size_t i = 0; i < ARRAY_COUNT; i++ )
+    {
+      uint32_t value;
+
+      seed = seed * 1103515245 + 12345;
+      value = (i < NELEMS(edges)) ? edges[i] : seed ^ (seed >> 15);
+      if( cases[c].bits < 32 )
+      {
+        value &= (1u << cases[c].bits) - 1;
+      }
+      if( cases[c].kind == KIND_INT && cases[c].bits == 16 )
+      {
+        value = (uint32_t)(int32_t)(int16_t)value;
+      }
+      data[c][i] = value;
+    }
+  }
+}
+
+static void array_chprintf(BaseSequentialStream * chp, const bench_case_t * bp, const uint32_t * dp)
+{
+  chprintf(chp, "U:%s:", bp->name);
+  for( size_t i = 0; i < ARRAY_COUNT; i++ )
+  {
+    chprintf(chp, bp->format, dp[i]);
+    if( i + 1 < ARRAY_COUNT )
+    {
+      chprintf(chp, ",");
+    }
+  }
+  chprintf(chp, "\r\n");
+}
+
+static void array_format(BaseSequentialStream * chp, const bench_case_t * bp, const uint32_t * dp)
+{
+  char buffer[CHUNK_SIZE];
+  char * p = buffer;
+
+  chprintf(chp, "U:%s:", bp->name);
+  for( size_t i = 0; i < ARRAY_COUNT; i++ )
+  {
+    switch( bp->kind )
+    {
+      case KIND_UINT:  p = util_format_uint32(p, dp[i]); break;
+      case KIND_INT:   p = util_format_int32(p, (int32_t)dp[i]); break;
+      case KIND_HEX8:  p = util_format_hex8(p, dp[i]); break;
+      case KIND_HEX16: p = util_format_hex16(p, dp[i]); break;
+      case KIND_HEX32: p = util_format_hex32(p, dp[i]); break;
+    }
+    if( i + 1 < ARRAY_COUNT )
+    {
+      *p++ = ',';
+    }
+    if( p - buffer > CHUNK_SIZE - ELEMENT_MAX )
+    {
+      streamWrite(chp, (const uint8_t *)buffer, p - buffer);
+      p = buffer;
+    }
+  }
+  *p++ = '\r';
+  *p++ = '\n';
+  streamWrite(chp, (const uint8_t *)buffer, p - buffer);
+}
+
+static bool check(const bench_case_t * bp, const uint32_t * dp)
+{
+  static uint8_t expected[OUTPUT_SIZE];
+  size_t length;
+
+  ram.length = 0;
+  array_chprintf((BaseSequentialStream *)&ram, bp, dp);
+  length = ram.length;
+  memcpy(expected, ram.buffer, length);
+
+  ram.length = 0;
+  array_format((BaseSequentialStream *)&ram, bp, dp);
+  if( ram.length != length || memcmp(expected, ram.buffer, length) != 0 )
+  {
+    printf("%s: output differs\n  chprintf:    %.*s  util_format: %.*s",
+           bp->name, (int)length, expected, (int)ram.length, ram.buffer);
+    return false;
+  }
+  return true;
+}
+
+static double now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double run(void (*fn)(BaseSequentialStream *, const bench_case_t *, const uint32_t *),
+                  const bench_case_t * bp, const uint32_t * dp, long iterations)
+{
+  double start = now_ns();
+
+  for( long i = 0; i < iterations; i++ )
+  {
+    fn((BaseSequentialStream *)&ram, bp, dp);
+  }
+
+  return (now_ns() - start) / ((double)iterations * ARRAY_COUNT);
+}
+
+int main(int argc, char * argv[])
+{
+  long iterations = (argc > 1) ? atol(argv[1]) : 20000;
+  bool ok = true;
+
+  if( iterations <= 0 )
+  {
+    fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+    return 2;
+  }
+
+  fill_data();
+
+  for( size_t c = 0; c < NELEMS(cases); c++ )
+  {
+    ok = check(&cases[c], data[c]) && ok;
+  }
+  if( !ok )
+  {
+    return 1;
+  }
+
+  printf("%-18s %14s %14s %8s\n", "array", "chprintf_ns", "format_ns", "speedup");
+  for( size_t c = 0; c < NELEMS(cases); c++ )
+  {
+    double slow = run(array_chprintf, &cases[c], data[c], iterations);
+    double fast = run(array_format, &cases[c], data[c], iterations);
+
+    printf("%-18s %14.1f %14.1f %7.1fx\n", cases[c].name, slow, fast, slow / fast);
+  }
+  printf("ns per element, %d elements, %ld iterations\n", ARRAY_COUNT, iterations);
+
+  return 0;
+}
@@ -0,0 +1,49 @@
+/*! \file hal.h
+ *
+ * Just enough of the ChibiOS stream interface to build chprintf.c and
+ * memstreams.c on the host
+ */
+
+#ifndef FORMAT_BENCH_HAL_H_
+#define FORMAT_BENCH_HAL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdarg.h>
+
+#ifndef TRUE
+#define TRUE  1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+typedef int32_t msg_t;
+
+#define MSG_OK     (msg_t)0
+#define MSG_RESET  (msg_t)-2
+
+#define _base_sequential_stream_methods                                     \
+  size_t (*write)(void *instance, const uint8_t *bp, size_t n);             \
+  size_t (*read)(void *instance, uint8_t *bp, size_t n);                    \
+  msg_t (*put)(void *instance, uint8_t b);                                  \
+  msg_t (*get)(void *instance);
+
+#define _base_sequential_stream_data
+
+struct BaseSequentialStreamVMT {
+  _base_sequential_stream_methods
+};
+
+typedef struct {
+  const struct BaseSequentialStreamVMT *vmt;
+  _base_sequential_stream_data
+} BaseSequentialStream;
+
+#define streamWrite(ip, bp, n) ((ip)->vmt->write(ip, bp, n))
+#define streamRead(ip, bp, n)  ((ip)->vmt->read(ip, bp, n))
+#define streamPut(ip, b)       ((ip)->vmt->put(ip, b))
+#define streamGet(ip)          ((ip)->vmt->get(ip))
+
+#endif
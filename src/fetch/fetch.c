@@ -18,6 +18,7 @@
 #include "util_version.h"
 #include "util_io.h"
 #include "util_arg_parse.h"
+#include "util_timebase.h"
 
 #include "fetch_defs.h"
 #include "fetch_commands.h"
@@ -196,14 +197,26 @@ bool fetch_help_cmd( BaseSequentialStream * chp, uint32_t argc, char * argv[] )
   FETCH_HELP_DES(chp, "Display adc help");
   FETCH_HELP_CMD(chp, "dac.help");
   FETCH_HELP_DES(chp, "Display dac help");
+  FETCH_HELP_CMD(chp, "can.help");
+  FETCH_HELP_DES(chp, "Display can help");
   FETCH_HELP_CMD(chp, "spi.help");
   FETCH_HELP_DES(chp, "Display spi help");
   FETCH_HELP_CMD(chp, "i2c.help");
   FETCH_HELP_DES(chp, "Display i2c help");
   FETCH_HELP_CMD(chp, "mbus.help");
   FETCH_HELP_DES(chp, "Display mbus help");
+  FETCH_HELP_CMD(chp, "sd.help");
+  FETCH_HELP_DES(chp, "Display sd card help");
+  FETCH_HELP_CMD(chp, "mcard.help");
+  FETCH_HELP_DES(chp, "Display sd card recorder help");
+  FETCH_HELP_CMD(chp, "mpipe.help");
+  FETCH_HELP_DES(chp, "Display mpipe help");
+  FETCH_HELP_CMD(chp, "stream.help");
+  FETCH_HELP_DES(chp, "Display stream health help");
   FETCH_HELP_CMD(chp, "clocks");
   FETCH_HELP_DES(chp, "Display info about internal clocks");
+  FETCH_HELP_CMD(chp, "timestamp");
+  FETCH_HELP_DES(chp, "Query the 32 bit microsecond timebase of stream timestamps");
   FETCH_HELP_CMD(chp, "reset");
   FETCH_HELP_DES(chp, "Reset all peripheral modules");
   FETCH_HELP_CMD(chp, "chipid");
@@ -223,6 +236,16 @@ bool fetch_version_cmd( BaseSequentialStream * chp, uint32_t argc, char * argv[]
 	return true;
 }
 
+bool fetch_timestamp_cmd( BaseSequentialStream * chp, uint32_t argc, char * argv[] )
+{
+  FETCH_MAX_ARGS(chp, argc, 0);
+
+  util_message_uint32(chp, "timestamp", util_timebase_now());
+  util_message_uint32(chp, "timebase_hz", UTIL_TIMEBASE_FREQ);
+
+  return true;
+}
+
 bool fetch_chip_id_cmd( BaseSequentialStream * chp, uint32_t argc, char * argv[] )
 {
   FETCH_MAX_ARGS(chp, argc, 0);
@@ -244,12 +267,16 @@ bool fetch_reset_cmd( BaseSequentialStream * chp, uint32_t argc, char * argv[] )
   // Add any new peripheral reset functions here
   fetch_adc_reset(chp);
   fetch_dac_reset(chp);
+  fetch_can_reset(chp);
   fetch_spi_reset(chp);
   fetch_i2c_reset(chp);
   fetch_gpio_reset(chp);
   fetch_mbus_reset(chp);
+  fetch_mcard_reset(chp);
   fetch_sd_reset(chp);
   fetch_timer_reset(chp);
+  fetch_mpipe_reset(chp);
+  fetch_stream_reset(chp);
 
   // make sure all pin assignments are set to defaults
   // ~not needed at the moment~
@@ -267,12 +294,15 @@ void fetch_init(void)
   fetch_gpio_init();
 	fetch_adc_init();
   fetch_dac_init();
+  fetch_can_init();
   fetch_spi_init();
   fetch_i2c_init();
   fetch_mbus_init();
   fetch_sd_init();
+  fetch_mcard_init();
   fetch_timer_init();
   fetch_serial_init();
+  fetch_mpipe_init();
 }
 
 bool fetch_execute( BaseSequentialStream * chp, const char * input_line )
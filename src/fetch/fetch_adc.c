@@ -16,19 +16,26 @@
 #include "hal.h"
 #include "chprintf.h"
 #include "adc_lld.h"
+// chibios header defining the stm32 timer peripheral registers
+#include "stm32_tim.h"
 
 #include "util_general.h"
 #include "util_strings.h"
 #include "util_messages.h"
 #include "util_io.h"
+#include "util_arg_parse.h"
+#include "util_spsc.h"
+#include "util_decimate.h"
+#include "util_timebase.h"
 
 #include "fetch_defs.h"
 #include "fetch.h"
 
 #include "fetch_adc.h"
 #include "mpipe.h"
+#include "mcard.h"
 
-#define FETCH_ADC_SAMPLE_DEPTH  1
+#define FETCH_ADC_DEV_COUNT     2
 
 #define FETCH_ADC2_CH_COUNT     7
 #define FETCH_ADC3_CH_COUNT     7
@@ -37,62 +44,124 @@
 #error "sample set size not large enough for number of adc channels"
 #endif
 
-#define FETCH_ADC2_BUFFER_SIZE  (FETCH_ADC_SAMPLE_DEPTH * FETCH_ADC2_CH_COUNT)
-#define FETCH_ADC3_BUFFER_SIZE  (FETCH_ADC_SAMPLE_DEPTH * FETCH_ADC3_CH_COUNT)
+// circular dma buffer holds two blocks, one is copied out while the other fills
+#define FETCH_ADC_DMA_BUFFER_SIZE  (2 * ADC_SAMPLE_BLOCK_SIZE)
 
 #ifndef FETCH_ADC_MEM_POOL_SIZE
-#define FETCH_ADC_MEM_POOL_SIZE 128
+#define FETCH_ADC_MEM_POOL_SIZE 32
 #endif
 
 #ifndef FETCH_ADC_DEFAULT_SAMPLE_RATE
 #define FETCH_ADC_DEFAULT_SAMPLE_RATE  100
 #endif
 
+// blocks per device in the lock free transport ring, must be a power of two
+#ifndef FETCH_ADC_RING_SIZE
+#define FETCH_ADC_RING_SIZE 8
+#endif
+
+#if (FETCH_ADC_RING_SIZE & (FETCH_ADC_RING_SIZE - 1)) != 0
+#error "FETCH_ADC_RING_SIZE must be a power of two"
+#endif
+
+// core memory left to other users when the capture buffer is allocated
+#ifndef FETCH_ADC_CAPTURE_RESERVE
+#define FETCH_ADC_CAPTURE_RESERVE 8192
+#endif
+
+// a single dma transfer moves at most 65535 samples
+#define FETCH_ADC_CAPTURE_MAX_SAMPLES 65534
+
+#ifndef FETCH_ADC_DEFAULT_BLOCK_DEPTH
+#define FETCH_ADC_DEFAULT_BLOCK_DEPTH  1
+#endif
+
 #ifndef FETCH_ADC_TIMER_FREQ
 #define FETCH_ADC_TIMER_FREQ 1000000
 #endif
 
+// trigger timer intervals are used as timebase ticks for the timestamps
+#if FETCH_ADC_TIMER_FREQ != UTIL_TIMEBASE_FREQ
+#error "FETCH_ADC_TIMER_FREQ must equal UTIL_TIMEBASE_FREQ"
+#endif
+
 #define ADC_CR2_EXTSEL_TIM2_TRGO (ADC_CR2_EXTSEL_2 | ADC_CR2_EXTSEL_1) // 0b0110
+#define ADC_CR2_EXTSEL_TIM3_CC1  (ADC_CR2_EXTSEL_2 | ADC_CR2_EXTSEL_1 | ADC_CR2_EXTSEL_0) // 0b0111
 #define ADC_CR2_EXTSEL_TIM3_TRGO (ADC_CR2_EXTSEL_3)                    // 0b1000
+#define ADC_CR2_EXTSEL_MASK      (ADC_CR2_EXTSEL_3 | ADC_CR2_EXTSEL_2 | ADC_CR2_EXTSEL_1 | ADC_CR2_EXTSEL_0)
+
+// inputs wired to both ADC2 and ADC3, ADC123_IN11 (PC1) and ADC123_IN13 (PC3)
+#define FETCH_ADC_INTERLEAVE_CH_A  11
+#define FETCH_ADC_INTERLEAVE_CH_B  13
+
+// adc inputs 0 ... 18, 16 - 18 are the internal sensor/vref/vbat channels of ADC1
+#define FETCH_ADC_INPUT_COUNT   19
+
+// conversion time of a 12 bit sample on top of the sample time
+#define FETCH_ADC_CONVERSION_CYCLES 12
+
+#ifndef FETCH_ADC_DEFAULT_SAMPLE_TIME
+#define FETCH_ADC_DEFAULT_SAMPLE_TIME ADC_SAMPLE_480
+#endif
 
-#define ADC_SMPR1(smp) (smp | (smp<<3) | (smp<<6) | (smp<<9) | (smp<<12) | (smp<<15) | (smp<<18) | (smp<<21) | (smp<<24))
-#define ADC_SMPR2(smp) (smp | (smp<<3) | (smp<<6) | (smp<<9) | (smp<<12) | (smp<<15) | (smp<<18) | (smp<<21) | (smp<<24) | (smp<<27))
+// adc cycles for each SMPx code
+static const uint16_t adc_sample_time_cycles[] = { 3, 15, 28, 56, 84, 112, 144, 480 };
+
+// inputs wired out on Marionette, also the default sequence
+static const uint8_t adc2_channels[FETCH_ADC2_CH_COUNT] = { 2, 6, 7, 11, 13, 14, 15 };
+static const uint8_t adc3_channels[FETCH_ADC3_CH_COUNT] = { 5, 6, 7, 8, 9, 14, 15 };
 
 static void fetch_adc_error_cb(ADCDriver * adcp, adcerror_t err);
 static void fetch_adc_end_cb(ADCDriver * adcp, adcsample_t * buffer, size_t n);
 
-static adcsample_t adc2_sample_buffer[FETCH_ADC2_BUFFER_SIZE];
-static adcsample_t adc3_sample_buffer[FETCH_ADC3_BUFFER_SIZE];
+static adcsample_t adc2_sample_buffer[FETCH_ADC_DMA_BUFFER_SIZE];
+static adcsample_t adc3_sample_buffer[FETCH_ADC_DMA_BUFFER_SIZE];
+
+static adc_sample_block_t adc_sample_block_buffer[FETCH_ADC_MEM_POOL_SIZE];
+memory_pool_t adc_sample_block_pool;
 
-static adc_sample_set_t adc_sample_set_buffer[FETCH_ADC_MEM_POOL_SIZE];
-memory_pool_t adc_sample_set_pool;
+// blocks out of the pool, updated under the system lock
+static uint32_t adc_pool_used;
+static uint32_t adc_pool_high_water;
 
-static volatile uint16_t adc2_sequence_number = 0;
-static volatile uint16_t adc3_sequence_number = 0;
+static adc_sample_block_t adc2_ring_slots[FETCH_ADC_RING_SIZE];
+static adc_sample_block_t adc3_ring_slots[FETCH_ADC_RING_SIZE];
 
-static uint16_t adc2_timer_interval = 0;
-static uint16_t adc3_timer_interval = 0;
-static uint32_t adc2_sample_rate = 0;
-static uint32_t adc3_sample_rate = 0;
+// capture and burst buffer, takes the free core memory at init
+static adcsample_t * adc_capture_buffer;
+static uint32_t adc_capture_samples;
 
+// event counts since the last adc.status
 typedef struct {
-  bool error_dmafailure;
-  bool error_overflow;
-  bool mpipe_overflow;
-  bool mcard_overflow;
-  bool mem_alloc_null;
+  uint32_t error_dmafailure;
+  uint32_t error_overflow;
+  uint32_t mpipe_overflow;
+  uint32_t mcard_overflow;
+  uint32_t mem_alloc_null;
 } adc_status_t;
 
-volatile adc_status_t adc2_status;
-volatile adc_status_t adc3_status;
+/*! \brief How sample blocks are handed to mpipe
+ *
+ * mailbox: blocks are allocated from a shared pool and posted, freed by
+ *          reference count once every consumer is done (allows mcard).
+ * ring:    blocks are written into a per device lock free ring and read
+ *          in place by the mpipe thread, no kernel locks on either side.
+ */
+typedef enum {
+  FETCH_ADC_TRANSPORT_MAILBOX,
+  FETCH_ADC_TRANSPORT_RING
+} adc_transport_t;
 
 static GPTConfig gpt2_cfg;
 static GPTConfig gpt3_cfg;
 
 /*! \brief ADC conversion group configuration
+ *
+ * The sequence and sample time registers are built from the device
+ * channel configuration by adc_conv_grp_build().
  */
 
-static ADCConversionGroup adc2_conv_grp = {
+static const ADCConversionGroup adc2_conv_grp_default = {
 	.circular        = true,
 	.num_channels    = FETCH_ADC2_CH_COUNT,
 	.end_cb          = fetch_adc_end_cb,
@@ -100,14 +169,9 @@ static ADCConversionGroup adc2_conv_grp = {
 	/* HW dependent part.*/
 	.cr1             = 0,
 	.cr2             = ADC_CR2_EXTEN_0 | ADC_CR2_EXTSEL_TIM2_TRGO, // rising edge of TIM2_TRGO
-	.smpr1           = ADC_SMPR1(ADC_SAMPLE_480),
-	.smpr2           = ADC_SMPR2(ADC_SAMPLE_480),
-	.sqr1            = ADC_SQR1_NUM_CH(FETCH_ADC2_CH_COUNT),
-	.sqr2            = ADC_SQR2_SQ7_N(15),
-	.sqr3            = ADC_SQR3_SQ1_N(2) | ADC_SQR3_SQ2_N(6) | ADC_SQR3_SQ3_N(7) | ADC_SQR3_SQ4_N(11) | ADC_SQR3_SQ5_N(13) | ADC_SQR3_SQ6_N(14)
 };
 
-static ADCConversionGroup adc3_conv_grp = {
+static const ADCConversionGroup adc3_conv_grp_default = {
 	.circular        = true,
 	.num_channels    = FETCH_ADC3_CH_COUNT,
 	.end_cb          = fetch_adc_end_cb,
@@ -115,406 +179,2199 @@ static ADCConversionGroup adc3_conv_grp = {
 	/* HW dependent part.*/
 	.cr1             = 0,
 	.cr2             = ADC_CR2_EXTEN_0 | ADC_CR2_EXTSEL_TIM3_TRGO, // rising edge of TIM3_TRGO
-	.smpr1           = ADC_SMPR1(ADC_SAMPLE_480),
-	.smpr2           = ADC_SMPR2(ADC_SAMPLE_480),
-	.sqr1            = ADC_SQR1_NUM_CH(FETCH_ADC3_CH_COUNT),
-	.sqr2            = ADC_SQR2_SQ7_N(15),
-	.sqr3            = ADC_SQR3_SQ1_N(5) | ADC_SQR3_SQ2_N(6) | ADC_SQR3_SQ3_N(7) | ADC_SQR3_SQ4_N(8) | ADC_SQR3_SQ5_N(9) | ADC_SQR3_SQ6_N(14)
 };
 
+// runtime copies, modified by adc.mode, adc.channels and adc.sample_time
+static ADCConversionGroup adc2_conv_grp;
+static ADCConversionGroup adc3_conv_grp;
+
+/*! \brief Relationship between the two adc devices
+ *
+ * The STM32F4 hardware dual mode (ADC_CCR MULTI) only pairs ADC1 with ADC2,
+ * ADC3 only joins in triple mode and ADC1 is not wired up on Marionette.
+ * ADC2 and ADC3 therefore stay in independent mode in ADC_CCR and are
+ * phase aligned by triggering both from TIM3 (device 0 timer) instead:
+ *
+ * simultaneous: both convert on TIM3_TRGO, sets hold dev 0 then dev 1 samples
+ * interleaved:  dev 0 converts on TIM3_TRGO and dev 1 on TIM3_CC1 half a
+ *               period later, both on the same input, doubling the rate
+ */
+typedef enum {
+  FETCH_ADC_MODE_INDEPENDENT,
+  FETCH_ADC_MODE_SIMULTANEOUS,
+  FETCH_ADC_MODE_INTERLEAVED
+} adc_mode_t;
+
+static volatile adc_mode_t adc_mode = FETCH_ADC_MODE_INDEPENDENT;
+static uint8_t adc_interleave_channel = FETCH_ADC_INTERLEAVE_CH_A;
+
+// pairing state for the combined stream of the dual modes
+static struct {
+  adcsample_t * buffer[FETCH_ADC_DEV_COUNT];
+  uint8_t done;
+  volatile uint32_t sequence_number;
+  uint32_t timestamp_next;
+} adc_combined;
+
+/*! \brief Per device state of adc.stats
+ */
+typedef struct {
+  uint32_t window;              // sets per summary, 0 when off
+  util_stats_t acc;
+  adc_stats_record_t record;    // last complete window, owned by mpipe while ready
+  volatile bool ready;
+  volatile uint32_t overrun;    // windows dropped while mpipe was busy
+} adc_dev_stats_t;
+
+/*! \brief Per device streaming state
+ *
+ * Indexed by the Marionette device number, dev 0 is ADC3 and dev 1 is ADC2.
+ */
+typedef struct {
+  ADCDriver * driver;
+  GPTDriver * timer;
+  ADCConversionGroup * conv_grp;
+  adcsample_t * sample_buffer;
+  mailbox_t * mpipe_mb;
+  mailbox_t * mcard_mb;
+  adc_sample_block_t * ring_slots;
+  const uint8_t * valid_channels;
+  uint8_t channels[ADC_SAMPLE_SET_SIZE];
+  uint8_t channel_count;
+  uint8_t sample_time[FETCH_ADC_INPUT_COUNT];   // SMPx code per adc input
+  util_decimate_t decimator;
+  adc_dev_stats_t stats;
+  util_spsc_t ring;
+  volatile uint32_t ring_overrun;
+  adc_transport_t transport;
+  volatile uint32_t sequence_number;
+  uint32_t timestamp_next;      // predicted time of the next dma half
+  uint16_t timer_interval;
+  uint32_t sample_rate;
+  uint16_t block_depth;
+  volatile adc_status_t status;
+} adc_dev_t;
+
+static adc_dev_t adc_devs[FETCH_ADC_DEV_COUNT] = {
+  { &ADCD3, &GPTD3, &adc3_conv_grp, adc3_sample_buffer, &mpipe_adc3_mb, &mcard_adc3_mb, adc3_ring_slots, adc3_channels },
+  { &ADCD2, &GPTD2, &adc2_conv_grp, adc2_sample_buffer, &mpipe_adc2_mb, &mcard_adc2_mb, adc2_ring_slots, adc2_channels }
+};
+
+typedef enum {
+  FETCH_ADC_CAPTURE_IDLE,
+  FETCH_ADC_CAPTURE_ARMED,      // filling the ring, testing the trigger
+  FETCH_ADC_CAPTURE_TRIGGERED,  // filling the post trigger sets
+  FETCH_ADC_CAPTURE_BURST,      // linear dma straight into the buffer
+  FETCH_ADC_CAPTURE_READY,      // window frozen until mpipe has sent it
+  FETCH_ADC_CAPTURE_SPECTRUM    // buffer lent to adc.fft
+} adc_capture_state_t;
+
+static const str_table_t adc_capture_state_table[] = {
+  {"IDLE", FETCH_ADC_CAPTURE_IDLE},
+  {"ARMED", FETCH_ADC_CAPTURE_ARMED},
+  {"TRIGGERED", FETCH_ADC_CAPTURE_TRIGGERED},
+  {"BURST", FETCH_ADC_CAPTURE_BURST},
+  {"READY", FETCH_ADC_CAPTURE_READY},
+  {"SPECTRUM", FETCH_ADC_CAPTURE_SPECTRUM},
+  {NULL, 0}
+};
+
+typedef enum {
+  FETCH_ADC_TRIGGER_RISING,
+  FETCH_ADC_TRIGGER_FALLING,
+  FETCH_ADC_TRIGGER_ABOVE,
+  FETCH_ADC_TRIGGER_BELOW
+} adc_trigger_condition_t;
+
+/*! \brief Triggered and burst capture state
+ *
+ * While armed the callback copies every set into adc_capture_buffer, used
+ * as a ring of whole sets, and tests the trigger channel. A burst has the
+ * dma write the buffer directly. One device at a time owns the buffer.
+ */
+static struct {
+  adc_capture_t window;
+  volatile adc_capture_state_t state;
+  adc_dev_t * volatile dev;
+  adc_trigger_condition_t condition;
+  uint8_t channel_index;        // position of the trigger channel in a set
+  uint16_t level;
+  uint16_t pre;
+  uint16_t post;                // includes the trigger set
+  bool repeat;
+  uint16_t head;                // next set to write
+  uint16_t filled;              // sets since arming, up to primed
+  uint16_t primed;              // sets needed before the trigger is tested
+  uint16_t remaining;           // post trigger sets still to capture
+  adcsample_t last;             // previous value of the trigger channel
+} adc_capture;
+
+/*! \brief adc.fft state
+ *
+ * Borrows the capture buffer: two sample buffers of size samples which the
+ * callback fills in turn with one input, followed by the float and the
+ * magnitude scratch of the reader. A full buffer is handed over unless the
+ * reader still holds the other one, then the acquisition is dropped and
+ * restarted.
+ */
+static struct {
+  adc_fft_block_t block;
+  adcsample_t * buffer[2];
+  uint8_t channel_index;        // position of the input in a set
+  uint8_t active;               // buffer being filled
+  uint16_t fill;
+  volatile bool ready;
+  volatile uint32_t dropped;
+} adc_fft;
+
+static adc_dev_t * adc_dev_lookup(ADCDriver * adcp)
+{
+  return (adcp == &ADCD2) ? &adc_devs[1] : &adc_devs[0];
+}
+
+static void adc_status_clear(volatile adc_status_t * status)
+{
+  status->error_dmafailure = 0;
+  status->error_overflow = 0;
+  status->mpipe_overflow = 0;
+  status->mcard_overflow = 0;
+  status->mem_alloc_null = 0;
+}
+
 static void fetch_adc_error_cb(ADCDriver * adcp, adcerror_t err)
 {
-  if( adcp == &ADCD2 )
+  adc_dev_t * dev = adc_dev_lookup(adcp);
+
+  switch(err)
+  {
+    case ADC_ERR_DMAFAILURE:
+      dev->status.error_dmafailure++;
+      break;
+    case ADC_ERR_OVERFLOW:
+      dev->status.error_overflow++;
+      break;
+  }
+}
+
+static void adc_pool_free(adc_sample_block_t * bp)
+{
+  chPoolFreeI(&adc_sample_block_pool, bp);
+  adc_pool_used--;
+}
+
+/*! \brief get an empty block for set_count sets of a stream
+ *
+ * The sets of a failed allocation count as produced and dropped, or as
+ * paused when the mpipe flow policy holds the stream back.
+ * \return NULL when the ring is full, the pool is empty or the stream is paused
+ */
+static adc_sample_block_t * adc_block_alloc(adc_dev_t * dev, uint8_t stream, uint32_t set_count)
+{
+  mpipe_stream_stats_t * sp = &mpipe_stream_stats[stream];
+  adc_sample_block_t *bp;
+  uint32_t queued;
+
+  if( dev->transport == FETCH_ADC_TRANSPORT_RING )
+  {
+    queued = util_spsc_count(&dev->ring);
+  }
+  else
+  {
+    chSysLockFromISR();
+    queued = chMBGetUsedCountI(dev->mpipe_mb);
+    chSysUnlockFromISR();
+  }
+  if( !mpipe_flow_admit(MPIPE_PRODUCER_ADC0 + (dev - adc_devs), queued) )
+  {
+    sp->produced += set_count;
+    sp->paused += set_count;
+    return NULL;
+  }
+
+  if( dev->transport == FETCH_ADC_TRANSPORT_RING )
+  {
+    if( util_spsc_full(&dev->ring) )
+    {
+      dev->ring_overrun++;
+      sp->mailbox_full++;
+      sp->produced += set_count;
+      sp->dropped += set_count;
+      return NULL;
+    }
+    return &dev->ring_slots[util_spsc_write_index(&dev->ring)];
+  }
+
+  chSysLockFromISR();
+  bp = chPoolAllocI(&adc_sample_block_pool);
+  if( bp != NULL && ++adc_pool_used > adc_pool_high_water )
+  {
+    adc_pool_high_water = adc_pool_used;
+  }
+  chSysUnlockFromISR();
+
+  if( bp == NULL )
+  {
+    dev->status.mem_alloc_null++;
+    sp->pool_exhausted++;
+    sp->produced += set_count;
+    sp->dropped += set_count;
+    return NULL;
+  }
+
+  bp->mem_ref_count = 0;
+  return bp;
+}
+
+/*! \brief hand a filled block downstream
+ */
+static void adc_block_post(adc_dev_t * dev, adc_sample_block_t * bp)
+{
+  mpipe_stream_stats_t * sp = &mpipe_stream_stats[bp->dev];
+  uint32_t used;
+
+  sp->produced += bp->set_count;
+
+  if( dev->transport == FETCH_ADC_TRANSPORT_RING )
+  {
+    util_spsc_commit(&dev->ring);
+    used = util_spsc_count(&dev->ring);
+    if( used > sp->mailbox_high_water )
+    {
+      sp->mailbox_high_water = used;
+    }
+    if( mcard_is_recording() )
+    {
+      // ring slots are reused in place, mcard can not hold on to them
+      dev->status.mcard_overflow++;
+    }
+    return;
+  }
+
+  chSysLockFromISR();
+  if( chMBPostI(dev->mpipe_mb, (msg_t)bp) != MSG_OK )
+  {
+    dev->status.mpipe_overflow++;
+    sp->mailbox_full++;
+    sp->dropped += bp->set_count;
+  }
+  else
+  {
+    bp->mem_ref_count++;
+    used = chMBGetUsedCountI(dev->mpipe_mb);
+    if( used > sp->mailbox_high_water )
+    {
+      sp->mailbox_high_water = used;
+    }
+  }
+  if( mcard_is_recording() )
+  {
+    if( chMBPostI(dev->mcard_mb, (msg_t)bp) != MSG_OK )
+    {
+      dev->status.mcard_overflow++;
+    }
+    else
+    {
+      bp->mem_ref_count++;
+      mcard_signal_i();
+    }
+  }
+
+  if( bp->mem_ref_count == 0 )
+  {
+    // we were not able to enqueue it anywhere so lets free it imediately
+    adc_pool_free(bp);
+  }
+  chSysUnlockFromISR();
+}
+
+/*! \brief occupancy of the shared sample block pool
+ */
+void fetch_adc_pool_stats(uint32_t * size, uint32_t * used, uint32_t * high_water)
+{
+  chSysLock();
+  *size = FETCH_ADC_MEM_POOL_SIZE;
+  *used = adc_pool_used;
+  *high_water = adc_pool_high_water;
+  chSysUnlock();
+}
+
+void fetch_adc_pool_stats_reset(void)
+{
+  chSysLock();
+  adc_pool_high_water = adc_pool_used;
+  chSysUnlock();
+}
+
+/*! \brief timebase time of the latest trigger of a device timer
+ *
+ * The trigger fires on the update event, so it was CNT ticks ago.
+ */
+static inline uint32_t adc_trigger_time(adc_dev_t * timer_dev)
+{
+  uint32_t count = timer_dev->timer->tim->CNT;
+
+  return util_timebase_now() - count;
+}
+
+/*! \brief timebase time of the first of n sets which just completed
+ *
+ * At high rates the interrupt latency may hide whole timer periods from
+ * adc_trigger_time(), so a half which continues the previous one takes the
+ * predicted time. Only a restart, where the measurement is far from the
+ * prediction, is measured again.
+ */
+static uint32_t adc_timestamp(uint32_t * next, adc_dev_t * timer_dev, size_t n)
+{
+  uint32_t interval = timer_dev->timer_interval;
+  uint32_t first = adc_trigger_time(timer_dev) - (n - 1) * interval;
+
+  if( first - *next < n * interval )
+  {
+    first = *next;
+  }
+  *next = first + n * interval;
+
+  return first;
+}
+
+/*! \brief merge the matching halves of both devices into one block
+ *
+ * Both dma streams run at the same irq priority so the callbacks never
+ * nest and the pairing state needs no locking. The block is assembled once
+ * the second device has filled its half and goes out on device 0.
+ */
+static void adc_combined_cb(adc_dev_t * dev, adcsample_t * buffer, size_t n)
+{
+  adc_dev_t * out = &adc_devs[0];
+  adc_sample_block_t *bp;
+  adcsample_t * dp;
+  const adcsample_t * src0;
+  const adcsample_t * src1;
+  uint32_t timestamp;
+  uint32_t set_count;
+  uint16_t ch0 = adc_devs[0].conv_grp->num_channels;
+  uint16_t ch1 = adc_devs[1].conv_grp->num_channels;
+
+  adc_combined.buffer[dev - adc_devs] = buffer;
+  if( ++adc_combined.done < FETCH_ADC_DEV_COUNT )
+  {
+    return;
+  }
+  adc_combined.done = 0;
+
+  src0 = adc_combined.buffer[0];
+  src1 = adc_combined.buffer[1];
+
+  // both devices are paced by the dev 0 timer
+  timestamp = adc_timestamp(&adc_combined.timestamp_next, out, n);
+
+  set_count = (adc_mode == FETCH_ADC_MODE_INTERLEAVED) ? 2 * n : n;
+  if( (bp = adc_block_alloc(out, FETCH_ADC_DEV_COMBINED, set_count)) == NULL )
+  {
+    adc_combined.sequence_number += set_count;
+    return;
+  }
+
+  dp = bp->sample;
+  bp->sequence_number = adc_combined.sequence_number + 1;
+  bp->timestamp = timestamp;
+  bp->dev = FETCH_ADC_DEV_COMBINED;
+  bp->bits = ADC_SAMPLE_BITS;
+
+  if( adc_mode == FETCH_ADC_MODE_INTERLEAVED )
+  {
+    // dev 0 converts on the timer update, dev 1 half a period later
+    for( size_t i = 0; i < n; i++ )
+    {
+      *dp++ = src0[i];
+      *dp++ = src1[i];
+    }
+    bp->channel_count = 1;
+    bp->set_count = 2 * n;
+  }
+  else
+  {
+    for( size_t i = 0; i < n; i++ )
+    {
+      memcpy(dp, src0, sizeof(adcsample_t) * ch0);
+      dp += ch0;
+      src0 += ch0;
+      memcpy(dp, src1, sizeof(adcsample_t) * ch1);
+      dp += ch1;
+      src1 += ch1;
+    }
+    bp->channel_count = ch0 + ch1;
+    bp->set_count = n;
+  }
+  adc_combined.sequence_number += bp->set_count;
+
+  adc_block_post(out, bp);
+}
+
+/*! \brief filter a dma half through the device decimator into a block
+ *
+ * Runs in the callback so only the decimated sets are copied downstream.
+ * The filter state is advanced even when no block can be allocated.
+ */
+static void adc_decimate_block(adc_dev_t * dev, adcsample_t * buffer, size_t n, uint32_t timestamp)
+{
+  adc_sample_block_t *bp = NULL;
+  size_t count = util_decimate_count(&dev->decimator, n);
+
+  if( count == 0 || (bp = adc_block_alloc(dev, dev - adc_devs, count)) == NULL )
+  {
+    util_decimate_process(&dev->decimator, buffer, n, NULL);
+    dev->sequence_number += count;
+    return;
+  }
+
+  util_decimate_process(&dev->decimator, buffer, n, bp->sample);
+  bp->sequence_number = dev->sequence_number + 1;
+  bp->timestamp = timestamp;
+  bp->set_count = count;
+  bp->channel_count = dev->decimator.channel_count;
+  bp->dev = dev - adc_devs;
+  bp->bits = UTIL_DECIMATE_OUTPUT_BITS;
+  dev->sequence_number += count;
+
+  adc_block_post(dev, bp);
+}
+
+static bool adc_trigger_test(adcsample_t value, adcsample_t last)
+{
+  uint16_t level = adc_capture.level;
+
+  switch( adc_capture.condition )
+  {
+    case FETCH_ADC_TRIGGER_RISING:
+      return last < level && value >= level;
+    case FETCH_ADC_TRIGGER_FALLING:
+      return last > level && value <= level;
+    case FETCH_ADC_TRIGGER_ABOVE:
+      return value > level;
+    case FETCH_ADC_TRIGGER_BELOW:
+      return value < level;
+  }
+  return false;
+}
+
+/*! \brief copy a dma half into the capture ring and watch for the trigger
+ *
+ * Stops copying as soon as the window is complete, so the window stays
+ * intact while mpipe sends it.
+ */
+static void adc_trigger_process(adc_dev_t * dev, const adcsample_t * buffer, size_t n, uint32_t timestamp)
+{
+  uint8_t channels = adc_capture.window.channel_count;
+  uint16_t size = adc_capture.window.size;
+  uint32_t interval = dev->timer_interval;
+
+  for( size_t set = 0; set < n; set++, buffer += channels )
+  {
+    adc_capture_state_t state = adc_capture.state;
+    adcsample_t * dp;
+    uint16_t index;
+
+    if( state != FETCH_ADC_CAPTURE_ARMED && state != FETCH_ADC_CAPTURE_TRIGGERED )
+    {
+      return;
+    }
+
+    index = adc_capture.head;
+    dp = &adc_capture_buffer[index * channels];
+    for( uint8_t ch = 0; ch < channels; ch++ )
+    {
+      dp[ch] = buffer[ch];
+    }
+    if( ++adc_capture.head >= size )
+    {
+      adc_capture.head = 0;
+    }
+
+    if( state == FETCH_ADC_CAPTURE_ARMED )
+    {
+      adcsample_t value = buffer[adc_capture.channel_index];
+      bool fire = adc_capture.filled >= adc_capture.primed && adc_trigger_test(value, adc_capture.last);
+
+      adc_capture.last = value;
+      if( !fire )
+      {
+        if( adc_capture.filled < adc_capture.primed )
+        {
+          adc_capture.filled++;
+        }
+        continue;
+      }
+
+      adc_capture.window.start = (index + size - adc_capture.pre) % size;
+      adc_capture.window.timestamp = timestamp + (set - adc_capture.pre) * interval;
+      adc_capture.remaining = adc_capture.post;
+      adc_capture.state = FETCH_ADC_CAPTURE_TRIGGERED;
+    }
+
+    if( --adc_capture.remaining == 0 )
+    {
+      adc_capture.window.number++;
+      adc_capture.state = FETCH_ADC_CAPTURE_READY;
+      return;
+    }
+  }
+}
+
+/*! \brief accumulate a dma half, hand each complete window to mpipe
+ */
+static void adc_stats_process(adc_dev_t * dev, const adcsample_t * buffer, size_t n)
+{
+  adc_dev_stats_t * sp = &dev->stats;
+  uint8_t channels = sp->acc.channel_count;
+
+  while( n > 0 )
+  {
+    size_t count = sp->window - sp->acc.count;
+
+    if( count > n )
+    {
+      count = n;
+    }
+    util_stats_add(&sp->acc, buffer, count);
+    buffer += count * channels;
+    n -= count;
+
+    if( sp->acc.count < sp->window )
+    {
+      break;
+    }
+
+    if( sp->ready )
+    {
+      sp->overrun++;
+    }
+    else
+    {
+      sp->record.acc = sp->acc;
+      sp->record.number++;
+      // record contents before the flag
+      __DMB();
+      sp->ready = true;
+    }
+    util_stats_init(&sp->acc, channels);
+  }
+}
+
+/*! \brief collect one input of a dma half into the fft buffers
+ */
+static void adc_fft_process(adc_dev_t * dev, const adcsample_t * buffer, size_t n)
+{
+  uint8_t channels = dev->channel_count;
+  uint16_t size = adc_fft.block.size;
+  adcsample_t * dp = adc_fft.buffer[adc_fft.active];
+
+  buffer += adc_fft.channel_index;
+  for( size_t set = 0; set < n; set++, buffer += channels )
+  {
+    dp[adc_fft.fill] = *buffer;
+    if( ++adc_fft.fill < size )
+    {
+      continue;
+    }
+    adc_fft.fill = 0;
+
+    if( adc_fft.ready )
+    {
+      adc_fft.dropped++;
+      continue;
+    }
+    adc_fft.block.sample = dp;
+    adc_fft.block.number++;
+    // block contents before the flag
+    __DMB();
+    adc_fft.ready = true;
+
+    adc_fft.active ^= 1;
+    dp = adc_fft.buffer[adc_fft.active];
+  }
+}
+
+/*!
+ * ADC end conversion callback
+ *
+ * In circular mode the dma buffer holds two blocks and this is called on the
+ * half and full transfer interrupts, so buffer points at the half which was
+ * just filled and n is the number of sample sets in it. The whole block is
+ * handed downstream with a single mailbox message or ring slot.
+ */
+static void fetch_adc_end_cb(ADCDriver * adcp, adcsample_t * buffer, size_t n)
+{
+  adc_dev_t * dev = adc_dev_lookup(adcp);
+  adc_sample_block_t *bp;
+  uint16_t channel_count = adcp->grpp->num_channels;
+  uint32_t timestamp;
+
+  // the writer only runs once this interrupt has returned
+  if( adc_mode != FETCH_ADC_MODE_INDEPENDENT )
   {
-    switch(err)
+    mpipe_signal_from_isr(MPIPE_PRODUCER_ADC0);
+    adc_combined_cb(dev, buffer, n);
+    return;
+  }
+  mpipe_signal_from_isr(MPIPE_PRODUCER_ADC0 + (dev - adc_devs));
+
+  if( adc_capture.dev == dev && adc_capture.state == FETCH_ADC_CAPTURE_BURST )
+  {
+    // linear dma, called on the half and the full transfer only
+    if( adcp->state == ADC_COMPLETE )
     {
-      case ADC_ERR_DMAFAILURE:
-        adc2_status.error_dmafailure = true;
-        break;
-      case ADC_ERR_OVERFLOW:
-        adc2_status.error_overflow = true;
-        break;
+      adc_capture.window.timestamp = adc_trigger_time(dev) - (adc_capture.window.set_count - 1) * dev->timer_interval;
+      adc_capture.window.number++;
+      adc_capture.state = FETCH_ADC_CAPTURE_READY;
     }
+    return;
   }
-  else if( adcp == &ADCD3 )
+
+  timestamp = adc_timestamp(&dev->timestamp_next, dev, n);
+
+  if( adc_capture.dev == dev )
   {
-    switch(err)
+    if( adc_capture.state == FETCH_ADC_CAPTURE_SPECTRUM )
+    {
+      adc_fft_process(dev, buffer, n);
+    }
+    else
     {
-      case ADC_ERR_DMAFAILURE:
-        adc3_status.error_dmafailure = true;
-        break;
-      case ADC_ERR_OVERFLOW:
-        adc3_status.error_overflow = true;
-        break;
+      adc_trigger_process(dev, buffer, n, timestamp);
     }
+    dev->sequence_number += n;
+    return;
+  }
+
+  if( dev->stats.window != 0 )
+  {
+    adc_stats_process(dev, buffer, n);
+    dev->sequence_number += n;
+    return;
+  }
+
+  if( dev->decimator.filter != UTIL_DECIMATE_NONE )
+  {
+    adc_decimate_block(dev, buffer, n, timestamp);
+    return;
+  }
+
+  if( (bp = adc_block_alloc(dev, dev - adc_devs, n)) == NULL )
+  {
+    dev->sequence_number += n;
+    return;
+  }
+
+  memcpy(bp->sample, buffer, sizeof(adcsample_t) * channel_count * n);
+  bp->sequence_number = dev->sequence_number + 1;
+  bp->timestamp = timestamp;
+  bp->set_count = n;
+  bp->channel_count = channel_count;
+  bp->dev = dev - adc_devs;
+  bp->bits = ADC_SAMPLE_BITS;
+  dev->sequence_number += n;
+
+  adc_block_post(dev, bp);
+}
+
+/*! \brief oldest block in the transport ring of a device
+ *
+ * Only to be called from the single consumer thread of that device. The
+ * block stays valid until fetch_adc_ring_release() is called.
+ * \return NULL if the ring is empty
+ */
+adc_sample_block_t * fetch_adc_ring_peek( uint32_t dev_num )
+{
+  adc_dev_t * dev = &adc_devs[dev_num];
+
+  if( util_spsc_empty(&dev->ring) )
+  {
+    return NULL;
+  }
+  return &dev->ring_slots[util_spsc_read_index(&dev->ring)];
+}
+
+void fetch_adc_ring_release( uint32_t dev_num )
+{
+  util_spsc_release(&adc_devs[dev_num].ring);
+}
+
+/*! \brief completed capture window of a device
+ *
+ * Only to be called from the mpipe thread of that device. The window stays
+ * valid until fetch_adc_capture_release() is called.
+ * \return NULL if there is no window to send
+ */
+const adc_capture_t * fetch_adc_capture_peek( uint32_t dev_num )
+{
+  if( adc_capture.state != FETCH_ADC_CAPTURE_READY || adc_capture.dev != &adc_devs[dev_num] )
+  {
+    return NULL;
+  }
+  return &adc_capture.window;
+}
+
+/*! \brief re-arm the trigger, or free the capture after a single window, once the window is sent
+ *
+ * A single capture gives up the device, so its blocks go back to the
+ * stream path and the other device may capture.
+ */
+void fetch_adc_capture_release( uint32_t dev_num )
+{
+  chSysLock();
+  if( adc_capture.state == FETCH_ADC_CAPTURE_READY && adc_capture.dev == &adc_devs[dev_num] )
+  {
+    adc_capture.filled = 0;
+    if( adc_capture.repeat )
+    {
+      adc_capture.state = FETCH_ADC_CAPTURE_ARMED;
+    }
+    else
+    {
+      adc_capture.dev = NULL;
+      adc_capture.state = FETCH_ADC_CAPTURE_IDLE;
+    }
+  }
+  chSysUnlock();
+}
+
+/*! \brief last complete adc.stats window of a device
+ *
+ * Only to be called from the mpipe thread of that device, valid until
+ * fetch_adc_stats_release() is called.
+ * \return NULL if there is no window to send
+ */
+const adc_stats_record_t * fetch_adc_stats_peek( uint32_t dev_num )
+{
+  adc_dev_t * dev = &adc_devs[dev_num];
+
+  if( !dev->stats.ready )
+  {
+    return NULL;
+  }
+  __DMB();
+  return &dev->stats.record;
+}
+
+void fetch_adc_stats_release( uint32_t dev_num )
+{
+  adc_devs[dev_num].stats.ready = false;
+}
+
+/*! \brief last complete adc.fft acquisition of a device
+ *
+ * Only to be called from the mpipe thread of that device. The samples stay
+ * valid until fetch_adc_fft_release() is called, the work area until the
+ * next peek.
+ * \return NULL if there is nothing to transform
+ */
+const adc_fft_block_t * fetch_adc_fft_peek( uint32_t dev_num )
+{
+  if( !adc_fft.ready || adc_capture.state != FETCH_ADC_CAPTURE_SPECTRUM || adc_capture.dev != &adc_devs[dev_num] )
+  {
+    return NULL;
+  }
+  __DMB();
+  return &adc_fft.block;
+}
+
+void fetch_adc_fft_release( uint32_t dev_num )
+{
+  (void)dev_num;
+  adc_fft.ready = false;
+}
+
+/*! \brief stop the capture of a device, the callback stops writing the ring
+ */
+static void adc_capture_stop(adc_dev_t * dev)
+{
+  if( dev == NULL || adc_capture.dev == dev )
+  {
+    adc_capture.dev = NULL;
+    adc_capture.state = FETCH_ADC_CAPTURE_IDLE;
+  }
+}
+
+void fetch_adc_free_sample_block( adc_sample_block_t *bp )
+{
+  if( bp != NULL )
+  {
+    chSysLock();
+    bp->mem_ref_count--;
+    if( bp->mem_ref_count <= 0 )
+    {
+      adc_pool_free(bp);
+    }
+    chSysUnlock();
+  }
+}
+
+static const str_table_t adc_mode_table[] = {
+  {"INDEPENDENT", FETCH_ADC_MODE_INDEPENDENT},
+  {"SIMULTANEOUS", FETCH_ADC_MODE_SIMULTANEOUS},
+  {"INTERLEAVED", FETCH_ADC_MODE_INTERLEAVED},
+  {NULL, 0}
+};
+
+/*! \brief fill the sequence and sample time registers of a conversion group
+ */
+static void adc_conv_grp_build(ADCConversionGroup * grp, const uint8_t * channels, uint8_t count, const uint8_t * sample_time)
+{
+  grp->num_channels = count;
+  grp->sqr1 = ADC_SQR1_NUM_CH(count);
+  grp->sqr2 = 0;
+  grp->sqr3 = 0;
+
+  // SQ1 ... SQ6 in SQR3, SQ7 ... SQ12 in SQR2
+  for( uint8_t i = 0; i < count; i++ )
+  {
+    if( i < 6 )
+    {
+      grp->sqr3 |= channels[i] << (5 * i);
+    }
+    else
+    {
+      grp->sqr2 |= channels[i] << (5 * (i - 6));
+    }
+  }
+
+  // SMP0 ... SMP9 in SMPR2, SMP10 ... SMP18 in SMPR1
+  grp->smpr1 = 0;
+  grp->smpr2 = 0;
+  for( uint8_t ch = 0; ch < FETCH_ADC_INPUT_COUNT; ch++ )
+  {
+    if( ch < 10 )
+    {
+      grp->smpr2 |= sample_time[ch] << (3 * ch);
+    }
+    else
+    {
+      grp->smpr1 |= sample_time[ch] << (3 * (ch - 10));
+    }
+  }
+}
+
+/*! \brief highest trigger rate a channel sequence can keep up with
+ */
+static uint32_t adc_max_rate(const uint8_t * channels, uint8_t count, const uint8_t * sample_time)
+{
+  uint32_t cycles = 0;
+
+  for( uint8_t i = 0; i < count; i++ )
+  {
+    cycles += adc_sample_time_cycles[sample_time[channels[i]]] + FETCH_ADC_CONVERSION_CYCLES;
+  }
+
+  if( cycles == 0 || STM32_ADCCLK / cycles > FETCH_ADC_TIMER_FREQ )
+  {
+    return FETCH_ADC_TIMER_FREQ;
+  }
+  return STM32_ADCCLK / cycles;
+}
+
+/*! \brief highest trigger rate of a device in a given mode
+ */
+static uint32_t adc_dev_max_rate(const adc_dev_t * dev, adc_mode_t mode)
+{
+  if( mode == FETCH_ADC_MODE_INTERLEAVED )
+  {
+    return adc_max_rate(&adc_interleave_channel, 1, dev->sample_time);
+  }
+  return adc_max_rate(dev->channels, dev->channel_count, dev->sample_time);
+}
+
+/*! \brief check a trigger rate against the devices it drives in a mode
+ *
+ * In the dual modes the dev 0 timer triggers both devices.
+ * Reports the achievable maximum when the rate is too high.
+ */
+static bool adc_rate_check(BaseSequentialStream * chp, adc_dev_t * dev, adc_mode_t mode, uint32_t sample_rate)
+{
+  uint32_t max_rate;
+
+  if( mode == FETCH_ADC_MODE_INDEPENDENT )
+  {
+    max_rate = adc_dev_max_rate(dev, mode);
+  }
+  else if( dev != &adc_devs[0] )
+  {
+    // dev 1 timer is unused in the dual modes
+    return true;
+  }
+  else
+  {
+    max_rate = adc_dev_max_rate(&adc_devs[0], mode);
+    if( adc_dev_max_rate(&adc_devs[1], mode) < max_rate )
+    {
+      max_rate = adc_dev_max_rate(&adc_devs[1], mode);
+    }
+  }
+
+  if( sample_rate > max_rate )
+  {
+    util_message_uint32(chp, "max_sample_rate", max_rate);
+    util_message_error(chp, "sample rate too high for channel configuration");
+    return false;
+  }
+  return true;
+}
+
+/*! \brief rate of the timer that triggers a device in the current mode
+ */
+static uint32_t adc_trigger_rate(adc_dev_t * dev)
+{
+  return (adc_mode == FETCH_ADC_MODE_INDEPENDENT) ? dev->sample_rate : adc_devs[0].sample_rate;
+}
+
+/*! \brief (re)start the sample timer of a device from a zero count
+ */
+static void adc_timer_start(adc_dev_t * dev)
+{
+  gptStopTimer(dev->timer);
+
+  // TIM3_CC1 triggers dev 1 half a period after the update event
+  if( adc_mode == FETCH_ADC_MODE_INTERLEAVED && dev == &adc_devs[0] )
+  {
+    dev->timer->tim->CCR[0] = dev->timer_interval / 2;
+  }
+
+  gptStartContinuous(dev->timer, dev->timer_interval);
+}
+
+/*! \brief validate a sample rate and retime the trigger timer of a device
+ */
+static bool adc_rate_set(BaseSequentialStream * chp, adc_dev_t * dev, uint32_t sample_rate)
+{
+  if( sample_rate <= (FETCH_ADC_TIMER_FREQ / 0xffff) || sample_rate > FETCH_ADC_TIMER_FREQ )
+  {
+    util_message_error(chp, "invalid sample rate");
+    return false;
+  }
+
+  if( !adc_rate_check(chp, dev, adc_mode, FETCH_ADC_TIMER_FREQ / (FETCH_ADC_TIMER_FREQ / sample_rate)) )
+  {
+    return false;
+  }
+
+  dev->timer_interval = FETCH_ADC_TIMER_FREQ / sample_rate;
+  dev->sample_rate = FETCH_ADC_TIMER_FREQ / dev->timer_interval;
+
+  adc_timer_start(dev);
+
+  return true;
+}
+
+/*! \brief longest burst of a device in sample sets
+ */
+static uint32_t adc_max_burst(adc_dev_t * dev)
+{
+  return adc_capture_samples / dev->channel_count;
+}
+
+/*! \brief largest adc.fft size the capture buffer can hold
+ *
+ * Two sample buffers, the float and the magnitude scratch take four and a
+ * half samples per point.
+ */
+static uint32_t adc_max_fft_size(void)
+{
+  uint32_t size = UTIL_FFT_MAX_SIZE;
+
+  while( size >= UTIL_FFT_MIN_SIZE && 4 * size + size / 2 + 1 > adc_capture_samples )
+  {
+    size >>= 1;
+  }
+  return (size >= UTIL_FFT_MIN_SIZE) ? size : 0;
+}
+
+/*! \brief set up both conversion groups and TIM3 for a device mode
+ *
+ * Both devices must be stopped.
+ */
+static void adc_mode_apply(adc_mode_t mode, uint8_t channel)
+{
+  stm32_tim_t * tim = adc_devs[0].timer->tim;
+
+  adc2_conv_grp = adc2_conv_grp_default;
+  adc3_conv_grp = adc3_conv_grp_default;
+
+  adc_conv_grp_build(&adc2_conv_grp, adc_devs[1].channels, adc_devs[1].channel_count, adc_devs[1].sample_time);
+  adc_conv_grp_build(&adc3_conv_grp, adc_devs[0].channels, adc_devs[0].channel_count, adc_devs[0].sample_time);
+
+  // ADC2/ADC3 have no hardware dual mode, see adc_mode_t
+  ADC->CCR &= ~ADC_CCR_MULTI;
+
+  // only interleaved mode triggers on the channel 1 compare
+  tim->CCER &= ~STM32_TIM_CCER_CC1E;
+
+  switch( mode )
+  {
+    case FETCH_ADC_MODE_SIMULTANEOUS:
+      adc2_conv_grp.cr2 = ADC_CR2_EXTEN_0 | ADC_CR2_EXTSEL_TIM3_TRGO;
+      break;
+    case FETCH_ADC_MODE_INTERLEAVED:
+      adc_interleave_channel = channel;
+      adc_conv_grp_build(&adc2_conv_grp, &adc_interleave_channel, 1, adc_devs[1].sample_time);
+      adc_conv_grp_build(&adc3_conv_grp, &adc_interleave_channel, 1, adc_devs[0].sample_time);
+      adc2_conv_grp.cr2 = ADC_CR2_EXTEN_0 | ADC_CR2_EXTSEL_TIM3_CC1;
+
+      // pwm mode 2, OC1REF rises when the count reaches CCR1
+      tim->CCMR1 = (tim->CCMR1 & ~STM32_TIM_CCMR1_OC1M_MASK) | STM32_TIM_CCMR1_OC1M(7);
+      // the compare event only reaches the adc with the output enabled, no
+      // TIM3_CH1 pin (PA6, PB4, PC6) is in AF2 so nothing toggles
+      tim->CCER |= STM32_TIM_CCER_CC1E;
+      break;
+    case FETCH_ADC_MODE_INDEPENDENT:
+    default:
+      break;
+  }
+
+  adc_mode = mode;
+  adc_combined.done = 0;
+}
+
+/*! \brief restore the wired channel sequence and default sample times
+ */
+static void adc_channels_default(adc_dev_t * dev)
+{
+  memcpy(dev->channels, dev->valid_channels, ADC_SAMPLE_SET_SIZE);
+  dev->channel_count = ADC_SAMPLE_SET_SIZE;
+  memset(dev->sample_time, FETCH_ADC_DEFAULT_SAMPLE_TIME, sizeof(dev->sample_time));
+  util_decimate_init(&dev->decimator, UTIL_DECIMATE_NONE, 1, dev->channel_count, ADC_SAMPLE_BITS);
+}
+
+/*! \brief restart the decimator of a device with its current settings
+ *
+ * Clears the filter history and follows channel count changes.
+ */
+static void adc_decimate_restart(adc_dev_t * dev)
+{
+  if( !util_decimate_init(&dev->decimator, dev->decimator.filter, dev->decimator.factor, dev->channel_count, ADC_SAMPLE_BITS) )
+  {
+    util_decimate_init(&dev->decimator, UTIL_DECIMATE_NONE, 1, dev->channel_count, ADC_SAMPLE_BITS);
+  }
+}
+
+/*! \brief all devices affected by a channel change must be stopped
+ */
+static bool adc_channels_idle(BaseSequentialStream * chp, adc_dev_t * dev)
+{
+  for( uint32_t i = 0; i < FETCH_ADC_DEV_COUNT; i++ )
+  {
+    if( (adc_mode != FETCH_ADC_MODE_INDEPENDENT || &adc_devs[i] == dev) && adc_devs[i].driver->state != ADC_READY )
+    {
+      util_message_error(chp, "ADC device not in ready state");
+      return false;
+    }
+  }
+  return true;
+}
+
+/*! \brief start both devices for one of the dual modes
+ *
+ * The shared trigger timer is held while both conversions are armed so the
+ * first trigger reaches both devices and their half buffers stay paired.
+ */
+static bool adc_combined_start(BaseSequentialStream * chp)
+{
+  adc_dev_t * master = &adc_devs[0];
+  uint16_t set_size;
+
+  if( adc_mode == FETCH_ADC_MODE_INTERLEAVED )
+  {
+    set_size = 2;
+  }
+  else
+  {
+    set_size = adc_devs[0].conv_grp->num_channels + adc_devs[1].conv_grp->num_channels;
+  }
+
+  if( master->block_depth * set_size > ADC_SAMPLE_BLOCK_SIZE )
+  {
+    util_message_error(chp, "block depth too large for mode");
+    return false;
+  }
+
+  for( uint32_t i = 0; i < FETCH_ADC_DEV_COUNT; i++ )
+  {
+    if( adc_devs[i].driver->state != ADC_READY )
+    {
+      util_message_error(chp, "ADC device not in ready state");
+      return false;
+    }
+  }
+
+  gptStopTimer(master->timer);
+  adc_combined.done = 0;
+
+  for( uint32_t i = 0; i < FETCH_ADC_DEV_COUNT; i++ )
+  {
+    adc_dev_t * dev = &adc_devs[i];
+
+    dev->conv_grp->circular = true;
+    adcStartConversion(dev->driver, dev->conv_grp, dev->sample_buffer, 2 * master->block_depth);
+  }
+
+  adc_timer_start(master);
+
+  return true;
+}
+
+static adc_dev_t * parse_adc_dev( char * str, int32_t * dev )
+{
+  char * endptr;
+  int32_t num = strtol(str, &endptr, 0);
+
+  if(*endptr != '\0')
+  {
+    return NULL;
+  }
+
+  if( num < 0 || num >= FETCH_ADC_DEV_COUNT )
+  {
+    return NULL;
+  }
+
+  if( dev != NULL )
+  {
+    *dev = num;
+  }
+
+  return &adc_devs[num];
+}
+
+/*! \brief current configuration of a block stream
+ *
+ * dev is the block dev number, FETCH_ADC_DEV_COMBINED for the stream of
+ * the dual modes. Describes the blocks the stream would produce now.
+ */
+void fetch_adc_stream_info(uint8_t dev_num, adc_stream_info_t * ip)
+{
+  adc_dev_t * dev = &adc_devs[(dev_num == FETCH_ADC_DEV_COMBINED) ? 0 : dev_num];
+
+  memset(ip, 0, sizeof(*ip));
+  ip->mode = adc_mode;
+  ip->decimate_factor = 1;
+  ip->bits = ADC_SAMPLE_BITS;
+
+  if( dev_num == FETCH_ADC_DEV_COMBINED )
+  {
+    if( adc_mode == FETCH_ADC_MODE_INTERLEAVED )
+    {
+      ip->channel_count = 1;
+      ip->channels[0] = adc_interleave_channel;
+      ip->sample_rate = 2 * dev->sample_rate;
+    }
+    else
+    {
+      ip->channel_count = adc_devs[0].channel_count + adc_devs[1].channel_count;
+      memcpy(ip->channels, adc_devs[0].channels, adc_devs[0].channel_count);
+      memcpy(ip->channels + adc_devs[0].channel_count, adc_devs[1].channels, adc_devs[1].channel_count);
+      ip->sample_rate = dev->sample_rate;
+    }
+    return;
+  }
+
+  ip->channel_count = dev->channel_count;
+  memcpy(ip->channels, dev->channels, dev->channel_count);
+  ip->sample_rate = adc_trigger_rate(dev);
+  if( dev->decimator.filter != UTIL_DECIMATE_NONE )
+  {
+    ip->decimate_filter = dev->decimator.filter;
+    ip->decimate_factor = dev->decimator.factor;
+    ip->sample_rate /= dev->decimator.factor;
+    ip->bits = UTIL_DECIMATE_OUTPUT_BITS;
+  }
+}
+
+/*! \brief display adc help
+ */
+bool fetch_adc_help_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 0);
+
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_LEGEND(chp);
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_TITLE(chp, "ADC Help");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "single(<dev>)");
+  FETCH_HELP_DES(chp, "Single sample from each channel");
+  FETCH_HELP_ARG(chp, "dev", "0 | 1");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "start(<dev>)");
+  FETCH_HELP_DES(chp, "Start ADC sampling");
+  FETCH_HELP_ARG(chp, "dev", "0 | 1");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "stop(<dev>)");
+  FETCH_HELP_DES(chp, "Stop ADC sampling");
+  FETCH_HELP_ARG(chp, "dev", "0 | 1");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "status");
+  FETCH_HELP_DES(chp, "Query current adc status");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "config(<dev>, <sample rate>[, <block depth>])");
+  FETCH_HELP_DES(chp, "Configure adc device");
+  FETCH_HELP_ARG(chp, "sample rate", "16 ... 1000000");
+  FETCH_HELP_ARG(chp, "block depth", "1 ... " STRINGIFY(ADC_SAMPLE_BLOCK_DEPTH_MAX) " {sample sets per mpipe block, applied on next start}");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "channels(<dev>, <channel>[, <channel> ...])");
+  FETCH_HELP_DES(chp, "Select channel sequence, device must be stopped");
+  FETCH_HELP_ARG(chp, "dev 0", "5 | 6 | 7 | 8 | 9 | 14 | 15 {up to 7}");
+  FETCH_HELP_ARG(chp, "dev 1", "2 | 6 | 7 | 11 | 13 | 14 | 15 {up to 7}");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "sample_time(<dev>, <channel>, <cycles>)");
+  FETCH_HELP_DES(chp, "Set channel sample time, device must be stopped");
+  FETCH_HELP_ARG(chp, "cycles", "3 | 15 | 28 | 56 | 84 | 112 | 144 | 480");
+  FETCH_HELP_DES(chp, "Configurations too slow for the sample rate are rejected");
+  FETCH_HELP_DES(chp, "and max_sample_rate is reported");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "stats(<dev>, <window>)");
+  FETCH_HELP_DES(chp, "Stream one min/max/mean/rms/variance summary per window");
+  FETCH_HELP_DES(chp, "instead of samples, stop(<dev>) ends it");
+  FETCH_HELP_ARG(chp, "window", "1 ... " STRINGIFY(UTIL_STATS_MAX_COUNT) " {sample sets per summary}");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "trigger(<dev>, <channel>, <condition>, <level>, <pre>, <post>[, <repeat>])");
+  FETCH_HELP_DES(chp, "Start triggered capture, stop(<dev>) disarms");
+  FETCH_HELP_ARG(chp, "channel", "trigger input, must be in the channel sequence");
+  FETCH_HELP_ARG(chp, "condition", "rising | falling | above | below");
+  FETCH_HELP_ARG(chp, "level", "0 ... 4095");
+  FETCH_HELP_ARG(chp, "pre", "sample sets before the trigger set");
+  FETCH_HELP_ARG(chp, "post", "sample sets from the trigger set on, >= 1");
+  FETCH_HELP_ARG(chp, "repeat", "single | normal {default single, normal re-arms}");
+  FETCH_HELP_DES(chp, "pre + post up to max_burst {see status}, the window is");
+  FETCH_HELP_DES(chp, "sent as one capture on mpipe");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "capture(<dev>, <count>, <sample rate>)");
+  FETCH_HELP_DES(chp, "Acquire count sample sets by dma into ram, then send them");
+  FETCH_HELP_DES(chp, "as one capture on mpipe");
+  FETCH_HELP_ARG(chp, "count", "1 ... max_burst {see status}");
+  FETCH_HELP_ARG(chp, "sample rate", "16 ... 1000000 | max {fastest for channel configuration}");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "fft(<dev>, <channel>, <size>, <window>[, <peaks>])");
+  FETCH_HELP_DES(chp, "Stream magnitude spectra of one input instead of samples,");
+  FETCH_HELP_DES(chp, "one per size sample sets while mpipe keeps up, stop(<dev>) ends it");
+  FETCH_HELP_ARG(chp, "channel", "input, must be in the channel sequence");
+  FETCH_HELP_ARG(chp, "size", "256 | 512 | 1024 | 2048 | 4096 {points, up to max_fft_size}");
+  FETCH_HELP_ARG(chp, "window", "none | hann | hamming | blackman");
+  FETCH_HELP_ARG(chp, "peaks", "0 ... " STRINGIFY(UTIL_FFT_MAX_PEAKS) " {strongest peaks only, default 0 sends all bins}");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "decimate(<dev>, <filter>[, <output rate>])");
+  FETCH_HELP_DES(chp, "Filter and decimate to 16 bit samples, device must be stopped");
+  FETCH_HELP_ARG(chp, "filter", "none | boxcar | cic | fir");
+  FETCH_HELP_ARG(chp, "output rate", "sample rate / factor {boxcar 2 ... 256,");
+  FETCH_HELP_ARG(chp, "", "cic power of two 2 ... 64, fir 2 ... 16}");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "mode(<mode>[, <channel>])");
+  FETCH_HELP_DES(chp, "Set relationship of both devices, both must be stopped");
+  FETCH_HELP_ARG(chp, "mode", "independent | simultaneous | interleaved");
+  FETCH_HELP_ARG(chp, "channel", "11 | 13 {interleaved input, default 11}");
+  FETCH_HELP_DES(chp, "Dual modes are timed and configured by dev 0 and");
+  FETCH_HELP_DES(chp, "stream as one combined source, start/stop act on both");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "transport(<dev>, <transport>)");
+  FETCH_HELP_DES(chp, "Select how sample blocks reach mpipe, device must be stopped");
+  FETCH_HELP_ARG(chp, "dev", "0 | 1");
+  FETCH_HELP_ARG(chp, "transport", "mailbox | ring {mcard.record takes mailbox blocks only}");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "reset");
+  FETCH_HELP_DES(chp, "Reset adc module");
+  FETCH_HELP_BREAK(chp);
+
+	return true;
+}
+
+
+/*! \brief return sample data
+ */
+bool fetch_adc_single_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 1);
+  FETCH_MIN_ARGS(chp, argc, 1);
+
+  adc_dev_t * dev = parse_adc_dev(argv[0], NULL);
+
+  if( dev == NULL )
+  {
+    util_message_error(chp, "invalid adc device");
+    return false;
+  }
+
+  // TODO add ability to sample from streamming state by grabbing the current sample set instead of trigging a conversion
+
+  if( adc_mode != FETCH_ADC_MODE_INDEPENDENT )
+  {
+    util_message_error(chp, "not available in dual modes");
+    return false;
+  }
+
+  if( dev->driver->state != ADC_READY )
+  {
+    util_message_error(chp, "ADC device not in ready state");
+    return false;
+  }
+
+  dev->conv_grp->circular = false;
+  adcConvert(dev->driver, dev->conv_grp, dev->sample_buffer, 1);
+  util_message_uint16_array(chp, "samples", dev->sample_buffer, dev->conv_grp->num_channels);
+
+  return true;
+}
+
+
+/*! \brief Start a conversion
+ */
+bool fetch_adc_stream_start_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 1);
+  FETCH_MIN_ARGS(chp, argc, 1);
+
+  adc_dev_t * dev = parse_adc_dev(argv[0], NULL);
+
+  if( dev == NULL )
+  {
+    util_message_error(chp, "invalid adc device");
+    return false;
+  }
+
+  if( adc_mode != FETCH_ADC_MODE_INDEPENDENT )
+  {
+    return adc_combined_start(chp);
+  }
+
+  if( dev->driver->state != ADC_READY )
+  {
+    util_message_error(chp, "ADC device not in ready state");
+    return false;
+  }
+
+  adc_capture_stop(dev);
+  adc_decimate_restart(dev);
+
+  // the dma buffer holds two blocks so that the half transfer callback can
+  // hand one block downstream while the other is being filled
+  dev->conv_grp->circular = true;
+  adcStartConversion(dev->driver, dev->conv_grp, dev->sample_buffer, 2 * dev->block_depth);
+
+	return true;
+}
+
+/*! \brief Stop the current conversion
+ */
+bool fetch_adc_stream_stop_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 1);
+  FETCH_MIN_ARGS(chp, argc, 1);
+  
+  adc_dev_t * dev = parse_adc_dev(argv[0], NULL);
+
+  if( dev == NULL )
+  {
+    util_message_error(chp, "invalid adc device");
+    return false;
+  }
+
+  if( adc_mode != FETCH_ADC_MODE_INDEPENDENT )
+  {
+    for( uint32_t i = 0; i < FETCH_ADC_DEV_COUNT; i++ )
+    {
+      adcStopConversion(adc_devs[i].driver);
+    }
+    return true;
+  }
+
+  adcStopConversion(dev->driver);
+  adc_capture_stop(dev);
+  dev->stats.window = 0;
+
+	return true;
+}
+
+
+/*! \brief check if adc is done
+ */
+bool fetch_adc_status_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 0);
+
+  adc_status_t status;
+
+  util_message_string_format(chp, "adc_mode", "%s", adc_mode_table[adc_mode].str);
+
+  chSysLock();
+  status = adc_devs[1].status;
+  adc_status_clear(&adc_devs[1].status);
+  chSysUnlock();
+
+  util_message_uint32(chp, "adc1_error_dmafailure", status.error_dmafailure);
+  util_message_uint32(chp, "adc1_error_overflow", status.error_overflow);
+  util_message_uint32(chp, "adc1_mpipe_overflow", status.mpipe_overflow);
+  util_message_uint32(chp, "adc1_mcard_overflow", status.mcard_overflow);
+  util_message_uint32(chp, "adc1_mem_alloc_null", status.mem_alloc_null);
+  util_message_uint32(chp, "adc1_sequence_number", adc_devs[1].sequence_number);
+  util_message_uint16(chp, "adc1_timer_count", gptGetCounterX(&GPTD2));
+  util_message_uint16(chp, "adc1_block_depth", adc_devs[1].block_depth);
+  util_message_uint8_array(chp, "adc1_channels", adc_devs[1].channels, adc_devs[1].channel_count);
+  util_message_uint32(chp, "adc1_max_sample_rate", adc_dev_max_rate(&adc_devs[1], adc_mode));
+  util_message_uint32(chp, "adc1_decimate_factor", adc_devs[1].decimator.factor);
+  util_message_uint32(chp, "adc1_ring_overrun", adc_devs[1].ring_overrun);
+  util_message_uint32(chp, "adc1_stats_window", adc_devs[1].stats.window);
+  util_message_uint32(chp, "adc1_stats_overrun", adc_devs[1].stats.overrun);
+
+  chSysLock();
+  status = adc_devs[0].status;
+  adc_status_clear(&adc_devs[0].status);
+  chSysUnlock();
+
+  util_message_uint32(chp, "adc0_error_dmafailure", status.error_dmafailure);
+  util_message_uint32(chp, "adc0_error_overflow", status.error_overflow);
+  util_message_uint32(chp, "adc0_mpipe_overflow", status.mpipe_overflow);
+  util_message_uint32(chp, "adc0_mcard_overflow", status.mcard_overflow);
+  util_message_uint32(chp, "adc0_mem_alloc_null", status.mem_alloc_null);
+  util_message_uint32(chp, "adc0_sequence_number", adc_devs[0].sequence_number);
+  util_message_uint16(chp, "adc0_timer_count", gptGetCounterX(&GPTD3));
+  util_message_uint16(chp, "adc0_block_depth", adc_devs[0].block_depth);
+  util_message_uint8_array(chp, "adc0_channels", adc_devs[0].channels, adc_devs[0].channel_count);
+  util_message_uint32(chp, "adc0_max_sample_rate", adc_dev_max_rate(&adc_devs[0], adc_mode));
+  util_message_uint32(chp, "adc0_decimate_factor", adc_devs[0].decimator.factor);
+  util_message_uint32(chp, "adc0_ring_overrun", adc_devs[0].ring_overrun);
+  util_message_uint32(chp, "adc0_stats_window", adc_devs[0].stats.window);
+  util_message_uint32(chp, "adc0_stats_overrun", adc_devs[0].stats.overrun);
+
+  if( adc_capture.dev != NULL )
+  {
+    util_message_uint8(chp, "capture_dev", adc_capture.dev - adc_devs);
+  }
+  util_message_string_format(chp, "capture_state", "%s", adc_capture_state_table[adc_capture.state].str);
+  util_message_uint32(chp, "capture_count", adc_capture.window.number);
+  util_message_uint32(chp, "capture_samples", adc_capture_samples);
+  util_message_uint32(chp, "adc0_max_burst", adc_max_burst(&adc_devs[0]));
+  util_message_uint32(chp, "adc1_max_burst", adc_max_burst(&adc_devs[1]));
+  util_message_uint32(chp, "fft_count", adc_fft.block.number);
+  util_message_uint32(chp, "fft_dropped", adc_fft.dropped);
+  util_message_uint32(chp, "max_fft_size", adc_max_fft_size());
+
+  return true;
+}
+
+
+/*! \brief Process an ADC configure command
+ */
+bool fetch_adc_config_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 3);
+  FETCH_MIN_ARGS(chp, argc, 2);
+
+  char * endptr;
+  adc_dev_t * dev = parse_adc_dev(argv[0], NULL);
+  uint16_t block_depth;
+
+  if( dev == NULL )
+  {
+    util_message_error(chp, "invalid adc device");
+    return false;
+  }
+
+  uint32_t sample_rate = strtoul(argv[1], &endptr, 0);
+
+  if( *endptr != '\0' )
+  {
+    util_message_error(chp, "invalid sample rate");
+    return false;
+  }
+
+  block_depth = dev->block_depth;
+  if( argc > 2 && (!util_parse_uint16(argv[2], &block_depth) || block_depth < 1 || block_depth > ADC_SAMPLE_BLOCK_DEPTH_MAX) )
+  {
+    util_message_error(chp, "invalid block depth");
+    return false;
+  }
+
+  if( !adc_rate_set(chp, dev, sample_rate) )
+  {
+    return false;
+  }
+
+  // takes effect the next time the conversion is started
+  dev->block_depth = block_depth;
+
+  util_message_uint32(chp, "sample_rate", dev->sample_rate);
+  util_message_uint32(chp, "block_depth", dev->block_depth);
+  if( dev->decimator.filter != UTIL_DECIMATE_NONE )
+  {
+    // the decimation factor is kept, so the output rate follows the sample rate
+    util_message_uint32(chp, "output_rate", dev->sample_rate / dev->decimator.factor);
+  }
+
+  return true;
+}
+
+/*! \brief Select the channel sequence of a device
+ */
+bool fetch_adc_channels_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 1 + ADC_SAMPLE_SET_SIZE);
+  FETCH_MIN_ARGS(chp, argc, 2);
+
+  adc_dev_t * dev = parse_adc_dev(argv[0], NULL);
+  uint8_t channels[ADC_SAMPLE_SET_SIZE];
+  uint8_t old_channels[ADC_SAMPLE_SET_SIZE];
+  uint8_t old_count;
+  uint8_t count = argc - 1;
+
+  if( dev == NULL )
+  {
+    util_message_error(chp, "invalid adc device");
+    return false;
+  }
+
+  for( uint8_t i = 0; i < count; i++ )
+  {
+    if( !util_parse_uint8(argv[i + 1], &channels[i]) || memchr(dev->valid_channels, channels[i], ADC_SAMPLE_SET_SIZE) == NULL )
+    {
+      util_message_error(chp, "invalid channel");
+      return false;
+    }
+  }
+
+  if( !adc_channels_idle(chp, dev) )
+  {
+    return false;
+  }
+
+  memcpy(old_channels, dev->channels, sizeof(old_channels));
+  old_count = dev->channel_count;
+
+  memcpy(dev->channels, channels, count);
+  dev->channel_count = count;
+
+  if( !adc_rate_check(chp, dev, adc_mode, adc_trigger_rate(dev)) )
+  {
+    memcpy(dev->channels, old_channels, sizeof(old_channels));
+    dev->channel_count = old_count;
+    return false;
+  }
+
+  adc_mode_apply(adc_mode, adc_interleave_channel);
+  adc_decimate_restart(dev);
+
+  util_message_uint32(chp, "max_sample_rate", adc_dev_max_rate(dev, adc_mode));
+
+  return true;
+}
+
+/*! \brief Set the sample time of one channel of a device
+ */
+bool fetch_adc_sample_time_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 3);
+  FETCH_MIN_ARGS(chp, argc, 3);
+
+  adc_dev_t * dev = parse_adc_dev(argv[0], NULL);
+  uint8_t channel;
+  uint16_t cycles;
+  uint8_t code;
+  uint8_t old_code;
+
+  if( dev == NULL )
+  {
+    util_message_error(chp, "invalid adc device");
+    return false;
+  }
+
+  if( !util_parse_uint8(argv[1], &channel) || memchr(dev->valid_channels, channel, ADC_SAMPLE_SET_SIZE) == NULL )
+  {
+    util_message_error(chp, "invalid channel");
+    return false;
+  }
+
+  if( !util_parse_uint16(argv[2], &cycles) )
+  {
+    util_message_error(chp, "invalid sample time");
+    return false;
+  }
+
+  for( code = 0; code < NELEMS(adc_sample_time_cycles); code++ )
+  {
+    if( adc_sample_time_cycles[code] == cycles )
+    {
+      break;
+    }
+  }
+
+  if( code == NELEMS(adc_sample_time_cycles) )
+  {
+    util_message_error(chp, "invalid sample time");
+    return false;
+  }
+
+  if( !adc_channels_idle(chp, dev) )
+  {
+    return false;
+  }
+
+  old_code = dev->sample_time[channel];
+  dev->sample_time[channel] = code;
+
+  if( !adc_rate_check(chp, dev, adc_mode, adc_trigger_rate(dev)) )
+  {
+    dev->sample_time[channel] = old_code;
+    return false;
+  }
+
+  adc_mode_apply(adc_mode, adc_interleave_channel);
+
+  util_message_uint32(chp, "max_sample_rate", adc_dev_max_rate(dev, adc_mode));
+
+  return true;
+}
+
+/*! \brief Stream per window statistics instead of samples
+ */
+bool fetch_adc_stats_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 2);
+  FETCH_MIN_ARGS(chp, argc, 2);
+
+  int32_t dev_num;
+  adc_dev_t * dev = parse_adc_dev(argv[0], &dev_num);
+  uint32_t window;
+
+  if( dev == NULL )
+  {
+    util_message_error(chp, "invalid adc device");
+    return false;
+  }
+
+  if( !util_parse_uint32(argv[1], &window) || window == 0 || window > UTIL_STATS_MAX_COUNT )
+  {
+    util_message_error(chp, "invalid window");
+    return false;
+  }
+
+  if( adc_mode != FETCH_ADC_MODE_INDEPENDENT )
+  {
+    util_message_error(chp, "not available in dual modes");
+    return false;
+  }
+
+  if( dev->driver->state != ADC_READY )
+  {
+    util_message_error(chp, "ADC device not in ready state");
+    return false;
+  }
+
+  adc_capture_stop(dev);
+
+  util_stats_init(&dev->stats.acc, dev->channel_count);
+  dev->stats.record.dev = dev_num;
+  dev->stats.record.number = 0;
+  dev->stats.overrun = 0;
+  dev->stats.window = window;
+
+  // whole blocks per callback, the summary is all that goes downstream
+  dev->conv_grp->circular = true;
+  adcStartConversion(dev->driver, dev->conv_grp, dev->sample_buffer, 2 * (ADC_SAMPLE_BLOCK_SIZE / dev->channel_count));
+
+  util_message_uint32(chp, "sample_rate", dev->sample_rate);
+  util_message_uint32(chp, "window_us", (uint64_t)window * 1000000 / dev->sample_rate);
+
+  return true;
+}
+
+/*! \brief Arm a triggered capture on a device
+ */
+bool fetch_adc_trigger_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 7);
+  FETCH_MIN_ARGS(chp, argc, 6);
+
+  static const str_table_t condition_table[] = {
+    {"RISING", FETCH_ADC_TRIGGER_RISING},
+    {"FALLING", FETCH_ADC_TRIGGER_FALLING},
+    {"ABOVE", FETCH_ADC_TRIGGER_ABOVE},
+    {"BELOW", FETCH_ADC_TRIGGER_BELOW},
+    {NULL, 0}
+  };
+
+  static const str_table_t repeat_table[] = {
+    {"SINGLE", false},
+    {"NORMAL", true},
+    {NULL, 0}
+  };
+
+  int32_t dev_num;
+  adc_dev_t * dev = parse_adc_dev(argv[0], &dev_num);
+  uint8_t channel;
+  uint8_t * slot;
+  uint32_t condition;
+  uint32_t repeat = false;
+  uint16_t level;
+  uint16_t pre;
+  uint16_t post;
+  uint16_t size;
+
+  if( dev == NULL )
+  {
+    util_message_error(chp, "invalid adc device");
+    return false;
+  }
+
+  if( !util_parse_uint8(argv[1], &channel) || (slot = memchr(dev->channels, channel, dev->channel_count)) == NULL )
+  {
+    util_message_error(chp, "channel not in sequence");
+    return false;
+  }
+
+  if( !util_match_str_table(argv[2], &condition, condition_table) )
+  {
+    util_message_error(chp, "invalid condition");
+    return false;
+  }
+
+  if( !util_parse_uint16(argv[3], &level) || level > 4095 )
+  {
+    util_message_error(chp, "invalid level");
+    return false;
+  }
+
+  size = adc_max_burst(dev);
+
+  if( !util_parse_uint16(argv[4], &pre) || !util_parse_uint16(argv[5], &post) || post == 0 || (uint32_t)pre + post > size )
+  {
+    util_message_error(chp, "invalid window");
+    util_message_uint32(chp, "max_window", size);
+    return false;
+  }
+
+  if( argc > 6 && !util_match_str_table(argv[6], &repeat, repeat_table) )
+  {
+    util_message_error(chp, "invalid repeat");
+    return false;
+  }
+
+  if( adc_mode != FETCH_ADC_MODE_INDEPENDENT )
+  {
+    util_message_error(chp, "not available in dual modes");
+    return false;
+  }
+
+  if( adc_capture.dev != NULL && adc_capture.dev != dev )
+  {
+    util_message_error(chp, "capture in use by other device");
+    return false;
+  }
+
+  if( dev->driver->state != ADC_READY )
+  {
+    util_message_error(chp, "ADC device not in ready state");
+    return false;
   }
+
+  adc_capture.condition = condition;
+  adc_capture.channel_index = slot - dev->channels;
+  adc_capture.level = level;
+  adc_capture.pre = pre;
+  adc_capture.post = post;
+  adc_capture.repeat = repeat;
+  adc_capture.head = 0;
+  adc_capture.filled = 0;
+  adc_capture.primed = (pre > 0) ? pre : 1;
+
+  adc_capture.window.sample = adc_capture_buffer;
+  adc_capture.window.size = size;
+  adc_capture.window.set_count = pre + post;
+  adc_capture.window.pre = pre;
+  adc_capture.window.channel_count = dev->channel_count;
+  adc_capture.window.dev = dev_num;
+  adc_capture.window.number = 0;
+
+  adc_capture.state = FETCH_ADC_CAPTURE_ARMED;
+  adc_capture.dev = dev;
+
+  // whole blocks per callback, the trigger is tested set by set anyway
+  dev->conv_grp->circular = true;
+  adcStartConversion(dev->driver, dev->conv_grp, dev->sample_buffer, 2 * (ADC_SAMPLE_BLOCK_SIZE / dev->channel_count));
+
+  util_message_uint32(chp, "sample_rate", dev->sample_rate);
+  util_message_uint32(chp, "window", pre + post);
+
+  return true;
 }
 
-/*!
- * ADC end conversion callback
+/*! \brief Acquire a burst of sample sets straight into the capture buffer
  */
-static void fetch_adc_end_cb(ADCDriver * adcp, adcsample_t * buffer, size_t n)
+bool fetch_adc_capture_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
 {
+  FETCH_MAX_ARGS(chp, argc, 3);
+  FETCH_MIN_ARGS(chp, argc, 3);
 
-	(void) buffer;
-	(void) n;
-  adc_sample_set_t *ssp;
-  uint16_t seq_num;
+  static const str_table_t rate_table[] = {
+    {"MAX", 0},
+    {NULL, 0}
+  };
 
-  chSysLockFromISR();
-  ssp = chPoolAllocI(&adc_sample_set_pool);
-  chSysUnlockFromISR();
+  int32_t dev_num;
+  adc_dev_t * dev = parse_adc_dev(argv[0], &dev_num);
+  uint32_t count;
+  uint32_t sample_rate;
+  uint32_t rate_keyword;
 
-  if( ssp != NULL )
+  if( dev == NULL )
   {
-    memcpy(ssp->sample, buffer, sizeof(adcsample_t) * ADC_SAMPLE_SET_SIZE);
+    util_message_error(chp, "invalid adc device");
+    return false;
   }
 
-  if( adcp == &ADCD2 )
+  if( !util_parse_uint32(argv[1], &count) || count == 0 || count > adc_max_burst(dev) )
   {
-    adc2_sequence_number++;
-    if( ssp != NULL )
-    {
-      ssp->sequence_number = adc2_sequence_number;
-      chSysLockFromISR();
-      if( chMBPostI(&mpipe_adc2_mb, (msg_t)ssp) != MSG_OK )
-      {
-        adc2_status.mpipe_overflow = true;
-      }
-      else
-      {
-        ssp->mem_ref_count++;
-      }
-#if 0
-      if( chMBPostI(&mcard_adc2_mb, (msg_t)ssp) != MSG_OK )
-      {
-        adc2_status.mcard_overflow = true;
-      }
-      else
-      {
-        ssp->mem_ref_count++;
-      }
-#endif
-      chSysUnlockFromISR();
-    }
-    else
-    {
-      adc2_status.mem_alloc_null = true;
-    }
+    util_message_error(chp, "invalid count");
+    util_message_uint32(chp, "max_burst", adc_max_burst(dev));
+    return false;
   }
-  else //ADCD3
+
+  if( util_match_str_table(argv[2], &rate_keyword, rate_table) )
   {
-    adc3_sequence_number++;
-    if( ssp != NULL )
-    {
-      ssp->sequence_number = adc3_sequence_number;
-      chSysLockFromISR();
-      if( chMBPostI(&mpipe_adc3_mb, (msg_t)ssp) != MSG_OK )
-      {
-        adc3_status.mpipe_overflow = true;
-      }
-      else
-      {
-        ssp->mem_ref_count++;
-      }
-#if 0
-      if( chMBPostI(&mcard_adc3_mb, (msg_t)ssp) != MSG_OK )
-      {
-        adc3_status.mcard_overflow = true;
-      }
-      else
-      {
-        ssp->mem_ref_count++;
-      }
-#endif
-      chSysUnlockFromISR();
-    }
-    else
-    {
-      adc3_status.mem_alloc_null = true;
-    }
+    // round the timer interval up so the rate stays within the limit
+    uint32_t max_rate = adc_dev_max_rate(dev, FETCH_ADC_MODE_INDEPENDENT);
+    sample_rate = FETCH_ADC_TIMER_FREQ / ((FETCH_ADC_TIMER_FREQ + max_rate - 1) / max_rate);
   }
-
-  if( ssp != NULL && ssp->mem_ref_count == 0 )
+  else if( !util_parse_uint32(argv[2], &sample_rate) )
   {
-    // we were not able to enqueue it anywhere so lets free it imediately
-    chSysLockFromISR();
-    chPoolFreeI(&adc_sample_set_pool, ssp);
-    chSysUnlockFromISR();
+    util_message_error(chp, "invalid sample rate");
+    return false;
   }
-}
 
-void fetch_adc_free_sample_set( adc_sample_set_t *ssp )
-{
-  if( ssp != NULL )
+  if( adc_mode != FETCH_ADC_MODE_INDEPENDENT )
   {
-    chSysLock();
-    ssp->mem_ref_count--;
-    if( ssp->mem_ref_count <= 0 )
-    {
-      chPoolFreeI(&adc_sample_set_pool, ssp);
-    }
-    chSysUnlock();
+    util_message_error(chp, "not available in dual modes");
+    return false;
   }
-}
 
-static ADCDriver * parse_adc_dev( char * str, int32_t * dev )
-{
-  char * endptr;
-  int32_t num = strtol(str, &endptr, 0);
+  if( adc_capture.dev != NULL && adc_capture.dev != dev )
+  {
+    util_message_error(chp, "capture in use by other device");
+    return false;
+  }
 
-  if(*endptr != '\0')
+  if( dev->driver->state != ADC_READY )
   {
-    return NULL;
+    util_message_error(chp, "ADC device not in ready state");
+    return false;
   }
 
-  if( dev != NULL )
+  // the previous burst may still be on its way out
+  if( adc_capture.state == FETCH_ADC_CAPTURE_READY )
   {
-    *dev = num;
+    util_message_error(chp, "capture still being sent");
+    return false;
   }
 
-  switch( num )
+  if( !adc_rate_set(chp, dev, sample_rate) )
   {
-    case 1: // Marionette name
-      return &ADCD2;
-    case 0:
-      return &ADCD3;
-    default:
-      return NULL;
+    return false;
   }
-}
 
-/*! \brief display adc help
- */
-bool fetch_adc_help_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
-{
-  FETCH_MAX_ARGS(chp, argc, 0);
+  adc_capture.window.sample = adc_capture_buffer;
+  adc_capture.window.size = count;
+  adc_capture.window.start = 0;
+  adc_capture.window.set_count = count;
+  adc_capture.window.pre = 0;
+  adc_capture.window.channel_count = dev->channel_count;
+  adc_capture.window.dev = dev_num;
+  adc_capture.repeat = false;
 
-  FETCH_HELP_BREAK(chp);
-  FETCH_HELP_LEGEND(chp);
-  FETCH_HELP_BREAK(chp);
-  FETCH_HELP_TITLE(chp, "ADC Help");
-  FETCH_HELP_BREAK(chp);
-  FETCH_HELP_CMD(chp, "single(<dev>)");
-  FETCH_HELP_DES(chp, "Single sample from each channel");
-  FETCH_HELP_ARG(chp, "dev", "0 | 1");
-  FETCH_HELP_BREAK(chp);
-  FETCH_HELP_CMD(chp, "start(<dev>)");
-  FETCH_HELP_DES(chp, "Start ADC sampling");
-  FETCH_HELP_ARG(chp, "dev", "0 | 1");
-  FETCH_HELP_BREAK(chp);
-  FETCH_HELP_CMD(chp, "stop(<dev>)");
-  FETCH_HELP_DES(chp, "Stop ADC sampling");
-  FETCH_HELP_ARG(chp, "dev", "0 | 1");
-  FETCH_HELP_BREAK(chp);
-  FETCH_HELP_CMD(chp, "status");
-  FETCH_HELP_DES(chp, "Query current adc status");
-  FETCH_HELP_BREAK(chp);
-  FETCH_HELP_CMD(chp, "config(<dev>, <sample rate>)");
-  FETCH_HELP_DES(chp, "Configure adc device");
-  FETCH_HELP_ARG(chp, "sample rate", "16 ... 1000000");
-  FETCH_HELP_BREAK(chp);
-  FETCH_HELP_CMD(chp, "reset");
-  FETCH_HELP_DES(chp, "Reset adc module");
-  FETCH_HELP_BREAK(chp);
+  adc_capture.state = FETCH_ADC_CAPTURE_BURST;
+  adc_capture.dev = dev;
 
-	return true;
-}
+  dev->conv_grp->circular = false;
+  adcStartConversion(dev->driver, dev->conv_grp, adc_capture_buffer, count);
 
+  util_message_uint32(chp, "sample_rate", dev->sample_rate);
+  util_message_uint32(chp, "count", count);
+  util_message_uint32(chp, "duration_us", (uint64_t)count * 1000000 / dev->sample_rate);
 
-/*! \brief return sample data
+  return true;
+}
+
+/*! \brief Stream spectra of one input instead of samples
  */
-bool fetch_adc_single_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+bool fetch_adc_fft_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
 {
-  FETCH_MAX_ARGS(chp, argc, 1);
-  FETCH_MIN_ARGS(chp, argc, 1);
+  FETCH_MAX_ARGS(chp, argc, 5);
+  FETCH_MIN_ARGS(chp, argc, 4);
+
+  static const str_table_t window_table[] = {
+    {"NONE", UTIL_FFT_WINDOW_NONE},
+    {"HANN", UTIL_FFT_WINDOW_HANN},
+    {"HAMMING", UTIL_FFT_WINDOW_HAMMING},
+    {"BLACKMAN", UTIL_FFT_WINDOW_BLACKMAN},
+    {NULL, 0}
+  };
+
+  int32_t dev_num;
+  adc_dev_t * dev = parse_adc_dev(argv[0], &dev_num);
+  uint8_t channel;
+  uint8_t * slot;
+  uint16_t size;
+  uint32_t window;
+  uint8_t peaks = 0;
+
+  if( dev == NULL )
+  {
+    util_message_error(chp, "invalid adc device");
+    return false;
+  }
+
+  if( !util_parse_uint8(argv[1], &channel) || (slot = memchr(dev->channels, channel, dev->channel_count)) == NULL )
+  {
+    util_message_error(chp, "channel not in sequence");
+    return false;
+  }
 
-  int32_t dev;
-  ADCDriver *adc_drv = parse_adc_dev(argv[0], &dev);
+  if( !util_parse_uint16(argv[2], &size) || !util_fft_size_valid(size) || size > adc_max_fft_size() )
+  {
+    util_message_error(chp, "invalid size");
+    util_message_uint32(chp, "max_fft_size", adc_max_fft_size());
+    return false;
+  }
 
-  if( adc_drv == NULL )
+  if( !util_match_str_table(argv[3], &window, window_table) )
   {
-    util_message_error(chp, "invalid adc device");
-    false;
+    util_message_error(chp, "invalid window");
+    return false;
   }
 
-  // TODO add ability to sample from streamming state by grabbing the current sample set instead of trigging a conversion
+  if( argc > 4 && (!util_parse_uint8(argv[4], &peaks) || peaks > UTIL_FFT_MAX_PEAKS) )
+  {
+    util_message_error(chp, "invalid peaks");
+    return false;
+  }
+
+  if( adc_mode != FETCH_ADC_MODE_INDEPENDENT )
+  {
+    util_message_error(chp, "not available in dual modes");
+    return false;
+  }
+
+  if( adc_capture.dev != NULL && adc_capture.dev != dev )
+  {
+    util_message_error(chp, "capture in use by other device");
+    return false;
+  }
 
-  if( adc_drv->state != ADC_READY )
+  if( dev->driver->state != ADC_READY )
   {
     util_message_error(chp, "ADC device not in ready state");
     return false;
   }
 
-  switch(dev)
+  if( adc_capture.state == FETCH_ADC_CAPTURE_READY )
   {
-    case 1:
-      adc2_conv_grp.circular = false;
-      adcConvert( &ADCD2, &adc2_conv_grp, adc2_sample_buffer, FETCH_ADC_SAMPLE_DEPTH);
-      util_message_uint16_array(chp, "samples", adc2_sample_buffer, FETCH_ADC2_BUFFER_SIZE);
-      break;
-    case 0:
-      adc3_conv_grp.circular = false;
-	    adcConvert( &ADCD3, &adc3_conv_grp, adc3_sample_buffer, FETCH_ADC_SAMPLE_DEPTH);
-      util_message_uint16_array(chp, "samples", adc3_sample_buffer, FETCH_ADC3_BUFFER_SIZE);
-      break;
+    util_message_error(chp, "capture still being sent");
+    return false;
   }
 
+  adc_fft.buffer[0] = adc_capture_buffer;
+  adc_fft.buffer[1] = adc_capture_buffer + size;
+  adc_fft.channel_index = slot - dev->channels;
+  adc_fft.active = 0;
+  adc_fft.fill = 0;
+  adc_fft.ready = false;
+  adc_fft.dropped = 0;
+
+  // the core allocator aligns the buffer for the float scratch
+  adc_fft.block.work = (float *)(adc_capture_buffer + 2 * size);
+  adc_fft.block.magnitude = adc_capture_buffer + 4 * size;
+  adc_fft.block.size = size;
+  adc_fft.block.channel = channel;
+  adc_fft.block.window = window;
+  adc_fft.block.peaks = peaks;
+  adc_fft.block.dev = dev_num;
+  adc_fft.block.sample_rate = dev->sample_rate;
+  adc_fft.block.number = 0;
+
+  adc_capture.state = FETCH_ADC_CAPTURE_SPECTRUM;
+  adc_capture.dev = dev;
+
+  dev->conv_grp->circular = true;
+  adcStartConversion(dev->driver, dev->conv_grp, dev->sample_buffer, 2 * (ADC_SAMPLE_BLOCK_SIZE / dev->channel_count));
+
+  util_message_uint32(chp, "sample_rate", dev->sample_rate);
+  util_message_uint32(chp, "bins", size / 2 + 1);
+  util_message_uint32(chp, "bin_width_mhz", (uint64_t)dev->sample_rate * 1000 / size);
+  util_message_uint32(chp, "frame_us", (uint64_t)size * 1000000 / dev->sample_rate);
+
   return true;
 }
 
-
-/*! \brief Start a conversion
+/*! \brief Select the decimation filter of a device
  */
-bool fetch_adc_stream_start_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+bool fetch_adc_decimate_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
 {
-  FETCH_MAX_ARGS(chp, argc, 1);
-  FETCH_MIN_ARGS(chp, argc, 1);
+  FETCH_MAX_ARGS(chp, argc, 3);
+  FETCH_MIN_ARGS(chp, argc, 2);
+
+  static const str_table_t filter_table[] = {
+    {"NONE", UTIL_DECIMATE_NONE},
+    {"BOXCAR", UTIL_DECIMATE_BOXCAR},
+    {"CIC", UTIL_DECIMATE_CIC},
+    {"FIR", UTIL_DECIMATE_FIR},
+    {NULL, 0}
+  };
 
-  int32_t dev;
-  ADCDriver *adc_drv = parse_adc_dev(argv[0], &dev);
+  adc_dev_t * dev = parse_adc_dev(argv[0], NULL);
+  uint32_t filter;
+  uint32_t output_rate;
+  uint32_t factor = 1;
 
-  if( adc_drv == NULL )
+  if( dev == NULL )
   {
     util_message_error(chp, "invalid adc device");
-    false;
+    return false;
   }
 
-  if( adc_drv->state != ADC_READY )
+  if( !util_match_str_table(argv[1], &filter, filter_table) )
   {
-    util_message_error(chp, "ADC device not in ready state");
+    util_message_error(chp, "invalid filter");
     return false;
   }
 
-  switch(dev)
+  if( filter != UTIL_DECIMATE_NONE )
   {
-    case 1:
-      adc2_conv_grp.circular = true;
-      adcStartConversion( &ADCD2, &adc2_conv_grp, adc2_sample_buffer, FETCH_ADC_SAMPLE_DEPTH);
-      break;
-    case 0:
-      adc3_conv_grp.circular = true;
-	    adcStartConversion( &ADCD3, &adc3_conv_grp, adc3_sample_buffer, FETCH_ADC_SAMPLE_DEPTH);
-      break;
+    if( argc < 3 || !util_parse_uint32(argv[2], &output_rate) || output_rate == 0 || output_rate > dev->sample_rate / 2 )
+    {
+      util_message_error(chp, "invalid output rate");
+      return false;
+    }
+    factor = (dev->sample_rate + output_rate / 2) / output_rate;
   }
 
-	return true;
-}
+  if( adc_mode != FETCH_ADC_MODE_INDEPENDENT )
+  {
+    util_message_error(chp, "decimation not available in dual modes");
+    return false;
+  }
 
-/*! \brief Stop the current conversion
- */
-bool fetch_adc_stream_stop_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
-{
-  FETCH_MAX_ARGS(chp, argc, 1);
-  FETCH_MIN_ARGS(chp, argc, 1);
-  
-  ADCDriver *adc_drv = parse_adc_dev(argv[0], NULL);
+  if( dev->driver->state != ADC_READY )
+  {
+    util_message_error(chp, "ADC device not in ready state");
+    return false;
+  }
 
-  if( adc_drv == NULL )
+  if( !util_decimate_init(&dev->decimator, filter, factor, dev->channel_count, ADC_SAMPLE_BITS) )
   {
-    util_message_error(chp, "invalid adc device");
+    util_message_error(chp, "decimation factor not supported by filter");
     return false;
   }
 
-  adcStopConversion(adc_drv);
+  util_message_uint32(chp, "factor", dev->decimator.factor);
+  util_message_uint32(chp, "output_rate", dev->sample_rate / dev->decimator.factor);
+  util_message_uint32(chp, "output_bits", (filter == UTIL_DECIMATE_NONE) ? ADC_SAMPLE_BITS : UTIL_DECIMATE_OUTPUT_BITS);
 
-	return true;
+  return true;
 }
 
-
-/*! \brief check if adc is done
+/*! \brief Select independent or one of the dual device modes
  */
-bool fetch_adc_status_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+bool fetch_adc_mode_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
 {
-  FETCH_MAX_ARGS(chp, argc, 0);
+  FETCH_MAX_ARGS(chp, argc, 2);
+  FETCH_MIN_ARGS(chp, argc, 1);
 
-  adc_status_t status;
+  uint32_t mode;
+  uint32_t channel = FETCH_ADC_INTERLEAVE_CH_A;
 
-  chSysLock();
-  status = adc2_status;
-  adc2_status.error_dmafailure = false;
-  adc2_status.error_overflow = false;
-  adc2_status.mpipe_overflow = false;
-  adc2_status.mcard_overflow = false;
-  adc2_status.mem_alloc_null = false;
-  chSysUnlock();
+  if( !util_match_str_table(argv[0], &mode, adc_mode_table) )
+  {
+    util_message_error(chp, "invalid mode");
+    return false;
+  }
 
-  util_message_bool(chp, "adc1_error_dmafailure", status.error_dmafailure);
-  util_message_bool(chp, "adc1_error_overflow", status.error_overflow);
-  util_message_bool(chp, "adc1_mpipe_overflow", status.mpipe_overflow);
-  util_message_bool(chp, "adc1_mcard_overflow", status.mcard_overflow);
-  util_message_bool(chp, "adc1_mem_alloc_null", status.mem_alloc_null);
-  util_message_uint16(chp, "adc1_sequence_number", adc2_sequence_number);
-  util_message_uint16(chp, "adc1_timer_count", gptGetCounterX(&GPTD2));
+  if( argc > 1 )
+  {
+    if( !util_parse_uint32(argv[1], &channel) || (channel != FETCH_ADC_INTERLEAVE_CH_A && channel != FETCH_ADC_INTERLEAVE_CH_B) )
+    {
+      util_message_error(chp, "invalid channel");
+      return false;
+    }
+  }
 
-  chSysLock();
-  status = adc3_status;
-  adc3_status.error_dmafailure = false;
-  adc3_status.error_overflow = false;
-  adc3_status.mpipe_overflow = false;
-  adc3_status.mcard_overflow = false;
-  adc3_status.mem_alloc_null = false;
-  chSysUnlock();
+  for( uint32_t i = 0; i < FETCH_ADC_DEV_COUNT; i++ )
+  {
+    if( adc_devs[i].driver->state != ADC_READY )
+    {
+      util_message_error(chp, "ADC device not in ready state");
+      return false;
+    }
+    if( mode != FETCH_ADC_MODE_INDEPENDENT && adc_devs[i].decimator.filter != UTIL_DECIMATE_NONE )
+    {
+      util_message_error(chp, "decimation not available in dual modes");
+      return false;
+    }
+  }
 
-  util_message_bool(chp, "adc0_error_dmafailure", status.error_dmafailure);
-  util_message_bool(chp, "adc0_error_overflow", status.error_overflow);
-  util_message_bool(chp, "adc0_mpipe_overflow", status.mpipe_overflow);
-  util_message_bool(chp, "adc0_mcard_overflow", status.mcard_overflow);
-  util_message_bool(chp, "adc0_mem_alloc_null", status.mem_alloc_null);
-  util_message_uint16(chp, "adc0_sequence_number", adc3_sequence_number);
-  util_message_uint16(chp, "adc0_timer_count", gptGetCounterX(&GPTD3));
+  uint8_t old_channel = adc_interleave_channel;
+  adc_interleave_channel = channel;
+  if( !adc_rate_check(chp, &adc_devs[0], mode, adc_devs[0].sample_rate) )
+  {
+    adc_interleave_channel = old_channel;
+    return false;
+  }
+
+  adc_mode_apply(mode, channel);
+  adc_timer_start(&adc_devs[0]);
+
+  if( mode == FETCH_ADC_MODE_INTERLEAVED )
+  {
+    util_message_uint32(chp, "sample_rate", 2 * adc_devs[0].sample_rate);
+  }
+  else
+  {
+    util_message_uint32(chp, "sample_rate", adc_devs[0].sample_rate);
+  }
 
   return true;
 }
 
-
-/*! \brief Process an ADC configure command
+/*! \brief Select the sample block transport of a device
  */
-bool fetch_adc_config_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+bool fetch_adc_transport_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
 {
   FETCH_MAX_ARGS(chp, argc, 2);
   FETCH_MIN_ARGS(chp, argc, 2);
 
-  char * endptr;
-  int32_t dev;
-  ADCDriver *adc_drv = parse_adc_dev(argv[0], &dev);
+  static const str_table_t transport_table[] = {
+    {"MAILBOX", FETCH_ADC_TRANSPORT_MAILBOX},
+    {"RING", FETCH_ADC_TRANSPORT_RING},
+    {NULL, 0}
+  };
 
-  if( adc_drv == NULL )
+  adc_dev_t * dev = parse_adc_dev(argv[0], NULL);
+  uint32_t transport;
+
+  if( dev == NULL )
   {
     util_message_error(chp, "invalid adc device");
     return false;
   }
 
-  uint32_t sample_rate = strtoul(argv[1], &endptr, 0);
-
-  if( *endptr != '\0' || sample_rate <= (FETCH_ADC_TIMER_FREQ / 0xffff) || sample_rate > FETCH_ADC_TIMER_FREQ )
+  if( !util_match_str_table(argv[1], &transport, transport_table) )
   {
-    util_message_error(chp, "invalid sample rate");
+    util_message_error(chp, "invalid transport");
     return false;
   }
 
-  switch(dev)
+  // the callback reads the transport, so only switch while it can not run
+  if( dev->driver->state != ADC_READY )
   {
-    case 1:
-      adc2_timer_interval = FETCH_ADC_TIMER_FREQ / sample_rate;
-      adc2_sample_rate = FETCH_ADC_TIMER_FREQ / adc2_timer_interval;
-
-      gptStopTimer(&GPTD2);
-      gptStartContinuous( &GPTD2, adc2_timer_interval);
-
-      util_message_uint32(chp, "sample_rate", adc2_sample_rate);
-      break;
-    case 0:
-      adc3_timer_interval = FETCH_ADC_TIMER_FREQ / sample_rate;
-      adc3_sample_rate = FETCH_ADC_TIMER_FREQ / adc3_timer_interval;
-      
-      gptStopTimer(&GPTD3);
-      gptStartContinuous( &GPTD3, adc3_timer_interval);
-      
-      util_message_uint32(chp, "sample_rate", adc3_sample_rate);
-      break;
+    util_message_error(chp, "ADC device not in ready state");
+    return false;
   }
 
+  dev->transport = transport;
+
   return true;
 }
 
@@ -522,10 +2379,14 @@ bool fetch_adc_timer_reset_cmd(BaseSequentialStream * chp, uint32_t argc, char *
 {
   FETCH_MAX_ARGS(chp, argc, 0);
 
-  gptStopTimer(&GPTD2);
-  gptStopTimer(&GPTD3);
-  gptStartContinuous( &GPTD2, adc2_timer_interval);
-  gptStartContinuous( &GPTD3, adc3_timer_interval);
+  for( uint32_t i = 0; i < FETCH_ADC_DEV_COUNT; i++ )
+  {
+    gptStopTimer(adc_devs[i].timer);
+  }
+  for( uint32_t i = 0; i < FETCH_ADC_DEV_COUNT; i++ )
+  {
+    adc_timer_start(&adc_devs[i]);
+  }
 
   return true;
 }
@@ -543,23 +2404,32 @@ void fetch_adc_init(void)
 {
   adcStart(&ADCD2,NULL);
   adcStart(&ADCD3,NULL);
- 
-  chPoolObjectInit(&adc_sample_set_pool, sizeof(adc_sample_set_t), NULL);
-  chPoolLoadArray(&adc_sample_set_pool, adc_sample_set_buffer, FETCH_ADC_MEM_POOL_SIZE);
-  
-  adc2_status.error_dmafailure = false;
-  adc2_status.error_overflow = false;
-  adc2_status.mpipe_overflow = false;
-  adc2_status.mcard_overflow = false;
-  adc2_status.mem_alloc_null = false;
-
-  adc3_status.error_dmafailure = false;
-  adc3_status.error_overflow = false;
-  adc3_status.mpipe_overflow = false;
-  adc3_status.mcard_overflow = false;
-  adc3_status.mem_alloc_null = false;
 
+  for( uint32_t i = 0; i < FETCH_ADC_DEV_COUNT; i++ )
+  {
+    adc_channels_default(&adc_devs[i]);
+  }
+  adc_mode_apply(FETCH_ADC_MODE_INDEPENDENT, FETCH_ADC_INTERLEAVE_CH_A);
+ 
+  // the capture buffer takes what is left of the core memory
+  adc_capture_samples = 0;
+  if( chCoreGetStatusX() > FETCH_ADC_CAPTURE_RESERVE )
+  {
+    adc_capture_samples = (chCoreGetStatusX() - FETCH_ADC_CAPTURE_RESERVE) / sizeof(adcsample_t);
+    if( adc_capture_samples > FETCH_ADC_CAPTURE_MAX_SAMPLES )
+    {
+      adc_capture_samples = FETCH_ADC_CAPTURE_MAX_SAMPLES;
+    }
+    adc_capture_buffer = chCoreAlloc(adc_capture_samples * sizeof(adcsample_t));
+    if( adc_capture_buffer == NULL )
+    {
+      adc_capture_samples = 0;
+    }
+  }
 
+  chPoolObjectInit(&adc_sample_block_pool, sizeof(adc_sample_block_t), NULL);
+  chPoolLoadArray(&adc_sample_block_pool, adc_sample_block_buffer, FETCH_ADC_MEM_POOL_SIZE);
+  
   memset(&gpt2_cfg, 0, sizeof(gpt2_cfg));
 
   gpt2_cfg.frequency = 1000000;
@@ -571,36 +2441,54 @@ void fetch_adc_init(void)
   gptStart(&GPTD2, &gpt2_cfg);
   gptStart(&GPTD3, &gpt3_cfg);
 
-  adc2_timer_interval = FETCH_ADC_TIMER_FREQ / FETCH_ADC_DEFAULT_SAMPLE_RATE;
-  adc2_sample_rate = FETCH_ADC_TIMER_FREQ / adc2_timer_interval;
+  for( uint32_t i = 0; i < FETCH_ADC_DEV_COUNT; i++ )
+  {
+    adc_dev_t * dev = &adc_devs[i];
+
+    adc_status_clear(&dev->status);
 
-  adc3_timer_interval = FETCH_ADC_TIMER_FREQ / FETCH_ADC_DEFAULT_SAMPLE_RATE;
-  adc3_sample_rate = FETCH_ADC_TIMER_FREQ / adc3_timer_interval;
+    util_spsc_init(&dev->ring, FETCH_ADC_RING_SIZE);
+    dev->ring_overrun = 0;
+    dev->transport = FETCH_ADC_TRANSPORT_MAILBOX;
 
-  gptStartContinuous( &GPTD2, adc2_timer_interval);
-  gptStartContinuous( &GPTD3, adc3_timer_interval);
+    dev->block_depth = FETCH_ADC_DEFAULT_BLOCK_DEPTH;
+    dev->timer_interval = FETCH_ADC_TIMER_FREQ / FETCH_ADC_DEFAULT_SAMPLE_RATE;
+    dev->sample_rate = FETCH_ADC_TIMER_FREQ / dev->timer_interval;
+
+    adc_timer_start(dev);
+  }
 }
 
 
 bool fetch_adc_reset(BaseSequentialStream * chp)
 {
-	adcStopConversion(&ADCD2);
-  adcStopConversion(&ADCD3);
-  gptStopTimer(&GPTD2);
-  gptStopTimer(&GPTD3);
-  
-  adc2_timer_interval = FETCH_ADC_TIMER_FREQ / FETCH_ADC_DEFAULT_SAMPLE_RATE;
-  adc2_sample_rate = FETCH_ADC_TIMER_FREQ / adc2_timer_interval;
+  for( uint32_t i = 0; i < FETCH_ADC_DEV_COUNT; i++ )
+  {
+    adcStopConversion(adc_devs[i].driver);
+    gptStopTimer(adc_devs[i].timer);
+    adc_channels_default(&adc_devs[i]);
+  }
+  adc_capture_stop(NULL);
+
+  adc_mode_apply(FETCH_ADC_MODE_INDEPENDENT, FETCH_ADC_INTERLEAVE_CH_A);
+
+  for( uint32_t i = 0; i < FETCH_ADC_DEV_COUNT; i++ )
+  {
+    adc_dev_t * dev = &adc_devs[i];
 
-  adc3_timer_interval = FETCH_ADC_TIMER_FREQ / FETCH_ADC_DEFAULT_SAMPLE_RATE;
-  adc3_sample_rate = FETCH_ADC_TIMER_FREQ / adc3_timer_interval;
+    // blocks already in the ring are drained by the mpipe thread
+    dev->ring_overrun = 0;
+    dev->stats.window = 0;
+    dev->transport = FETCH_ADC_TRANSPORT_MAILBOX;
 
-  gptStartContinuous( &GPTD2, adc2_timer_interval);
-  gptStartContinuous( &GPTD3, adc3_timer_interval);
+    dev->block_depth = FETCH_ADC_DEFAULT_BLOCK_DEPTH;
+    dev->timer_interval = FETCH_ADC_TIMER_FREQ / FETCH_ADC_DEFAULT_SAMPLE_RATE;
+    dev->sample_rate = FETCH_ADC_TIMER_FREQ / dev->timer_interval;
+
+    adc_timer_start(dev);
+  }
 
   return true;
 }
 
 /*! @} */
-
-
@@ -0,0 +1,686 @@
+/*! \file fetch_can.c
+  *
+  * Supporting Fetch DSL
+  *
+  * \sa fetch.c
+  * @defgroup fetch_can Fetch CAN
+  * @{
+  */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "util_general.h"
+#include "util_messages.h"
+#include "util_arg_parse.h"
+#include "util_timebase.h"
+
+#include "fetch_defs.h"
+#include "fetch.h"
+#include "fetch_can.h"
+
+#include "mpipe.h"
+
+#ifndef FETCH_CAN_RX_WA_SIZE
+#define FETCH_CAN_RX_WA_SIZE 256
+#endif
+
+// above the mpipe threads, the hardware fifos only hold three frames each
+#ifndef FETCH_CAN_RX_PRIO
+#define FETCH_CAN_RX_PRIO (NORMALPRIO + 2)
+#endif
+
+#ifndef FETCH_CAN_TX_TIMEOUT
+#define FETCH_CAN_TX_TIMEOUT MS2ST(100)
+#endif
+
+#define FETCH_CAN_DEFAULT_BITRATE 500000
+
+// CAN1 owns the filter banks below the CAN2 start bank
+#define FETCH_CAN_FILTER_COUNT 14
+
+// time quanta per bit, sync segment + ts1 (1 ... 16) + ts2 (1 ... 8)
+#define FETCH_CAN_MIN_TQ 8
+#define FETCH_CAN_MAX_TQ 25
+#define FETCH_CAN_MAX_BRP 1024
+
+// sample point the bit timing aims for, in permille of the bit
+#define FETCH_CAN_SAMPLE_POINT 875
+
+#define FETCH_CAN_RX_EVENT    EVENT_MASK(0)
+#define FETCH_CAN_ERROR_EVENT EVENT_MASK(1)
+
+#define FETCH_CAN_STD_ID_MAX 0x7ff
+#define FETCH_CAN_EXT_ID_MAX 0x1fffffff
+
+typedef enum {
+  FETCH_CAN_MODE_NORMAL,
+  FETCH_CAN_MODE_LOOPBACK,          // frames sent are received, and go out on the bus
+  FETCH_CAN_MODE_SILENT,            // listen only, no ack and no error frames
+  FETCH_CAN_MODE_SILENT_LOOPBACK    // internal only, for testing without a bus
+} can_mode_t;
+
+static const str_table_t can_mode_table[] = {
+  {"NORMAL", FETCH_CAN_MODE_NORMAL},
+  {"LOOPBACK", FETCH_CAN_MODE_LOOPBACK},
+  {"SILENT", FETCH_CAN_MODE_SILENT},
+  {"SILENT_LOOPBACK", FETCH_CAN_MODE_SILENT_LOOPBACK},
+  {NULL, 0}
+};
+
+static const uint32_t can_mode_btr[] = {
+  0,
+  CAN_BTR_LBKM,
+  CAN_BTR_SILM,
+  CAN_BTR_SILM | CAN_BTR_LBKM
+};
+
+static CANConfig can_cfg;
+static uint32_t can_bitrate = FETCH_CAN_DEFAULT_BITRATE;
+static can_mode_t can_mode = FETCH_CAN_MODE_NORMAL;
+
+/*! \brief acceptance filter banks, a bank passes matching frames to a fifo
+ *
+ * Applied while the driver is stopped, so changing them restarts a
+ * running driver. Without any bank every frame is accepted.
+ */
+static struct {
+  bool used;
+  CANFilter filter;
+} can_filters[FETCH_CAN_FILTER_COUNT];
+
+// rx thread reads the fifos only while the shell is not restarting the driver
+static mutex_t can_lock;
+
+static THD_WORKING_AREA(can_rx_wa, FETCH_CAN_RX_WA_SIZE);
+
+static fetch_can_rx_t can_rx_buffer[FETCH_CAN_RX_POOL_SIZE];
+static memory_pool_t can_rx_pool;
+
+static volatile bool can_stream = false;
+static uint32_t can_rx_sequence;
+
+/*! \brief counters kept until can.reset
+ */
+static struct {
+  uint32_t rx_frames;
+  uint32_t rx_dropped;          // pool or mpipe mailbox full
+  uint32_t rx_paused;           // held back by the mpipe flow policy
+  uint32_t tx_frames;
+  uint32_t tx_timeouts;
+  uint32_t warnings;            // error counters passed 96
+  uint32_t passive;             // error counters passed 127
+  uint32_t bus_off;
+  uint32_t bus_errors;          // protocol errors seen by the controller
+  uint32_t overflows;           // frames lost to a full hardware fifo
+  uint32_t bits;                // bus bits of the frames counted, without stuff bits
+} can_status;
+
+// bus load is measured between can.status calls
+static struct {
+  uint32_t bits;
+  uint32_t time;
+} can_load_snapshot;
+
+/*! \brief bits a frame takes on the bus, leaving out stuff bits
+ *
+ * Start of frame, arbitration, control, data, crc, ack, end of frame and
+ * interframe space.
+ */
+static uint32_t can_frame_bits(uint8_t ide, uint8_t rtr, uint8_t dlc)
+{
+  uint32_t bits = (ide == CAN_IDE_EXT) ? 67 : 47;
+
+  if( rtr == CAN_RTR_DATA )
+  {
+    bits += 8 * ((dlc > 8) ? 8 : dlc);
+  }
+  return bits;
+}
+
+/*! \brief bit timing with the sample point closest to FETCH_CAN_SAMPLE_POINT
+ *
+ * Only prescalers which divide PCLK1 down to the bitrate exactly are
+ * considered, of equally good ones the finest time quantum wins.
+ * \return false if no exact bit timing exists
+ */
+static bool can_bit_timing(uint32_t bitrate, uint32_t * btr, uint32_t * tq_count, uint32_t * sample_point)
+{
+  uint32_t best_error = UINT32_MAX;
+
+  if( bitrate == 0 )
+  {
+    return false;
+  }
+
+  for( uint32_t tq = FETCH_CAN_MAX_TQ; tq >= FETCH_CAN_MIN_TQ; tq-- )
+  {
+    uint32_t brp;
+    uint32_t ts1;
+    uint32_t ts2;
+    uint32_t point;
+    uint32_t error;
+
+    if( STM32_PCLK1 % (bitrate * tq) != 0 )
+    {
+      continue;
+    }
+    brp = STM32_PCLK1 / (bitrate * tq);
+    if( brp == 0 || brp > FETCH_CAN_MAX_BRP )
+    {
+      continue;
+    }
+
+    ts1 = (tq * FETCH_CAN_SAMPLE_POINT + 500) / 1000 - 1;
+    if( ts1 > 16 )
+    {
+      ts1 = 16;
+    }
+    ts2 = tq - 1 - ts1;
+    if( ts2 < 1 || ts2 > 8 )
+    {
+      continue;
+    }
+
+    point = (1 + ts1) * 1000 / tq;
+    error = (point > FETCH_CAN_SAMPLE_POINT) ? point - FETCH_CAN_SAMPLE_POINT : FETCH_CAN_SAMPLE_POINT - point;
+    if( error < best_error )
+    {
+      best_error = error;
+      *btr = CAN_BTR_SJW(((ts2 > 4) ? 4 : ts2) - 1) | CAN_BTR_TS2(ts2 - 1) | CAN_BTR_TS1(ts1 - 1) | CAN_BTR_BRP(brp - 1);
+      *tq_count = tq;
+      *sample_point = point;
+    }
+  }
+
+  return best_error != UINT32_MAX;
+}
+
+static void can_stop(void)
+{
+  chMtxLock(&can_lock);
+  canStop(&CAND1);
+  chMtxUnlock(&can_lock);
+
+  // shut the transceiver down
+  palSetPad(GPIOF, GPIOF_PF2_CAN_SHDN);
+}
+
+/*! \brief (re)start the driver with the current bit timing and filters
+ */
+static void can_start(void)
+{
+  CANFilter filters[FETCH_CAN_FILTER_COUNT];
+  uint32_t count = 0;
+
+  for( uint32_t i = 0; i < FETCH_CAN_FILTER_COUNT; i++ )
+  {
+    if( can_filters[i].used )
+    {
+      filters[count++] = can_filters[i].filter;
+    }
+  }
+
+  palSetPadMode(GPIOH, GPIOH_PH13_CAN1_TX, PAL_MODE_ALTERNATE(9));
+  palSetPadMode(GPIOI, GPIOI_PI9_CAN1_RX, PAL_MODE_ALTERNATE(9));
+
+  // time triggered mode for the rx timestamps, tx mailboxes in request order
+  can_cfg.mcr = CAN_MCR_ABOM | CAN_MCR_AWUM | CAN_MCR_TXFP | CAN_MCR_TTCM;
+
+  chMtxLock(&can_lock);
+  canStop(&CAND1);
+  canSTM32SetFilters(FETCH_CAN_FILTER_COUNT, count, filters);
+  canStart(&CAND1, &can_cfg);
+  chMtxUnlock(&can_lock);
+
+  // silent loopback stays off the bus
+  if( can_mode == FETCH_CAN_MODE_SILENT_LOOPBACK )
+  {
+    palSetPad(GPIOF, GPIOF_PF2_CAN_SHDN);
+  }
+  else
+  {
+    palClearPad(GPIOF, GPIOF_PF2_CAN_SHDN);
+  }
+
+  can_load_snapshot.bits = can_status.bits;
+  can_load_snapshot.time = util_timebase_now();
+}
+
+static void can_count_errors(eventflags_t flags)
+{
+  if( flags & CAN_LIMIT_WARNING )
+  {
+    can_status.warnings++;
+  }
+  if( flags & CAN_LIMIT_ERROR )
+  {
+    can_status.passive++;
+  }
+  if( flags & CAN_BUS_OFF_ERROR )
+  {
+    can_status.bus_off++;
+  }
+  if( flags & CAN_FRAMING_ERROR )
+  {
+    can_status.bus_errors++;
+  }
+  if( flags & CAN_OVERFLOW_ERROR )
+  {
+    can_status.overflows++;
+  }
+}
+
+/*! \brief count a received frame and queue it for mpipe while streaming
+ */
+static void can_rx_post(const CANRxFrame * rxp, uint32_t timestamp)
+{
+  fetch_can_rx_t * fp;
+  uint32_t sequence = can_rx_sequence++;
+
+  can_status.rx_frames++;
+  can_status.bits += can_frame_bits(rxp->IDE, rxp->RTR, rxp->DLC);
+
+  if( !can_stream )
+  {
+    return;
+  }
+
+  chSysLock();
+  if( !mpipe_flow_admit(MPIPE_PRODUCER_CAN, chMBGetUsedCountI(&mpipe_can_mb)) )
+  {
+    can_status.rx_paused++;
+    chSysUnlock();
+    return;
+  }
+
+  fp = chPoolAllocI(&can_rx_pool);
+  if( fp == NULL )
+  {
+    can_status.rx_dropped++;
+    chSysUnlock();
+    return;
+  }
+  fp->sequence = sequence;
+  fp->timestamp = timestamp;
+  fp->frame = *rxp;
+
+  if( chMBPostI(&mpipe_can_mb, (msg_t)fp) != MSG_OK )
+  {
+    chPoolFreeI(&can_rx_pool, fp);
+    can_status.rx_dropped++;
+    chSysUnlock();
+    return;
+  }
+  chSysUnlock();
+
+  mpipe_signal(MPIPE_PRODUCER_CAN);
+}
+
+/*! \brief drain the receive fifos whenever the driver reports frames
+ *
+ * Frames are stamped with the timebase as they are read, the TIME field
+ * keeps the exact start of frame in bit times of the controller.
+ */
+static void can_rx_thread(void * arg)
+{
+  event_listener_t rx_listener;
+  event_listener_t error_listener;
+  CANRxFrame rx;
+
+  (void)arg;
+  chRegSetThreadName("can_rx");
+
+  chEvtRegisterMask(&CAND1.rxfull_event, &rx_listener, FETCH_CAN_RX_EVENT);
+  chEvtRegisterMask(&CAND1.error_event, &error_listener, FETCH_CAN_ERROR_EVENT);
+
+  while( true )
+  {
+    eventmask_t events = chEvtWaitAny(ALL_EVENTS);
+
+    if( events & FETCH_CAN_ERROR_EVENT )
+    {
+      can_count_errors(chEvtGetAndClearFlags(&error_listener));
+    }
+
+    chMtxLock(&can_lock);
+    while( CAND1.state == CAN_READY && canReceive(&CAND1, CAN_ANY_MAILBOX, &rx, TIME_IMMEDIATE) == MSG_OK )
+    {
+      can_rx_post(&rx, util_timebase_now());
+    }
+    chMtxUnlock(&can_lock);
+  }
+}
+
+void fetch_can_free_rx_frame(fetch_can_rx_t * fp)
+{
+  if( fp != NULL )
+  {
+    chPoolFree(&can_rx_pool, fp);
+  }
+}
+
+bool fetch_can_config_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 2);
+  FETCH_MIN_ARGS(chp, argc, 1);
+
+  uint32_t bitrate;
+  uint32_t mode = FETCH_CAN_MODE_NORMAL;
+  uint32_t btr;
+  uint32_t tq_count;
+  uint32_t sample_point;
+
+  if( !util_parse_uint32(argv[0], &bitrate) || !can_bit_timing(bitrate, &btr, &tq_count, &sample_point) )
+  {
+    util_message_error(chp, "Invalid bitrate, needs an exact divider of %d Hz", STM32_PCLK1);
+    return false;
+  }
+
+  if( argc > 1 && !util_match_str_table(argv[1], &mode, can_mode_table) )
+  {
+    util_message_error(chp, "Invalid mode");
+    return false;
+  }
+
+  can_bitrate = bitrate;
+  can_mode = (can_mode_t)mode;
+  can_cfg.btr = btr | can_mode_btr[can_mode];
+  can_start();
+
+  util_message_uint32(chp, "bitrate", can_bitrate);
+  util_message_uint32(chp, "prescaler", (btr & 0x3ff) + 1);
+  util_message_uint32(chp, "tq_per_bit", tq_count);
+  util_message_uint32(chp, "sample_point", sample_point);
+  util_message_string_format(chp, "mode", "%s", can_mode_table[can_mode].str);
+
+  return true;
+}
+
+/*! \brief set or clear a 32 bit mask mode acceptance filter
+ *
+ * A frame passes when its id agrees with id in every bit set in mask. A
+ * bank only matches its own id type. Even banks feed fifo 0, odd banks
+ * fifo 1, so spreading filters over both doubles the hardware buffering.
+ */
+bool fetch_can_filter_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 4);
+  FETCH_MIN_ARGS(chp, argc, 1);
+
+  uint32_t bank;
+  uint32_t id;
+  uint32_t mask;
+  bool ext = false;
+  CANFilter * fp;
+
+  if( !util_parse_uint32(argv[0], &bank) || bank >= FETCH_CAN_FILTER_COUNT )
+  {
+    util_message_error(chp, "Invalid bank, max=%d", FETCH_CAN_FILTER_COUNT - 1);
+    return false;
+  }
+
+  if( argc == 1 )
+  {
+    can_filters[bank].used = false;
+  }
+  else
+  {
+    if( argc < 3 )
+    {
+      util_message_error(chp, "Need id and mask");
+      return false;
+    }
+    if( argc > 3 && !util_parse_bool(argv[3], &ext) )
+    {
+      util_message_error(chp, "Invalid ext setting");
+      return false;
+    }
+    if( !util_parse_uint32(argv[1], &id) || id > (ext ? FETCH_CAN_EXT_ID_MAX : FETCH_CAN_STD_ID_MAX) )
+    {
+      util_message_error(chp, "Invalid id");
+      return false;
+    }
+    if( !util_parse_uint32(argv[2], &mask) || mask > (ext ? FETCH_CAN_EXT_ID_MAX : FETCH_CAN_STD_ID_MAX) )
+    {
+      util_message_error(chp, "Invalid mask");
+      return false;
+    }
+
+    // FiRx layout: STID[31:21] or EXID[31:3], IDE bit 2, RTR bit 1
+    fp = &can_filters[bank].filter;
+    fp->filter = bank;
+    fp->mode = 0;
+    fp->scale = 1;
+    fp->assignment = bank & 1;
+    fp->register1 = (ext ? (id << 3) : (id << 21)) | (ext ? 0x4 : 0);
+    fp->register2 = (ext ? (mask << 3) : (mask << 21)) | 0x4;
+    can_filters[bank].used = true;
+  }
+
+  if( CAND1.state == CAN_READY )
+  {
+    can_start();
+  }
+
+  return true;
+}
+
+/*! \brief send data as one or more frames of the same id
+ *
+ * Data beyond 8 bytes continues in further frames. They are handed to the
+ * three transmit mailboxes back to back and leave in request order, the
+ * command only waits when all mailboxes are busy.
+ */
+bool fetch_can_tx_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MIN_ARGS(chp, argc, 3);
+
+  uint32_t id;
+  bool ext;
+  uint32_t count = 0;
+  uint32_t offset = 0;
+  uint32_t frames = 0;
+  CANTxFrame tx;
+
+  if( CAND1.state != CAN_READY )
+  {
+    util_message_error(chp, "CAN not configured");
+    return false;
+  }
+  if( !util_parse_bool(argv[1], &ext) )
+  {
+    util_message_error(chp, "Invalid ext setting");
+    return false;
+  }
+  if( !util_parse_uint32(argv[0], &id) || id > (ext ? FETCH_CAN_EXT_ID_MAX : FETCH_CAN_STD_ID_MAX) )
+  {
+    util_message_error(chp, "Invalid id");
+    return false;
+  }
+  if( !fetch_parse_bytes(chp, argc - 2, &argv[2], fetch_shared_buffer, sizeof(fetch_shared_buffer), &count) )
+  {
+    util_message_error(chp, "fetch_parse_bytes failed");
+    return false;
+  }
+
+  memset(&tx, 0, sizeof(tx));
+  tx.IDE = ext ? CAN_IDE_EXT : CAN_IDE_STD;
+  tx.RTR = CAN_RTR_DATA;
+  if( ext )
+  {
+    tx.EID = id;
+  }
+  else
+  {
+    tx.SID = id;
+  }
+
+  do
+  {
+    tx.DLC = (count - offset > 8) ? 8 : (count - offset);
+    memcpy(tx.data8, &fetch_shared_buffer[offset], tx.DLC);
+
+    if( canTransmit(&CAND1, CAN_ANY_MAILBOX, &tx, FETCH_CAN_TX_TIMEOUT) != MSG_OK )
+    {
+      can_status.tx_timeouts++;
+      util_message_error(chp, "timeout");
+      util_message_uint32(chp, "frames", frames);
+      return false;
+    }
+    can_status.tx_frames++;
+    can_status.bits += can_frame_bits(tx.IDE, tx.RTR, tx.DLC);
+    frames++;
+    offset += tx.DLC;
+  } while( offset < count );
+
+  util_message_uint32(chp, "frames", frames);
+
+  return true;
+}
+
+bool fetch_can_rx_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 1);
+
+  bool enable;
+
+  if( argc > 0 )
+  {
+    if( !util_parse_bool(argv[0], &enable) )
+    {
+      util_message_error(chp, "Invalid enable setting");
+      return false;
+    }
+    can_stream = enable;
+  }
+
+  util_message_bool(chp, "stream", can_stream);
+
+  return true;
+}
+
+bool fetch_can_status_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 0);
+
+  uint32_t now = util_timebase_now();
+  uint32_t elapsed = now - can_load_snapshot.time;
+  uint32_t bits = can_status.bits - can_load_snapshot.bits;
+  uint32_t load = 0;
+  uint32_t esr = CAND1.can->ESR;
+  bool running = (CAND1.state == CAN_READY);
+
+  if( running && elapsed > 0 )
+  {
+    load = (uint64_t)bits * 1000 * UTIL_TIMEBASE_FREQ / ((uint64_t)can_bitrate * elapsed);
+  }
+  can_load_snapshot.bits = can_status.bits;
+  can_load_snapshot.time = now;
+
+  util_message_bool(chp, "running", running);
+  util_message_uint32(chp, "bitrate", can_bitrate);
+  util_message_string_format(chp, "mode", "%s", can_mode_table[can_mode].str);
+  util_message_bool(chp, "stream", can_stream);
+  util_message_uint32(chp, "rx_frames", can_status.rx_frames);
+  util_message_uint32(chp, "rx_dropped", can_status.rx_dropped);
+  util_message_uint32(chp, "rx_paused", can_status.rx_paused);
+  util_message_uint32(chp, "tx_frames", can_status.tx_frames);
+  util_message_uint32(chp, "tx_timeouts", can_status.tx_timeouts);
+  util_message_uint32(chp, "bus_load", load);
+  util_message_uint32(chp, "tx_error_count", running ? (esr & CAN_ESR_TEC) >> 16 : 0);
+  util_message_uint32(chp, "rx_error_count", running ? (esr & CAN_ESR_REC) >> 24 : 0);
+  util_message_uint32(chp, "last_error_code", running ? (esr & CAN_ESR_LEC) >> 4 : 0);
+  util_message_bool(chp, "error_passive", running && (esr & CAN_ESR_EPVF));
+  util_message_bool(chp, "is_bus_off", running && (esr & CAN_ESR_BOFF));
+  util_message_uint32(chp, "warnings", can_status.warnings);
+  util_message_uint32(chp, "passive", can_status.passive);
+  util_message_uint32(chp, "bus_off", can_status.bus_off);
+  util_message_uint32(chp, "bus_errors", can_status.bus_errors);
+  util_message_uint32(chp, "overflows", can_status.overflows);
+
+  return true;
+}
+
+bool fetch_can_reset_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 0);
+
+  return fetch_can_reset(chp);
+}
+
+bool fetch_can_help_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 0);
+
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_LEGEND(chp);
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_TITLE(chp,"CAN Help");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "config(<bitrate>[,<mode>])");
+  FETCH_HELP_DES(chp, "Start CAN1 with the given bit timing");
+  FETCH_HELP_ARG(chp, "bitrate", "bits per second, e.g. 125000 | 250000 | 500000 | 1000000");
+  FETCH_HELP_ARG(chp, "mode", "normal | loopback | silent | silent_loopback");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "filter(<bank>[,<id>,<mask>[,<ext>]])");
+  FETCH_HELP_DES(chp, "Set or clear a hardware acceptance filter, none accepts all");
+  FETCH_HELP_ARG(chp, "bank", "0 ... 13 {even banks use fifo 0, odd banks fifo 1}");
+  FETCH_HELP_ARG(chp, "id", "id bits to match");
+  FETCH_HELP_ARG(chp, "mask", "id bits that must match");
+  FETCH_HELP_ARG(chp, "ext", "0 | 1 {extended 29 bit ids}");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "tx(<id>,<ext>,<data 0>[,<data 1> ...])");
+  FETCH_HELP_DES(chp, "Send data, 8 bytes per frame");
+  FETCH_HELP_ARG(chp, "id", "frame id");
+  FETCH_HELP_ARG(chp, "ext", "0 | 1 {extended 29 bit id}");
+  FETCH_HELP_ARG(chp, "data", "List of bytes or strings");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "rx([<enable>])");
+  FETCH_HELP_DES(chp, "Stream received frames to mpipe");
+  FETCH_HELP_ARG(chp, "enable", "0 | 1");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "status");
+  FETCH_HELP_DES(chp, "Query counters, bus load in permille since the last status and error state");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "reset");
+  FETCH_HELP_DES(chp, "Stop CAN1, clear filters and counters");
+  FETCH_HELP_BREAK(chp);
+
+  return true;
+}
+
+void fetch_can_init(void)
+{
+  chMtxObjectInit(&can_lock);
+
+  chPoolObjectInit(&can_rx_pool, sizeof(fetch_can_rx_t), NULL);
+  chPoolLoadArray(&can_rx_pool, can_rx_buffer, FETCH_CAN_RX_POOL_SIZE);
+
+  chThdCreateStatic(can_rx_wa, sizeof(can_rx_wa), FETCH_CAN_RX_PRIO, can_rx_thread, NULL);
+}
+
+bool fetch_can_reset(BaseSequentialStream * chp)
+{
+  (void)chp;
+
+  can_stream = false;
+  can_stop();
+
+  for( uint32_t i = 0; i < FETCH_CAN_FILTER_COUNT; i++ )
+  {
+    can_filters[i].used = false;
+  }
+  can_bitrate = FETCH_CAN_DEFAULT_BITRATE;
+  can_mode = FETCH_CAN_MODE_NORMAL;
+  can_rx_sequence = 0;
+  memset(&can_status, 0, sizeof(can_status));
+
+  return true;
+}
+
+//! @}
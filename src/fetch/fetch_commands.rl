@@ -14,6 +14,7 @@
                     | "test"i       %{ *func=fetch_test_cmd; }
                     | "test_data"i  %{ *func=fetch_test_data_cmd; }
                     | "clocks"i     %{ *func=fetch_clocks_cmd; }
+                    | "timestamp"i  %{ *func=fetch_timestamp_cmd; }
                   );
 
   gpio_commands = "gpio"i . cmd_delim . (
@@ -48,6 +49,9 @@
   dac_commands = "dac"i . cmd_delim . (
                       "help"i       %{ *func=fetch_dac_help_cmd; }
                     | "write"i      %{ *func=fetch_dac_write_cmd; }
+                    | "stream"i     %{ *func=fetch_dac_stream_cmd; }
+                    | "stop"i       %{ *func=fetch_dac_stop_cmd; }
+                    | "status"i     %{ *func=fetch_dac_status_cmd; }
                     | "reset"i      %{ *func=fetch_dac_reset_cmd; }
                   );
 
@@ -66,16 +70,26 @@
                     | "stop"i       %{ *func=fetch_adc_stream_stop_cmd; }
                     | "status"i     %{ *func=fetch_adc_status_cmd; }
                     | "config"i     %{ *func=fetch_adc_config_cmd; }
+                    | "channels"i   %{ *func=fetch_adc_channels_cmd; }
+                    | "sample_time"i  %{ *func=fetch_adc_sample_time_cmd; }
+                    | "stats"i      %{ *func=fetch_adc_stats_cmd; }
+                    | "trigger"i    %{ *func=fetch_adc_trigger_cmd; }
+                    | "capture"i    %{ *func=fetch_adc_capture_cmd; }
+                    | "fft"i        %{ *func=fetch_adc_fft_cmd; }
+                    | "decimate"i   %{ *func=fetch_adc_decimate_cmd; }
+                    | "mode"i       %{ *func=fetch_adc_mode_cmd; }
+                    | "transport"i  %{ *func=fetch_adc_transport_cmd; }
                     | "reset"i      %{ *func=fetch_adc_reset_cmd; }
                   );
 
   can_commands = "can"i . cmd_delim . (
-                      "tx"i         %{ *func=NULL; /*FIXME*/ }
-                    | "rx"i         %{ *func=NULL; /*FIXME*/ }
-                    | "status"i     %{ *func=NULL; /*FIXME*/ }
-                    | "config"i     %{ *func=NULL; /*FIXME*/ }
-                    | "help"i       %{ *func=NULL; /*FIXME*/ }
-                    | "reset"i      %{ *func=NULL; /*FIXME*/ }
+                      "tx"i         %{ *func=fetch_can_tx_cmd; }
+                    | "rx"i         %{ *func=fetch_can_rx_cmd; }
+                    | "status"i     %{ *func=fetch_can_status_cmd; }
+                    | "config"i     %{ *func=fetch_can_config_cmd; }
+                    | "filter"i     %{ *func=fetch_can_filter_cmd; }
+                    | "help"i       %{ *func=fetch_can_help_cmd; }
+                    | "reset"i      %{ *func=fetch_can_reset_cmd; }
                   );
 
   timer_commands = "timer"i . cmd_delim . (
@@ -91,12 +105,46 @@
                     | "write_eeprom"i %{ *func=fetch_mbus_write_eeprom_cmd; }
                   );
 
+  sd_commands = "sd"i . cmd_delim . (
+                      "help"i       %{ *func=fetch_sd_help_cmd; }
+                    | "connect"i    %{ *func=fetch_sd_connect_cmd; }
+                    | "disconnect"i %{ *func=fetch_sd_disconnect_cmd; }
+                    | "mount"i      %{ *func=fetch_sd_mount_cmd; }
+                    | "unmount"i    %{ *func=fetch_sd_unmount_cmd; }
+                    | "format"i     %{ *func=fetch_sd_format_cmd; }
+                    | "open"i       %{ *func=fetch_sd_open_cmd; }
+                    | "close"i      %{ *func=fetch_sd_close_cmd; }
+                    | "unlink"i     %{ *func=fetch_sd_unlink_cmd; }
+                    | "read"i       %{ *func=fetch_sd_read_cmd; }
+                    | "write"i      %{ *func=fetch_sd_write_cmd; }
+                    | "tell"i       %{ *func=fetch_sd_tell_cmd; }
+                    | "seek"i       %{ *func=fetch_sd_seek_cmd; }
+                    | "dir"i        %{ *func=fetch_sd_dir_cmd; }
+                    | "prealloc"i   %{ *func=fetch_sd_prealloc_cmd; }
+                    | "dump"i       %{ *func=fetch_sd_dump_cmd; }
+                    | "bench"i      %{ *func=fetch_sd_bench_cmd; }
+                  );
+
   mcard_commands = "mcard"i . cmd_delim . (
-                    "help"i       %{ *func=NULL; /*FIXME*/ }
+                      "help"i       %{ *func=fetch_mcard_help_cmd; }
+                    | "record"i     %{ *func=fetch_mcard_record_cmd; }
+                    | "stop"i       %{ *func=fetch_mcard_stop_cmd; }
+                    | "status"i     %{ *func=fetch_mcard_status_cmd; }
+                    | "reset"i      %{ *func=fetch_mcard_reset_cmd; }
                   );
 
   mpipe_commands = "mpipe"i . cmd_delim . (
-                    "help"i       %{ *func=NULL; /*FIXME*/ }
+                      "help"i       %{ *func=fetch_mpipe_help_cmd; }
+                    | "format"i     %{ *func=fetch_mpipe_format_cmd; }
+                    | "weight"i     %{ *func=fetch_mpipe_weight_cmd; }
+                    | "flow"i       %{ *func=fetch_mpipe_flow_cmd; }
+                    | "reset"i      %{ *func=fetch_mpipe_reset_cmd; }
+                  );
+
+  stream_commands = "stream"i . cmd_delim . (
+                      "help"i       %{ *func=fetch_stream_help_cmd; }
+                    | "stats"i      %{ *func=fetch_stream_stats_cmd; }
+                    | "reset"i      %{ *func=fetch_stream_reset_cmd; }
                   );
 
   serial_commands = "serial"i . cmd_delim . (
@@ -110,6 +158,7 @@
                     | "reset"i        %{ *func=fetch_serial_reset_cmd; }
                     | "flush_input"i  %{ *func=fetch_serial_flush_input_cmd; }
                     | "read_line"i    %{ *func=fetch_serial_read_line_cmd; }
+                    | "capture"i      %{ *func=fetch_serial_capture_cmd; }
                   );
 
   fetch_command = ( root_commands   | 
@@ -121,8 +170,10 @@
                     can_commands    |
                     timer_commands  |
                     mbus_commands   |
+                    sd_commands     |
                     mcard_commands  |
                     mpipe_commands  |
+                    stream_commands |
                     serial_commands
                   ) @err{ fetch_parser_info.error_msg = "invalid command"; };
 
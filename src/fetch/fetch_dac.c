@@ -31,6 +31,7 @@
 #include "util_messages.h"
 #include "util_io.h"
 #include "util_arg_parse.h"
+#include "util_spsc.h"
 
 #include "fetch_defs.h"
 #include "fetch.h"
@@ -45,18 +46,89 @@
 SPIConfig spi4_cfg;
 DACConfig dac1_cfg;
 
+static GPTConfig gpt6_cfg;
 
-static bool external_dac_write(uint16_t channel, uint16_t value)
-{
-  uint8_t tx_data[2];
+// dac.stream pacing timer
+#define FETCH_DAC_TIMER_FREQ  1000000
+#define FETCH_DAC_MIN_RATE    (FETCH_DAC_TIMER_FREQ / 0xffff + 1)
 
-  // External DAC -> DAC124S085
+// every channel takes a 16 bit spi transfer or a dac write per set
+#ifndef FETCH_DAC_MAX_RATE
+#define FETCH_DAC_MAX_RATE    100000
+#endif
 
-  if( channel > 3 || value > 0xfff)
-  {
-    return false;
-  }
+// queued blocks, a power of two, playback starts once all are filled
+#ifndef FETCH_DAC_RING_SIZE
+#define FETCH_DAC_RING_SIZE   4
+#endif
+
+// slack on top of one block play time before a push gives up
+#ifndef FETCH_DAC_PUSH_MARGIN_MS
+#define FETCH_DAC_PUSH_MARGIN_MS  50
+#endif
 
+#define FETCH_DAC_CHANNEL_HS    4
+#define FETCH_DAC_CHANNEL_COUNT 5
+
+typedef enum {
+  FETCH_DAC_STREAM_IDLE,
+  FETCH_DAC_STREAM_FILLING,     // waiting for the ring to fill
+  FETCH_DAC_STREAM_RUNNING
+} dac_stream_state_t;
+
+typedef struct {
+  uint16_t sample[FETCH_DAC_BLOCK_SAMPLES];
+  uint16_t set_count;
+} dac_block_t;
+
+/*! \brief dac.stream playback
+ *
+ * Blocks from the mpipe input go through a single producer single consumer
+ * ring, the free slot semaphore blocks the input while the ring is full so
+ * usb flow control holds the host back. The TIM6 callback plays one set
+ * per tick, the internal dac directly and the external channels as a
+ * chain of spi transfers continued from the spi callback. Without a queued
+ * block the outputs hold their last value and the tick counts an underrun.
+ */
+static struct {
+  volatile dac_stream_state_t state;
+  uint8_t channels[FETCH_DAC_CHANNEL_COUNT];
+  uint8_t channel_count;
+  uint32_t rate;
+  util_spsc_t ring;
+  dac_block_t slots[FETCH_DAC_RING_SIZE];
+  semaphore_t free;
+  uint16_t position;            // next set of the playing block
+  uint8_t spi_tx[FETCH_DAC_CHANNEL_COUNT][2];
+  uint8_t spi_count;
+  uint8_t spi_next;
+  volatile bool spi_busy;
+  uint32_t next_sequence;
+  bool sequence_valid;
+  volatile uint32_t sets_played;
+  volatile uint32_t underruns;  // ticks without a queued block
+  volatile uint32_t late;       // ticks which found the spi chain busy
+  uint32_t blocks;
+  uint32_t rejected;
+  uint32_t sequence_gaps;
+} dac_stream;
+
+static const str_table_t dac_channel_table[] = {
+  {"0", 0},
+  {"1", 1},
+  {"2", 2},
+  {"3", 3},
+  {"4", FETCH_DAC_CHANNEL_HS},
+  {"HS", FETCH_DAC_CHANNEL_HS},
+  {NULL, 0}
+};
+
+static const char * dac_stream_state_names[] = { "IDLE", "FILLING", "RUNNING" };
+
+/*! \brief DAC124S085 command word, write and update one output
+ */
+static uint16_t external_dac_word(uint16_t channel, uint16_t value)
+{
   // set channel bits (15..16)
   value |= (channel << 14);
 
@@ -68,6 +140,22 @@ static bool external_dac_write(uint16_t channel, uint16_t value)
   // 3 = Power down outputs
   value |= (1 << 12);
 
+  return value;
+}
+
+static bool external_dac_write(uint16_t channel, uint16_t value)
+{
+  uint8_t tx_data[2];
+
+  // External DAC -> DAC124S085
+
+  if( channel > 3 || value > 0xfff)
+  {
+    return false;
+  }
+
+  value = external_dac_word(channel, value);
+
   // make sure the byte order is correct (MSBF 16bit)
   tx_data[0] = value >> 8;
   tx_data[1] = value & 0xff;
@@ -79,6 +167,194 @@ static bool external_dac_write(uint16_t channel, uint16_t value)
   return true;
 }
 
+/*! \brief continue the spi chain of the current set
+ */
+static void dac_spi_end_cb(SPIDriver * spip)
+{
+  // dac.write transfers from a thread end up here as well
+  if( !dac_stream.spi_busy )
+  {
+    return;
+  }
+
+  chSysLockFromISR();
+  spiUnselectI(spip);
+  if( ++dac_stream.spi_next < dac_stream.spi_count )
+  {
+    spiSelectI(spip);
+    spiStartSendI(spip, 2, dac_stream.spi_tx[dac_stream.spi_next]);
+  }
+  else
+  {
+    dac_stream.spi_busy = false;
+  }
+  chSysUnlockFromISR();
+}
+
+/*! \brief play one set of the oldest queued block
+ */
+static void dac_stream_tick(GPTDriver * gptp)
+{
+  const dac_block_t * bp;
+  const uint16_t * sp;
+  bool spi_free;
+
+  (void)gptp;
+
+  chSysLockFromISR();
+  if( dac_stream.state != FETCH_DAC_STREAM_RUNNING )
+  {
+    chSysUnlockFromISR();
+    return;
+  }
+  if( util_spsc_empty(&dac_stream.ring) )
+  {
+    dac_stream.underruns++;
+    chSysUnlockFromISR();
+    return;
+  }
+
+  bp = &dac_stream.slots[util_spsc_read_index(&dac_stream.ring)];
+  sp = &bp->sample[dac_stream.position * dac_stream.channel_count];
+
+  // a chain still running means the rate is too high for the channels
+  spi_free = !dac_stream.spi_busy;
+  if( !spi_free )
+  {
+    dac_stream.late++;
+  }
+
+  dac_stream.spi_count = 0;
+  for( uint8_t i = 0; i < dac_stream.channel_count; i++ )
+  {
+    if( dac_stream.channels[i] == FETCH_DAC_CHANNEL_HS )
+    {
+      dacPutChannelX(&DACD1, 0, sp[i]);
+    }
+    else if( spi_free )
+    {
+      uint16_t word = external_dac_word(dac_stream.channels[i], sp[i]);
+
+      dac_stream.spi_tx[dac_stream.spi_count][0] = word >> 8;
+      dac_stream.spi_tx[dac_stream.spi_count][1] = word & 0xff;
+      dac_stream.spi_count++;
+    }
+  }
+  if( dac_stream.spi_count > 0 )
+  {
+    dac_stream.spi_next = 0;
+    dac_stream.spi_busy = true;
+    spiSelectI(&SPID4);
+    spiStartSendI(&SPID4, 2, dac_stream.spi_tx[0]);
+  }
+
+  dac_stream.sets_played++;
+  if( ++dac_stream.position >= bp->set_count )
+  {
+    dac_stream.position = 0;
+    util_spsc_release(&dac_stream.ring);
+    chSemSignalI(&dac_stream.free);
+  }
+  chSysUnlockFromISR();
+}
+
+/*! \brief stop playback and wait for the spi chain of the last set
+ *
+ * A dac.write may follow right away and must not start a transfer on
+ * SPID4 while the chain is still running.
+ */
+static void dac_stream_stop(void)
+{
+  chSysLock();
+  gptStopTimerI(&GPTD6);
+  dac_stream.state = FETCH_DAC_STREAM_IDLE;
+  // wakes an input waiting for a slot
+  chSemResetI(&dac_stream.free, 0);
+  chSchRescheduleS();
+  chSysUnlock();
+
+  while( dac_stream.spi_busy )
+  {
+    chThdSleepMilliseconds(1);
+  }
+}
+
+/*! \brief longest a push waits for a slot
+ *
+ * A running stream frees a slot within the play time of one block of the
+ * largest size, anything longer means playback has stalled.
+ */
+static systime_t dac_push_timeout(void)
+{
+  uint32_t sets = FETCH_DAC_BLOCK_SAMPLES / dac_stream.channel_count;
+
+  return MS2ST(FETCH_DAC_PUSH_MARGIN_MS + (1000 * sets) / dac_stream.rate);
+}
+
+/*! \brief queue a MPIPE_FRAME_DAC_BLOCK payload for playback
+ *
+ * Called from the mpipe input thread, waits while the ring is full, at
+ * most dac_push_timeout(). The host paces its frames by this wait; input
+ * queued behind the frame, K credit lines included, is held up as long.
+ * \return false if the block was rejected
+ */
+bool fetch_dac_stream_push(uint32_t sequence, const uint8_t * payload, size_t n)
+{
+  dac_block_t * bp;
+  uint8_t channel_count;
+  uint16_t set_count;
+  uint32_t count;
+
+  if( n < 3 )
+  {
+    dac_stream.rejected++;
+    return false;
+  }
+  channel_count = payload[0];
+  set_count = payload[1] | (payload[2] << 8);
+  count = (uint32_t)set_count * channel_count;
+
+  if( dac_stream.state == FETCH_DAC_STREAM_IDLE || channel_count != dac_stream.channel_count ||
+      set_count == 0 || count > FETCH_DAC_BLOCK_SAMPLES || n != 3 + 2 * count )
+  {
+    dac_stream.rejected++;
+    return false;
+  }
+
+  if( chSemWaitTimeout(&dac_stream.free, dac_push_timeout()) != MSG_OK || dac_stream.state == FETCH_DAC_STREAM_IDLE )
+  {
+    dac_stream.rejected++;
+    return false;
+  }
+
+  bp = &dac_stream.slots[util_spsc_write_index(&dac_stream.ring)];
+  payload += 3;
+  for( uint32_t i = 0; i < count; i++, payload += 2 )
+  {
+    bp->sample[i] = (payload[0] | (payload[1] << 8)) & 0xfff;
+  }
+  bp->set_count = set_count;
+
+  if( dac_stream.sequence_valid && sequence != dac_stream.next_sequence )
+  {
+    dac_stream.sequence_gaps++;
+  }
+  dac_stream.next_sequence = sequence + 1;
+  dac_stream.sequence_valid = true;
+  dac_stream.blocks++;
+
+  chSysLock();
+  util_spsc_commit(&dac_stream.ring);
+  if( dac_stream.state == FETCH_DAC_STREAM_FILLING && util_spsc_full(&dac_stream.ring) )
+  {
+    dac_stream.state = FETCH_DAC_STREAM_RUNNING;
+    gptStartContinuousI(&GPTD6, FETCH_DAC_TIMER_FREQ / dac_stream.rate);
+  }
+  chSysUnlock();
+
+  return true;
+}
+
 bool fetch_dac_help_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
 {
   FETCH_MAX_ARGS(chp, argc, 0);
@@ -93,6 +369,18 @@ bool fetch_dac_help_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]
   FETCH_HELP_ARG(chp,"channel","0 | 1 | 2 | 3 | HS");
   FETCH_HELP_ARG(chp,"value","12bit value to write");
   FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp,"stream(<rate>,<channel>[,<channel> ...])");
+  FETCH_HELP_DES(chp,"Play sample blocks sent to the mpipe port as DAC frames");
+  FETCH_HELP_DES(chp,"Playback starts once " STRINGIFY(FETCH_DAC_RING_SIZE) " blocks are queued, see mpipe_frame.h");
+  FETCH_HELP_ARG(chp,"rate","sets per second {16 .. " STRINGIFY(FETCH_DAC_MAX_RATE) "}");
+  FETCH_HELP_ARG(chp,"channel","0 | 1 | 2 | 3 | HS, in the order of the samples in a set");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp,"stop");
+  FETCH_HELP_DES(chp,"Stop streaming, outputs keep their last value");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp,"status");
+  FETCH_HELP_DES(chp,"Stream state, underrun and rejected block counters");
+  FETCH_HELP_BREAK(chp);
   FETCH_HELP_CMD(chp,"reset");
   FETCH_HELP_DES(chp,"Reset DAC module");
   FETCH_HELP_BREAK(chp);
@@ -119,6 +407,12 @@ bool fetch_dac_write_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[
     return false;
   }
 
+  if( dac_stream.state != FETCH_DAC_STREAM_IDLE )
+  {
+    util_message_error(chp, "dac is streaming");
+    return false;
+  }
+
   switch(channel)
   {
     case 0:
@@ -138,6 +432,81 @@ bool fetch_dac_write_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[
   return true;
 }
 
+bool fetch_dac_stream_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 1 + FETCH_DAC_CHANNEL_COUNT);
+  FETCH_MIN_ARGS(chp, argc, 2);
+
+  uint32_t rate;
+  uint32_t channel;
+  uint16_t used = 0;
+
+  if( !util_parse_uint32(argv[0], &rate) || rate < FETCH_DAC_MIN_RATE || rate > FETCH_DAC_MAX_RATE )
+  {
+    util_message_error(chp, "invalid rate");
+    return false;
+  }
+
+  dac_stream_stop();
+
+  for( uint32_t i = 1; i < argc; i++ )
+  {
+    if( !util_match_str_table(argv[i], &channel, dac_channel_table) || (used & (1 << channel)) )
+    {
+      util_message_error(chp, "invalid channel");
+      return false;
+    }
+    used |= 1 << channel;
+    dac_stream.channels[i - 1] = channel;
+  }
+  dac_stream.channel_count = argc - 1;
+  dac_stream.rate = FETCH_DAC_TIMER_FREQ / (FETCH_DAC_TIMER_FREQ / rate);
+
+  util_spsc_init(&dac_stream.ring, FETCH_DAC_RING_SIZE);
+  chSemReset(&dac_stream.free, FETCH_DAC_RING_SIZE);
+  dac_stream.position = 0;
+  dac_stream.sequence_valid = false;
+  dac_stream.sets_played = 0;
+  dac_stream.underruns = 0;
+  dac_stream.late = 0;
+  dac_stream.blocks = 0;
+  dac_stream.rejected = 0;
+  dac_stream.sequence_gaps = 0;
+  dac_stream.state = FETCH_DAC_STREAM_FILLING;
+
+  util_message_uint32(chp, "rate", dac_stream.rate);
+  util_message_uint16(chp, "max_sets_per_block", FETCH_DAC_BLOCK_SAMPLES / dac_stream.channel_count);
+
+  return true;
+}
+
+bool fetch_dac_stop_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 0);
+
+  dac_stream_stop();
+
+  return true;
+}
+
+bool fetch_dac_status_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 0);
+
+  util_message_string_format(chp, "state", "%s", dac_stream_state_names[dac_stream.state]);
+  util_message_uint32(chp, "rate", dac_stream.rate);
+  util_message_uint8_array(chp, "channels", dac_stream.channels, dac_stream.channel_count);
+  util_message_uint32(chp, "queued", util_spsc_count(&dac_stream.ring));
+  util_message_uint32(chp, "blocks", dac_stream.blocks);
+  util_message_uint32(chp, "sets_played", dac_stream.sets_played);
+  util_message_uint32(chp, "underruns", dac_stream.underruns);
+  util_message_uint32(chp, "late", dac_stream.late);
+  util_message_uint32(chp, "rejected", dac_stream.rejected);
+  util_message_uint32(chp, "sequence_gaps", dac_stream.sequence_gaps);
+
+  return true;
+}
+
 bool fetch_dac_reset_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
 {
   FETCH_MAX_ARGS(chp, argc, 0);
@@ -153,13 +522,22 @@ void fetch_dac_init(void)
 
   dacStart(&DACD1, &dac1_cfg);
   
-  spi4_cfg.end_cb = NULL;
+  spi4_cfg.end_cb = dac_spi_end_cb;
   spi4_cfg.ssport = GPIOE;
   spi4_cfg.sspad = GPIOE_PE11_DAC_SPI4_NSS;
   spi4_cfg.cr1 = SPI_CR1_CPHA;
 
   spiStart(&SPID4, &spi4_cfg);
 
+  dac_stream.state = FETCH_DAC_STREAM_IDLE;
+  util_spsc_init(&dac_stream.ring, FETCH_DAC_RING_SIZE);
+  chSemObjectInit(&dac_stream.free, 0);
+
+  gpt6_cfg.frequency = FETCH_DAC_TIMER_FREQ;
+  gpt6_cfg.callback = dac_stream_tick;
+  gpt6_cfg.cr2 = 0;
+  gptStart(&GPTD6, &gpt6_cfg);
+
   dacPutChannelX(&DACD1, 0, 0);
   external_dac_write(0,0);
   external_dac_write(1,0);
@@ -170,6 +548,8 @@ void fetch_dac_init(void)
 
 bool fetch_dac_reset(BaseSequentialStream * chp)
 {
+  dac_stream_stop();
+
   dacPutChannelX(&DACD1, 0, 0);
   external_dac_write(0,0);
   external_dac_write(1,0);
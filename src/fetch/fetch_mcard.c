@@ -0,0 +1,166 @@
+/*! \file fetch_mcard.c
+  *
+  * Supporting Fetch DSL
+  *
+  * \sa fetch.c
+  * @defgroup fetch_mcard Fetch MCARD
+  * @{
+  */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "util_general.h"
+#include "util_messages.h"
+#include "util_arg_parse.h"
+#include "util_timebase.h"
+
+#include "fetch_defs.h"
+#include "fetch.h"
+#include "fetch_sd.h"
+#include "fetch_mcard.h"
+
+#include "mcard.h"
+
+bool fetch_mcard_help_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 0);
+
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_LEGEND(chp);
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_TITLE(chp, "MCARD Help");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "record(<file>[, <size>])");
+  FETCH_HELP_DES(chp, "Record the adc block streams to a file, replacing it");
+  FETCH_HELP_DES(chp, "Takes blocks of devices in mailbox transport, the sd card must be mounted");
+  FETCH_HELP_DES(chp, "The file holds blocks of binary mpipe frames with a time index {see mcard_format.h}");
+  FETCH_HELP_ARG(chp, "file", "path on the sd card");
+  FETCH_HELP_ARG(chp, "size", "preallocate contiguously and write sectors directly, bytes {see sd.prealloc}");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "stop");
+  FETCH_HELP_DES(chp, "Write out the buffered data and close the file");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "status");
+  FETCH_HELP_DES(chp, "Counters of the current or last recording");
+  FETCH_HELP_DES(chp, "rate_bytes_per_s is the recorded rate, write_bytes_per_s the card rate while writing");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "reset");
+  FETCH_HELP_DES(chp, "Stop recording");
+  FETCH_HELP_BREAK(chp);
+
+  return true;
+}
+
+bool fetch_mcard_record_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 2);
+  FETCH_MIN_ARGS(chp, argc, 1);
+
+  uint32_t size = 0;
+  FRESULT result;
+
+  if( argc > 1 && (!util_parse_uint32(argv[1], &size) || size < MCARD_SECTOR_SIZE) )
+  {
+    util_message_error(chp, "invalid size");
+    return false;
+  }
+
+  if( mcard_is_recording() )
+  {
+    util_message_error(chp, "already recording");
+    return false;
+  }
+
+  result = mcard_start(argv[0], size);
+  if( result == FR_DENIED && size != 0 )
+  {
+    util_message_error(chp, "no contiguous free space of that size");
+    return false;
+  }
+
+  return fetch_sd_error_check(chp, result);
+}
+
+bool fetch_mcard_stop_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 0);
+
+  return fetch_sd_error_check(chp, mcard_stop());
+}
+
+/*! \brief report the recording counters
+ *
+ * The elapsed time comes from the system time and wraps after about five
+ * days at the 10 kHz tick.
+ */
+bool fetch_mcard_status_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 0);
+
+  mcard_stats_t stats;
+  bool recording;
+  uint32_t elapsed_ms;
+  uint32_t rate = 0;
+  uint32_t write_rate = 0;
+
+  recording = mcard_is_recording();
+  mcard_get_stats(&stats);
+
+  elapsed_ms = ((uint64_t)((recording ? chVTGetSystemTime() : stats.stop) - stats.start) * 1000) / CH_CFG_ST_FREQUENCY;
+  if( elapsed_ms != 0 )
+  {
+    rate = ((uint64_t)stats.bytes * 1000) / elapsed_ms;
+  }
+  if( stats.write_time != 0 )
+  {
+    write_rate = ((uint64_t)stats.bytes * UTIL_TIMEBASE_FREQ) / stats.write_time;
+  }
+
+  util_message_bool(chp, "recording", recording);
+  util_message_bool(chp, "contiguous", stats.contiguous);
+  util_message_uint32(chp, "capacity", stats.capacity);
+  util_message_uint32(chp, "blocks", stats.blocks);
+  util_message_uint32(chp, "sets", stats.sets);
+  util_message_uint32(chp, "dropped", stats.dropped);
+  util_message_uint32(chp, "gaps", stats.gaps);
+  util_message_uint32(chp, "bytes", stats.bytes);
+  util_message_uint32(chp, "lost_bytes", stats.lost_bytes);
+  util_message_uint32(chp, "writes", stats.writes);
+  util_message_uint32(chp, "elapsed_ms", elapsed_ms);
+  util_message_uint32(chp, "rate_bytes_per_s", rate);
+  util_message_uint32(chp, "write_bytes_per_s", write_rate);
+  util_message_uint32(chp, "write_max_us", stats.write_max);
+  util_message_uint32(chp, "sync_max_us", stats.sync_max);
+  util_message_uint32(chp, "buffer_size", MCARD_BUFFER_SIZE);
+  util_message_uint32(chp, "buffer_count", MCARD_BUFFER_COUNT);
+  util_message_uint32(chp, "buffers_high_water", stats.buffers_high_water);
+  util_message_uint32(chp, "mailbox_high_water", stats.mailbox_high_water);
+  util_message_uint8(chp, "result", stats.result);
+
+  return true;
+}
+
+bool fetch_mcard_reset_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 0);
+
+  return fetch_mcard_reset(chp);
+}
+
+void fetch_mcard_init(void)
+{
+  mcard_init();
+}
+
+bool fetch_mcard_reset(BaseSequentialStream * chp)
+{
+  mcard_stop();
+  return true;
+}
+
+/*! @} */
@@ -0,0 +1,323 @@
+/*! \file fetch_mpipe.c
+  *
+  * Supporting Fetch DSL
+  *
+  * \sa fetch.c
+  * @defgroup fetch_mpipe Fetch MPIPE
+  * @{
+  */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "hal.h"
+
+#include "util_general.h"
+#include "util_strings.h"
+#include "util_messages.h"
+#include "util_arg_parse.h"
+#include "util_timebase.h"
+
+#include "fetch_defs.h"
+#include "fetch.h"
+
+#include "fetch_mpipe.h"
+#include "fetch_adc.h"
+#include "mpipe.h"
+#include "mpipe_frame.h"
+
+static const str_table_t format_table[] = {
+  {"ASCII", MPIPE_FORMAT_ASCII},
+  {"BINARY", MPIPE_FORMAT_BINARY},
+  {"DELTA", MPIPE_FORMAT_DELTA},
+  {NULL, 0}
+};
+
+static const str_table_t producer_table[] = {
+  {"ADC0", MPIPE_PRODUCER_ADC0},
+  {"ADC1", MPIPE_PRODUCER_ADC1},
+  {"CAN", MPIPE_PRODUCER_CAN},
+  {"SERIAL", MPIPE_PRODUCER_SERIAL},
+  {"FILE", MPIPE_PRODUCER_FILE},
+  {NULL, 0}
+};
+
+static const str_table_t flow_table[] = {
+  {"NONE", MPIPE_FLOW_NONE},
+  {"PAUSE", MPIPE_FLOW_PAUSE},
+  {"DECIMATE", MPIPE_FLOW_DECIMATE},
+  {"BUFFER", MPIPE_FLOW_BUFFER},
+  {NULL, 0}
+};
+
+static char * stream_names[MPIPE_STREAM_COUNT] = { "ADC0", "ADC1", "ADC_DUAL" };
+
+// counters at the previous stream.stats, throughput is reported since then
+static struct {
+  uint32_t time;
+  uint32_t delivered[MPIPE_STREAM_COUNT];
+  uint32_t bytes[MPIPE_STREAM_COUNT];
+} stream_snapshot;
+
+bool fetch_mpipe_help_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 0);
+
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_LEGEND(chp);
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_TITLE(chp, "MPIPE Help");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "format(<format>[, <keyframe interval>])");
+  FETCH_HELP_DES(chp, "Select wire format of streamed data");
+  FETCH_HELP_ARG(chp, "format", "ascii | binary | delta {cobs framed, see mpipe_frame.h}");
+  FETCH_HELP_ARG(chp, "keyframe interval", "delta frames per keyframe {default 16}");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "weight(<producer>[, <bytes>])");
+  FETCH_HELP_DES(chp, "Share of the output a producer gets while others are busy");
+  FETCH_HELP_ARG(chp, "producer", "adc0 | adc1 | can | serial | file");
+  FETCH_HELP_ARG(chp, "bytes", "written per writer round {default 512}, omit to query");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "flow([<policy>[, <n>]])");
+  FETCH_HELP_DES(chp, "Credit based flow control, the host grants bytes with K<hex count> lines");
+  FETCH_HELP_DES(chp, "Enabling starts without credit, no arguments queries the state");
+  FETCH_HELP_ARG(chp, "policy", "none | pause | decimate | buffer {when short of credit}");
+  FETCH_HELP_ARG(chp, "n", "decimate: send one block in n, buffer: queue up to n blocks");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "reset");
+  FETCH_HELP_DES(chp, "Reset mpipe module");
+  FETCH_HELP_BREAK(chp);
+
+  return true;
+}
+
+bool fetch_mpipe_format_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 2);
+  FETCH_MIN_ARGS(chp, argc, 1);
+
+  uint32_t format;
+  uint16_t interval = MPIPE_DELTA_KEYFRAME_INTERVAL;
+
+  if( !util_match_str_table(argv[0], &format, format_table) )
+  {
+    util_message_error(chp, "invalid format");
+    return false;
+  }
+
+  if( argc > 1 && (format != MPIPE_FORMAT_DELTA || !util_parse_uint16(argv[1], &interval) || interval == 0) )
+  {
+    util_message_error(chp, "invalid keyframe interval");
+    return false;
+  }
+
+  mpipe_set_keyframe_interval(interval);
+  mpipe_set_format(format);
+
+  return true;
+}
+
+bool fetch_mpipe_weight_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 2);
+  FETCH_MIN_ARGS(chp, argc, 1);
+
+  uint32_t producer;
+  uint16_t weight;
+
+  if( !util_match_str_table(argv[0], &producer, producer_table) )
+  {
+    util_message_error(chp, "invalid producer");
+    return false;
+  }
+
+  if( argc > 1 )
+  {
+    if( !util_parse_uint16(argv[1], &weight) || weight == 0 )
+    {
+      util_message_error(chp, "invalid weight");
+      return false;
+    }
+    mpipe_set_weight(producer, weight);
+  }
+
+  util_message_uint16(chp, "weight", mpipe_get_weight(producer));
+
+  return true;
+}
+
+bool fetch_mpipe_flow_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 2);
+
+  uint32_t policy;
+  uint16_t arg = 1;
+
+  if( argc > 0 )
+  {
+    if( !util_match_str_table(argv[0], &policy, flow_table) )
+    {
+      util_message_error(chp, "invalid policy");
+      return false;
+    }
+
+    if( argc > 1 && (!util_parse_uint16(argv[1], &arg) || arg == 0) )
+    {
+      util_message_error(chp, "invalid n");
+      return false;
+    }
+
+    mpipe_set_flow(policy, arg);
+  }
+
+  util_message_string_format(chp, "policy", "%s", flow_table[mpipe_get_flow()].str);
+  util_message_uint16(chp, "n", mpipe_get_flow_arg());
+  util_message_int32(chp, "credit", mpipe_get_credit());
+
+  return true;
+}
+
+bool fetch_stream_help_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 0);
+
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_LEGEND(chp);
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_TITLE(chp, "STREAM Help");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "stats");
+  FETCH_HELP_DES(chp, "Health counters of the adc block streams {adc0, adc1, adc_dual}");
+  FETCH_HELP_DES(chp, "sets_per_s and bytes_per_s are measured since the previous stats");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "reset");
+  FETCH_HELP_DES(chp, "Clear all stream counters");
+  FETCH_HELP_BREAK(chp);
+
+  return true;
+}
+
+static void stream_snapshot_take(uint32_t now)
+{
+  stream_snapshot.time = now;
+  for( uint32_t i = 0; i < MPIPE_STREAM_COUNT; i++ )
+  {
+    stream_snapshot.delivered[i] = mpipe_stream_stats[i].delivered;
+    stream_snapshot.bytes[i] = mpipe_stream_stats[i].bytes;
+  }
+}
+
+/*! \brief report the stream health counters
+ *
+ * Counters are cumulative since stream.reset. The interval of the
+ * throughput figures wraps after about 71 minutes.
+ */
+bool fetch_stream_stats_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 0);
+
+  mpipe_stream_stats_t stats[MPIPE_STREAM_COUNT];
+  uint32_t produced[MPIPE_STREAM_COUNT];
+  uint32_t delivered[MPIPE_STREAM_COUNT];
+  uint32_t dropped[MPIPE_STREAM_COUNT];
+  uint32_t paused[MPIPE_STREAM_COUNT];
+  uint32_t mailbox_full[MPIPE_STREAM_COUNT];
+  uint32_t pool_exhausted[MPIPE_STREAM_COUNT];
+  uint32_t mailbox_high_water[MPIPE_STREAM_COUNT];
+  uint32_t gaps[MPIPE_STREAM_COUNT];
+  uint32_t sets_per_s[MPIPE_STREAM_COUNT];
+  uint32_t bytes_per_s[MPIPE_STREAM_COUNT];
+  uint32_t pool_size, pool_used, pool_high_water;
+  uint32_t now, elapsed;
+
+  chSysLock();
+  memcpy(stats, (const void *)mpipe_stream_stats, sizeof(stats));
+  now = util_timebase_now();
+  chSysUnlock();
+  fetch_adc_pool_stats(&pool_size, &pool_used, &pool_high_water);
+
+  elapsed = now - stream_snapshot.time;
+  for( uint32_t i = 0; i < MPIPE_STREAM_COUNT; i++ )
+  {
+    produced[i] = stats[i].produced;
+    delivered[i] = stats[i].delivered;
+    dropped[i] = stats[i].dropped + stats[i].write_dropped;
+    paused[i] = stats[i].paused;
+    mailbox_full[i] = stats[i].mailbox_full;
+    pool_exhausted[i] = stats[i].pool_exhausted;
+    mailbox_high_water[i] = stats[i].mailbox_high_water;
+    gaps[i] = stats[i].gaps;
+    sets_per_s[i] = 0;
+    bytes_per_s[i] = 0;
+    if( elapsed != 0 )
+    {
+      sets_per_s[i] = ((uint64_t)(delivered[i] - stream_snapshot.delivered[i]) * UTIL_TIMEBASE_FREQ) / elapsed;
+      bytes_per_s[i] = ((uint64_t)(stats[i].bytes - stream_snapshot.bytes[i]) * UTIL_TIMEBASE_FREQ) / elapsed;
+    }
+    stream_snapshot.delivered[i] = delivered[i];
+    stream_snapshot.bytes[i] = stats[i].bytes;
+  }
+  stream_snapshot.time = now;
+
+  util_message_string_array(chp, "streams", stream_names, MPIPE_STREAM_COUNT);
+  util_message_uint32_array(chp, "produced", produced, MPIPE_STREAM_COUNT);
+  util_message_uint32_array(chp, "delivered", delivered, MPIPE_STREAM_COUNT);
+  util_message_uint32_array(chp, "dropped", dropped, MPIPE_STREAM_COUNT);
+  util_message_uint32_array(chp, "paused", paused, MPIPE_STREAM_COUNT);
+  util_message_uint32_array(chp, "mailbox_full", mailbox_full, MPIPE_STREAM_COUNT);
+  util_message_uint32_array(chp, "pool_exhausted", pool_exhausted, MPIPE_STREAM_COUNT);
+  util_message_uint32_array(chp, "mailbox_high_water", mailbox_high_water, MPIPE_STREAM_COUNT);
+  util_message_uint32_array(chp, "gaps", gaps, MPIPE_STREAM_COUNT);
+  util_message_uint32_array(chp, "sets_per_s", sets_per_s, MPIPE_STREAM_COUNT);
+  util_message_uint32_array(chp, "bytes_per_s", bytes_per_s, MPIPE_STREAM_COUNT);
+  util_message_uint32(chp, "pool_size", pool_size);
+  util_message_uint32(chp, "pool_used", pool_used);
+  util_message_uint32(chp, "pool_high_water", pool_high_water);
+  util_message_uint32(chp, "input_errors", mpipe_get_input_errors());
+  util_message_uint32(chp, "elapsed_ms", elapsed / (UTIL_TIMEBASE_FREQ / 1000));
+
+  return true;
+}
+
+bool fetch_stream_reset_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 0);
+
+  return fetch_stream_reset(chp);
+}
+
+bool fetch_mpipe_reset_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 0);
+
+  return fetch_mpipe_reset(chp);
+}
+
+void fetch_mpipe_init(void)
+{
+  mpipe_set_keyframe_interval(MPIPE_DELTA_KEYFRAME_INTERVAL);
+  mpipe_set_format(MPIPE_FORMAT_ASCII);
+  mpipe_set_flow(MPIPE_FLOW_NONE, 1);
+  stream_snapshot_take(util_timebase_now());
+}
+
+bool fetch_mpipe_reset(BaseSequentialStream * chp)
+{
+  mpipe_set_keyframe_interval(MPIPE_DELTA_KEYFRAME_INTERVAL);
+  mpipe_set_format(MPIPE_FORMAT_ASCII);
+  mpipe_reset_weights();
+  mpipe_set_flow(MPIPE_FLOW_NONE, 1);
+  return true;
+}
+
+bool fetch_stream_reset(BaseSequentialStream * chp)
+{
+  mpipe_stream_stats_reset();
+  fetch_adc_pool_stats_reset();
+  stream_snapshot_take(util_timebase_now());
+  return true;
+}
+
+/*! @} */
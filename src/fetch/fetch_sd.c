@@ -6,6 +6,7 @@
 
 #include "ch.h"
 #include "hal.h"
+#include "chprintf.h"
 
 #include <string.h>
 #include <stdbool.h>
@@ -16,6 +17,7 @@
 #include "util_general.h"
 #include "util_io.h"
 #include "util_arg_parse.h"
+#include "util_timebase.h"
 
 #include "ff.h"
 
@@ -23,6 +25,8 @@
 #include "fetch_defs.h"
 #include "fetch_sd.h"
 
+#include "mpipe.h"
+
 #if 0
 static fetch_command_t fetch_sd_commands[] = {
     { fetch_sd_connect_cmd,     "connect",    "Connet SD card" },
@@ -44,10 +48,81 @@ static fetch_command_t fetch_sd_commands[] = {
   };
 #endif
 
+// cluster runs the link map describes, a longer chain is only counted
+#define FETCH_SD_LINKMAP_RUNS 8
+
+#define FETCH_SD_SECTOR_SIZE 512
+
+/*! \brief Bytes per f_read of sd.dump
+ *
+ * Reads of whole sectors at sector aligned offsets go from the card to the
+ * buffer as one multi block transfer, FatFS copies nothing.
+ */
+#ifndef FETCH_SD_DUMP_BUFFER_SIZE
+#define FETCH_SD_DUMP_BUFFER_SIZE 8192
+#endif
+
+#if (FETCH_SD_DUMP_BUFFER_SIZE % FETCH_SD_SECTOR_SIZE) != 0
+#error "FETCH_SD_DUMP_BUFFER_SIZE must be a multiple of FETCH_SD_SECTOR_SIZE"
+#endif
+
+// longest sd.dump waits for mpipe to hand back a buffer
+#ifndef FETCH_SD_DUMP_TIMEOUT
+#define FETCH_SD_DUMP_TIMEOUT S2ST(5)
+#endif
+
 FATFS filesystem;
 FIL file_obj;
 
-static bool fatfs_error_check(BaseSequentialStream * chp, FRESULT err)
+// the sdio dma moves whole words
+static uint8_t dump_data[FETCH_SD_DUMP_BUFFERS][FETCH_SD_DUMP_BUFFER_SIZE] __attribute__((aligned(4)));
+static fetch_sd_dump_chunk_t dump_chunks[FETCH_SD_DUMP_BUFFERS];
+
+// buffers not queued at or held by the mpipe writer
+static msg_t dump_free_mb_buffer[FETCH_SD_DUMP_BUFFERS];
+static mailbox_t dump_free_mb;
+
+static FIL dump_file;
+static uint8_t dump_number;
+
+// operations timed per sd.bench test
+#ifndef FETCH_SD_BENCH_OPS
+#define FETCH_SD_BENCH_OPS 64
+#endif
+
+// sd.bench works in a scratch file, raw transfers stay inside its sectors
+#define FETCH_SD_BENCH_FILE "BENCH.TMP"
+#define FETCH_SD_BENCH_DEFAULT_SIZE (4 * 1024 * 1024)
+
+// the transfers borrow the dump buffers, one contiguous region
+#define FETCH_SD_BENCH_MAX_TRANSFER (FETCH_SD_DUMP_BUFFERS * FETCH_SD_DUMP_BUFFER_SIZE)
+
+typedef enum {
+  BENCH_RAW_SEQ_WRITE,
+  BENCH_RAW_SEQ_READ,
+  BENCH_RAW_RANDOM_WRITE,
+  BENCH_RAW_RANDOM_READ,
+  BENCH_FILE_WRITE,
+  BENCH_FILE_READ
+} bench_test_t;
+
+static const char * bench_test_names[] = {
+  "raw_seq_write", "raw_seq_read", "raw_random_write", "raw_random_read", "file_write", "file_read"
+};
+
+static char * bench_columns[] = {
+  "bytes", "ops", "kb_per_s", "p50_us", "p90_us", "p99_us", "max_us"
+};
+
+static const uint32_t bench_transfers[] = { 512, 2048, 8192, 16384 };
+
+static uint32_t bench_latency[FETCH_SD_BENCH_OPS];
+static FIL bench_file;
+
+/*! \brief report a FatFS result as an error message
+ * \return true for FR_OK
+ */
+bool fetch_sd_error_check(BaseSequentialStream * chp, FRESULT err)
 {
   switch(err)
   {
@@ -115,6 +190,89 @@ static bool fatfs_error_check(BaseSequentialStream * chp, FRESULT err)
   }
 }
 
+/*! \brief create path with size bytes allocated and no data written
+ *
+ * Seeking past the end of a new file makes FatFS allocate the cluster
+ * chain and update the FAT once, up front. The file is left open at
+ * offset 0.
+ * \param mode  FatFS access mode, FA_WRITE with FA_READ if the file is
+ *              also read while open
+ * \return FR_DENIED when the volume has less than size bytes free
+ */
+FRESULT fetch_sd_prealloc(FIL * fp, const char * path, uint32_t size, BYTE mode)
+{
+  FRESULT result;
+
+  result = f_open(fp, path, FA_CREATE_ALWAYS | mode);
+  if( result != FR_OK )
+  {
+    return result;
+  }
+
+  result = f_lseek(fp, size);
+  if( result == FR_OK && f_tell(fp) != size )
+  {
+    result = FR_DENIED;
+  }
+  if( result == FR_OK )
+  {
+    result = f_sync(fp);
+  }
+  if( result == FR_OK )
+  {
+    result = f_lseek(fp, 0);
+  }
+
+  if( result != FR_OK )
+  {
+    f_close(fp);
+  }
+  return result;
+}
+
+/*! \brief where an open file lies on the card
+ *
+ * \param sector     first sector of the file
+ * \param fragments  runs of consecutive clusters, 1 for a contiguous file
+ *                   and 0 for an empty one
+ */
+FRESULT fetch_sd_file_extent(FIL * fp, uint32_t * sector, uint32_t * fragments)
+{
+  DWORD linkmap[(2 * FETCH_SD_LINKMAP_RUNS) + 2];
+  FRESULT result;
+
+  *sector = 0;
+  *fragments = 0;
+  if( fp->sclust == 0 )
+  {
+    return FR_OK;
+  }
+  *sector = fp->fs->database + ((fp->sclust - 2) * fp->fs->csize);
+
+  // the link map holds a cluster count and start cluster per run, 0 terminated
+  linkmap[0] = NELEMS(linkmap);
+  fp->cltbl = linkmap;
+  result = f_lseek(fp, CREATE_LINKMAP);
+  fp->cltbl = NULL;
+
+  if( result == FR_NOT_ENOUGH_CORE )
+  {
+    // linkmap[0] is the size a map of the whole chain needs, two per run plus two
+    *fragments = (linkmap[0] - 2) / 2;
+    return FR_OK;
+  }
+  if( result != FR_OK )
+  {
+    return result;
+  }
+
+  for( uint32_t i = 1; linkmap[i] != 0; i += 2 )
+  {
+    (*fragments)++;
+  }
+  return FR_OK;
+}
+
 bool fetch_sd_connect_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
 {
   FETCH_MAX_ARGS(chp, argc, 0);
@@ -161,21 +319,21 @@ bool fetch_sd_mount_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]
 {
   FETCH_MAX_ARGS(chp, argc, 0);
 
-  return fatfs_error_check(chp, f_mount(&filesystem, "", 1) );
+  return fetch_sd_error_check(chp, f_mount(&filesystem, "", 1) );
 }
 
 bool fetch_sd_unmount_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
 {
   FETCH_MAX_ARGS(chp, argc, 0);
 
-  return fatfs_error_check(chp, f_mount(NULL, NULL, 0) );
+  return fetch_sd_error_check(chp, f_mount(NULL, NULL, 0) );
 }
 
 bool fetch_sd_format_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
 {
   FETCH_MAX_ARGS(chp, argc, 0);
 
-  return fatfs_error_check(chp, f_mkfs("", 0, 0) );
+  return fetch_sd_error_check(chp, f_mkfs("", 0, 0) );
 }
 
 bool fetch_sd_open_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
@@ -183,21 +341,22 @@ bool fetch_sd_open_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
   FETCH_MAX_ARGS(chp, argc, 1);
   FETCH_MIN_ARGS(chp, argc, 1);
 
-  return fatfs_error_check(chp, f_open(&file_obj, argv[0], FA_READ+FA_WRITE+FA_OPEN_ALWAYS)); 
+  return fetch_sd_error_check(chp, f_open(&file_obj, argv[0], FA_READ+FA_WRITE+FA_OPEN_ALWAYS)); 
 }
 
 bool fetch_sd_close_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
 {
   FETCH_MAX_ARGS(chp, argc, 0);
 
-  return fatfs_error_check(chp, f_close(&file_obj));
+  return fetch_sd_error_check(chp, f_close(&file_obj));
 }
 
 bool fetch_sd_unlink_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
 {
-  FETCH_MAX_ARGS(chp, argc, 0);
+  FETCH_MAX_ARGS(chp, argc, 1);
+  FETCH_MIN_ARGS(chp, argc, 1);
   
-  return fatfs_error_check(chp, f_unlink(argv[0]));
+  return fetch_sd_error_check(chp, f_unlink(argv[0]));
 }
 
 bool fetch_sd_read_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
@@ -207,7 +366,7 @@ bool fetch_sd_read_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
   uint8_t buffer[64];
   uint32_t read_count = 0;
   
-  if( !fatfs_error_check(chp, f_read(&file_obj, buffer, sizeof(buffer), (UINT*)&read_count)) )
+  if( !fetch_sd_error_check(chp, f_read(&file_obj, buffer, sizeof(buffer), (UINT*)&read_count)) )
   {
     return false;
   }
@@ -225,7 +384,7 @@ bool fetch_sd_write_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]
 
   uint32_t write_count = 0;
 
-  if( !fatfs_error_check(chp, f_write(&file_obj, argv[0], strlen(argv[0]), (UINT*)&write_count)) )
+  if( !fetch_sd_error_check(chp, f_write(&file_obj, argv[0], strlen(argv[0]), (UINT*)&write_count)) )
   {
     return false;
   }
@@ -257,7 +416,431 @@ bool fetch_sd_seek_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
     return false;
   }
 
-  return fatfs_error_check(chp, f_lseek(&file_obj, offset));
+  return fetch_sd_error_check(chp, f_lseek(&file_obj, offset));
+}
+
+/*! \brief create a file of a given size and check it is contiguous
+ *
+ * A contiguous file can be written sector by sector without touching the
+ * FAT, see mcard.record.
+ */
+bool fetch_sd_prealloc_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 2);
+  FETCH_MIN_ARGS(chp, argc, 2);
+
+  FIL prealloc_file;
+  uint32_t size;
+  uint32_t sector;
+  uint32_t fragments;
+  FRESULT result;
+
+  if( !util_parse_uint32(argv[1], &size) || size == 0 )
+  {
+    util_message_error(chp, "invalid size");
+    return false;
+  }
+
+  if( !fetch_sd_error_check(chp, fetch_sd_prealloc(&prealloc_file, argv[0], size, FA_WRITE)) )
+  {
+    return false;
+  }
+
+  result = fetch_sd_file_extent(&prealloc_file, &sector, &fragments);
+  if( result == FR_OK )
+  {
+    result = f_close(&prealloc_file);
+  }
+  else
+  {
+    f_close(&prealloc_file);
+  }
+  if( !fetch_sd_error_check(chp, result) )
+  {
+    return false;
+  }
+
+  util_message_uint32(chp, "size", size);
+  util_message_uint32(chp, "sector", sector);
+  util_message_uint32(chp, "fragments", fragments);
+
+  if( fragments != 1 )
+  {
+    util_message_error(chp, "file is fragmented, free space on the card is not contiguous");
+    return false;
+  }
+
+  return true;
+}
+
+/*! \brief return a dump buffer once mpipe has written it
+ */
+void fetch_sd_dump_free(fetch_sd_dump_chunk_t * cp)
+{
+  chMBPost(&dump_free_mb, (msg_t)cp, TIME_IMMEDIATE);
+}
+
+/*! \brief stream a file over mpipe
+ *
+ * One buffer is read while mpipe writes the other, the command returns
+ * once mpipe has taken the last one. The shell is busy meanwhile.
+ */
+bool fetch_sd_dump_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 3);
+  FETCH_MIN_ARGS(chp, argc, 1);
+
+  fetch_sd_dump_chunk_t * back[FETCH_SD_DUMP_BUFFERS];
+  fetch_sd_dump_chunk_t * cp = NULL;
+  uint32_t offset = 0;
+  uint32_t length = UINT32_MAX;
+  uint32_t left;
+  uint32_t size;
+  uint32_t start;
+  uint32_t begin;
+  uint32_t elapsed;
+  uint32_t read_time = 0;
+  uint32_t free_count;
+  UINT count;
+  FRESULT result;
+  bool stalled = false;
+  msg_t msg;
+
+  if( argc > 1 && !util_parse_uint32(argv[1], &offset) )
+  {
+    util_message_error(chp, "invalid offset");
+    return false;
+  }
+  if( argc > 2 && !util_parse_uint32(argv[2], &length) )
+  {
+    util_message_error(chp, "invalid length");
+    return false;
+  }
+
+  chSysLock();
+  free_count = chMBGetUsedCountI(&dump_free_mb);
+  chSysUnlock();
+  if( free_count != FETCH_SD_DUMP_BUFFERS )
+  {
+    util_message_error(chp, "previous dump still held by mpipe");
+    return false;
+  }
+
+  if( !fetch_sd_error_check(chp, f_open(&dump_file, argv[0], FA_READ | FA_OPEN_EXISTING)) )
+  {
+    return false;
+  }
+  size = f_size(&dump_file);
+  if( offset > size )
+  {
+    f_close(&dump_file);
+    util_message_error(chp, "offset beyond the end of the file");
+    return false;
+  }
+  if( length > size - offset )
+  {
+    length = size - offset;
+  }
+  result = f_lseek(&dump_file, offset);
+  if( !fetch_sd_error_check(chp, result) )
+  {
+    f_close(&dump_file);
+    return false;
+  }
+
+  dump_number++;
+  left = length;
+  start = util_timebase_now();
+
+  do
+  {
+    uint32_t n = FETCH_SD_DUMP_BUFFER_SIZE;
+
+    if( chMBFetch(&dump_free_mb, &msg, FETCH_SD_DUMP_TIMEOUT) != MSG_OK )
+    {
+      stalled = true;
+      break;
+    }
+    cp = (fetch_sd_dump_chunk_t *)msg;
+
+    // the first read ends on a sector boundary, the rest bypass the FatFS buffer
+    if( (offset % FETCH_SD_SECTOR_SIZE) != 0 )
+    {
+      n -= offset % FETCH_SD_SECTOR_SIZE;
+    }
+    if( n > left )
+    {
+      n = left;
+    }
+
+    begin = util_timebase_now();
+    result = f_read(&dump_file, cp->data, n, &count);
+    read_time += util_timebase_now() - begin;
+
+    cp->length = count;
+    cp->offset = offset;
+    cp->dump = dump_number;
+    cp->error = (result != FR_OK || count != n);
+    cp->last = cp->error || (count == left);
+    chMBPost(&mpipe_file_mb, (msg_t)cp, TIME_INFINITE);
+    mpipe_signal(MPIPE_PRODUCER_FILE);
+
+    offset += count;
+    left -= count;
+  } while( !cp->last );
+
+  // mpipe has written everything once all buffers are back
+  for( free_count = 0; !stalled && free_count < FETCH_SD_DUMP_BUFFERS; free_count++ )
+  {
+    if( chMBFetch(&dump_free_mb, &msg, FETCH_SD_DUMP_TIMEOUT) != MSG_OK )
+    {
+      stalled = true;
+      break;
+    }
+    back[free_count] = (fetch_sd_dump_chunk_t *)msg;
+  }
+  elapsed = util_timebase_now() - start;
+  for( uint32_t i = 0; i < free_count; i++ )
+  {
+    chMBPost(&dump_free_mb, (msg_t)back[i], TIME_IMMEDIATE);
+  }
+  f_close(&dump_file);
+
+  if( stalled )
+  {
+    // take back what the writer has not started on, it returns the rest
+    while( chMBFetch(&mpipe_file_mb, &msg, TIME_IMMEDIATE) == MSG_OK )
+    {
+      fetch_sd_dump_free((fetch_sd_dump_chunk_t *)msg);
+    }
+    util_message_error(chp, "mpipe stalled, is the host reading and granting credit?");
+    return false;
+  }
+
+  util_message_uint8(chp, "dump", dump_number);
+  util_message_uint32(chp, "bytes", length - left);
+  util_message_uint32(chp, "elapsed_us", elapsed);
+  util_message_uint32(chp, "read_us", read_time);
+  util_message_uint32(chp, "bytes_per_s", (elapsed == 0) ? 0 : ((uint64_t)(length - left) * UTIL_TIMEBASE_FREQ) / elapsed);
+  util_message_uint32(chp, "read_bytes_per_s", (read_time == 0) ? 0 : ((uint64_t)(length - left) * UTIL_TIMEBASE_FREQ) / read_time);
+
+  if( cp->error )
+  {
+    return fetch_sd_error_check(chp, (result != FR_OK) ? result : FR_DISK_ERR);
+  }
+  return true;
+}
+
+static uint32_t bench_random(uint32_t * state)
+{
+  // xorshift32
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+static int bench_compare(const void * a, const void * b)
+{
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+/*! \brief time one test of ops transfers of size bytes
+ *
+ * Raw transfers go straight to SDCD1 inside the sectors of the scratch
+ * file, holding the file system lock like mcard does. File transfers are
+ * f_write or f_read calls on the scratch file.
+ * \return false on a transfer error
+ */
+static bool bench_run(bench_test_t test, uint32_t sector, uint32_t sectors, uint32_t size, uint32_t ops,
+                      uint32_t * total_time)
+{
+  uint8_t * buffer = dump_data[0];
+  uint32_t blocks = size / FETCH_SD_SECTOR_SIZE;
+  uint32_t state = 0x2545f491;
+  bool failed = false;
+  UINT count;
+
+  *total_time = 0;
+  if( test == BENCH_FILE_WRITE || test == BENCH_FILE_READ )
+  {
+    if( f_lseek(&bench_file, 0) != FR_OK )
+    {
+      return false;
+    }
+  }
+
+  for( uint32_t i = 0; i < ops && !failed; i++ )
+  {
+    uint32_t block = sector + (i * blocks);
+    uint32_t start;
+    uint32_t elapsed;
+
+    if( test == BENCH_RAW_RANDOM_WRITE || test == BENCH_RAW_RANDOM_READ )
+    {
+      block = sector + ((bench_random(&state) % (sectors / blocks)) * blocks);
+    }
+    if( test == BENCH_RAW_SEQ_WRITE || test == BENCH_RAW_RANDOM_WRITE || test == BENCH_FILE_WRITE )
+    {
+      memset(buffer, i, size);
+    }
+
+    start = util_timebase_now();
+    switch( test )
+    {
+      case BENCH_RAW_SEQ_WRITE:
+      case BENCH_RAW_RANDOM_WRITE:
+        if( !ff_req_grant(filesystem.sobj) )
+        {
+          return false;
+        }
+        failed = sdcWrite(&SDCD1, block, buffer, blocks) != HAL_SUCCESS;
+        ff_rel_grant(filesystem.sobj);
+        break;
+      case BENCH_RAW_SEQ_READ:
+      case BENCH_RAW_RANDOM_READ:
+        if( !ff_req_grant(filesystem.sobj) )
+        {
+          return false;
+        }
+        failed = sdcRead(&SDCD1, block, buffer, blocks) != HAL_SUCCESS;
+        ff_rel_grant(filesystem.sobj);
+        break;
+      case BENCH_FILE_WRITE:
+        failed = f_write(&bench_file, buffer, size, &count) != FR_OK || count != size;
+        break;
+      case BENCH_FILE_READ:
+        failed = f_read(&bench_file, buffer, size, &count) != FR_OK || count != size;
+        break;
+    }
+    elapsed = util_timebase_now() - start;
+
+    bench_latency[i] = elapsed;
+    *total_time += elapsed;
+  }
+
+  // written data only counts once it is on the card
+  if( !failed && test == BENCH_FILE_WRITE )
+  {
+    uint32_t start = util_timebase_now();
+
+    failed = f_sync(&bench_file) != FR_OK;
+    *total_time += util_timebase_now() - start;
+  }
+
+  return !failed;
+}
+
+/*! \brief report a test as bytes, ops, kb_per_s and latency percentiles
+ */
+static void bench_report(BaseSequentialStream * chp, bench_test_t test, uint32_t size, uint32_t ops, uint32_t total_time)
+{
+  char name[32];
+  uint32_t row[NELEMS(bench_columns)];
+
+  qsort(bench_latency, ops, sizeof(bench_latency[0]), bench_compare);
+
+  row[0] = size;
+  row[1] = ops;
+  row[2] = (total_time == 0) ? 0 : (uint32_t)(((uint64_t)size * ops * UTIL_TIMEBASE_FREQ) / (1024ULL * total_time));
+  row[3] = bench_latency[((ops - 1) * 50) / 100];
+  row[4] = bench_latency[((ops - 1) * 90) / 100];
+  row[5] = bench_latency[((ops - 1) * 99) / 100];
+  row[6] = bench_latency[ops - 1];
+
+  chsnprintf(name, sizeof(name), "%s_%u", bench_test_names[test], size);
+  util_message_uint32_array(chp, name, row, NELEMS(row));
+
+  // the run takes a while, show each row as it completes
+  util_message_flush(chp);
+}
+
+/*! \brief measure the card, raw and through FatFS
+ *
+ * Creates the scratch file FETCH_SD_BENCH_FILE in one run of clusters and
+ * runs every test at every transfer size inside it, so nothing else on the
+ * card is touched. The file is deleted afterwards. The sdio bus width and
+ * clock are those the HAL configured at sd.connect.
+ */
+bool fetch_sd_bench_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 1);
+
+  uint32_t size = FETCH_SD_BENCH_DEFAULT_SIZE;
+  uint32_t sector;
+  uint32_t sectors;
+  uint32_t fragments;
+  uint32_t free_count;
+  uint32_t total_time;
+  FRESULT result;
+  bool success = true;
+
+  if( argc > 0 && (!util_parse_uint32(argv[0], &size) || size < FETCH_SD_BENCH_OPS * FETCH_SD_BENCH_MAX_TRANSFER) )
+  {
+    util_message_error(chp, "invalid size, at least %u bytes", FETCH_SD_BENCH_OPS * FETCH_SD_BENCH_MAX_TRANSFER);
+    return false;
+  }
+  size -= size % FETCH_SD_BENCH_MAX_TRANSFER;
+
+  chSysLock();
+  free_count = chMBGetUsedCountI(&dump_free_mb);
+  chSysUnlock();
+  if( free_count != FETCH_SD_DUMP_BUFFERS )
+  {
+    util_message_error(chp, "dump buffers still held by mpipe");
+    return false;
+  }
+
+  if( !fetch_sd_error_check(chp, fetch_sd_prealloc(&bench_file, FETCH_SD_BENCH_FILE, size, FA_READ | FA_WRITE)) )
+  {
+    return false;
+  }
+  result = fetch_sd_file_extent(&bench_file, &sector, &fragments);
+  if( result == FR_OK && fragments != 1 )
+  {
+    util_message_error(chp, "no contiguous free space of that size");
+    success = false;
+  }
+  else if( !fetch_sd_error_check(chp, result) )
+  {
+    success = false;
+  }
+  sectors = size / FETCH_SD_SECTOR_SIZE;
+
+  if( success )
+  {
+    util_message_uint32(chp, "capacity_blocks", SDCD1.capacity);
+    util_message_uint32(chp, "bench_sector", sector);
+    util_message_string_array(chp, "columns", bench_columns, NELEMS(bench_columns));
+  }
+
+  for( uint32_t t = 0; success && t < NELEMS(bench_test_names); t++ )
+  {
+    for( uint32_t i = 0; success && i < NELEMS(bench_transfers); i++ )
+    {
+      uint32_t transfer = bench_transfers[i];
+
+      if( transfer > FETCH_SD_BENCH_MAX_TRANSFER )
+      {
+        continue;
+      }
+      if( !bench_run((bench_test_t)t, sector, sectors, transfer, FETCH_SD_BENCH_OPS, &total_time) )
+      {
+        util_message_error(chp, "%s failed at %u bytes", bench_test_names[t], transfer);
+        success = false;
+        break;
+      }
+      bench_report(chp, (bench_test_t)t, transfer, FETCH_SD_BENCH_OPS, total_time);
+    }
+  }
+
+  f_close(&bench_file);
+  f_unlink(FETCH_SD_BENCH_FILE);
+
+  return success;
 }
 
 bool fetch_sd_dir_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
@@ -267,7 +850,7 @@ bool fetch_sd_dir_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
 
   f_opendir(&dir_obj, "/");
 
-  while( fatfs_error_check(chp, f_readdir(&dir_obj, &file_info)) && file_info.fname[0] != 0 )
+  while( fetch_sd_error_check(chp, f_readdir(&dir_obj, &file_info)) && file_info.fname[0] != 0 )
   {
     util_message_uint32(chp, file_info.fname, file_info.fsize);
   }
@@ -290,7 +873,51 @@ bool fetch_sd_help_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
   FETCH_HELP_BREAK(chp);
   FETCH_HELP_TITLE(chp,"SD Help");
   FETCH_HELP_BREAK(chp);
-  FETCH_HELP_CMD(chp,"FIXME");
+  FETCH_HELP_CMD(chp, "connect");
+  FETCH_HELP_DES(chp, "Power up and connect the card");
+  FETCH_HELP_CMD(chp, "disconnect");
+  FETCH_HELP_DES(chp, "Disconnect and power down the card");
+  FETCH_HELP_CMD(chp, "mount");
+  FETCH_HELP_DES(chp, "Mount the file system");
+  FETCH_HELP_CMD(chp, "unmount");
+  FETCH_HELP_DES(chp, "Unmount the file system");
+  FETCH_HELP_CMD(chp, "format");
+  FETCH_HELP_DES(chp, "Create a FAT file system on the card");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "open(<file>)");
+  FETCH_HELP_DES(chp, "Open or create a file for read, write, tell and seek");
+  FETCH_HELP_CMD(chp, "close");
+  FETCH_HELP_DES(chp, "Close the open file");
+  FETCH_HELP_CMD(chp, "unlink(<file>)");
+  FETCH_HELP_DES(chp, "Delete a file");
+  FETCH_HELP_CMD(chp, "read");
+  FETCH_HELP_DES(chp, "Read up to 64 bytes at the file pointer");
+  FETCH_HELP_CMD(chp, "write(<string>)");
+  FETCH_HELP_DES(chp, "Write a string at the file pointer");
+  FETCH_HELP_CMD(chp, "tell");
+  FETCH_HELP_DES(chp, "Query the file pointer");
+  FETCH_HELP_CMD(chp, "seek(<offset>)");
+  FETCH_HELP_DES(chp, "Move the file pointer");
+  FETCH_HELP_CMD(chp, "dir");
+  FETCH_HELP_DES(chp, "List the root directory with file sizes");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "prealloc(<file>, <size>)");
+  FETCH_HELP_DES(chp, "Create a file with size bytes allocated in one run of clusters");
+  FETCH_HELP_DES(chp, "Fails when the clusters are fragmented, a fresh format helps");
+  FETCH_HELP_ARG(chp, "size", "bytes");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "dump(<file>[, <offset>[, <length>]])");
+  FETCH_HELP_DES(chp, "Stream a file over mpipe and report the throughput");
+  FETCH_HELP_DES(chp, "Binary format sends MPIPE_FRAME_FILE_DATA frames {see mpipe_frame.h}");
+  FETCH_HELP_DES(chp, "ascii sends F:<dump><offset><flags><hex data> lines");
+  FETCH_HELP_ARG(chp, "offset", "first byte, default 0");
+  FETCH_HELP_ARG(chp, "length", "bytes, default to the end of the file");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "bench[(<size>)]");
+  FETCH_HELP_DES(chp, "Time raw sequential and random block reads and writes and FatFS file reads and writes");
+  FETCH_HELP_DES(chp, "Runs inside a scratch file " FETCH_SD_BENCH_FILE " of size bytes, deleted afterwards");
+  FETCH_HELP_DES(chp, "One row per test and transfer size: bytes, ops, kb_per_s, p50_us, p90_us, p99_us, max_us");
+  FETCH_HELP_ARG(chp, "size", "scratch file bytes, default 4 MB");
   FETCH_HELP_BREAK(chp);
 
 	return true;
@@ -303,6 +930,13 @@ void fetch_sd_init(void)
 
   // start sdio peripheral
   sdcStart(&SDCD1,0);
+
+  chMBObjectInit(&dump_free_mb, dump_free_mb_buffer, FETCH_SD_DUMP_BUFFERS);
+  for( uint32_t i = 0; i < FETCH_SD_DUMP_BUFFERS; i++ )
+  {
+    dump_chunks[i].data = dump_data[i];
+    chMBPost(&dump_free_mb, (msg_t)&dump_chunks[i], TIME_IMMEDIATE);
+  }
 }
 
 bool fetch_sd_reset(BaseSequentialStream * chp)
@@ -22,12 +22,14 @@
 #include "fetch_serial.h"
 #include "fetch_parser.h"
 
-#define SERIAL_DRIVER_COUNT 3
+#define SERIAL_DRIVER_COUNT FETCH_SERIAL_DEV_COUNT
 
 SerialConfig serial_configs[SERIAL_DRIVER_COUNT];
 event_listener_t serial_events[SERIAL_DRIVER_COUNT];
 SerialDriver * serial_drivers[SERIAL_DRIVER_COUNT] = { &SD4, &SD3, &SD2 };
 
+static fetch_serial_capture_t serial_captures[SERIAL_DRIVER_COUNT];
+
 uint32_t tx_timeout_ms = 100;
 uint32_t rx_timeout_ms = 100;
 
@@ -177,6 +179,11 @@ bool fetch_serial_read_cmd(BaseSequentialStream * chp, uint32_t argc, char * arg
     util_message_error(chp, "Serial device not ready");
     return false;
   }
+  if( serial_captures[dev].enabled )
+  {
+    util_message_error(chp, "Serial device captured by mpipe");
+    return false;
+  }
   
   if( !util_parse_uint32(argv[1], &max_count) || max_count == 0 || max_count >= FETCH_SHARED_BUFFER_SIZE)
   {
@@ -270,6 +277,11 @@ bool fetch_serial_flush_input_cmd(BaseSequentialStream * chp, uint32_t argc, cha
     util_message_error(chp, "Serial device not ready");
     return false;
   }
+  if( serial_captures[dev].enabled )
+  {
+    util_message_error(chp, "Serial device captured by mpipe");
+    return false;
+  }
   
   chSysLock();
   iqResetI(&(serial_drv)->iqueue);
@@ -300,6 +312,11 @@ bool fetch_serial_read_line_cmd(BaseSequentialStream * chp, uint32_t argc, char
     util_message_error(chp, "Serial device not ready");
     return false;
   }
+  if( serial_captures[dev].enabled )
+  {
+    util_message_error(chp, "Serial device captured by mpipe");
+    return false;
+  }
   
   if( argc == 1 )
   {
@@ -354,11 +371,114 @@ bool fetch_serial_reset_cmd(BaseSequentialStream * chp, uint32_t argc, char * ar
     return false;
   }
 
+  serial_captures[dev].enabled = false;
   sdStop(serial_drv);
 
   return true;
 }
 
+/*! \brief route the received bytes of a uart to mpipe
+ *
+ * The mpipe writer collects them into chunks which end after idle_us
+ * without a byte or at chunk bytes, whichever comes first. Enabling starts
+ * from an empty input queue and clears the counters.
+ */
+bool fetch_serial_capture_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
+{
+  FETCH_MAX_ARGS(chp, argc, 4);
+  FETCH_MIN_ARGS(chp, argc, 1);
+
+  uint32_t dev;
+  bool enable;
+  uint32_t idle_us = FETCH_SERIAL_IDLE_US;
+  uint32_t chunk = FETCH_SERIAL_CHUNK_MAX;
+  SerialDriver * serial_drv = parse_serial_dev( argv[0], &dev );
+  fetch_serial_capture_t * cp;
+
+  if( serial_drv == NULL )
+  {
+    util_message_error(chp, "Invalid serial device");
+    return false;
+  }
+  cp = &serial_captures[dev];
+
+  if( argc > 1 )
+  {
+    if( !util_parse_bool(argv[1], &enable) )
+    {
+      util_message_error(chp, "Invalid enable setting");
+      return false;
+    }
+    if( argc > 2 && (!util_parse_uint32(argv[2], &idle_us) || idle_us == 0) )
+    {
+      util_message_error(chp, "Invalid idle time");
+      return false;
+    }
+    if( argc > 3 && (!util_parse_uint32(argv[3], &chunk) || chunk == 0 || chunk > FETCH_SERIAL_CHUNK_MAX) )
+    {
+      util_message_error(chp, "Invalid chunk size, min=1, max=%d", FETCH_SERIAL_CHUNK_MAX);
+      return false;
+    }
+    if( enable && serial_drv->state != SD_READY )
+    {
+      util_message_error(chp, "Serial device not ready");
+      return false;
+    }
+
+    cp->enabled = false;
+    if( enable )
+    {
+      chSysLock();
+      iqResetI(&(serial_drv)->iqueue);
+      cp->idle_us = idle_us;
+      cp->chunk = chunk;
+      cp->bytes = 0;
+      cp->chunks = 0;
+      cp->errors = 0;
+      cp->session++;
+      cp->enabled = true;
+      chSysUnlock();
+    }
+  }
+
+  util_message_bool(chp, "enabled", cp->enabled);
+  util_message_uint32(chp, "idle_us", cp->idle_us);
+  util_message_uint32(chp, "chunk", cp->chunk);
+  util_message_uint32(chp, "bytes", cp->bytes);
+  util_message_uint32(chp, "chunks", cp->chunks);
+  util_message_uint32(chp, "errors", cp->errors);
+
+  return true;
+}
+
+SerialDriver * fetch_serial_driver(uint32_t dev)
+{
+  return (dev < SERIAL_DRIVER_COUNT) ? serial_drivers[dev] : NULL;
+}
+
+/*! \brief driver and settings of a captured serial device
+ * \return NULL unless the capture is enabled and the driver running
+ */
+SerialDriver * fetch_serial_capture_driver(uint32_t dev, fetch_serial_capture_t ** cpp)
+{
+  if( dev >= SERIAL_DRIVER_COUNT || !serial_captures[dev].enabled || serial_drivers[dev]->state != SD_READY )
+  {
+    return NULL;
+  }
+  *cpp = &serial_captures[dev];
+
+  return serial_drivers[dev];
+}
+
+uint32_t fetch_serial_speed(uint32_t dev)
+{
+  if( dev >= SERIAL_DRIVER_COUNT || serial_configs[dev].speed == 0 )
+  {
+    return SERIAL_DEFAULT_BITRATE;
+  }
+  return serial_configs[dev].speed;
+}
+
 bool fetch_serial_help_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
 {
   FETCH_MAX_ARGS(chp, argc, 0);
@@ -410,6 +530,13 @@ bool fetch_serial_help_cmd(BaseSequentialStream * chp, uint32_t argc, char * arg
   FETCH_HELP_DES(chp, "Read until CR or NL");
   FETCH_HELP_ARG(chp, "dev", "Serial device number");
   FETCH_HELP_ARG(chp, "count", "Optional maximum bytes to read");
+  FETCH_HELP_BREAK(chp);
+  FETCH_HELP_CMD(chp, "capture(<dev>[,<enable>[,<idle_us>[,<chunk>]]])");
+  FETCH_HELP_DES(chp, "Send received data to mpipe in timestamped chunks");
+  FETCH_HELP_ARG(chp, "dev", "Serial device number");
+  FETCH_HELP_ARG(chp, "enable", "0 | 1");
+  FETCH_HELP_ARG(chp, "idle_us", "silence that ends a chunk, default " STRINGIFY(FETCH_SERIAL_IDLE_US));
+  FETCH_HELP_ARG(chp, "chunk", "bytes that end a chunk, max " STRINGIFY(FETCH_SERIAL_CHUNK_MAX));
   FETCH_HELP_BREAK(chp);
 
 	return true;
@@ -420,6 +547,8 @@ void fetch_serial_init(void)
   for( uint32_t i = 0; i < SERIAL_DRIVER_COUNT; i++ )
   {
     chEvtRegister(chnGetEventSource(serial_drivers[i]), &serial_events[i], i);
+    serial_captures[i].idle_us = FETCH_SERIAL_IDLE_US;
+    serial_captures[i].chunk = FETCH_SERIAL_CHUNK_MAX;
   }
 }
 
@@ -427,6 +556,7 @@ bool fetch_serial_reset(BaseSequentialStream * chp)
 {
   for( uint32_t i = 0; i < SERIAL_DRIVER_COUNT; i++ )
   {
+    serial_captures[i].enabled = false;
     sdStop(serial_drivers[i]);
   }
   return true;
@@ -36,6 +36,8 @@ typedef enum {
  * PA15 TIM2 CH1 ETR
  *
  * TIM7 as freq time ref
+ * TIM5 counts the firmware timebase (util_timebase.h), its channels can
+ * only be used for input capture against it
  */
 
 #define STM32_TIM1_CLK  STM32_TIMCLK2
@@ -75,6 +75,7 @@ bool fetch_version_cmd( BaseSequentialStream  * chp, uint32_t argc, char * argv[
 bool fetch_chip_id_cmd( BaseSequentialStream  * chp, uint32_t argc, char * argv[] );
 bool fetch_test_cmd( BaseSequentialStream  * chp, uint32_t argc, char * argv[] );
 bool fetch_clocks_cmd( BaseSequentialStream  * chp, uint32_t argc, char * argv[] );
+bool fetch_timestamp_cmd( BaseSequentialStream  * chp, uint32_t argc, char * argv[] );
 bool fetch_sleep_cmd( BaseSequentialStream  * chp, uint32_t argc, char * argv[] );
 
 #ifdef __cplusplus
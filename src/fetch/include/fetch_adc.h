@@ -9,17 +9,104 @@
 
 #include <stdbool.h>
 
+#include "util_stats.h"
+#include "util_fft.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #define ADC_SAMPLE_SET_SIZE 7
 
+/*! \brief Resolution of raw converter samples
+ */
+#define ADC_SAMPLE_BITS 12
+
+/*! \brief Maximum number of sample sets handed downstream in one block
+ */
+#ifndef ADC_SAMPLE_BLOCK_DEPTH_MAX
+#define ADC_SAMPLE_BLOCK_DEPTH_MAX 32
+#endif
+
+#define ADC_SAMPLE_BLOCK_SIZE (ADC_SAMPLE_SET_SIZE * ADC_SAMPLE_BLOCK_DEPTH_MAX)
+
+/*! \brief Block dev number of the combined stream in the dual adc modes
+ */
+#define FETCH_ADC_DEV_COMBINED 2
+
+/*! \brief Block of consecutive sample sets from one adc device
+ *
+ * Samples are stored set after set, each set holding channel_count samples.
+ */
 typedef struct {
-  adcsample_t sample[ADC_SAMPLE_SET_SIZE];
-  uint16_t sequence_number;
+  adcsample_t sample[ADC_SAMPLE_BLOCK_SIZE];
+  uint32_t sequence_number;   // sequence number of the first set in the block
+  uint32_t timestamp;         // util_timebase time the first set was triggered
+  uint16_t set_count;
+  uint8_t channel_count;
+  uint8_t dev;                // source device number or FETCH_ADC_DEV_COMBINED
+  uint8_t bits;               // sample resolution, ADC_SAMPLE_BITS or 16 when decimated
   volatile int16_t mem_ref_count;
-} adc_sample_set_t;
+} adc_sample_block_t;
+
+/*! \brief Window of a triggered or burst capture
+ *
+ * The sets live in a ring of size sets, the window starts at set start and
+ * wraps at the end of the ring. Set number pre of the window is the set
+ * which fired the trigger, a burst has pre 0 and start 0.
+ */
+typedef struct {
+  const adcsample_t * sample;
+  uint16_t size;
+  uint16_t start;
+  uint16_t set_count;
+  uint16_t pre;
+  uint8_t channel_count;
+  uint8_t dev;
+  uint32_t number;            // capture number, restarts when a trigger is armed
+  uint32_t timestamp;         // util_timebase time of the first window set
+} adc_capture_t;
+
+/*! \brief Window of adc.stats, the reader reduces the accumulators
+ * with util_stats_summary()
+ */
+typedef struct {
+  util_stats_t acc;
+  uint32_t number;            // window number since adc.stats
+  uint8_t dev;
+} adc_stats_record_t;
+
+/*! \brief One acquisition of adc.fft, the reader transforms it
+ *
+ * sample holds size consecutive samples of a single input. work (size
+ * floats) and magnitude (size / 2 + 1 bins) are scratch the callback never
+ * touches, so the reader may release the samples as soon as they are
+ * windowed into work.
+ */
+typedef struct {
+  const adcsample_t * sample;
+  float * work;
+  uint16_t * magnitude;
+  uint16_t size;
+  uint8_t channel;            // adc input
+  uint8_t window;             // util_fft_window_t
+  uint8_t peaks;              // strongest peaks to send, 0 for the whole spectrum
+  uint8_t dev;
+  uint32_t sample_rate;
+  uint32_t number;            // spectrum number since adc.fft
+} adc_fft_block_t;
+
+/*! \brief Configuration of a block stream, as stored by a recorder
+ */
+typedef struct {
+  uint32_t sample_rate;       // sets per second in the blocks, after decimation
+  uint16_t decimate_factor;   // 1 when not decimated
+  uint8_t decimate_filter;    // util_decimate_filter_t
+  uint8_t mode;               // independent, simultaneous or interleaved
+  uint8_t channel_count;
+  uint8_t bits;               // as adc_sample_block_t bits
+  uint8_t channels[2 * ADC_SAMPLE_SET_SIZE];  // adc input of each channel in set order
+} adc_stream_info_t;
 
 bool fetch_adc_help_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
 bool fetch_adc_single_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
@@ -27,10 +114,30 @@ bool fetch_adc_stream_start_cmd(BaseSequentialStream * chp, uint32_t argc, char
 bool fetch_adc_stream_stop_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
 bool fetch_adc_status_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
 bool fetch_adc_config_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_adc_channels_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_adc_sample_time_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_adc_stats_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_adc_capture_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_adc_trigger_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_adc_fft_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_adc_decimate_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_adc_mode_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_adc_transport_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
 bool fetch_adc_timer_reset_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
 bool fetch_adc_reset_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
 
-void fetch_adc_free_sample_set( adc_sample_set_t *ssp );
+void fetch_adc_free_sample_block( adc_sample_block_t *bp );
+void fetch_adc_pool_stats(uint32_t * size, uint32_t * used, uint32_t * high_water);
+void fetch_adc_pool_stats_reset(void);
+void fetch_adc_stream_info(uint8_t dev_num, adc_stream_info_t * ip);
+adc_sample_block_t * fetch_adc_ring_peek( uint32_t dev_num );
+void fetch_adc_ring_release( uint32_t dev_num );
+const adc_capture_t * fetch_adc_capture_peek( uint32_t dev_num );
+void fetch_adc_capture_release( uint32_t dev_num );
+const adc_stats_record_t * fetch_adc_stats_peek( uint32_t dev_num );
+void fetch_adc_stats_release( uint32_t dev_num );
+const adc_fft_block_t * fetch_adc_fft_peek( uint32_t dev_num );
+void fetch_adc_fft_release( uint32_t dev_num );
 
 bool fetch_adc_reset(BaseSequentialStream * chp);
 
@@ -0,0 +1,46 @@
+/*! \file fetch_can.h
+ *
+ * @addtogroup fetch_can
+ * @{
+ */
+
+#ifndef FETCH_CAN_H_
+#define FETCH_CAN_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// received frames on their way to mpipe
+#ifndef FETCH_CAN_RX_POOL_SIZE
+#define FETCH_CAN_RX_POOL_SIZE 16
+#endif
+
+/*! \brief a received frame as queued for mpipe
+ */
+typedef struct {
+  uint32_t sequence;            // received frame number, frames not streamed included
+  uint32_t timestamp;           // util_timebase when the frame was taken from the fifo
+  CANRxFrame frame;             // TIME is the bxcan bit time counter at start of frame
+} fetch_can_rx_t;
+
+void fetch_can_init(void);
+bool fetch_can_reset(BaseSequentialStream * chp);
+
+void fetch_can_free_rx_frame(fetch_can_rx_t * fp);
+
+bool fetch_can_help_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_can_config_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_can_filter_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_can_tx_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_can_rx_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_can_status_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_can_reset_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+//! @}
@@ -6,10 +6,13 @@
 /* Include all header files that define fetch commands */
 #include "fetch.h"
 #include "fetch_adc.h"
+#include "fetch_can.h"
 #include "fetch_dac.h"
 #include "fetch_gpio.h"
 #include "fetch_i2c.h"
 #include "fetch_mbus.h"
+#include "fetch_mcard.h"
+#include "fetch_mpipe.h"
 #include "fetch_sd.h"
 #include "fetch_spi.h"
 #include "fetch_timer.h"
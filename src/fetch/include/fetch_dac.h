@@ -13,6 +13,11 @@ extern "C" {
 
 #include "dac.h"
 
+// samples per dac.stream block, all channels of a set together
+#ifndef FETCH_DAC_BLOCK_SAMPLES
+#define FETCH_DAC_BLOCK_SAMPLES 256
+#endif
+
 
 void fetch_dac_init(void);
 bool fetch_dac_reset(BaseSequentialStream * chp);
@@ -20,6 +25,11 @@ bool fetch_dac_reset(BaseSequentialStream * chp);
 bool fetch_dac_help_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
 bool fetch_dac_write_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
 bool fetch_dac_reset_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_dac_stream_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_dac_stop_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_dac_status_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+
+bool fetch_dac_stream_push(uint32_t sequence, const uint8_t * payload, size_t n);
 
 #ifdef __cplusplus
 }
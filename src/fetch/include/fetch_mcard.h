@@ -0,0 +1,29 @@
+/*! \file fetch_mcard.h
+ *
+ * @addtogroup fetch_mcard
+ * @{
+ */
+
+#ifndef FETCH_MCARD_H_
+#define FETCH_MCARD_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void fetch_mcard_init(void);
+bool fetch_mcard_reset(BaseSequentialStream * chp);
+
+bool fetch_mcard_help_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_mcard_record_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_mcard_stop_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_mcard_status_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_mcard_reset_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+//! @}
@@ -0,0 +1,34 @@
+/*! \file fetch_mpipe.h
+ *
+ * @addtogroup fetch_mpipe
+ * @{
+ */
+
+#ifndef FETCH_MPIPE_H_
+#define FETCH_MPIPE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void fetch_mpipe_init(void);
+bool fetch_mpipe_reset(BaseSequentialStream * chp);
+bool fetch_stream_reset(BaseSequentialStream * chp);
+
+bool fetch_mpipe_help_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_mpipe_format_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_mpipe_flow_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_mpipe_weight_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_mpipe_reset_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+
+bool fetch_stream_help_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_stream_stats_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_stream_reset_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+//! @}
@@ -6,12 +6,34 @@
 #ifndef __FETCH_SD_H_
 #define __FETCH_SD_H_
 
+#include "ff.h"
+
+// read buffers of sd.dump, one is read while the other goes out over mpipe
+#ifndef FETCH_SD_DUMP_BUFFERS
+#define FETCH_SD_DUMP_BUFFERS 2
+#endif
+
+/*! \brief part of a file read by sd.dump, on its way to the mpipe writer
+ */
+typedef struct {
+  uint8_t * data;
+  uint32_t length;
+  uint32_t offset;              // file offset of data[0]
+  uint8_t dump;                 // dump number
+  bool last;                    // ends the dump
+  bool error;                   // the read failed, the dump ends short
+} fetch_sd_dump_chunk_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 void fetch_sd_init(void);
 bool fetch_sd_reset(BaseSequentialStream * chp);
+bool fetch_sd_error_check(BaseSequentialStream * chp, FRESULT err);
+FRESULT fetch_sd_prealloc(FIL * fp, const char * path, uint32_t size, BYTE mode);
+FRESULT fetch_sd_file_extent(FIL * fp, uint32_t * sector, uint32_t * fragments);
+void fetch_sd_dump_free(fetch_sd_dump_chunk_t * cp);
 
 bool fetch_sd_connect_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
 bool fetch_sd_disconnect_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
@@ -25,6 +47,9 @@ bool fetch_sd_read_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[])
 bool fetch_sd_write_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
 bool fetch_sd_tell_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
 bool fetch_sd_seek_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_sd_prealloc_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_sd_dump_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_sd_bench_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
 bool fetch_sd_dir_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
 bool fetch_sd_status_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
 bool fetch_sd_help_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
@@ -6,6 +6,31 @@
 #ifndef FETCH_FETCH_SERIAL_H_
 #define FETCH_FETCH_SERIAL_H_
 
+#define FETCH_SERIAL_DEV_COUNT 3
+
+// largest chunk the mpipe capture collects before sending it
+#define FETCH_SERIAL_CHUNK_MAX 256
+
+// silence in microseconds that ends a capture chunk
+#ifndef FETCH_SERIAL_IDLE_US
+#define FETCH_SERIAL_IDLE_US 1000
+#endif
+
+/*! \brief mpipe capture of a serial device
+ *
+ * Set up by serial.capture, the counters are kept by the mpipe writer which
+ * does the reading.
+ */
+typedef struct {
+  volatile bool enabled;
+  uint32_t idle_us;             // silence that ends a chunk
+  uint16_t chunk;               // size that ends a chunk
+  uint32_t bytes;               // bytes sent, the offset of the next chunk
+  uint32_t chunks;
+  uint32_t errors;              // chunks with line errors
+  uint8_t session;              // bumped on enable, stale chunks are dropped
+} fetch_serial_capture_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -13,6 +38,10 @@ extern "C" {
 void fetch_serial_init(void);
 bool fetch_serial_reset(BaseSequentialStream * chp);
 
+SerialDriver * fetch_serial_driver(uint32_t dev);
+SerialDriver * fetch_serial_capture_driver(uint32_t dev, fetch_serial_capture_t ** cpp);
+uint32_t fetch_serial_speed(uint32_t dev);
+
 bool fetch_serial_config_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
 bool fetch_serial_write_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
 bool fetch_serial_read_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
@@ -23,6 +52,7 @@ bool fetch_serial_reset_cmd(BaseSequentialStream * chp, uint32_t argc, char * ar
 bool fetch_serial_help_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
 bool fetch_serial_read_line_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
 bool fetch_serial_flush_input_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
+bool fetch_serial_capture_cmd(BaseSequentialStream * chp, uint32_t argc, char * argv[]);
 
 #ifdef __cplusplus
 }
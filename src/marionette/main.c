@@ -38,6 +38,7 @@
 #include "util_version.h"
 #include "util_messages.h"
 #include "util_io.h"
+#include "util_timebase.h"
 #include "usbcfg.h"
 
 
@@ -127,6 +128,7 @@ static void main_app(void)
   chprintf(DEBUG_CHP, "Marionette start\r\n");
   set_status_led(1,0,0);
 
+  util_timebase_init();
 	fetch_init();
 	mshell_init();
   mpipe_init();
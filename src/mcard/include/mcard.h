@@ -1,20 +1,78 @@
 #ifndef __MCARD_H
 #define __MCARD_H
 
+#include <stdint.h>
 #include <stdbool.h>
 
+#include "ff.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/*! \brief Size of one record buffer, a multiple of the sector size
+ *
+ * Whole buffers are written at sector aligned file offsets so FatFS hands
+ * them to the card as multi block writes without copying.
+ */
+#ifndef MCARD_BUFFER_SIZE
+#define MCARD_BUFFER_SIZE 16384
+#endif
+
+// one buffer fills while the others are written
+#ifndef MCARD_BUFFER_COUNT
+#define MCARD_BUFFER_COUNT 2
+#endif
+
+// buffers written between f_sync calls, bounds what a power loss takes
+#ifndef MCARD_SYNC_BUFFERS
+#define MCARD_SYNC_BUFFERS 64
+#endif
+
+#define MCARD_SECTOR_SIZE 512
+
+#if (MCARD_BUFFER_SIZE % MCARD_SECTOR_SIZE) != 0
+#error "MCARD_BUFFER_SIZE must be a multiple of MCARD_SECTOR_SIZE"
+#endif
+
+#if MCARD_BUFFER_COUNT < 2
+#error "MCARD_BUFFER_COUNT must be at least 2"
+#endif
+
+/*! \brief Counters of the current or last recording
+ *
+ * Times are util_timebase microseconds.
+ */
+typedef struct {
+  bool contiguous;              // written straight to the sectors of a preallocated file
+  uint32_t capacity;            // bytes preallocated, 0 when the file grows through FatFS
+  uint32_t blocks;              // adc blocks recorded
+  uint32_t sets;                // sample sets recorded
+  uint32_t dropped;             // sets lost while no buffer was free
+  uint32_t gaps;                // gap markers written
+  uint32_t bytes;               // bytes written to the file, FAT32 files stay below 4 GB
+  uint32_t lost_bytes;          // bytes not written after a write error
+  uint32_t writes;              // buffers written
+  uint64_t write_time;          // time spent in f_write and f_sync
+  uint32_t write_max;           // slowest buffer write
+  uint32_t sync_max;            // slowest f_sync, FatFS mode only
+  uint32_t buffers_high_water;  // most buffers waiting for or in the writer
+  uint32_t mailbox_high_water;  // most adc blocks waiting for the collector
+  systime_t start;              // system time the recording started
+  systime_t stop;               // system time it stopped, while not recording
+  FRESULT result;               // first file error, FR_OK if none
+} mcard_stats_t;
+
 extern mailbox_t mcard_adc2_mb;
 extern mailbox_t mcard_adc3_mb;
-extern mailbox_t mcard_can_mb;
-extern mailbox_t mcard_event_mb;
 
 void mcard_init(void);
-void mcard_start(void);
-void mcard_stop(void);
+FRESULT mcard_start(const char * path, uint32_t size);
+FRESULT mcard_stop(void);
+
+bool mcard_is_recording(void);
+void mcard_signal_i(void);
+void mcard_get_stats(mcard_stats_t * sp);
 
 #ifdef __cplusplus
 }
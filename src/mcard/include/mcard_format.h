@@ -0,0 +1,148 @@
+/*! \file mcard_format.h
+ *
+ * On-disk format of mcard recordings
+ *
+ * @addtogroup mcard_format
+ */
+
+#ifndef _MCARD_FORMAT_H_
+#define _MCARD_FORMAT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "fetch_adc.h"
+
+/*
+ * A recording is a sequence of fixed size blocks, block n starts at file
+ * offset n * block_size. Block 0 is the file header, every block numbered
+ * index_interval - 1 modulo index_interval is an index block, all others
+ * are data blocks. The last block of a closed recording is an index block
+ * over the data blocks after the previous index block. Multi byte fields
+ * are little endian.
+ *
+ * Block header, at the start of every block
+ *
+ *  0   magic       uint32  "MLOG" header, "MDAT" data or "MIDX" index
+ *  4   number      uint32  block number
+ *  8   length      uint32  bytes used including this header, the rest is 0
+ * 12   crc         uint16  CRC-16/CCITT-FALSE (mpipe_crc16) over bytes
+ *                          0 ... 11 and 14 up to length
+ * 14   flags       uint16  header block: MCARD_FLAG_*, others 0
+ * 16   first_time  uint64  util_timebase microseconds, counted on past
+ * 24   last_time   uint64  the 32 bit wrap from the start of the recording
+ *
+ * Header block body
+ *
+ * 32   version         uint16  MCARD_FORMAT_VERSION
+ * 34   index_interval  uint16
+ * 36   block_size      uint32
+ * 40   timebase_hz     uint32  UTIL_TIMEBASE_FREQ
+ * 44   block_count     uint32  blocks in the file, 0 until closed
+ * 48   vdda_mv         uint16  analog supply the samples refer to
+ * 50   vrefint_cal     uint16  factory VREFINT reading at 3.3 V and 30 C
+ * 52   ts_cal1         uint16  factory temperature sensor reading at 30 C
+ * 54   ts_cal2         uint16  and at 110 C
+ * 56   chip_id         uint32[3]
+ * 68   source_count    uint8
+ * 80   firmware        char[48], 0 padded
+ * 128  sources         source_count records of 32 bytes
+ *      0   source          uint8   mpipe_source_t
+ *      1   mode            uint8   0 independent, 1 simultaneous, 2 interleaved
+ *      2   channel_count   uint8
+ *      3   bits            uint8   as MPIPE_FRAME_ADC_BLOCK
+ *      4   sample_rate     uint32  sets per second
+ *      8   decimate_factor uint16
+ *     10   decimate_filter uint8   util_decimate_filter_t
+ *     12   channels        uint8[14], adc input of each channel in set order
+ *
+ * The header times are the start and, once closed, the end of the
+ * recording. Sources describe the adc configuration when recording
+ * started. The header is rewritten when the recording stops; a file cut
+ * short has block_count 0 and no MCARD_FLAG_CLOSED.
+ *
+ * Data block body
+ *
+ * Whole COBS encoded mpipe frames (see mpipe_frame.h), each terminated by
+ * its delimiter, so every block decodes on its own. first_time and
+ * last_time are the earliest and latest adc block timestamp in the block,
+ * a block without one repeats the last time of the block before.
+ *
+ * Index block body, one 24 byte entry per data block since the previous
+ * index block
+ *
+ *  0   block       uint32  block number
+ *  4   frames      uint32  frames in the block
+ *  8   first_time  uint64  as in the block header
+ * 16   last_time   uint64
+ *
+ * The index block header carries the first and last time of its entries.
+ * A reader finds a time by a binary search over the index blocks, then
+ * over their entries, touching a few blocks of a file of any size.
+ */
+
+#define MCARD_FORMAT_VERSION      1
+
+#define MCARD_MAGIC_HEADER        0x474f4c4d      // "MLOG"
+#define MCARD_MAGIC_DATA          0x5441444d      // "MDAT"
+#define MCARD_MAGIC_INDEX         0x5844494d      // "MIDX"
+
+#define MCARD_BLOCK_HEADER_SIZE   32
+#define MCARD_INDEX_ENTRY_SIZE    24
+#define MCARD_SOURCE_SIZE         32
+#define MCARD_SOURCE_CHANNELS     14
+#define MCARD_FIRMWARE_SIZE       48
+
+#define MCARD_HEADER_SOURCES      128
+
+#ifndef MCARD_INDEX_INTERVAL
+#define MCARD_INDEX_INTERVAL      64
+#endif
+
+// the file header is rewritten as a single sector
+#define MCARD_FILE_HEADER_MAX     512
+
+#define MCARD_FLAG_CLOSED         0x0001          // header rewritten at the end
+#define MCARD_FLAG_CONTIGUOUS     0x0002          // written to a preallocated file
+
+/*! \brief Contents of the file header block
+ */
+typedef struct {
+  uint32_t block_size;
+  uint32_t block_count;
+  uint16_t flags;
+  uint64_t start_time;
+  uint64_t end_time;
+  uint16_t vdda_mv;
+  uint16_t vrefint_cal;
+  uint16_t ts_cal1;
+  uint16_t ts_cal2;
+  uint32_t chip_id[3];
+  const char * firmware;
+  uint8_t source_count;
+  uint8_t source[3];                  // mpipe_source_t of each stream
+  adc_stream_info_t stream[3];
+} mcard_file_info_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static inline bool mcard_format_is_index(uint32_t number)
+{
+  return (number % MCARD_INDEX_INTERVAL) == (MCARD_INDEX_INTERVAL - 1);
+}
+
+void mcard_format_block_begin(uint8_t * block, uint32_t magic, uint32_t number);
+void mcard_format_block_finish(uint8_t * block, uint32_t length, uint16_t flags,
+                               uint64_t first_time, uint64_t last_time, size_t block_size);
+size_t mcard_format_header(uint8_t * block, const mcard_file_info_t * ip);
+void mcard_format_index_entry(uint8_t * out, uint32_t number, uint32_t frames,
+                              uint64_t first_time, uint64_t last_time);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
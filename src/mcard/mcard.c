@@ -1,3 +1,27 @@
+/*! \file mcard.c
+ *
+ * Record adc sample blocks to a file on the sd card
+ *
+ * The collector thread takes blocks from the mcard mailboxes, encodes them
+ * as binary mpipe frames (see mpipe_frame.h) and packs whole frames into
+ * fixed size blocks, one record buffer each, laid out as in mcard_format.h:
+ * a header block, data blocks and an index block every
+ * MCARD_INDEX_INTERVAL blocks. Full buffers go to the writer thread, which
+ * writes them with one f_write each while the collector fills the next one
+ * and rewrites the header once the recording stops. Read a recording with
+ * test/devtest/mcard_read.py.
+ *
+ * Given a size the file is preallocated as one run of clusters and the
+ * writer puts the buffers straight into its sectors, so no write waits for
+ * FatFS to allocate a cluster or update the FAT. The file is cut to the
+ * recorded length when the recording stops; one cut short by a power loss
+ * keeps the preallocated size with stale data after the last buffer.
+ *
+ * When the card falls behind and no buffer is free the collector drops
+ * blocks instead of holding them, so the shared adc pool keeps serving
+ * mpipe. The hole shows up as a gap frame in the file.
+ */
+
 #include <string.h>
 #include <ctype.h>
 
@@ -9,63 +33,736 @@
 #include "util_strings.h"
 #include "util_messages.h"
 #include "util_version.h"
+#include "util_timebase.h"
 
 #include "fetch_adc.h"
+#include "fetch_sd.h"
+#include "mpipe_frame.h"
 
 #include "mcard.h"
+#include "mcard_format.h"
 
 #ifndef MCARD_ADC_MB_SIZE
 #define MCARD_ADC_MB_SIZE 128
 #endif
 
-#ifndef MCARD_CAN_MB_SIZE
-#define MCARD_CAN_MB_SIZE 128
+// longest the collector waits for blocks before checking for a stop
+#define MCARD_COLLECT_TIMEOUT MS2ST(100)
+
+// analog supply recorded in the header, the board has no measurement of it
+#ifndef MCARD_VDDA_MV
+#define MCARD_VDDA_MV 3300
 #endif
 
+// factory calibration values in system memory
+#define MCARD_VREFINT_CAL   (*(const uint16_t *)0x1FFF7A2A)
+#define MCARD_TS_CAL1       (*(const uint16_t *)0x1FFF7A2C)
+#define MCARD_TS_CAL2       (*(const uint16_t *)0x1FFF7A2E)
+
 msg_t mcard_adc2_mb_buffer[MCARD_ADC_MB_SIZE];
 mailbox_t mcard_adc2_mb;
 msg_t mcard_adc3_mb_buffer[MCARD_ADC_MB_SIZE];
 mailbox_t mcard_adc3_mb;
 
+/*! \brief a record buffer on its way between collector and writer
+ */
+typedef struct {
+  uint8_t * data;
+  uint32_t length;
+} mcard_buffer_t;
+
+// the sdio dma moves whole words
+static uint8_t mcard_buffer_data[MCARD_BUFFER_COUNT][MCARD_BUFFER_SIZE] __attribute__((aligned(4)));
+static mcard_buffer_t mcard_buffers[MCARD_BUFFER_COUNT];
+
+// empty buffers for the collector, filled ones for the writer, NULL closes the file
+static msg_t mcard_free_mb_buffer[MCARD_BUFFER_COUNT];
+static mailbox_t mcard_free_mb;
+static msg_t mcard_full_mb_buffer[MCARD_BUFFER_COUNT];
+static mailbox_t mcard_full_mb;
+
+static THD_WORKING_AREA(mcard_out_wa, 512);
+static THD_WORKING_AREA(mcard_write_wa, 1024);
+static thread_t * mcard_out_tp;
+static thread_t * mcard_write_tp;
+
+static FIL mcard_file;
+
+// next sector and sectors left of a preallocated file
+static uint32_t mcard_sector;
+static uint32_t mcard_sectors_left;
+static mpipe_frame_t mcard_frame;
+
+static volatile bool mcard_recording;
+static mcard_stats_t mcard_stats;
+
+// buffers handed to the writer and not yet back
+static uint32_t mcard_pending;
+
+/*! \brief binary source of each adc block dev number
+ */
+static const mpipe_source_t block_sources[] = {
+  MPIPE_SOURCE_ADC0,            // dev 0, ADC3
+  MPIPE_SOURCE_ADC1,            // dev 1, ADC2
+  MPIPE_SOURCE_ADC_DUAL         // FETCH_ADC_DEV_COMBINED
+};
+
+// gap detection, indexed by block dev number
+static struct {
+  uint32_t next;                // sequence number of the set expected next
+  bool valid;                   // a block has been recorded
+} block_gap[NELEMS(block_sources)];
+
+#if (MCARD_BLOCK_HEADER_SIZE + ((MCARD_INDEX_INTERVAL - 1) * MCARD_INDEX_ENTRY_SIZE)) > MCARD_BUFFER_SIZE
+#error "MCARD_INDEX_INTERVAL entries do not fit an index block of MCARD_BUFFER_SIZE"
+#endif
+
+// block the collector is filling, owned by the collector thread
+static struct {
+  mcard_buffer_t * active;      // data block being filled, NULL when none
+  uint32_t number;              // number of the next block in the file
+  uint32_t frames;              // frames in the active block
+  bool timed;                   // the active block holds an adc block
+  uint64_t first_time;
+  uint64_t last_time;           // also of the block before while not timed
+  uint64_t now;                 // latest time seen, extends the 32 bit times
+  uint32_t index_count;         // entries for the next index block
+  uint64_t index_first;
+  uint64_t index_last;
+  uint8_t index[(MCARD_INDEX_INTERVAL - 1) * MCARD_INDEX_ENTRY_SIZE];
+} collect;
+
+// contents of the header block, written at the start and rewritten at the end
+static mcard_file_info_t mcard_info;
+static uint8_t mcard_header[MCARD_FILE_HEADER_MAX] __attribute__((aligned(4)));
+
+static void high_water_update(uint32_t * high_water, uint32_t value)
+{
+  if( value > *high_water )
+  {
+    *high_water = value;
+  }
+}
+
+/*! \brief free the blocks left in the mailboxes
+ */
+static void mcard_adc_flush(void)
+{
+  msg_t msg;
+
+  while( chMBFetch(&mcard_adc3_mb, &msg, TIME_IMMEDIATE) == MSG_OK )
+  {
+    fetch_adc_free_sample_block((adc_sample_block_t *)msg);
+  }
+  while( chMBFetch(&mcard_adc2_mb, &msg, TIME_IMMEDIATE) == MSG_OK )
+  {
+    fetch_adc_free_sample_block((adc_sample_block_t *)msg);
+  }
+}
+
+static void mcard_buffer_post(mcard_buffer_t * bp)
+{
+  chSysLock();
+  high_water_update(&mcard_stats.buffers_high_water, ++mcard_pending);
+  chSysUnlock();
+  chMBPost(&mcard_full_mb, (msg_t)bp, TIME_INFINITE);
+}
+
+/*! \brief take an empty buffer
+ * \return NULL when none came back from the writer in time
+ */
+static mcard_buffer_t * mcard_buffer_take(systime_t timeout)
+{
+  msg_t msg;
+
+  if( chMBFetch(&mcard_free_mb, &msg, timeout) != MSG_OK )
+  {
+    return NULL;
+  }
+  return (mcard_buffer_t *)msg;
+}
+
+/*! \brief extend a 32 bit util_timebase time to the recording time line
+ *
+ * Times up to half the wrap period behind the latest one come out earlier
+ * than it, the adc blocks of the devices reach the collector out of order.
+ */
+static uint64_t mcard_time_extend(uint32_t time)
+{
+  uint64_t extended = collect.now + (int32_t)(time - (uint32_t)collect.now);
+
+  if( extended > collect.now )
+  {
+    collect.now = extended;
+  }
+  return extended;
+}
+
+/*! \brief write the index block at the current block number
+ *
+ * \return false when no buffer was free
+ */
+static bool mcard_index_post(systime_t timeout)
+{
+  mcard_buffer_t * bp;
+  uint32_t length = MCARD_BLOCK_HEADER_SIZE + (collect.index_count * MCARD_INDEX_ENTRY_SIZE);
+
+  bp = mcard_buffer_take(timeout);
+  if( bp == NULL )
+  {
+    return false;
+  }
+
+  mcard_format_block_begin(bp->data, MCARD_MAGIC_INDEX, collect.number);
+  memcpy(bp->data + MCARD_BLOCK_HEADER_SIZE, collect.index, collect.index_count * MCARD_INDEX_ENTRY_SIZE);
+  mcard_format_block_finish(bp->data, length, 0, collect.index_first, collect.index_last, MCARD_BUFFER_SIZE);
+  bp->length = MCARD_BUFFER_SIZE;
+  mcard_buffer_post(bp);
+
+  collect.number++;
+  collect.index_count = 0;
+  return true;
+}
+
+/*! \brief start a data block, after the index block due at its position
+ * \return false when no buffer was free
+ */
+static bool mcard_block_open(void)
+{
+  mcard_buffer_t * bp;
+
+  if( mcard_format_is_index(collect.number) && !mcard_index_post(TIME_IMMEDIATE) )
+  {
+    return false;
+  }
+
+  bp = mcard_buffer_take(TIME_IMMEDIATE);
+  if( bp == NULL )
+  {
+    return false;
+  }
+
+  mcard_format_block_begin(bp->data, MCARD_MAGIC_DATA, collect.number);
+  bp->length = MCARD_BLOCK_HEADER_SIZE;
+  collect.active = bp;
+  collect.frames = 0;
+  collect.timed = false;
+  return true;
+}
+
+/*! \brief finish the data block, enter it in the index and hand it to the writer
+ */
+static void mcard_block_close(void)
+{
+  mcard_buffer_t * bp = collect.active;
+  uint8_t * entry = collect.index + (collect.index_count * MCARD_INDEX_ENTRY_SIZE);
+
+  if( !collect.timed )
+  {
+    collect.first_time = collect.last_time;
+  }
+
+  mcard_format_block_finish(bp->data, bp->length, 0, collect.first_time, collect.last_time, MCARD_BUFFER_SIZE);
+  bp->length = MCARD_BUFFER_SIZE;
+  mcard_buffer_post(bp);
+  collect.active = NULL;
+
+  mcard_format_index_entry(entry, collect.number, collect.frames, collect.first_time, collect.last_time);
+  if( collect.index_count == 0 )
+  {
+    collect.index_first = collect.first_time;
+  }
+  collect.index_last = collect.last_time;
+  collect.index_count++;
+  collect.number++;
+}
+
+/*! \brief append an encoded frame to the data block being filled
+ *
+ * A frame that does not fit closes the block and starts the next one, no
+ * frame spans two blocks.
+ * \return false when no buffer was free, nothing was appended
+ */
+static bool mcard_append(const uint8_t * data, size_t n, bool timed, uint64_t time)
+{
+  mcard_buffer_t * bp = collect.active;
+
+  if( bp != NULL && bp->length + n > MCARD_BUFFER_SIZE )
+  {
+    mcard_block_close();
+    bp = NULL;
+  }
+  if( bp == NULL )
+  {
+    if( !mcard_block_open() )
+    {
+      return false;
+    }
+    bp = collect.active;
+  }
+
+  memcpy(bp->data + bp->length, data, n);
+  bp->length += n;
+  collect.frames++;
+
+  if( timed )
+  {
+    if( !collect.timed || time < collect.first_time )
+    {
+      collect.first_time = time;
+    }
+    if( !collect.timed || time > collect.last_time )
+    {
+      collect.last_time = time;
+    }
+    collect.timed = true;
+  }
+  return true;
+}
+
+/*! \brief encode one adc block, preceded by a gap frame after lost sets
+ */
+static void mcard_record_block(adc_sample_block_t * bp)
+{
+  mpipe_frame_t * fp = &mcard_frame;
+  uint64_t time;
+  uint32_t first;
+  size_t n;
+
+  if( bp->dev >= NELEMS(block_sources) )
+  {
+    return;
+  }
+  time = mcard_time_extend(bp->timestamp);
+
+  if( block_gap[bp->dev].valid && bp->sequence_number != block_gap[bp->dev].next )
+  {
+    first = block_gap[bp->dev].next;
+    n = mpipe_frame_gap(fp, block_sources[bp->dev], first, bp->sequence_number - first, bp->sequence_number - first);
+    if( !mcard_append(fp->encoded, n, false, 0) )
+    {
+      mcard_stats.dropped += bp->set_count;
+      return;
+    }
+    block_gap[bp->dev].next = bp->sequence_number;
+    mcard_stats.gaps++;
+  }
+
+  n = mpipe_frame_adc_block(fp, block_sources[bp->dev], bp->sequence_number, bp);
+  if( !mcard_append(fp->encoded, n, true, time) )
+  {
+    // the next block recorded writes the gap frame
+    mcard_stats.dropped += bp->set_count;
+    return;
+  }
+
+  block_gap[bp->dev].next = bp->sequence_number + bp->set_count;
+  block_gap[bp->dev].valid = true;
+  mcard_stats.blocks++;
+  mcard_stats.sets += bp->set_count;
+}
+
+/*! \brief record the blocks waiting in a mailbox
+ */
+static void mcard_collect(mailbox_t * mbp)
+{
+  msg_t msg;
+
+  chSysLock();
+  high_water_update(&mcard_stats.mailbox_high_water, chMBGetUsedCountI(mbp));
+  chSysUnlock();
+
+  while( chMBFetch(mbp, &msg, TIME_IMMEDIATE) == MSG_OK )
+  {
+    mcard_record_block((adc_sample_block_t *)msg);
+    fetch_adc_free_sample_block((adc_sample_block_t *)msg);
+  }
+}
 
 static void mcard_out_thread(void * p)
 {
 	chRegSetThreadName("mcard_out");
-  msg_t msg;
 
-  while(1)
+  while( !chThdShouldTerminateX() )
+  {
+    chEvtWaitAnyTimeout(ALL_EVENTS, MCARD_COLLECT_TIMEOUT);
+    mcard_collect(&mcard_adc3_mb);
+    mcard_collect(&mcard_adc2_mb);
+  }
+
+  // the adc no longer posts, take what is left and close the file
+  mcard_collect(&mcard_adc3_mb);
+  mcard_collect(&mcard_adc2_mb);
+  if( collect.active != NULL )
   {
-    // TODO
-		chThdSleepMilliseconds(1);
+    mcard_block_close();
   }
+  if( collect.index_count != 0 )
+  {
+    mcard_index_post(TIME_INFINITE);
+  }
+
+  // the writer rewrites the header after the NULL
+  mcard_info.end_time = mcard_time_extend(util_timebase_now());
+  chMBPost(&mcard_full_mb, (msg_t)NULL, TIME_INFINITE);
 }
 
-static void mcard_in_thread(void * p)
+/*! \brief write a buffer to the next sectors of a preallocated file
+ *
+ * A partly filled last buffer is padded with zeros to a whole sector. The
+ * file system lock keeps FatFS off the card during the transfer.
+ * \return FR_DENIED when the file is full
+ */
+static FRESULT mcard_write_sectors(mcard_buffer_t * bp, UINT * written)
 {
-	chRegSetThreadName("mcard_in");
-  
-  while(1)
+  FATFS * fs = mcard_file.fs;
+  uint32_t count = (bp->length + MCARD_SECTOR_SIZE - 1) / MCARD_SECTOR_SIZE;
+  FRESULT result = FR_OK;
+  bool failed;
+
+  *written = 0;
+  if( count > mcard_sectors_left )
+  {
+    count = mcard_sectors_left;
+    result = FR_DENIED;
+  }
+  if( count == 0 )
+  {
+    return result;
+  }
+  if( bp->length < count * MCARD_SECTOR_SIZE )
+  {
+    memset(bp->data + bp->length, 0, (count * MCARD_SECTOR_SIZE) - bp->length);
+  }
+
+  if( !ff_req_grant(fs->sobj) )
   {
-    // TODO
-		chThdSleepMilliseconds(1);
+    return FR_TIMEOUT;
   }
+  failed = sdcWrite(&SDCD1, mcard_sector, bp->data, count) != HAL_SUCCESS;
+  ff_rel_grant(fs->sobj);
+
+  if( failed )
+  {
+    return FR_DISK_ERR;
+  }
+
+  mcard_sector += count;
+  mcard_sectors_left -= count;
+  *written = (bp->length < count * MCARD_SECTOR_SIZE) ? bp->length : count * MCARD_SECTOR_SIZE;
+  return result;
+}
+
+/*! \brief format the header block into mcard_header
+ * \return bytes used
+ */
+static size_t mcard_header_format(void)
+{
+  size_t length;
+
+  mcard_format_block_begin(mcard_header, MCARD_MAGIC_HEADER, 0);
+  length = mcard_format_header(mcard_header, &mcard_info);
+  mcard_format_block_finish(mcard_header, length, mcard_info.flags,
+                            mcard_info.start_time, mcard_info.end_time, MCARD_FILE_HEADER_MAX);
+  return length;
+}
+
+/*! \brief cut a preallocated file to the recorded length, complete the header and close it
+ *
+ * The header goes out as one whole sector at offset 0, the rest of block 0
+ * is already zero on the card.
+ */
+static FRESULT mcard_close(void)
+{
+  FRESULT result = FR_OK;
+  UINT written;
+
+  if( mcard_stats.contiguous )
+  {
+    result = f_lseek(&mcard_file, mcard_stats.bytes);
+    if( result == FR_OK )
+    {
+      result = f_truncate(&mcard_file);
+    }
+  }
+
+  // a full preallocated file still holds a valid recording
+  if( result == FR_OK && (mcard_stats.result == FR_OK || mcard_stats.result == FR_DENIED) )
+  {
+    mcard_info.block_count = mcard_stats.bytes / MCARD_BUFFER_SIZE;
+    mcard_info.flags |= MCARD_FLAG_CLOSED;
+    mcard_header_format();
+    result = f_lseek(&mcard_file, 0);
+    if( result == FR_OK )
+    {
+      result = f_write(&mcard_file, mcard_header, MCARD_FILE_HEADER_MAX, &written);
+    }
+  }
+
+  if( result == FR_OK )
+  {
+    result = f_close(&mcard_file);
+  }
+  else
+  {
+    f_close(&mcard_file);
+  }
+  return result;
 }
 
+/*! \brief write filled buffers to the file, one f_write or sdcWrite per buffer
+ *
+ * After a write error the file is left alone and the remaining buffers
+ * only count as lost.
+ */
+static void mcard_write_thread(void * p)
+{
+  mcard_buffer_t * bp;
+  FRESULT result;
+  uint32_t since_sync = 0;
+  uint32_t start;
+  uint32_t elapsed;
+  UINT written;
+  msg_t msg;
+
+	chRegSetThreadName("mcard_write");
+
+  while( true )
+  {
+    chMBFetch(&mcard_full_mb, &msg, TIME_INFINITE);
+    bp = (mcard_buffer_t *)msg;
+    if( bp == NULL )
+    {
+      break;
+    }
+
+    if( mcard_stats.result != FR_OK )
+    {
+      mcard_stats.lost_bytes += bp->length;
+    }
+    else
+    {
+      start = util_timebase_now();
+      if( mcard_stats.contiguous )
+      {
+        result = mcard_write_sectors(bp, &written);
+      }
+      else
+      {
+        result = f_write(&mcard_file, bp->data, bp->length, &written);
+      }
+      elapsed = util_timebase_now() - start;
+
+      mcard_stats.bytes += written;
+      mcard_stats.writes++;
+      mcard_stats.write_time += elapsed;
+      high_water_update(&mcard_stats.write_max, elapsed);
+
+      if( result == FR_OK && written != bp->length )
+      {
+        // volume full
+        result = FR_DENIED;
+      }
+      if( result != FR_OK )
+      {
+        mcard_stats.result = result;
+        mcard_stats.lost_bytes += bp->length - written;
+      }
+      else if( !mcard_stats.contiguous && ++since_sync >= MCARD_SYNC_BUFFERS )
+      {
+        since_sync = 0;
+        start = util_timebase_now();
+        mcard_stats.result = f_sync(&mcard_file);
+        elapsed = util_timebase_now() - start;
+        mcard_stats.write_time += elapsed;
+        high_water_update(&mcard_stats.sync_max, elapsed);
+      }
+    }
+
+    chSysLock();
+    mcard_pending--;
+    chSysUnlock();
+    chMBPost(&mcard_free_mb, (msg_t)bp, TIME_INFINITE);
+  }
+
+  result = mcard_close();
+  if( mcard_stats.result == FR_OK )
+  {
+    mcard_stats.result = result;
+  }
+}
 
 void mcard_init(void)
 {
-  // TODO: add buffers for can and other data streams
   chMBObjectInit(&mcard_adc2_mb, mcard_adc2_mb_buffer, MCARD_ADC_MB_SIZE);
   chMBObjectInit(&mcard_adc3_mb, mcard_adc3_mb_buffer, MCARD_ADC_MB_SIZE);
+  chMBObjectInit(&mcard_free_mb, mcard_free_mb_buffer, MCARD_BUFFER_COUNT);
+  chMBObjectInit(&mcard_full_mb, mcard_full_mb_buffer, MCARD_BUFFER_COUNT);
+
+  for( uint32_t i = 0; i < MCARD_BUFFER_COUNT; i++ )
+  {
+    mcard_buffers[i].data = mcard_buffer_data[i];
+    chMBPost(&mcard_free_mb, (msg_t)&mcard_buffers[i], TIME_IMMEDIATE);
+  }
 }
 
-void mcard_start(void)
+/*! \brief describe the recording in the header block
+ */
+static void mcard_info_init(void)
 {
-  // TODO
+  static VERSIONData version;
+
+  util_fwversion(&version);
+
+  memset(&mcard_info, 0, sizeof(mcard_info));
+  mcard_info.block_size = MCARD_BUFFER_SIZE;
+  mcard_info.flags = mcard_stats.contiguous ? MCARD_FLAG_CONTIGUOUS : 0;
+  mcard_info.start_time = collect.now;
+  mcard_info.vdda_mv = MCARD_VDDA_MV;
+  mcard_info.vrefint_cal = MCARD_VREFINT_CAL;
+  mcard_info.ts_cal1 = MCARD_TS_CAL1;
+  mcard_info.ts_cal2 = MCARD_TS_CAL2;
+  mcard_info.chip_id[0] = *(const uint32_t *)STM32F4_UNIQUE_ID_LOW;
+  mcard_info.chip_id[1] = *(const uint32_t *)STM32F4_UNIQUE_ID_CENTER;
+  mcard_info.chip_id[2] = *(const uint32_t *)STM32F4_UNIQUE_ID_HIGH;
+  mcard_info.firmware = version.firmware;
+
+  mcard_info.source_count = NELEMS(block_sources);
+  for( uint32_t i = 0; i < NELEMS(block_sources); i++ )
+  {
+    mcard_info.source[i] = block_sources[i];
+    fetch_adc_stream_info(i, &mcard_info.stream[i]);
+  }
 }
 
-void mcard_stop(void)
+/*! \brief create path and start recording the adc block streams
+ *
+ * The file system must be mounted. Blocks are recorded from every device
+ * streaming in mailbox transport. A size other than 0 preallocates the
+ * file and stops writing once it is full.
+ * \return FR_DENIED when size bytes are not free in one run of clusters
+ */
+FRESULT mcard_start(const char * path, uint32_t size)
 {
-  // TODO
+  mcard_buffer_t * bp;
+  uint32_t fragments;
+  FRESULT result;
+
+  if( mcard_recording )
+  {
+    return FR_LOCKED;
+  }
+
+  if( size == 0 )
+  {
+    result = f_open(&mcard_file, path, FA_CREATE_ALWAYS | FA_WRITE);
+    if( result != FR_OK )
+    {
+      return result;
+    }
+  }
+  else
+  {
+    size -= size % MCARD_SECTOR_SIZE;
+    if( size == 0 )
+    {
+      return FR_INVALID_PARAMETER;
+    }
+    result = fetch_sd_prealloc(&mcard_file, path, size, FA_WRITE);
+    if( result != FR_OK )
+    {
+      return result;
+    }
+    result = fetch_sd_file_extent(&mcard_file, &mcard_sector, &fragments);
+    if( result == FR_OK && fragments != 1 )
+    {
+      result = FR_DENIED;
+    }
+    if( result != FR_OK )
+    {
+      f_close(&mcard_file);
+      f_unlink(path);
+      return result;
+    }
+    mcard_sectors_left = size / MCARD_SECTOR_SIZE;
+  }
+
+  mcard_adc_flush();
+  memset(&mcard_stats, 0, sizeof(mcard_stats));
+  mcard_stats.contiguous = (size != 0);
+  mcard_stats.capacity = size;
+  memset(block_gap, 0, sizeof(block_gap));
+  mcard_pending = 0;
+  mcard_stats.start = chVTGetSystemTime();
+
+  memset(&collect, 0, sizeof(collect));
+  collect.now = util_timebase_now();
+  mcard_info_init();
+
+  // block 0, the writer takes it first
+  bp = mcard_buffer_take(TIME_IMMEDIATE);
+  mcard_header_format();
+  memcpy(bp->data, mcard_header, MCARD_FILE_HEADER_MAX);
+  memset(bp->data + MCARD_FILE_HEADER_MAX, 0, MCARD_BUFFER_SIZE - MCARD_FILE_HEADER_MAX);
+  bp->length = MCARD_BUFFER_SIZE;
+  mcard_buffer_post(bp);
+  collect.number = 1;
+
+  mcard_write_tp = chThdCreateStatic(mcard_write_wa, sizeof(mcard_write_wa), NORMALPRIO + 1, mcard_write_thread, NULL);
+  mcard_out_tp = chThdCreateStatic(mcard_out_wa, sizeof(mcard_out_wa), NORMALPRIO + 2, mcard_out_thread, NULL);
+  mcard_recording = true;
+
+  return FR_OK;
+}
+
+/*! \brief stop recording, write out the buffers and close the file
+ * \return first file error of the recording
+ */
+FRESULT mcard_stop(void)
+{
+  if( !mcard_recording )
+  {
+    return FR_OK;
+  }
+  mcard_recording = false;
+
+  chThdTerminate(mcard_out_tp);
+  chEvtSignal(mcard_out_tp, ALL_EVENTS);
+  chThdWait(mcard_out_tp);
+  chThdWait(mcard_write_tp);
+  mcard_out_tp = NULL;
+  mcard_write_tp = NULL;
+
+  mcard_stats.stop = chVTGetSystemTime();
+
+  return mcard_stats.result;
+}
+
+/*! \brief true while the adc should post blocks to the mcard mailboxes
+ */
+bool mcard_is_recording(void)
+{
+  return mcard_recording;
+}
+
+/*! \brief wake the collector, a block was posted
+ */
+void mcard_signal_i(void)
+{
+  if( mcard_out_tp != NULL )
+  {
+    chEvtSignalI(mcard_out_tp, EVENT_MASK(0));
+  }
 }
 
+/*! \brief snapshot of the recording counters
+ *
+ * The counters are updated by the mcard threads without a lock, a field
+ * read while it changes is off by one update at most.
+ */
+void mcard_get_stats(mcard_stats_t * sp)
+{
+  chSysLock();
+  memcpy(sp, &mcard_stats, sizeof(*sp));
+  chSysUnlock();
+}
@@ -0,0 +1,122 @@
+/*! \file mcard_format.c
+ *
+ * Blocks of an mcard recording, see mcard_format.h for the layout
+ *
+ * @defgroup mcard_format MCARD Format
+ * @{
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "util_timebase.h"
+
+#include "mpipe_frame.h"
+#include "mcard_format.h"
+
+static inline uint8_t * put_uint16(uint8_t * out, uint16_t value)
+{
+  *out++ = value & 0xff;
+  *out++ = value >> 8;
+  return out;
+}
+
+static inline uint8_t * put_uint32(uint8_t * out, uint32_t value)
+{
+  out = put_uint16(out, value & 0xffff);
+  return put_uint16(out, value >> 16);
+}
+
+static inline uint8_t * put_uint64(uint8_t * out, uint64_t value)
+{
+  out = put_uint32(out, value & 0xffffffff);
+  return put_uint32(out, value >> 32);
+}
+
+/*! \brief start a block with a cleared header
+ */
+void mcard_format_block_begin(uint8_t * block, uint32_t magic, uint32_t number)
+{
+  memset(block, 0, MCARD_BLOCK_HEADER_SIZE);
+  put_uint32(block, magic);
+  put_uint32(block + 4, number);
+}
+
+/*! \brief complete the block header, clear the unused tail and add the crc
+ */
+void mcard_format_block_finish(uint8_t * block, uint32_t length, uint16_t flags,
+                               uint64_t first_time, uint64_t last_time, size_t block_size)
+{
+  uint16_t crc;
+
+  put_uint32(block + 8, length);
+  put_uint16(block + 12, 0);
+  put_uint16(block + 14, flags);
+  put_uint64(block + 16, first_time);
+  put_uint64(block + 24, last_time);
+
+  if( length < block_size )
+  {
+    memset(block + length, 0, block_size - length);
+  }
+
+  crc = mpipe_crc16(0xffff, block, 12);
+  crc = mpipe_crc16(crc, block + 14, length - 14);
+  put_uint16(block + 12, crc);
+}
+
+/*! \brief write the header block body
+ * \return bytes used by the header including the block header
+ */
+size_t mcard_format_header(uint8_t * block, const mcard_file_info_t * ip)
+{
+  uint8_t * out = block + MCARD_BLOCK_HEADER_SIZE;
+
+  memset(out, 0, MCARD_HEADER_SOURCES - MCARD_BLOCK_HEADER_SIZE);
+  out = put_uint16(out, MCARD_FORMAT_VERSION);
+  out = put_uint16(out, MCARD_INDEX_INTERVAL);
+  out = put_uint32(out, ip->block_size);
+  out = put_uint32(out, UTIL_TIMEBASE_FREQ);
+  out = put_uint32(out, ip->block_count);
+  out = put_uint16(out, ip->vdda_mv);
+  out = put_uint16(out, ip->vrefint_cal);
+  out = put_uint16(out, ip->ts_cal1);
+  out = put_uint16(out, ip->ts_cal2);
+  for( uint32_t i = 0; i < 3; i++ )
+  {
+    out = put_uint32(out, ip->chip_id[i]);
+  }
+  *out = ip->source_count;
+  strncpy((char *)block + 80, ip->firmware, MCARD_FIRMWARE_SIZE - 1);
+
+  out = block + MCARD_HEADER_SOURCES;
+  for( uint32_t i = 0; i < ip->source_count; i++ )
+  {
+    const adc_stream_info_t * sp = &ip->stream[i];
+
+    memset(out, 0, MCARD_SOURCE_SIZE);
+    out[0] = ip->source[i];
+    out[1] = sp->mode;
+    out[2] = sp->channel_count;
+    out[3] = sp->bits;
+    put_uint32(out + 4, sp->sample_rate);
+    put_uint16(out + 8, sp->decimate_factor);
+    out[10] = sp->decimate_filter;
+    memcpy(out + 12, sp->channels, MCARD_SOURCE_CHANNELS);
+    out += MCARD_SOURCE_SIZE;
+  }
+
+  return out - block;
+}
+
+void mcard_format_index_entry(uint8_t * out, uint32_t number, uint32_t frames,
+                              uint64_t first_time, uint64_t last_time)
+{
+  out = put_uint32(out, number);
+  out = put_uint32(out, frames);
+  out = put_uint64(out, first_time);
+  put_uint64(out, last_time);
+}
+
+/*! @} */
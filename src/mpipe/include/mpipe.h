@@ -1,16 +1,87 @@
 #ifndef _MPIPE_H_
 #define _MPIPE_H_
 
+#include <stdint.h>
 #include <stdbool.h>
 
 extern mailbox_t mpipe_adc2_mb;
 extern mailbox_t mpipe_adc3_mb;
 extern mailbox_t mpipe_can_mb;
+extern mailbox_t mpipe_file_mb;
 
 typedef struct {
   BaseAsynchronousChannel * channel;
 } mpipe_config_t;
 
+/*! \brief wire format of streamed data
+ * \sa mpipe_frame.h
+ */
+typedef enum {
+  MPIPE_FORMAT_ASCII,
+  MPIPE_FORMAT_BINARY,
+  MPIPE_FORMAT_DELTA
+} mpipe_format_t;
+
+/*! \brief Producers served by the mpipe writer
+ *
+ * ADC0 is fetch adc dev 0 (ADC3) and also carries the dual adc streams,
+ * ADC1 is dev 1 (ADC2). SERIAL covers all devices captured by
+ * serial.capture, they wake the writer through their driver events. FILE
+ * carries the buffers of sd.dump.
+ */
+typedef enum {
+  MPIPE_PRODUCER_ADC0,
+  MPIPE_PRODUCER_ADC1,
+  MPIPE_PRODUCER_CAN,
+  MPIPE_PRODUCER_SERIAL,
+  MPIPE_PRODUCER_FILE,
+  MPIPE_PRODUCER_COUNT
+} mpipe_producer_t;
+
+#define MPIPE_EVENT(producer) EVENT_MASK(producer)
+
+/*! \brief What producers do while the host is short of credit
+ * \sa mpipe_flow_admit
+ */
+typedef enum {
+  MPIPE_FLOW_NONE,              // no flow control, the writer blocks on the channel
+  MPIPE_FLOW_PAUSE,             // skip blocks until credit is back
+  MPIPE_FLOW_DECIMATE,          // send one block in n
+  MPIPE_FLOW_BUFFER             // queue up to n blocks, then skip
+} mpipe_flow_t;
+
+/*! \brief Streams with health counters, numbered like the adc block devs
+ */
+typedef enum {
+  MPIPE_STREAM_ADC0,
+  MPIPE_STREAM_ADC1,
+  MPIPE_STREAM_ADC_DUAL,
+  MPIPE_STREAM_COUNT
+} mpipe_stream_t;
+
+/*! \brief Health counters of one stream, in sample sets unless noted
+ *
+ * The producer fields are only written from the interrupt that feeds the
+ * stream and the writer fields only from its mpipe thread, so neither side
+ * needs a lock.
+ */
+typedef struct {
+  // producer
+  volatile uint32_t produced;           // sets acquired for the stream
+  volatile uint32_t dropped;            // sets lost before reaching mpipe
+  volatile uint32_t paused;             // sets skipped by the flow policy
+  volatile uint32_t mailbox_full;       // blocks refused by the mailbox or ring
+  volatile uint32_t pool_exhausted;     // blocks that found the pool empty
+  volatile uint32_t mailbox_high_water; // most blocks waiting at once
+  // writer
+  volatile uint32_t delivered;          // sets written to the host
+  volatile uint32_t write_dropped;      // sets lost to write timeouts
+  volatile uint32_t bytes;              // bytes written to the host
+  volatile uint32_t gaps;               // gap markers sent
+} mpipe_stream_stats_t;
+
+extern mpipe_stream_stats_t mpipe_stream_stats[MPIPE_STREAM_COUNT];
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -19,6 +90,24 @@ void mpipe_init(void);
 void mpipe_start(const mpipe_config_t * cfg);
 void mpipe_stop(void);
 
+void mpipe_set_format(mpipe_format_t format);
+mpipe_format_t mpipe_get_format(void);
+void mpipe_set_keyframe_interval(uint16_t interval);
+uint16_t mpipe_get_keyframe_interval(void);
+void mpipe_stream_stats_reset(void);
+void mpipe_signal_from_isr(mpipe_producer_t producer);
+void mpipe_signal(mpipe_producer_t producer);
+void mpipe_set_weight(mpipe_producer_t producer, uint16_t weight);
+uint16_t mpipe_get_weight(mpipe_producer_t producer);
+void mpipe_reset_weights(void);
+void mpipe_grant_credit(uint32_t bytes);
+int32_t mpipe_get_credit(void);
+uint32_t mpipe_get_input_errors(void);
+void mpipe_set_flow(mpipe_flow_t policy, uint16_t arg);
+mpipe_flow_t mpipe_get_flow(void);
+uint16_t mpipe_get_flow_arg(void);
+bool mpipe_flow_admit(mpipe_producer_t producer, uint32_t queued);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,301 @@
+/*! \file mpipe_frame.h
+ *
+ * Binary framing for the mpipe stream
+ *
+ * @addtogroup mpipe_frame
+ */
+
+#ifndef _MPIPE_FRAME_H_
+#define _MPIPE_FRAME_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "hal.h"
+
+#include "fetch_adc.h"
+#include "fetch_can.h"
+
+/*
+ * Frame layout before encoding, multi byte fields are little endian
+ *
+ *  0   source      uint8   mpipe_source_t
+ *  1   type        uint8   mpipe_frame_type_t
+ *  2   sequence    uint32  per source sequence number
+ *  6   payload     ...
+ *  n   crc         uint16  CRC-16/CCITT-FALSE over source ... payload
+ *
+ * The frame is COBS encoded and terminated with a single 0x00 byte so a
+ * host can resynchronise at any delimiter.
+ *
+ * MPIPE_FRAME_ADC_BLOCK payload
+ *
+ *  0   channel_count uint8
+ *  1   set_count     uint8
+ *  2   bits          uint8   12: two samples packed in three bytes
+ *                            16: one sample per uint16
+ *  3   timestamp     uint32  util_timebase microseconds of the first set
+ *  7   samples       set after set, channel_count samples per set
+ *
+ * For the adc block the sequence is the sample set number of the first set.
+ * Sets follow at the configured sample rate, decimated blocks are stamped
+ * with the first input set.
+ * MPIPE_SOURCE_ADC_DUAL carries the combined stream of the dual adc modes,
+ * simultaneous sets hold the dev 0 then the dev 1 channels, interleaved
+ * blocks are a single channel at twice the timer rate.
+ *
+ * MPIPE_FRAME_ADC_DELTA payload, lossless compressed adc block
+ *
+ *  0   channel_count uint8
+ *  1   set_count     uint8
+ *  2   bits          uint8   resolution of the decoded samples
+ *  3   flags         uint8   MPIPE_DELTA_FLAG_*
+ *  4   timestamp     uint32  as in MPIPE_FRAME_ADC_BLOCK
+ *  8   samples       set after set, one varint per sample
+ *
+ * Each sample is coded as the difference to the previous sample of the same
+ * channel, zigzag mapped (0, -1, 1, -2 ... to 0, 1, 2, 3 ...) and written
+ * as a little endian base 128 varint, low groups first with bit 7 set on
+ * all but the last byte. The previous samples carry over from the last
+ * delta frame of the same source. A keyframe starts from zero so its first
+ * set holds the absolute values; a decoder that lost a frame discards delta
+ * frames until the next keyframe.
+ *
+ * MPIPE_FRAME_ADC_CAPTURE payload, part of a triggered capture window
+ *
+ *  0   channel_count uint8
+ *  1   bits          uint8   12, packed as in MPIPE_FRAME_ADC_BLOCK
+ *  2   window        uint16  sets in the whole window
+ *  4   pre           uint16  window set which fired the trigger
+ *  6   offset        uint16  window set of the first set in this frame
+ *  8   set_count     uint8
+ *  9   timestamp     uint32  util_timebase microseconds of window set 0
+ * 13   samples       set after set, channel_count samples per set
+ *
+ * A window is sent as consecutive frames with rising offset, the header
+ * sequence is the capture number of the window.
+ *
+ * MPIPE_FRAME_ADC_STATS payload, summary of one adc.stats window
+ *
+ *  0   channel_count uint8
+ *  1   frac_bits     uint8   fractional bits of mean, rms and variance
+ *  2   set_count     uint32  sets in the window
+ *  6   per channel   min uint16, max uint16, mean uint32, rms uint32,
+ *                    variance uint32
+ *
+ * The header sequence is the window number.
+ *
+ * MPIPE_FRAME_ADC_SPECTRUM payload, part of an adc.fft magnitude spectrum
+ *
+ *  0   channel       uint8   adc input
+ *  1   window        uint8   util_fft_window_t
+ *  2   size          uint16  fft points, the spectrum has size / 2 + 1 bins
+ *  4   sample_rate   uint32
+ *  8   frac_bits     uint8   fractional bits of the magnitudes
+ *  9   offset        uint16  first bin in this frame
+ * 11   bin_count     uint8
+ * 12   magnitudes    uint16 per bin, amplitude in adc counts
+ *
+ * A spectrum is sent as consecutive frames with rising offset, bin k is
+ * k * sample_rate / size Hz.
+ *
+ * MPIPE_FRAME_ADC_PEAKS payload, strongest local maxima of a spectrum
+ *
+ *  0   channel ... frac_bits as MPIPE_FRAME_ADC_SPECTRUM
+ *  9   peak_count    uint8
+ * 10   per peak      bin uint16, magnitude uint16, strongest first
+ *
+ * For both the header sequence is the spectrum number.
+ *
+ * MPIPE_FRAME_GAP payload, sets missing from an adc block stream
+ *
+ *  0   set_count     uint32  sets missing before the next block
+ *  4   dropped       uint32  sets the firmware lost since the last marker
+ *
+ * The header sequence is the number of the first missing set. dropped
+ * is below set_count when part of the hole was not streamed at all, e.g.
+ * the device was stopped or running adc.stats in between.
+ *
+ * MPIPE_FRAME_DAC_BLOCK payload, host to device samples for dac.stream
+ *
+ *  0   channel_count uint8   must match the dac.stream channels
+ *  1   set_count     uint16
+ *  3   samples       uint16, set after set, channel_count samples per set
+ *
+ * Sent by the host with source MPIPE_SOURCE_DAC and a block number as
+ * sequence. On the mpipe input a frame is introduced by a 'D', followed by
+ * the encoded frame up to and including its delimiter.
+ *
+ * MPIPE_FRAME_SERIAL_DATA payload, bytes received on a captured uart
+ *
+ *  0   flags         uint8   MPIPE_SERIAL_FLAG_*
+ *  1   timestamp     uint32  util_timebase microseconds the first byte was seen
+ *  5   data          the received bytes
+ *
+ * Sent with source MPIPE_SOURCE_SERIAL plus the fetch serial device number.
+ * The header sequence is the stream offset of the first byte, counted from
+ * the start of the capture, so a host can spot chunks lost on the way.
+ *
+ * MPIPE_FRAME_CAN_RX payload, frames received on CAN1
+ *
+ *  0   frame_count   uint8
+ *  1   per frame     24 bytes
+ *      0   sequence    uint32  received frame number
+ *      4   timestamp   uint32  util_timebase microseconds when read from the fifo
+ *      8   id          uint32  bit 31 extended id, bit 30 remote frame
+ *     12   time        uint16  bxcan bit time counter at the start of frame
+ *     14   filter      uint8   index of the filter which accepted the frame
+ *     15   dlc         uint8
+ *     16   data        8 bytes, dlc of them valid
+ *
+ * The header sequence is the sequence of the first frame, a jump in the
+ * frame sequences shows frames that were received but not streamed.
+ *
+ * MPIPE_FRAME_FILE_DATA payload, part of a file read by sd.dump
+ *
+ *  0   dump          uint8   dump number, counts up with every sd.dump
+ *  1   flags         uint8   MPIPE_FILE_FLAG_*
+ *  2   data          up to MPIPE_FRAME_FILE_CHUNK bytes of the file
+ *
+ * Sent with source MPIPE_SOURCE_FILE. The header sequence is the file
+ * offset of the first data byte. The last frame of a dump carries
+ * MPIPE_FILE_FLAG_LAST and may be empty.
+ */
+
+#define MPIPE_FRAME_HEADER_SIZE   6
+#define MPIPE_FRAME_CRC_SIZE      2
+
+#define MPIPE_FRAME_ADC_HEADER_SIZE 7
+#define MPIPE_FRAME_ADC_DELTA_HEADER_SIZE 8
+#define MPIPE_FRAME_ADC_CAPTURE_HEADER_SIZE 13
+#define MPIPE_FRAME_ADC_SPECTRUM_HEADER_SIZE 12
+#define MPIPE_FRAME_DAC_HEADER_SIZE 3
+#define MPIPE_FRAME_SERIAL_HEADER_SIZE 5
+#define MPIPE_FRAME_CAN_RECORD_SIZE 24
+#define MPIPE_FRAME_FILE_HEADER_SIZE 2
+
+// file bytes per frame
+#define MPIPE_FRAME_FILE_CHUNK    512
+
+// received can frames per frame
+#define MPIPE_FRAME_CAN_BATCH 8
+
+#define MPIPE_CAN_ID_EXT  0x80000000
+#define MPIPE_CAN_ID_RTR  0x40000000
+
+// bins per spectrum frame
+#define MPIPE_FRAME_SPECTRUM_CHUNK 255
+
+// a 16 bit zigzag delta takes at most three varint bytes
+#define MPIPE_DELTA_MAX_VARINT    3
+
+#define MPIPE_DELTA_FLAG_KEYFRAME 0x01
+
+// chunk ended by a silent line rather than its size
+#define MPIPE_SERIAL_FLAG_IDLE    0x01
+// line errors the driver reported while the chunk was collected
+#define MPIPE_SERIAL_FLAG_OVERRUN 0x02
+#define MPIPE_SERIAL_FLAG_FRAMING 0x04
+#define MPIPE_SERIAL_FLAG_PARITY  0x08
+#define MPIPE_SERIAL_FLAG_NOISE   0x10
+#define MPIPE_SERIAL_FLAG_BREAK   0x20
+
+// final frame of a dump
+#define MPIPE_FILE_FLAG_LAST      0x01
+// the file could not be read to the requested length
+#define MPIPE_FILE_FLAG_ERROR     0x02
+
+// dual simultaneous blocks carry the channels of both devices
+#define MPIPE_DELTA_MAX_CHANNELS  (2 * ADC_SAMPLE_SET_SIZE)
+
+#ifndef MPIPE_DELTA_KEYFRAME_INTERVAL
+#define MPIPE_DELTA_KEYFRAME_INTERVAL 16
+#endif
+
+#define MPIPE_FRAME_MAX_PAYLOAD   (MPIPE_FRAME_ADC_DELTA_HEADER_SIZE + (ADC_SAMPLE_BLOCK_SIZE * MPIPE_DELTA_MAX_VARINT))
+#define MPIPE_FRAME_MAX_SIZE      (MPIPE_FRAME_HEADER_SIZE + MPIPE_FRAME_MAX_PAYLOAD + MPIPE_FRAME_CRC_SIZE)
+
+#if (MPIPE_FRAME_FILE_HEADER_SIZE + MPIPE_FRAME_FILE_CHUNK) > MPIPE_FRAME_MAX_PAYLOAD
+#error "MPIPE_FRAME_FILE_CHUNK does not fit a frame"
+#endif
+
+// COBS adds one byte per 254 bytes of data plus the leading code byte, then the delimiter
+#define MPIPE_FRAME_MAX_ENCODED_SIZE (MPIPE_FRAME_MAX_SIZE + (MPIPE_FRAME_MAX_SIZE / 254) + 2)
+
+#define MPIPE_FRAME_DELIMITER     0x00
+
+typedef enum {
+  MPIPE_SOURCE_ADC0   = 0x00,
+  MPIPE_SOURCE_ADC1   = 0x01,
+  MPIPE_SOURCE_ADC_DUAL = 0x02,
+  MPIPE_SOURCE_CAN    = 0x10,
+  MPIPE_SOURCE_SERIAL = 0x20,
+  MPIPE_SOURCE_DAC    = 0x30,
+  MPIPE_SOURCE_FILE   = 0x40
+} mpipe_source_t;
+
+typedef enum {
+  MPIPE_FRAME_ADC_BLOCK = 0x01,
+  MPIPE_FRAME_ADC_DELTA = 0x02,
+  MPIPE_FRAME_ADC_CAPTURE = 0x03,
+  MPIPE_FRAME_ADC_STATS = 0x04,
+  MPIPE_FRAME_ADC_SPECTRUM = 0x05,
+  MPIPE_FRAME_ADC_PEAKS = 0x06,
+  MPIPE_FRAME_GAP = 0x07,
+  MPIPE_FRAME_DAC_BLOCK = 0x08,
+  MPIPE_FRAME_SERIAL_DATA = 0x09,
+  MPIPE_FRAME_CAN_RX = 0x0A,
+  MPIPE_FRAME_FILE_DATA = 0x0B
+} mpipe_frame_type_t;
+
+typedef struct {
+  uint8_t raw[MPIPE_FRAME_MAX_SIZE];
+  uint8_t encoded[MPIPE_FRAME_MAX_ENCODED_SIZE];
+  size_t length;
+} mpipe_frame_t;
+
+/*! \brief per source state of the delta coder
+ */
+typedef struct {
+  uint16_t last[MPIPE_DELTA_MAX_CHANNELS];   // previous sample of each channel
+  uint16_t blocks;                           // frames since the last keyframe, 0 forces one
+  uint8_t channel_count;
+  uint8_t bits;
+} mpipe_delta_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint16_t mpipe_crc16(uint16_t crc, const uint8_t * data, size_t n);
+size_t mpipe_cobs_encode(const uint8_t * src, size_t n, uint8_t * dst);
+size_t mpipe_cobs_decode(const uint8_t * src, size_t n, uint8_t * dst);
+bool mpipe_frame_check(const uint8_t * raw, size_t n);
+
+void mpipe_frame_begin(mpipe_frame_t * fp, mpipe_source_t source, mpipe_frame_type_t type, uint32_t sequence);
+bool mpipe_frame_put(mpipe_frame_t * fp, const void * data, size_t n);
+size_t mpipe_frame_finish(mpipe_frame_t * fp);
+
+size_t mpipe_frame_adc_block(mpipe_frame_t * fp, mpipe_source_t source, uint32_t sequence, const adc_sample_block_t * bp);
+size_t mpipe_frame_adc_delta(mpipe_frame_t * fp, mpipe_source_t source, uint32_t sequence, const adc_sample_block_t * bp,
+                             mpipe_delta_t * dp, uint16_t keyframe_interval);
+size_t mpipe_frame_adc_capture(mpipe_frame_t * fp, mpipe_source_t source, const adc_capture_t * cp,
+                               uint16_t offset, uint8_t set_count);
+size_t mpipe_frame_adc_stats(mpipe_frame_t * fp, mpipe_source_t source, const adc_stats_record_t * rp);
+size_t mpipe_frame_adc_spectrum(mpipe_frame_t * fp, mpipe_source_t source, const adc_fft_block_t * bp,
+                                const uint16_t * magnitude, uint16_t offset, uint8_t bin_count);
+size_t mpipe_frame_adc_peaks(mpipe_frame_t * fp, mpipe_source_t source, const adc_fft_block_t * bp,
+                             const util_fft_peak_t * peaks, uint8_t peak_count);
+size_t mpipe_frame_gap(mpipe_frame_t * fp, mpipe_source_t source, uint32_t first, uint32_t set_count, uint32_t dropped);
+size_t mpipe_frame_serial_data(mpipe_frame_t * fp, mpipe_source_t source, uint32_t offset, uint8_t flags,
+                               uint32_t timestamp, const uint8_t * data, size_t n);
+size_t mpipe_frame_can_rx(mpipe_frame_t * fp, fetch_can_rx_t * const * frames, uint8_t count);
+size_t mpipe_frame_file_data(mpipe_frame_t * fp, uint8_t dump, uint32_t offset, uint8_t flags,
+                             const uint8_t * data, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
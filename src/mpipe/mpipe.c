@@ -3,55 +3,85 @@
 
 #include "ch.h"
 #include "hal.h"
-#include "chprintf.h"
 
 #include "util_general.h"
 #include "util_strings.h"
 #include "util_messages.h"
 #include "util_version.h"
+#include "util_timebase.h"
+#include "util_format.h"
 
 #include "fetch_adc.h"
+#include "fetch_can.h"
+#include "fetch_dac.h"
+#include "fetch_serial.h"
+#include "fetch_sd.h"
 
 #include "mpipe.h"
+#include "mpipe_frame.h"
 
 #ifndef MPIPE_ADC_MB_SIZE
 #define MPIPE_ADC_MB_SIZE 16
 #endif
 
+// room for the whole rx frame pool
 #ifndef MPIPE_CAN_MB_SIZE
-#define MPIPE_CAN_MB_SIZE 8
+#define MPIPE_CAN_MB_SIZE FETCH_CAN_RX_POOL_SIZE
 #endif
 
 #ifndef MPIPE_INPUT_WA_SIZE
-#define MPIPE_INPUT_WA_SIZE  128
+#define MPIPE_INPUT_WA_SIZE  256
 #endif
 
-#ifndef MPIPE_ADC_WA_SIZE
-#define MPIPE_ADC_WA_SIZE  128
+// largest host frame, a full dac block
+#define MPIPE_INPUT_FRAME_SIZE (MPIPE_FRAME_HEADER_SIZE + MPIPE_FRAME_DAC_HEADER_SIZE + \
+                                2 * FETCH_DAC_BLOCK_SAMPLES + MPIPE_FRAME_CRC_SIZE)
+#define MPIPE_INPUT_ENCODED_SIZE (MPIPE_INPUT_FRAME_SIZE + (MPIPE_INPUT_FRAME_SIZE / 254) + 1)
+
+// room for the fft helpers and the fpu context
+#ifndef MPIPE_WRITER_WA_SIZE
+#define MPIPE_WRITER_WA_SIZE  512
+#endif
+
+// longest ascii set line, <tag><label>:<index><samples>\r\n
+#define MPIPE_ASCII_SET_LINE_MAX (3 + 8 + 4 * 2 * ADC_SAMPLE_SET_SIZE + 2)
+
+// producers signal the writer, the timeout only bounds the stop latency
+#ifndef MPIPE_WRITER_POLL_TIME
+#define MPIPE_WRITER_POLL_TIME MS2ST(10)
 #endif
 
-#ifndef MPIPE_CAN_WA_SIZE
-#define MPIPE_CAN_WA_SIZE  128
+// one usb serial queue buffer per channel write
+#ifndef MPIPE_PACKET_SIZE
+#define MPIPE_PACKET_SIZE SERIAL_USB_BUFFERS_SIZE
 #endif
 
-#ifndef MPIPE_SERIAL_WA_SIZE
-#define MPIPE_SERIAL_WA_SIZE  128
+// bytes a producer may write per round of the writer
+#ifndef MPIPE_DEFAULT_WEIGHT
+#define MPIPE_DEFAULT_WEIGHT MPIPE_PACKET_SIZE
 #endif
 
-// mutex used to control access to printing out on mpipe stream
-mutex_t mpipe_output_mutex;
+// credit below which the flow policy throttles the producers
+#ifndef MPIPE_FLOW_LOW_WATER
+#define MPIPE_FLOW_LOW_WATER (4 * MPIPE_PACKET_SIZE)
+#endif
+
+// fetch adc device numbers
+#define MPIPE_ADC3_DEV 0
+#define MPIPE_ADC2_DEV 1
+
+// serial capture events, one per fetch serial device after the producer events
+#define MPIPE_SERIAL_EVENT(dev) EVENT_MASK(MPIPE_PRODUCER_COUNT + (dev))
+
+#ifndef MPIPE_WRITE_TIMEOUT
+#define MPIPE_WRITE_TIMEOUT MS2ST(100)
+#endif
 
 thread_t * mpipe_input_tp = NULL;
-thread_t * mpipe_adc2_tp = NULL;
-thread_t * mpipe_adc3_tp = NULL;
-thread_t * mpipe_can_tp = NULL;
-thread_t * mpipe_serial_tp = NULL;
+thread_t * volatile mpipe_writer_tp = NULL;
 
 static THD_WORKING_AREA(mpipe_input_wa, MPIPE_INPUT_WA_SIZE);
-static THD_WORKING_AREA(mpipe_adc2_wa, MPIPE_ADC_WA_SIZE);
-static THD_WORKING_AREA(mpipe_adc3_wa, MPIPE_ADC_WA_SIZE);
-static THD_WORKING_AREA(mpipe_can_wa, MPIPE_CAN_WA_SIZE);
-static THD_WORKING_AREA(mpipe_serial_wa, MPIPE_SERIAL_WA_SIZE);
+static THD_WORKING_AREA(mpipe_writer_wa, MPIPE_WRITER_WA_SIZE);
 
 msg_t mpipe_adc2_mb_buffer[MPIPE_ADC_MB_SIZE];
 mailbox_t mpipe_adc2_mb;
@@ -62,6 +92,82 @@ mailbox_t mpipe_adc3_mb;
 msg_t mpipe_can_mb_buffer[MPIPE_CAN_MB_SIZE];
 mailbox_t mpipe_can_mb;
 
+msg_t mpipe_file_mb_buffer[FETCH_SD_DUMP_BUFFERS];
+mailbox_t mpipe_file_mb;
+
+static volatile mpipe_format_t mpipe_format = MPIPE_FORMAT_ASCII;
+static volatile uint16_t mpipe_keyframe_interval = MPIPE_DELTA_KEYFRAME_INTERVAL;
+
+// frames are too large for the thread stack
+static mpipe_frame_t mpipe_writer_frame;
+
+// host frame being received, decoded in place
+static uint8_t mpipe_input_frame[MPIPE_INPUT_ENCODED_SIZE];
+
+// host frames with a bad encoding, crc or type
+static volatile uint32_t mpipe_input_errors;
+
+/*! \brief Packet buffer in front of the mpipe channel
+ *
+ * The writer hands it to the format code as its BaseSequentialStream, so
+ * ascii lines and encoded frames of all producers are packed into channel
+ * writes of MPIPE_PACKET_SIZE bytes. The buffer is flushed when full and
+ * whenever the writer runs out of work.
+ */
+typedef struct {
+  const struct BaseSequentialStreamVMT * vmt;
+  BaseChannel * channel;
+  uint8_t buffer[MPIPE_PACKET_SIZE];
+  size_t length;
+  uint32_t total;               // bytes accepted since mpipe start
+  uint32_t failed;              // flushes cut short by the write timeout
+} mpipe_out_t;
+
+static mpipe_out_t mpipe_out;
+
+/*! \brief deficit round robin state of a producer
+ */
+typedef struct {
+  uint16_t weight;              // bytes added to the deficit per round
+  int32_t deficit;              // bytes the producer may still write
+} mpipe_share_t;
+
+static mpipe_share_t mpipe_shares[MPIPE_PRODUCER_COUNT];
+
+/*! \brief Credit based flow control
+ *
+ * With a policy other than MPIPE_FLOW_NONE the writer only sends what the
+ * host has granted with K<count> lines, credit is in bytes and may go
+ * negative by one item. Granted credit is updated under the system lock,
+ * the producers only read it.
+ */
+static volatile mpipe_flow_t mpipe_flow_policy = MPIPE_FLOW_NONE;
+static volatile uint16_t mpipe_flow_arg;
+static volatile int32_t mpipe_flow_credit;
+
+// blocks since the last one let through by MPIPE_FLOW_DECIMATE
+static uint16_t mpipe_flow_skip[MPIPE_PRODUCER_COUNT];
+
+/*! \brief chunk of a captured serial device being collected by the writer
+ */
+static struct {
+  event_listener_t listener;    // wakes the writer on CHN_INPUT_AVAILABLE
+  uint8_t data[FETCH_SERIAL_CHUNK_MAX];
+  uint16_t length;
+  uint8_t session;              // capture the bytes belong to
+  uint32_t timestamp;           // timebase when the first byte was seen
+  uint32_t last;                // timebase when the chunk last grew
+} serial_chunks[FETCH_SERIAL_DEV_COUNT];
+
+// device looked at first for a finished chunk
+static uint32_t serial_next;
+
+// sd.dump buffer being written and the bytes of it already sent
+static struct {
+  fetch_sd_dump_chunk_t * chunk;
+  uint32_t sent;
+} file_out;
+
 #define IS_EOL(x) (x == '\n' || x == '\r')
 
 static bool parse_hex(uint8_t c, uint8_t * output)
@@ -85,201 +191,1035 @@ static bool parse_hex(uint8_t c, uint8_t * output)
   return true;
 }
 
-static void print_hex_nibble(BaseSequentialStream *chp, uint8_t data)
+static void print_hex8(BaseSequentialStream *chp, uint8_t data)
+{
+  char text[2];
+
+  util_format_hex8(text, data);
+  streamWrite(chp, (const uint8_t *)text, sizeof(text));
+}
+
+static void print_hex16(BaseSequentialStream *chp, uint16_t data)
+{
+  char text[4];
+
+  util_format_hex16(text, data);
+  streamWrite(chp, (const uint8_t *)text, sizeof(text));
+}
+
+static void print_hex32(BaseSequentialStream *chp, uint32_t data)
+{
+  char text[8];
+
+  util_format_hex32(text, data);
+  streamWrite(chp, (const uint8_t *)text, sizeof(text));
+}
+
+/*! \brief print bytes as hex pairs, a chunk per stream write
+ */
+static void print_hex8_array(BaseSequentialStream *chp, const uint8_t * data, size_t n)
+{
+  char text[64];
+
+  while( n > 0 )
+  {
+    size_t count = (n > sizeof(text) / 2) ? sizeof(text) / 2 : n;
+    char * p = text;
+
+    for( size_t i = 0; i < count; i++ )
+    {
+      p = util_format_hex8(p, data[i]);
+    }
+    streamWrite(chp, (const uint8_t *)text, p - text);
+    data += count;
+    n -= count;
+  }
+}
+
+/*! \brief print every sample set of an adc block as its own line
+ *
+ * Each set keeps the "A<n>:<seq><samples>" line format, the 32 bit sequence
+ * number of the set is derived from the sequence number of the first set in
+ * the block. Timestamps are only carried by the binary formats.
+ */
+static void print_adc_block(BaseSequentialStream *chp, char dev, adc_sample_block_t * bp)
+{
+  adcsample_t * sp = bp->sample;
+  char line[MPIPE_ASCII_SET_LINE_MAX];
+
+  for( uint16_t set = 0; set < bp->set_count; set++ )
+  {
+    char * p = line;
+
+    *p++ = 'A';
+    *p++ = dev;
+    *p++ = ':';
+    p = util_format_hex32(p, bp->sequence_number + set);
+    for( uint8_t i = 0; i < bp->channel_count; i++ )
+    {
+      p = util_format_hex16(p, *sp++);
+    }
+    *p++ = '\r';
+    *p++ = '\n';
+    streamWrite(chp, (const uint8_t *)line, p - line);
+  }
+}
+
+/*! \brief ascii label and binary source of each adc block dev number
+ */
+static const struct {
+  char label;
+  mpipe_source_t source;
+} adc_block_sources[] = {
+  { '3', MPIPE_SOURCE_ADC0 },     // dev 0, ADC3
+  { '2', MPIPE_SOURCE_ADC1 },     // dev 1, ADC2
+  { 'D', MPIPE_SOURCE_ADC_DUAL }  // FETCH_ADC_DEV_COMBINED
+};
+
+// delta coder state, indexed by block dev number
+static mpipe_delta_t adc_block_delta[NELEMS(adc_block_sources)];
+
+mpipe_stream_stats_t mpipe_stream_stats[MPIPE_STREAM_COUNT];
+
+// gap detection, indexed by block dev number
+static struct {
+  uint32_t next;                // sequence number of the set expected next
+  uint32_t dropped;             // drops already reported by gap markers
+  bool valid;                   // a block has been written since mpipe start
+} adc_block_gap[NELEMS(adc_block_sources)];
+
+/*! \brief write the packet buffer to the channel
+ *
+ * A short write loses whatever was buffered, which may include a delta
+ * frame of any source, so every delta stream restarts on a keyframe.
+ */
+static void mpipe_out_flush(mpipe_out_t * op)
 {
-  if( chp == NULL )
+  size_t length = op->length;
+
+  if( length == 0 )
+  {
     return;
+  }
+  op->length = 0;
 
-  data &= 0xf;
+  if( chnWriteTimeout(op->channel, op->buffer, length, MPIPE_WRITE_TIMEOUT) != length )
+  {
+    op->failed++;
+    for( uint32_t i = 0; i < NELEMS(adc_block_delta); i++ )
+    {
+      adc_block_delta[i].blocks = 0;
+    }
+  }
+}
 
-  if( data < 10 )
+static size_t mpipe_out_write(void * ip, const uint8_t * bp, size_t n)
+{
+  mpipe_out_t * op = (mpipe_out_t *)ip;
+  size_t left = n;
+
+  while( left > 0 )
   {
-    streamPut(chp, '0' + data);
+    size_t count = sizeof(op->buffer) - op->length;
+
+    if( count > left )
+    {
+      count = left;
+    }
+    memcpy(&op->buffer[op->length], bp, count);
+    op->length += count;
+    bp += count;
+    left -= count;
+    if( op->length == sizeof(op->buffer) )
+    {
+      mpipe_out_flush(op);
+    }
   }
-  else
+  op->total += n;
+
+  if( mpipe_flow_policy != MPIPE_FLOW_NONE )
   {
-    streamPut(chp, 'A' + data - 10);
+    chSysLock();
+    mpipe_flow_credit -= n;
+    chSysUnlock();
   }
+
+  return n;
 }
 
-static void print_hex8(BaseSequentialStream *chp, uint8_t data)
+static size_t mpipe_out_read(void * ip, uint8_t * bp, size_t n)
 {
-  print_hex_nibble(chp, data >> 4);
-  print_hex_nibble(chp, data);
+  (void)ip;
+  (void)bp;
+  (void)n;
+
+  return 0;
 }
 
-static void print_hex16(BaseSequentialStream *chp, uint16_t data)
+static msg_t mpipe_out_put(void * ip, uint8_t b)
 {
-  print_hex_nibble(chp, data >> 12);
-  print_hex_nibble(chp, data >> 8);
-  print_hex_nibble(chp, data >> 4);
-  print_hex_nibble(chp, data);
+  mpipe_out_write(ip, &b, 1);
+
+  return MSG_OK;
 }
 
-static void print_hex32(BaseSequentialStream *chp, uint16_t data)
+static msg_t mpipe_out_get(void * ip)
 {
-  print_hex_nibble(chp, data >> 28);
-  print_hex_nibble(chp, data >> 24);
-  print_hex_nibble(chp, data >> 20);
-  print_hex_nibble(chp, data >> 16);
-  print_hex_nibble(chp, data >> 12);
-  print_hex_nibble(chp, data >> 8);
-  print_hex_nibble(chp, data >> 4);
-  print_hex_nibble(chp, data);
+  (void)ip;
+
+  return MSG_RESET;
 }
 
-static void print_serial_output(BaseSequentialStream *chp, SerialDriver *sdp, char dev)
+static const struct BaseSequentialStreamVMT mpipe_out_vmt = {
+  mpipe_out_write, mpipe_out_read, mpipe_out_put, mpipe_out_get
+};
+
+/*! \brief tell the host that sets first ... first + count - 1 are missing
+ *
+ * ascii: G<label>:<first><count><dropped>
+ * binary/delta: MPIPE_FRAME_GAP
+ */
+static void write_adc_gap(BaseSequentialStream *chp, mpipe_frame_t * fp, uint8_t dev, uint32_t first, uint32_t count)
 {
-  static uint8_t uart_buffer[SERIAL_BUFFERS_SIZE];
-  uint32_t count;
+  mpipe_stream_stats_t * sp = &mpipe_stream_stats[dev];
+  uint32_t dropped = sp->dropped + sp->write_dropped;
+  uint32_t reported = dropped - adc_block_gap[dev].dropped;
+  size_t n;
 
-  count = sdAsynchronousRead(sdp, uart_buffer, sizeof(uart_buffer));
-  
-  if( count == 0 )
+  adc_block_gap[dev].dropped = dropped;
+  sp->gaps++;
+
+  if( mpipe_format == MPIPE_FORMAT_ASCII )
+  {
+    streamPut(chp, 'G');
+    streamPut(chp, adc_block_sources[dev].label);
+    streamPut(chp, ':');
+    print_hex32(chp, first);
+    print_hex32(chp, count);
+    print_hex32(chp, reported);
+    streamPut(chp, '\r');
+    streamPut(chp, '\n');
     return;
+  }
+
+  n = mpipe_frame_gap(fp, adc_block_sources[dev].source, first, count, reported);
+  streamWrite(chp, fp->encoded, n);
+}
+
+/*! \brief write an adc block in the currently selected format
+ *
+ * A block counts as delivered once it is in the packet buffer, unless a
+ * flush failed while it was being written. Blocks lost with a later flush
+ * only show as a sequence gap on the host.
+ */
+static void write_adc_block(BaseSequentialStream *chp, mpipe_frame_t * fp, adc_sample_block_t * bp)
+{
+  mpipe_stream_stats_t * sp;
+  uint32_t total;
+  uint32_t failed;
+  size_t n;
 
-  chprintf(chp, "S%c:", dev);
-  for(uint32_t i = 0; i < count; i++ )
+  if( bp->dev >= NELEMS(adc_block_sources) )
   {
-    if( isprint(uart_buffer[i]) )
-    {
-      streamPut(chp, uart_buffer[i]);
-    }
-    else
+    return;
+  }
+  sp = &mpipe_stream_stats[bp->dev];
+
+  // blocks that never arrived or never got out leave a hole in the sequence
+  if( !adc_block_gap[bp->dev].valid )
+  {
+    adc_block_gap[bp->dev].dropped = sp->dropped + sp->write_dropped;
+  }
+  else if( bp->sequence_number != adc_block_gap[bp->dev].next )
+  {
+    write_adc_gap(chp, fp, bp->dev, adc_block_gap[bp->dev].next, bp->sequence_number - adc_block_gap[bp->dev].next);
+  }
+
+  total = mpipe_out.total;
+  failed = mpipe_out.failed;
+
+  if( mpipe_format == MPIPE_FORMAT_BINARY )
+  {
+    n = mpipe_frame_adc_block(fp, adc_block_sources[bp->dev].source, bp->sequence_number, bp);
+    streamWrite(chp, fp->encoded, n);
+  }
+  else if( mpipe_format == MPIPE_FORMAT_DELTA )
+  {
+    n = mpipe_frame_adc_delta(fp, adc_block_sources[bp->dev].source, bp->sequence_number, bp,
+                              &adc_block_delta[bp->dev], mpipe_keyframe_interval);
+    streamWrite(chp, fp->encoded, n);
+  }
+  else
+  {
+    print_adc_block(chp, adc_block_sources[bp->dev].label, bp);
+  }
+
+  sp->bytes += mpipe_out.total - total;
+  if( mpipe_out.failed != failed )
+  {
+    // not advancing next makes the following block report the loss
+    sp->write_dropped += bp->set_count;
+    return;
+  }
+  sp->delivered += bp->set_count;
+  adc_block_gap[bp->dev].next = bp->sequence_number + bp->set_count;
+  adc_block_gap[bp->dev].valid = true;
+}
+
+/*! \brief write a triggered capture window
+ *
+ * ascii: a header line T<label>:TRIG<pre><window><timestamp> followed by one
+ * T<label>:<set index><samples> line per set.
+ * binary/delta: MPIPE_FRAME_ADC_CAPTURE frames of up to one block each.
+ */
+static void write_adc_capture(BaseSequentialStream *chp, mpipe_frame_t * fp, const adc_capture_t * cp)
+{
+  char label = adc_block_sources[cp->dev].label;
+  uint16_t chunk = ADC_SAMPLE_BLOCK_SIZE / cp->channel_count;
+  size_t n;
+
+  if( mpipe_format == MPIPE_FORMAT_ASCII )
+  {
+    uint16_t index = cp->start;
+    char line[MPIPE_ASCII_SET_LINE_MAX];
+    char * p = line;
+
+    *p++ = 'T';
+    *p++ = label;
+    memcpy(p, ":TRIG", 5);
+    p = util_format_hex16(p + 5, cp->pre);
+    p = util_format_hex16(p, cp->set_count);
+    p = util_format_hex32(p, cp->timestamp);
+    *p++ = '\r';
+    *p++ = '\n';
+    streamWrite(chp, (const uint8_t *)line, p - line);
+    for( uint16_t set = 0; set < cp->set_count; set++ )
     {
-      streamPut(chp, '\\');
-      switch( uart_buffer[i] )
+      const adcsample_t * sp = &cp->sample[index * cp->channel_count];
+
+      p = line;
+      *p++ = 'T';
+      *p++ = label;
+      *p++ = ':';
+      p = util_format_hex16(p, set);
+      for( uint8_t i = 0; i < cp->channel_count; i++ )
       {
-        case '\0':
-          streamPut(chp, '0');
-          break;
-        case '\n':
-          streamPut(chp, 'n');
-          break;
-        case '\r':
-          streamPut(chp, 'r');
-          break;
-        case '\t':
-          streamPut(chp, 't');
-          break;
-        default:
-          streamPut(chp, 'x');
-          print_hex8(chp, uart_buffer[i]);
-          break;
+        p = util_format_hex16(p, sp[i]);
+      }
+      *p++ = '\r';
+      *p++ = '\n';
+      streamWrite(chp, (const uint8_t *)line, p - line);
+      if( ++index >= cp->size )
+      {
+        index = 0;
       }
     }
+    return;
+  }
+
+  if( chunk > 0xff )
+  {
+    chunk = 0xff;
+  }
+
+  for( uint16_t offset = 0; offset < cp->set_count; offset += chunk )
+  {
+    uint16_t count = cp->set_count - offset;
+
+    n = mpipe_frame_adc_capture(fp, adc_block_sources[cp->dev].source, cp, offset, (count < chunk) ? count : chunk);
+    streamWrite(chp, fp->encoded, n);
   }
-  streamPut(chp, '\r');
-  streamPut(chp, '\n');
 }
 
-/* MARIONETTE -> PC */
-static void mpipe_serial_thread(void * p)
+/*! \brief write an adc.stats window summary
+ *
+ * ascii: M<label>:<window number><sets> then per channel
+ * <min><max><mean><rms><variance>, the last three in UTIL_STATS_FRAC_BITS
+ * fixed point.
+ */
+static void write_adc_stats(BaseSequentialStream *chp, mpipe_frame_t * fp, const adc_stats_record_t * rp)
 {
-	BaseSequentialStream * chp   = (BaseSequentialStream*)p;
-	chRegSetThreadName("mpipe_serial");
+  util_stats_summary_t summary;
+  size_t n;
 
-  // round robin all data sources
-  while(!chThdShouldTerminateX())
+  if( mpipe_format == MPIPE_FORMAT_ASCII )
   {
-    // FIXME this should be done through the fetch serial module
-    //print_serial_output(chp, &SD2, '2');
-    //print_serial_output(chp, &SD3, '3');
-    //print_serial_output(chp, &SD4, '4');
-    chThdSleepMilliseconds(1);
+    streamPut(chp, 'M');
+    streamPut(chp, adc_block_sources[rp->dev].label);
+    streamPut(chp, ':');
+    print_hex32(chp, rp->number);
+    print_hex32(chp, rp->acc.count);
+    for( uint8_t ch = 0; ch < rp->acc.channel_count; ch++ )
+    {
+      util_stats_summary(&rp->acc, ch, &summary);
+      print_hex16(chp, summary.min);
+      print_hex16(chp, summary.max);
+      print_hex32(chp, summary.mean);
+      print_hex32(chp, summary.rms);
+      print_hex32(chp, summary.variance);
+    }
+    streamPut(chp, '\r');
+    streamPut(chp, '\n');
+    return;
   }
-  chThdExit(MSG_OK);
+
+  n = mpipe_frame_adc_stats(fp, adc_block_sources[rp->dev].source, rp);
+  streamWrite(chp, fp->encoded, n);
 }
 
-/* MARIONETTE -> PC */
-static void mpipe_adc2_thread(void * p)
+/*! \brief transform an adc.fft acquisition and write its spectrum
+ *
+ * The samples are released once windowed into the scratch, so the callback
+ * fills the next acquisition while the transform and the write run.
+ * ascii: F<label>:SPEC<number><size><sample rate> followed by lines of
+ * F<label>:<first bin><up to 32 magnitudes>, or with peaks a single line
+ * P<label>:<number><size><sample rate> then <bin><magnitude> per peak.
+ * Magnitudes are in UTIL_FFT_MAG_FRAC_BITS fixed point.
+ * binary/delta: MPIPE_FRAME_ADC_SPECTRUM frames or one MPIPE_FRAME_ADC_PEAKS frame.
+ */
+static void write_adc_fft(BaseSequentialStream *chp, mpipe_frame_t * fp, const adc_fft_block_t * bp)
 {
-	BaseSequentialStream * chp   = (BaseSequentialStream*)p;
-	chRegSetThreadName("mpipe_adc2");
-  adc_sample_set_t *ssp;
-  msg_t msg;
+  adc_fft_block_t block = *bp;
+  char label = adc_block_sources[block.dev].label;
+  uint16_t bins = block.size / 2 + 1;
+  util_fft_peak_t peaks[UTIL_FFT_MAX_PEAKS];
+  uint8_t peak_count = 0;
+  float gain;
+  size_t n;
 
-  while(!chThdShouldTerminateX())
+  gain = util_fft_window(block.work, block.sample, block.size, block.window, 1 << (ADC_SAMPLE_BITS - 1));
+  fetch_adc_fft_release(block.dev);
+
+  util_fft_real(block.work, block.size);
+  util_fft_magnitude(block.work, block.size, gain, block.magnitude);
+  if( block.peaks > 0 )
+  {
+    peak_count = util_fft_peaks(block.magnitude, bins, peaks, block.peaks);
+  }
+
+  if( mpipe_format == MPIPE_FORMAT_ASCII )
   {
-    if( chMBFetch(&mpipe_adc2_mb, &msg, MS2ST(10)) == MSG_OK )
+    streamPut(chp, (block.peaks > 0) ? 'P' : 'F');
+    streamPut(chp, label);
+    streamPut(chp, ':');
+    if( block.peaks == 0 )
     {
-      chMtxLock(&mpipe_output_mutex);
-      ssp = (adc_sample_set_t*)msg;
-      streamPut(chp, 'A');
-      streamPut(chp, '2');
+      streamWrite(chp, (const uint8_t *)"SPEC", 4);
+    }
+    print_hex32(chp, block.number);
+    print_hex16(chp, block.size);
+    print_hex32(chp, block.sample_rate);
+    for( uint8_t i = 0; i < peak_count; i++ )
+    {
+      print_hex16(chp, peaks[i].bin);
+      print_hex16(chp, peaks[i].magnitude);
+    }
+    streamPut(chp, '\r');
+    streamPut(chp, '\n');
+    for( uint16_t bin = 0; block.peaks == 0 && bin < bins; )
+    {
+      streamPut(chp, 'F');
+      streamPut(chp, label);
       streamPut(chp, ':');
-      print_hex16(chp, ssp->sequence_number);
-      for( int i = 0; i < ADC_SAMPLE_SET_SIZE; i++ )
+      print_hex16(chp, bin);
+      for( uint8_t i = 0; i < 32 && bin < bins; i++, bin++ )
       {
-        print_hex16(chp, ssp->sample[i]);
+        print_hex16(chp, block.magnitude[bin]);
       }
       streamPut(chp, '\r');
       streamPut(chp, '\n');
-      chMtxUnlock(&mpipe_output_mutex);
-      fetch_adc_free_sample_set(ssp);
     }
+    return;
+  }
+
+  if( block.peaks > 0 )
+  {
+    n = mpipe_frame_adc_peaks(fp, adc_block_sources[block.dev].source, &block, peaks, peak_count);
+    streamWrite(chp, fp->encoded, n);
+    return;
+  }
+
+  for( uint16_t offset = 0; offset < bins; offset += MPIPE_FRAME_SPECTRUM_CHUNK )
+  {
+    uint16_t count = bins - offset;
+
+    if( count > MPIPE_FRAME_SPECTRUM_CHUNK )
+    {
+      count = MPIPE_FRAME_SPECTRUM_CHUNK;
+    }
+    n = mpipe_frame_adc_spectrum(fp, adc_block_sources[block.dev].source, &block, block.magnitude, offset, count);
+    streamWrite(chp, fp->encoded, n);
   }
-  chThdExit(MSG_OK);
 }
 
-/* MARIONETTE -> PC */
-static void mpipe_adc3_thread(void * p)
+/*! \brief write the next pending item of an adc device
+ *
+ * Capture windows, stats and spectra go before sample blocks. Ring blocks
+ * are read in place, dev 0 also carries the combined stream of the dual adc
+ * modes.
+ * \return false if the device had nothing to write
+ */
+static bool service_adc(BaseSequentialStream *chp, uint32_t dev_num, mailbox_t * mbp)
 {
-	BaseSequentialStream * chp   = (BaseSequentialStream*)p;
-	chRegSetThreadName("mpipe_adc3");
-  adc_sample_set_t *ssp;
+  mpipe_frame_t * fp = &mpipe_writer_frame;
+  adc_sample_block_t *bp;
+  const adc_capture_t * cp;
+  const adc_stats_record_t * rp;
+  const adc_fft_block_t * fbp;
   msg_t msg;
 
-  while(!chThdShouldTerminateX())
+  if( (cp = fetch_adc_capture_peek(dev_num)) != NULL )
+  {
+    write_adc_capture(chp, fp, cp);
+    fetch_adc_capture_release(dev_num);
+  }
+  else if( (rp = fetch_adc_stats_peek(dev_num)) != NULL )
+  {
+    write_adc_stats(chp, fp, rp);
+    fetch_adc_stats_release(dev_num);
+  }
+  // released by the writer before the transform
+  else if( (fbp = fetch_adc_fft_peek(dev_num)) != NULL )
+  {
+    write_adc_fft(chp, fp, fbp);
+  }
+  else if( (bp = fetch_adc_ring_peek(dev_num)) != NULL )
+  {
+    write_adc_block(chp, fp, bp);
+    fetch_adc_ring_release(dev_num);
+  }
+  else if( chMBFetch(mbp, &msg, TIME_IMMEDIATE) == MSG_OK )
+  {
+    bp = (adc_sample_block_t*)msg;
+    write_adc_block(chp, fp, bp);
+    fetch_adc_free_sample_block(bp);
+  }
+  else
   {
-    if( chMBFetch(&mpipe_adc3_mb, &msg, MS2ST(10)) == MSG_OK )
+    return false;
+  }
+  return true;
+}
+
+/*! \brief write received can frames in the currently selected format
+ *
+ * ascii: one C:<sequence><timestamp><id><time><filter><dlc><data> line per
+ * frame, with the id flags of MPIPE_FRAME_CAN_RX
+ * binary/delta: one MPIPE_FRAME_CAN_RX for the batch
+ */
+static void write_can_frames(BaseSequentialStream *chp, mpipe_frame_t * fp, fetch_can_rx_t * const * frames, uint8_t count)
+{
+  size_t n;
+
+  if( mpipe_format != MPIPE_FORMAT_ASCII )
+  {
+    n = mpipe_frame_can_rx(fp, frames, count);
+    streamWrite(chp, fp->encoded, n);
+    return;
+  }
+
+  for( uint8_t i = 0; i < count; i++ )
+  {
+    const CANRxFrame * rxp = &frames[i]->frame;
+    uint32_t id = (rxp->IDE == CAN_IDE_EXT) ? (rxp->EID | MPIPE_CAN_ID_EXT) : rxp->SID;
+
+    if( rxp->RTR == CAN_RTR_REMOTE )
     {
-      chMtxLock(&mpipe_output_mutex);
-      ssp = (adc_sample_set_t*)msg;
-      streamPut(chp, 'A');
-      streamPut(chp, '2');
-      streamPut(chp, ':');
-      print_hex16(chp, ssp->sequence_number);
-      for( int i = 0; i < ADC_SAMPLE_SET_SIZE; i++ )
+      id |= MPIPE_CAN_ID_RTR;
+    }
+    streamPut(chp, 'C');
+    streamPut(chp, ':');
+    print_hex32(chp, frames[i]->sequence);
+    print_hex32(chp, frames[i]->timestamp);
+    print_hex32(chp, id);
+    print_hex16(chp, rxp->TIME);
+    print_hex8(chp, rxp->FMI);
+    print_hex8(chp, rxp->DLC);
+    print_hex8_array(chp, rxp->data8, (rxp->DLC < 8) ? rxp->DLC : 8);
+    streamPut(chp, '\r');
+    streamPut(chp, '\n');
+  }
+}
+
+/*! \brief write the received can frames queued so far, up to a batch
+ */
+static bool service_can(BaseSequentialStream *chp)
+{
+  fetch_can_rx_t * frames[MPIPE_FRAME_CAN_BATCH];
+  uint8_t count = 0;
+  msg_t msg;
+
+  while( count < MPIPE_FRAME_CAN_BATCH && chMBFetch(&mpipe_can_mb, &msg, TIME_IMMEDIATE) == MSG_OK )
+  {
+    frames[count++] = (fetch_can_rx_t *)msg;
+  }
+  if( count == 0 )
+  {
+    return false;
+  }
+
+  write_can_frames(chp, &mpipe_writer_frame, frames, count);
+  for( uint8_t i = 0; i < count; i++ )
+  {
+    fetch_can_free_rx_frame(frames[i]);
+  }
+  return true;
+}
+
+/*! \brief write a captured serial chunk in the currently selected format
+ *
+ * ascii: S<dev>:<offset><timestamp><flags><data>, runs of printable bytes
+ * are written as they are, others escaped as \\ \0 \n \r \t or \xHH
+ * binary/delta: MPIPE_FRAME_SERIAL_DATA
+ */
+static void write_serial_chunk(BaseSequentialStream *chp, mpipe_frame_t * fp, uint32_t dev, uint32_t offset,
+                               uint8_t flags, uint32_t timestamp, const uint8_t * data, size_t n)
+{
+  size_t i = 0;
+
+  if( mpipe_format != MPIPE_FORMAT_ASCII )
+  {
+    n = mpipe_frame_serial_data(fp, (mpipe_source_t)(MPIPE_SOURCE_SERIAL + dev), offset, flags, timestamp, data, n);
+    streamWrite(chp, fp->encoded, n);
+    return;
+  }
+
+  streamPut(chp, 'S');
+  streamPut(chp, '0' + dev);
+  streamPut(chp, ':');
+  print_hex32(chp, offset);
+  print_hex32(chp, timestamp);
+  print_hex8(chp, flags);
+  while( i < n )
+  {
+    size_t run = i;
+
+    while( run < n && isprint(data[run]) && data[run] != '\\' )
+    {
+      run++;
+    }
+    if( run > i )
+    {
+      streamWrite(chp, &data[i], run - i);
+      i = run;
+      continue;
+    }
+
+    streamPut(chp, '\\');
+    switch( data[i] )
+    {
+      case '\\':
+        streamPut(chp, '\\');
+        break;
+      case '\0':
+        streamPut(chp, '0');
+        break;
+      case '\n':
+        streamPut(chp, 'n');
+        break;
+      case '\r':
+        streamPut(chp, 'r');
+        break;
+      case '\t':
+        streamPut(chp, 't');
+        break;
+      default:
+        streamPut(chp, 'x');
+        print_hex8(chp, data[i]);
+        break;
+    }
+    i++;
+  }
+  streamPut(chp, '\r');
+  streamPut(chp, '\n');
+}
+
+static uint8_t serial_line_flags(eventflags_t flags)
+{
+  return ((flags & SD_OVERRUN_ERROR) ? MPIPE_SERIAL_FLAG_OVERRUN : 0) |
+         ((flags & SD_FRAMING_ERROR) ? MPIPE_SERIAL_FLAG_FRAMING : 0) |
+         ((flags & SD_PARITY_ERROR) ? MPIPE_SERIAL_FLAG_PARITY : 0) |
+         ((flags & SD_NOISE_ERROR) ? MPIPE_SERIAL_FLAG_NOISE : 0) |
+         ((flags & SD_BREAK_DETECTED) ? MPIPE_SERIAL_FLAG_BREAK : 0);
+}
+
+/*! \brief collect the captured serial input, write a finished chunk
+ *
+ * Every call moves what the drivers have queued into the chunks, so their
+ * small input queues are emptied in bulk whenever the writer comes by. A
+ * chunk is finished when it reaches the capture chunk size or has not grown
+ * for idle_us, the line errors seen meanwhile go with it.
+ * \return false if no chunk was finished
+ */
+static bool service_serial(BaseSequentialStream *chp)
+{
+  uint32_t now = util_timebase_now();
+  fetch_serial_capture_t * cp;
+  uint32_t ready = FETCH_SERIAL_DEV_COUNT;
+  uint8_t flags;
+
+  for( uint32_t i = 0; i < FETCH_SERIAL_DEV_COUNT; i++ )
+  {
+    uint32_t dev = (serial_next + i) % FETCH_SERIAL_DEV_COUNT;
+    SerialDriver * sdp = fetch_serial_capture_driver(dev, &cp);
+    size_t n;
+
+    if( sdp == NULL )
+    {
+      serial_chunks[dev].length = 0;
+      continue;
+    }
+    if( serial_chunks[dev].session != cp->session )
+    {
+      serial_chunks[dev].session = cp->session;
+      serial_chunks[dev].length = 0;
+      chEvtGetAndClearFlags(&serial_chunks[dev].listener);
+    }
+
+    n = sdAsynchronousRead(sdp, &serial_chunks[dev].data[serial_chunks[dev].length], cp->chunk - serial_chunks[dev].length);
+    if( n > 0 )
+    {
+      if( serial_chunks[dev].length == 0 )
       {
-        print_hex16(chp, ssp->sample[i]);
+        serial_chunks[dev].timestamp = now;
       }
-      streamPut(chp, '\r');
-      streamPut(chp, '\n');
-      chMtxUnlock(&mpipe_output_mutex);
-      fetch_adc_free_sample_set(ssp);
+      serial_chunks[dev].length += n;
+      serial_chunks[dev].last = now;
+    }
+
+    if( ready == FETCH_SERIAL_DEV_COUNT && serial_chunks[dev].length > 0 &&
+        (serial_chunks[dev].length >= cp->chunk || now - serial_chunks[dev].last >= cp->idle_us) )
+    {
+      ready = dev;
     }
   }
-  chThdExit(MSG_OK);
+
+  if( ready == FETCH_SERIAL_DEV_COUNT )
+  {
+    return false;
+  }
+
+  fetch_serial_capture_driver(ready, &cp);
+  flags = serial_line_flags(chEvtGetAndClearFlags(&serial_chunks[ready].listener));
+  if( flags != 0 )
+  {
+    cp->errors++;
+  }
+  if( serial_chunks[ready].length < cp->chunk )
+  {
+    flags |= MPIPE_SERIAL_FLAG_IDLE;
+  }
+
+  write_serial_chunk(chp, &mpipe_writer_frame, ready, cp->bytes, flags, serial_chunks[ready].timestamp,
+                     serial_chunks[ready].data, serial_chunks[ready].length);
+  cp->bytes += serial_chunks[ready].length;
+  cp->chunks++;
+  serial_chunks[ready].length = 0;
+  serial_next = ready + 1;
+
+  return true;
 }
 
-/* MARIONETTE -> PC */
-static void mpipe_can_thread(void * p)
+/*! \brief events and timeout the idle writer waits for
+ *
+ * A device with a chunk in progress does not wake the writer for every new
+ * byte, the writer comes back before the driver queue can fill up or when
+ * the chunk will have been idle long enough. A device without one wakes it
+ * with its first byte, which is what the chunk timestamp is taken from.
+ */
+static systime_t serial_wait(eventmask_t * events)
+{
+  uint32_t now = util_timebase_now();
+  systime_t timeout = MPIPE_WRITER_POLL_TIME;
+  fetch_serial_capture_t * cp;
+
+  *events = ALL_EVENTS;
+
+  // out of credit nothing is read until the next grant
+  if( mpipe_flow_policy != MPIPE_FLOW_NONE && mpipe_flow_credit <= 0 )
+  {
+    return timeout;
+  }
+
+  for( uint32_t dev = 0; dev < FETCH_SERIAL_DEV_COUNT; dev++ )
+  {
+    uint32_t idle = now - serial_chunks[dev].last;
+    uint32_t wait_us;
+    systime_t ticks;
+
+    if( serial_chunks[dev].length == 0 || fetch_serial_capture_driver(dev, &cp) == NULL )
+    {
+      continue;
+    }
+    *events &= ~MPIPE_SERIAL_EVENT(dev);
+
+    // half the driver queue, ten bit times per byte
+    wait_us = (SERIAL_BUFFERS_SIZE / 2) * 10 * (UTIL_TIMEBASE_FREQ / 1000) / (fetch_serial_speed(dev) / 1000 + 1);
+    if( idle >= cp->idle_us )
+    {
+      wait_us = 0;
+    }
+    else if( cp->idle_us - idle < wait_us )
+    {
+      wait_us = cp->idle_us - idle;
+    }
+
+    ticks = (wait_us < 100000) ? US2ST(wait_us) : MPIPE_WRITER_POLL_TIME;
+    if( ticks == 0 )
+    {
+      ticks = 1;
+    }
+    if( ticks < timeout )
+    {
+      timeout = ticks;
+    }
+  }
+
+  return timeout;
+}
+
+/*! \brief write part of a dumped file in the currently selected format
+ *
+ * ascii: F:<dump><offset><flags><data>, data as hex bytes
+ * binary/delta: MPIPE_FRAME_FILE_DATA
+ */
+static void write_file_data(BaseSequentialStream *chp, mpipe_frame_t * fp, uint8_t dump, uint32_t offset,
+                            uint8_t flags, const uint8_t * data, size_t n)
+{
+  if( mpipe_format != MPIPE_FORMAT_ASCII )
+  {
+    n = mpipe_frame_file_data(fp, dump, offset, flags, data, n);
+    streamWrite(chp, fp->encoded, n);
+    return;
+  }
+
+  streamPut(chp, 'F');
+  streamPut(chp, ':');
+  print_hex8(chp, dump);
+  print_hex32(chp, offset);
+  print_hex8(chp, flags);
+  print_hex8_array(chp, data, n);
+  streamPut(chp, '\r');
+  streamPut(chp, '\n');
+}
+
+/*! \brief write the next MPIPE_FRAME_FILE_CHUNK bytes of the sd.dump buffers
+ *
+ * A buffer goes back to sd.dump once all of it has been written.
+ */
+static bool service_file(BaseSequentialStream *chp)
+{
+  fetch_sd_dump_chunk_t * cp = file_out.chunk;
+  uint8_t flags = 0;
+  size_t n;
+  msg_t msg;
+
+  if( cp == NULL )
+  {
+    if( chMBFetch(&mpipe_file_mb, &msg, TIME_IMMEDIATE) != MSG_OK )
+    {
+      return false;
+    }
+    cp = file_out.chunk = (fetch_sd_dump_chunk_t *)msg;
+    file_out.sent = 0;
+  }
+
+  n = cp->length - file_out.sent;
+  if( n > MPIPE_FRAME_FILE_CHUNK )
+  {
+    n = MPIPE_FRAME_FILE_CHUNK;
+  }
+  if( cp->last && file_out.sent + n == cp->length )
+  {
+    flags = MPIPE_FILE_FLAG_LAST | (cp->error ? MPIPE_FILE_FLAG_ERROR : 0);
+  }
+
+  write_file_data(chp, &mpipe_writer_frame, cp->dump, cp->offset + file_out.sent, flags, cp->data + file_out.sent, n);
+  file_out.sent += n;
+
+  if( file_out.sent == cp->length )
+  {
+    file_out.chunk = NULL;
+    fetch_sd_dump_free(cp);
+  }
+  return true;
+}
+
+/*! \brief hand the sd.dump buffers back unsent, the writer is stopping
+ */
+static void release_file(void)
 {
-	BaseSequentialStream * chp   = (BaseSequentialStream*)p;
-	chRegSetThreadName("mpipe_can");
   msg_t msg;
 
+  if( file_out.chunk != NULL )
+  {
+    fetch_sd_dump_free(file_out.chunk);
+    file_out.chunk = NULL;
+  }
+  while( chMBFetch(&mpipe_file_mb, &msg, TIME_IMMEDIATE) == MSG_OK )
+  {
+    fetch_sd_dump_free((fetch_sd_dump_chunk_t *)msg);
+  }
+}
+
+static bool service_producer(BaseSequentialStream *chp, mpipe_producer_t producer)
+{
+  switch( producer )
+  {
+    case MPIPE_PRODUCER_ADC0:
+      return service_adc(chp, MPIPE_ADC3_DEV, &mpipe_adc3_mb);
+    case MPIPE_PRODUCER_ADC1:
+      return service_adc(chp, MPIPE_ADC2_DEV, &mpipe_adc2_mb);
+    case MPIPE_PRODUCER_CAN:
+      return service_can(chp);
+    case MPIPE_PRODUCER_SERIAL:
+      return service_serial(chp);
+    case MPIPE_PRODUCER_FILE:
+      return service_file(chp);
+    default:
+      return false;
+  }
+}
+
+/* MARIONETTE -> PC
+ *
+ * Single writer for all producers. Each round every producer gets its
+ * weight in bytes added to its deficit and writes items until the deficit
+ * is used up or it runs dry, so under load the output is shared in
+ * proportion to the weights. An item is never split, an oversized one is
+ * paid back in the following rounds. When no producer has anything left
+ * the packet buffer is flushed and the thread sleeps until signalled or a
+ * serial chunk is due.
+ */
+static void mpipe_writer_thread(void * p)
+{
+  BaseSequentialStream * chp = (BaseSequentialStream *)&mpipe_out;
+	chRegSetThreadName("mpipe_writer");
+
+  mpipe_out.vmt = &mpipe_out_vmt;
+  mpipe_out.channel = (BaseChannel *)p;
+  mpipe_out.length = 0;
+
+  for( uint32_t i = 0; i < FETCH_SERIAL_DEV_COUNT; i++ )
+  {
+    chEvtRegisterMaskWithFlags(chnGetEventSource(fetch_serial_driver(i)), &serial_chunks[i].listener,
+                               MPIPE_SERIAL_EVENT(i), CHN_INPUT_AVAILABLE);
+  }
+
   while(!chThdShouldTerminateX())
   {
-    if( chMBFetch(&mpipe_can_mb, &msg, MS2ST(10)) == MSG_OK )
+    bool busy = false;
+
+    // out of credit everything waits for the next grant
+    for( uint32_t i = 0; i < MPIPE_PRODUCER_COUNT && (mpipe_flow_policy == MPIPE_FLOW_NONE || mpipe_flow_credit > 0); i++ )
+    {
+      mpipe_share_t * sp = &mpipe_shares[i];
+
+      sp->deficit += sp->weight;
+      while( sp->deficit > 0 && (mpipe_flow_policy == MPIPE_FLOW_NONE || mpipe_flow_credit > 0) )
+      {
+        uint32_t total = mpipe_out.total;
+
+        if( !service_producer(chp, (mpipe_producer_t)i) )
+        {
+          // an idle producer does not save up
+          sp->deficit = 0;
+          break;
+        }
+        sp->deficit -= mpipe_out.total - total;
+        busy = true;
+      }
+    }
+
+    if( !busy )
     {
-      chMtxLock(&mpipe_output_mutex);
-      //rxfp = (CANRxFrame*)msg;
-      // FIXME TODO
-      //
-      chMtxUnlock(&mpipe_output_mutex);
-      //fetch_can_free_rx_frame(rxfp);
+      eventmask_t events;
+      systime_t timeout = serial_wait(&events);
+
+      mpipe_out_flush(&mpipe_out);
+      chEvtWaitAnyTimeout(events, timeout);
     }
   }
+  mpipe_out_flush(&mpipe_out);
+  release_file();
+
+  for( uint32_t i = 0; i < FETCH_SERIAL_DEV_COUNT; i++ )
+  {
+    chEvtUnregister(chnGetEventSource(fetch_serial_driver(i)), &serial_chunks[i].listener);
+  }
   chThdExit(MSG_OK);
 }
 
+/*! \brief read the hex count of a K<count> credit line up to its end
+ * \return false unless the line held 1 to 8 hex digits
+ */
+static bool read_credit_line(BaseSequentialStream * chp, uint32_t * count)
+{
+  uint32_t value = 0;
+  uint8_t digits = 0;
+  uint8_t nibble;
+  bool valid = true;
+  char c;
+
+  for( c = streamGet(chp); !IS_EOL(c); c = streamGet(chp) )
+  {
+    if( !parse_hex(c, &nibble) || ++digits > 8 )
+    {
+      valid = false;
+    }
+    else
+    {
+      value = (value << 4) | nibble;
+    }
+  }
+  *count = value;
+
+  return valid && digits > 0;
+}
+
+/*! \brief receive the encoded frame following a 'D' and queue its samples
+ *
+ * The frame is read up to its delimiter, oversized frames are skipped.
+ */
+static void read_dac_frame(BaseSequentialStream * chp)
+{
+  uint8_t * raw = mpipe_input_frame;
+  size_t n = 0;
+  uint8_t c;
+  bool valid = true;
+
+  while( (c = streamGet(chp)) != MPIPE_FRAME_DELIMITER )
+  {
+    if( n < sizeof(mpipe_input_frame) )
+    {
+      raw[n++] = c;
+    }
+    else
+    {
+      valid = false;
+    }
+  }
+
+  if( valid )
+  {
+    n = mpipe_cobs_decode(raw, n, raw);
+  }
+  if( !valid || !mpipe_frame_check(raw, n) || raw[0] != MPIPE_SOURCE_DAC || raw[1] != MPIPE_FRAME_DAC_BLOCK )
+  {
+    mpipe_input_errors++;
+    return;
+  }
+
+  fetch_dac_stream_push(raw[2] | (raw[3] << 8) | (raw[4] << 16) | ((uint32_t)raw[5] << 24),
+                        &raw[MPIPE_FRAME_HEADER_SIZE], n - MPIPE_FRAME_HEADER_SIZE - MPIPE_FRAME_CRC_SIZE);
+}
+
 /* PC -> MARIONETTE */
 static void mpipe_input_thread(void * p)
 {
 	BaseSequentialStream * chp   = (BaseSequentialStream*)p;
 	chRegSetThreadName("mpipe_in");
+  uint32_t count;
   
   // process command char
   while(!chThdShouldTerminateX())
@@ -290,7 +1230,15 @@ static void mpipe_input_thread(void * p)
       case '\r': // ignore blank lines or extra newlines
       case '\n':
         break;
-      //case 'D': // dac
+      case 'K': // K<hex count>, the host can take count more bytes
+        if( read_credit_line(chp, &count) )
+        {
+          mpipe_grant_credit(count);
+        }
+        break;
+      case 'D': // D<encoded MPIPE_FRAME_DAC_BLOCK><delimiter>
+        read_dac_frame(chp);
+        break;
       //case 'S': // serial
       //case 'C': // can
       default:
@@ -304,21 +1252,9 @@ static void mpipe_input_thread(void * p)
 void mpipe_start(const mpipe_config_t * cfg)
 {
   // start/restart io threads
-  if( mpipe_adc2_tp == NULL || chThdTerminatedX(mpipe_adc2_tp))
-  {
-    mpipe_adc2_tp = chThdCreateStatic(mpipe_adc2_wa, sizeof(mpipe_adc2_wa), NORMALPRIO, mpipe_adc2_thread, (void*)cfg->channel);
-  }
-  if( mpipe_adc3_tp == NULL || chThdTerminatedX(mpipe_adc3_tp))
+  if( mpipe_writer_tp == NULL || chThdTerminatedX(mpipe_writer_tp))
   {
-    mpipe_adc3_tp = chThdCreateStatic(mpipe_adc3_wa, sizeof(mpipe_adc3_wa), NORMALPRIO, mpipe_adc3_thread, (void*)cfg->channel);
-  }
-  if( mpipe_serial_tp == NULL || chThdTerminatedX(mpipe_serial_tp))
-  {
-    mpipe_serial_tp = chThdCreateStatic(mpipe_serial_wa, sizeof(mpipe_serial_wa), NORMALPRIO, mpipe_serial_thread, (void*)cfg->channel);
-  }
-  if( mpipe_can_tp == NULL || chThdTerminatedX(mpipe_can_tp))
-  {
-    mpipe_can_tp = chThdCreateStatic(mpipe_can_wa, sizeof(mpipe_can_wa), NORMALPRIO, mpipe_can_thread, (void*)cfg->channel);
+    mpipe_writer_tp = chThdCreateStatic(mpipe_writer_wa, sizeof(mpipe_writer_wa), NORMALPRIO, mpipe_writer_thread, (void*)cfg->channel);
   }
   if( mpipe_input_tp == NULL || chThdTerminatedX(mpipe_input_tp))
   {
@@ -336,41 +1272,211 @@ void mpipe_stop(void)
     mpipe_input_tp = NULL;
   }
 
-  if( mpipe_adc2_tp )
+  if( mpipe_writer_tp )
+  {
+    thread_t * tp = mpipe_writer_tp;
+
+    mpipe_writer_tp = NULL;
+    chThdTerminate(tp);
+    chEvtSignal(tp, ALL_EVENTS);
+    chThdWait(tp);
+  }
+}
+
+/*! \brief wake the writer, a producer has queued output
+ *
+ * Called from the producer interrupts, the writer runs once the interrupt
+ * has returned.
+ */
+void mpipe_signal_from_isr(mpipe_producer_t producer)
+{
+  chSysLockFromISR();
+  if( mpipe_writer_tp != NULL )
+  {
+    chEvtSignalI(mpipe_writer_tp, MPIPE_EVENT(producer));
+  }
+  chSysUnlockFromISR();
+}
+
+/*! \brief wake the writer from a producer thread
+ */
+void mpipe_signal(mpipe_producer_t producer)
+{
+  chSysLock();
+  if( mpipe_writer_tp != NULL )
+  {
+    chEvtSignalI(mpipe_writer_tp, MPIPE_EVENT(producer));
+    chSchRescheduleS();
+  }
+  chSysUnlock();
+}
+
+/*! \brief bytes a producer may write per writer round
+ *
+ * Sets the share of the output each producer gets while all of them have
+ * data queued, a producer with less data only uses what it needs.
+ */
+void mpipe_set_weight(mpipe_producer_t producer, uint16_t weight)
+{
+  if( producer < MPIPE_PRODUCER_COUNT )
+  {
+    mpipe_shares[producer].weight = (weight == 0) ? 1 : weight;
+  }
+}
+
+uint16_t mpipe_get_weight(mpipe_producer_t producer)
+{
+  return (producer < MPIPE_PRODUCER_COUNT) ? mpipe_shares[producer].weight : 0;
+}
+
+/*! \brief add credit granted by the host and wake the writer
+ */
+void mpipe_grant_credit(uint32_t bytes)
+{
+  int64_t credit;
+
+  chSysLock();
+  credit = (int64_t)mpipe_flow_credit + bytes;
+  mpipe_flow_credit = (credit > INT32_MAX) ? INT32_MAX : credit;
+  if( mpipe_writer_tp != NULL )
+  {
+    chEvtSignalI(mpipe_writer_tp, ALL_EVENTS);
+    chSchRescheduleS();
+  }
+  chSysUnlock();
+}
+
+uint32_t mpipe_get_input_errors(void)
+{
+  return mpipe_input_errors;
+}
+
+int32_t mpipe_get_credit(void)
+{
+  return mpipe_flow_credit;
+}
+
+/*! \brief select how producers react to a host that runs short of credit
+ *
+ * Enabling flow control starts without credit, nothing is sent until the
+ * first K line. arg is the factor of MPIPE_FLOW_DECIMATE and the budget in
+ * queued blocks of MPIPE_FLOW_BUFFER.
+ */
+void mpipe_set_flow(mpipe_flow_t policy, uint16_t arg)
+{
+  chSysLock();
+  mpipe_flow_policy = policy;
+  mpipe_flow_arg = (arg == 0) ? 1 : arg;
+  mpipe_flow_credit = 0;
+  memset(mpipe_flow_skip, 0, sizeof(mpipe_flow_skip));
+  chSysUnlock();
+}
+
+mpipe_flow_t mpipe_get_flow(void)
+{
+  return mpipe_flow_policy;
+}
+
+uint16_t mpipe_get_flow_arg(void)
+{
+  return mpipe_flow_arg;
+}
+
+/*! \brief may a producer queue another block
+ *
+ * Called from the producer interrupt with the number of blocks it already
+ * has queued. Below MPIPE_FLOW_LOW_WATER credit the policy applies, out of
+ * credit only MPIPE_FLOW_BUFFER keeps queueing, up to its budget. Sets not
+ * admitted are skipped on purpose, they are counted as paused rather than
+ * dropped.
+ */
+bool mpipe_flow_admit(mpipe_producer_t producer, uint32_t queued)
+{
+  int32_t credit = mpipe_flow_credit;
+
+  if( mpipe_flow_policy == MPIPE_FLOW_NONE || credit >= MPIPE_FLOW_LOW_WATER )
+  {
+    mpipe_flow_skip[producer] = 0;
+    return true;
+  }
+
+  switch( mpipe_flow_policy )
   {
-    chThdTerminate(mpipe_adc2_tp);
-    chThdWait(mpipe_adc2_tp);
-    mpipe_adc2_tp = NULL;
+    case MPIPE_FLOW_DECIMATE:
+      if( credit <= 0 )
+      {
+        return false;
+      }
+      if( mpipe_flow_skip[producer] == 0 )
+      {
+        mpipe_flow_skip[producer] = mpipe_flow_arg - 1;
+        return true;
+      }
+      mpipe_flow_skip[producer]--;
+      return false;
+    case MPIPE_FLOW_BUFFER:
+      return queued < mpipe_flow_arg;
+    case MPIPE_FLOW_PAUSE:
+    default:
+      return false;
   }
+}
 
-  if( mpipe_adc3_tp )
+void mpipe_reset_weights(void)
+{
+  for( uint32_t i = 0; i < MPIPE_PRODUCER_COUNT; i++ )
   {
-    chThdTerminate(mpipe_adc3_tp);
-    chThdWait(mpipe_adc3_tp);
-    mpipe_adc3_tp = NULL;
+    mpipe_shares[i].weight = MPIPE_DEFAULT_WEIGHT;
   }
+}
 
-  if( mpipe_serial_tp )
+void mpipe_set_format(mpipe_format_t format)
+{
+  // start every delta stream on a keyframe
+  for( uint32_t i = 0; i < NELEMS(adc_block_delta); i++ )
   {
-    chThdTerminate(mpipe_serial_tp);
-    chThdWait(mpipe_serial_tp);
-    mpipe_serial_tp = NULL;
+    adc_block_delta[i].blocks = 0;
   }
+  mpipe_format = format;
+}
 
-  if( mpipe_can_tp )
+/*! \brief clear the health counters of all streams
+ */
+void mpipe_stream_stats_reset(void)
+{
+  chSysLock();
+  memset(mpipe_stream_stats, 0, sizeof(mpipe_stream_stats));
+  for( uint32_t i = 0; i < NELEMS(adc_block_gap); i++ )
   {
-    chThdTerminate(mpipe_can_tp);
-    chThdWait(mpipe_can_tp);
-    mpipe_can_tp = NULL;
+    adc_block_gap[i].dropped = 0;
   }
+  chSysUnlock();
+}
+
+mpipe_format_t mpipe_get_format(void)
+{
+  return mpipe_format;
+}
+
+/*! \brief number of delta frames per keyframe, 1 sends only keyframes
+ */
+void mpipe_set_keyframe_interval(uint16_t interval)
+{
+  mpipe_keyframe_interval = (interval == 0) ? 1 : interval;
+}
+
+uint16_t mpipe_get_keyframe_interval(void)
+{
+  return mpipe_keyframe_interval;
 }
 
 void mpipe_init(void)
 {
-  chMtxObjectInit(&mpipe_output_mutex);
+  mpipe_reset_weights();
 
   chMBObjectInit(&mpipe_adc2_mb, mpipe_adc2_mb_buffer, MPIPE_ADC_MB_SIZE);
   chMBObjectInit(&mpipe_adc3_mb, mpipe_adc3_mb_buffer, MPIPE_ADC_MB_SIZE);
   chMBObjectInit(&mpipe_can_mb, mpipe_can_mb_buffer, MPIPE_CAN_MB_SIZE);
+  chMBObjectInit(&mpipe_file_mb, mpipe_file_mb_buffer, FETCH_SD_DUMP_BUFFERS);
 }
 
@@ -0,0 +1,560 @@
+/*! \file mpipe_frame.c
+ *
+ * Binary framing for the mpipe stream
+ *
+ * \sa mpipe.c
+ * @defgroup mpipe_frame MPipe Frame
+ * @{
+ */
+
+#include <string.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "mpipe_frame.h"
+
+/*! \brief CRC-16/CCITT-FALSE table, poly 0x1021
+ */
+static const uint16_t crc16_table[256] = {
+  0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+  0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+  0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+  0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+  0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+  0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+  0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+  0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+  0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+  0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+  0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+  0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+  0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+  0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+  0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+  0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+  0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+  0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+  0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+  0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+  0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+  0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+  0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+  0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+  0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+  0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+  0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+  0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+  0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+  0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+  0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+  0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0
+};
+
+uint16_t mpipe_crc16(uint16_t crc, const uint8_t * data, size_t n)
+{
+  while( n-- )
+  {
+    crc = (crc << 8) ^ crc16_table[((crc >> 8) ^ *data++) & 0xff];
+  }
+  return crc;
+}
+
+/*! \brief COBS encode n bytes of src into dst
+ *
+ * dst must hold at least n + n/254 + 1 bytes. No delimiter is appended.
+ * \return number of bytes written to dst
+ */
+size_t mpipe_cobs_encode(const uint8_t * src, size_t n, uint8_t * dst)
+{
+  uint8_t * code_ptr = dst;
+  uint8_t * out = dst + 1;
+  uint8_t code = 1;
+
+  while( n-- )
+  {
+    if( *src == 0 )
+    {
+      *code_ptr = code;
+      code_ptr = out++;
+      code = 1;
+    }
+    else
+    {
+      *out++ = *src;
+      if( ++code == 0xff )
+      {
+        *code_ptr = code;
+        code_ptr = out++;
+        code = 1;
+      }
+    }
+    src++;
+  }
+  *code_ptr = code;
+
+  return out - dst;
+}
+
+/*! \brief COBS decode n bytes of src into dst, without the delimiter
+ *
+ * dst may be src, the output never runs ahead of the input.
+ * \return number of bytes written to dst, 0 if src is not valid COBS
+ */
+size_t mpipe_cobs_decode(const uint8_t * src, size_t n, uint8_t * dst)
+{
+  const uint8_t * end = src + n;
+  uint8_t * out = dst;
+
+  while( src < end )
+  {
+    uint8_t code = *src++;
+
+    if( code == 0 || code - 1 > end - src )
+    {
+      return 0;
+    }
+    for( uint8_t i = 1; i < code; i++ )
+    {
+      *out++ = *src++;
+    }
+    if( code < 0xff && src < end )
+    {
+      *out++ = 0;
+    }
+  }
+
+  return out - dst;
+}
+
+/*! \brief check length and crc of a decoded frame
+ */
+bool mpipe_frame_check(const uint8_t * raw, size_t n)
+{
+  uint16_t crc;
+
+  if( n < MPIPE_FRAME_HEADER_SIZE + MPIPE_FRAME_CRC_SIZE )
+  {
+    return false;
+  }
+  crc = mpipe_crc16(0xffff, raw, n - MPIPE_FRAME_CRC_SIZE);
+
+  return raw[n - 2] == (crc & 0xff) && raw[n - 1] == (crc >> 8);
+}
+
+void mpipe_frame_begin(mpipe_frame_t * fp, mpipe_source_t source, mpipe_frame_type_t type, uint32_t sequence)
+{
+  fp->raw[0] = source;
+  fp->raw[1] = type;
+  fp->raw[2] = sequence;
+  fp->raw[3] = sequence >> 8;
+  fp->raw[4] = sequence >> 16;
+  fp->raw[5] = sequence >> 24;
+  fp->length = MPIPE_FRAME_HEADER_SIZE;
+}
+
+bool mpipe_frame_put(mpipe_frame_t * fp, const void * data, size_t n)
+{
+  if( fp->length + n > MPIPE_FRAME_MAX_SIZE - MPIPE_FRAME_CRC_SIZE )
+  {
+    return false;
+  }
+  memcpy(&fp->raw[fp->length], data, n);
+  fp->length += n;
+  return true;
+}
+
+/*! \brief append the crc and encode the frame
+ * \return number of encoded bytes including the delimiter
+ */
+size_t mpipe_frame_finish(mpipe_frame_t * fp)
+{
+  uint16_t crc = mpipe_crc16(0xffff, fp->raw, fp->length);
+  size_t n;
+
+  fp->raw[fp->length++] = crc;
+  fp->raw[fp->length++] = crc >> 8;
+
+  n = mpipe_cobs_encode(fp->raw, fp->length, fp->encoded);
+  fp->encoded[n++] = MPIPE_FRAME_DELIMITER;
+
+  return n;
+}
+
+static inline uint8_t * put_uint16(uint8_t * out, uint16_t value)
+{
+  *out++ = value;
+  *out++ = value >> 8;
+  return out;
+}
+
+static inline uint8_t * put_uint32(uint8_t * out, uint32_t value)
+{
+  *out++ = value;
+  *out++ = value >> 8;
+  *out++ = value >> 16;
+  *out++ = value >> 24;
+  return out;
+}
+
+/*! \brief build an encoded frame from an adc sample block
+ *
+ * Raw 12 bit samples are packed two to three bytes, an odd trailing sample
+ * takes two bytes. Wider (decimated) samples are sent as uint16.
+ * \return number of encoded bytes including the delimiter
+ */
+size_t mpipe_frame_adc_block(mpipe_frame_t * fp, mpipe_source_t source, uint32_t sequence, const adc_sample_block_t * bp)
+{
+  const adcsample_t * sp = bp->sample;
+  size_t count = bp->set_count * bp->channel_count;
+  uint8_t * out;
+
+  mpipe_frame_begin(fp, source, MPIPE_FRAME_ADC_BLOCK, sequence);
+
+  out = &fp->raw[fp->length];
+  *out++ = bp->channel_count;
+  *out++ = bp->set_count;
+  *out++ = (bp->bits > 12) ? 16 : 12;
+  out = put_uint32(out, bp->timestamp);
+
+  if( bp->bits > 12 )
+  {
+    for( ; count > 0; count--, sp++ )
+    {
+      *out++ = *sp;
+      *out++ = *sp >> 8;
+    }
+    fp->length = out - fp->raw;
+    return mpipe_frame_finish(fp);
+  }
+
+  for( ; count >= 2; count -= 2, sp += 2 )
+  {
+    *out++ = sp[0];
+    *out++ = ((sp[0] >> 8) & 0x0f) | (sp[1] << 4);
+    *out++ = sp[1] >> 4;
+  }
+  if( count )
+  {
+    *out++ = sp[0];
+    *out++ = (sp[0] >> 8) & 0x0f;
+  }
+
+  fp->length = out - fp->raw;
+
+  return mpipe_frame_finish(fp);
+}
+
+static inline uint8_t * put_varint(uint8_t * out, uint32_t value)
+{
+  while( value >= 0x80 )
+  {
+    *out++ = value | 0x80;
+    value >>= 7;
+  }
+  *out++ = value;
+  return out;
+}
+
+/*! \brief build an encoded delta compressed frame from an adc sample block
+ *
+ * A keyframe is sent every keyframe_interval frames, when the block layout
+ * changes or after mpipe_delta_t.blocks was cleared.
+ * \return number of encoded bytes including the delimiter
+ */
+size_t mpipe_frame_adc_delta(mpipe_frame_t * fp, mpipe_source_t source, uint32_t sequence, const adc_sample_block_t * bp,
+                             mpipe_delta_t * dp, uint16_t keyframe_interval)
+{
+  const adcsample_t * sp = bp->sample;
+  uint8_t channels = bp->channel_count;
+  bool keyframe;
+  uint8_t * out;
+
+  if( channels > MPIPE_DELTA_MAX_CHANNELS )
+  {
+    return mpipe_frame_adc_block(fp, source, sequence, bp);
+  }
+
+  keyframe = dp->blocks == 0 || dp->blocks >= keyframe_interval
+             || dp->channel_count != channels || dp->bits != bp->bits;
+
+  if( keyframe )
+  {
+    memset(dp->last, 0, sizeof(dp->last));
+    dp->channel_count = channels;
+    dp->bits = bp->bits;
+    dp->blocks = 0;
+  }
+
+  mpipe_frame_begin(fp, source, MPIPE_FRAME_ADC_DELTA, sequence);
+
+  out = &fp->raw[fp->length];
+  *out++ = channels;
+  *out++ = bp->set_count;
+  *out++ = bp->bits;
+  *out++ = keyframe ? MPIPE_DELTA_FLAG_KEYFRAME : 0;
+  out = put_uint32(out, bp->timestamp);
+
+  for( uint16_t set = 0; set < bp->set_count; set++ )
+  {
+    for( uint8_t ch = 0; ch < channels; ch++, sp++ )
+    {
+      int32_t delta = (int32_t)*sp - dp->last[ch];
+      dp->last[ch] = *sp;
+      out = put_varint(out, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+    }
+  }
+
+  dp->blocks++;
+  fp->length = out - fp->raw;
+
+  return mpipe_frame_finish(fp);
+}
+
+/*! \brief build an encoded frame from part of a capture window
+ *
+ * Sets offset ... offset + set_count - 1 of the window, the caller keeps
+ * set_count * channel_count within ADC_SAMPLE_BLOCK_SIZE.
+ * \return number of encoded bytes including the delimiter
+ */
+size_t mpipe_frame_adc_capture(mpipe_frame_t * fp, mpipe_source_t source, const adc_capture_t * cp,
+                               uint16_t offset, uint8_t set_count)
+{
+  uint8_t channels = cp->channel_count;
+  uint16_t index = (cp->start + offset) % cp->size;
+  uint16_t pending = 0;
+  bool odd = false;
+  uint8_t * out;
+
+  mpipe_frame_begin(fp, source, MPIPE_FRAME_ADC_CAPTURE, cp->number);
+
+  out = &fp->raw[fp->length];
+  *out++ = channels;
+  *out++ = 12;
+  *out++ = cp->set_count;
+  *out++ = cp->set_count >> 8;
+  *out++ = cp->pre;
+  *out++ = cp->pre >> 8;
+  *out++ = offset;
+  *out++ = offset >> 8;
+  *out++ = set_count;
+  out = put_uint32(out, cp->timestamp);
+
+  // the window may wrap inside a sample pair, so pack sample by sample
+  for( uint8_t set = 0; set < set_count; set++ )
+  {
+    const adcsample_t * sp = &cp->sample[index * channels];
+
+    for( uint8_t ch = 0; ch < channels; ch++ )
+    {
+      if( !odd )
+      {
+        pending = sp[ch];
+      }
+      else
+      {
+        *out++ = pending;
+        *out++ = ((pending >> 8) & 0x0f) | (sp[ch] << 4);
+        *out++ = sp[ch] >> 4;
+      }
+      odd = !odd;
+    }
+    if( ++index >= cp->size )
+    {
+      index = 0;
+    }
+  }
+  if( odd )
+  {
+    *out++ = pending;
+    *out++ = (pending >> 8) & 0x0f;
+  }
+
+  fp->length = out - fp->raw;
+
+  return mpipe_frame_finish(fp);
+}
+
+/*! \brief build an encoded frame from an adc.stats window
+ * \return number of encoded bytes including the delimiter
+ */
+size_t mpipe_frame_adc_stats(mpipe_frame_t * fp, mpipe_source_t source, const adc_stats_record_t * rp)
+{
+  util_stats_summary_t summary;
+  uint8_t * out;
+
+  mpipe_frame_begin(fp, source, MPIPE_FRAME_ADC_STATS, rp->number);
+
+  out = &fp->raw[fp->length];
+  *out++ = rp->acc.channel_count;
+  *out++ = UTIL_STATS_FRAC_BITS;
+  out = put_uint32(out, rp->acc.count);
+
+  for( uint8_t ch = 0; ch < rp->acc.channel_count; ch++ )
+  {
+    util_stats_summary(&rp->acc, ch, &summary);
+    out = put_uint16(out, summary.min);
+    out = put_uint16(out, summary.max);
+    out = put_uint32(out, summary.mean);
+    out = put_uint32(out, summary.rms);
+    out = put_uint32(out, summary.variance);
+  }
+
+  fp->length = out - fp->raw;
+
+  return mpipe_frame_finish(fp);
+}
+
+static uint8_t * put_spectrum_header(uint8_t * out, const adc_fft_block_t * bp)
+{
+  *out++ = bp->channel;
+  *out++ = bp->window;
+  out = put_uint16(out, bp->size);
+  out = put_uint32(out, bp->sample_rate);
+  *out++ = UTIL_FFT_MAG_FRAC_BITS;
+  return out;
+}
+
+/*! \brief build an encoded frame from bins offset ... offset + bin_count - 1
+ * of an adc.fft spectrum, bin_count up to MPIPE_FRAME_SPECTRUM_CHUNK
+ * \return number of encoded bytes including the delimiter
+ */
+size_t mpipe_frame_adc_spectrum(mpipe_frame_t * fp, mpipe_source_t source, const adc_fft_block_t * bp,
+                                const uint16_t * magnitude, uint16_t offset, uint8_t bin_count)
+{
+  uint8_t * out;
+
+  mpipe_frame_begin(fp, source, MPIPE_FRAME_ADC_SPECTRUM, bp->number);
+
+  out = put_spectrum_header(&fp->raw[fp->length], bp);
+  out = put_uint16(out, offset);
+  *out++ = bin_count;
+  for( uint16_t i = 0; i < bin_count; i++ )
+  {
+    out = put_uint16(out, magnitude[offset + i]);
+  }
+
+  fp->length = out - fp->raw;
+
+  return mpipe_frame_finish(fp);
+}
+
+/*! \brief build an encoded frame from the peaks of an adc.fft spectrum
+ * \return number of encoded bytes including the delimiter
+ */
+size_t mpipe_frame_adc_peaks(mpipe_frame_t * fp, mpipe_source_t source, const adc_fft_block_t * bp,
+                             const util_fft_peak_t * peaks, uint8_t peak_count)
+{
+  uint8_t * out;
+
+  mpipe_frame_begin(fp, source, MPIPE_FRAME_ADC_PEAKS, bp->number);
+
+  out = put_spectrum_header(&fp->raw[fp->length], bp);
+  *out++ = peak_count;
+  for( uint8_t i = 0; i < peak_count; i++ )
+  {
+    out = put_uint16(out, peaks[i].bin);
+    out = put_uint16(out, peaks[i].magnitude);
+  }
+
+  fp->length = out - fp->raw;
+
+  return mpipe_frame_finish(fp);
+}
+
+/*! \brief build an encoded gap marker
+ * \return number of encoded bytes including the delimiter
+ */
+size_t mpipe_frame_gap(mpipe_frame_t * fp, mpipe_source_t source, uint32_t first, uint32_t set_count, uint32_t dropped)
+{
+  uint8_t * out;
+
+  mpipe_frame_begin(fp, source, MPIPE_FRAME_GAP, first);
+
+  out = &fp->raw[fp->length];
+  out = put_uint32(out, set_count);
+  out = put_uint32(out, dropped);
+
+  fp->length = out - fp->raw;
+
+  return mpipe_frame_finish(fp);
+}
+
+/*! \brief build an encoded frame from a chunk of captured uart bytes
+ */
+size_t mpipe_frame_serial_data(mpipe_frame_t * fp, mpipe_source_t source, uint32_t offset, uint8_t flags,
+                               uint32_t timestamp, const uint8_t * data, size_t n)
+{
+  uint8_t * out;
+
+  mpipe_frame_begin(fp, source, MPIPE_FRAME_SERIAL_DATA, offset);
+
+  out = &fp->raw[fp->length];
+  *out++ = flags;
+  out = put_uint32(out, timestamp);
+
+  fp->length = out - fp->raw;
+  mpipe_frame_put(fp, data, n);
+
+  return mpipe_frame_finish(fp);
+}
+
+/*! \brief build an encoded frame from up to MPIPE_FRAME_CAN_BATCH received can frames
+ */
+size_t mpipe_frame_can_rx(mpipe_frame_t * fp, fetch_can_rx_t * const * frames, uint8_t count)
+{
+  uint8_t * out;
+
+  if( count > MPIPE_FRAME_CAN_BATCH )
+  {
+    count = MPIPE_FRAME_CAN_BATCH;
+  }
+
+  mpipe_frame_begin(fp, MPIPE_SOURCE_CAN, MPIPE_FRAME_CAN_RX, (count > 0) ? frames[0]->sequence : 0);
+
+  out = &fp->raw[fp->length];
+  *out++ = count;
+  for( uint8_t i = 0; i < count; i++ )
+  {
+    const CANRxFrame * rxp = &frames[i]->frame;
+    uint32_t id = (rxp->IDE == CAN_IDE_EXT) ? (rxp->EID | MPIPE_CAN_ID_EXT) : rxp->SID;
+
+    if( rxp->RTR == CAN_RTR_REMOTE )
+    {
+      id |= MPIPE_CAN_ID_RTR;
+    }
+    out = put_uint32(out, frames[i]->sequence);
+    out = put_uint32(out, frames[i]->timestamp);
+    out = put_uint32(out, id);
+    out = put_uint16(out, rxp->TIME);
+    *out++ = rxp->FMI;
+    *out++ = rxp->DLC;
+    memcpy(out, rxp->data8, 8);
+    out += 8;
+  }
+
+  fp->length = out - fp->raw;
+
+  return mpipe_frame_finish(fp);
+}
+
+/*! \brief build an encoded frame from up to MPIPE_FRAME_FILE_CHUNK bytes of a dumped file
+ */
+size_t mpipe_frame_file_data(mpipe_frame_t * fp, uint8_t dump, uint32_t offset, uint8_t flags,
+                             const uint8_t * data, size_t n)
+{
+  if( n > MPIPE_FRAME_FILE_CHUNK )
+  {
+    n = MPIPE_FRAME_FILE_CHUNK;
+  }
+
+  mpipe_frame_begin(fp, MPIPE_SOURCE_FILE, MPIPE_FRAME_FILE_DATA, offset);
+
+  fp->raw[fp->length++] = dump;
+  fp->raw[fp->length++] = flags;
+  mpipe_frame_put(fp, data, n);
+
+  return mpipe_frame_finish(fp);
+}
+
+/*! @} */
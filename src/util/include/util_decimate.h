@@ -0,0 +1,79 @@
+/*! \file util_decimate.h
+ *
+ * Decimation filters for interleaved multi channel sample streams
+ *
+ * @addtogroup util_decimate
+ * @{
+ */
+
+#ifndef UTIL_DECIMATE_H_
+#define UTIL_DECIMATE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef UTIL_DECIMATE_MAX_CHANNELS
+#define UTIL_DECIMATE_MAX_CHANNELS 7
+#endif
+
+// fir length, even so the taps can be processed in pairs
+#ifndef UTIL_DECIMATE_FIR_TAPS
+#define UTIL_DECIMATE_FIR_TAPS 64
+#endif
+
+#define UTIL_DECIMATE_CIC_ORDER   3
+
+#define UTIL_DECIMATE_MAX_FACTOR      256
+#define UTIL_DECIMATE_CIC_MAX_FACTOR  64
+#define UTIL_DECIMATE_FIR_MAX_FACTOR  16
+
+// resolution of the filtered output
+#define UTIL_DECIMATE_OUTPUT_BITS 16
+
+typedef enum {
+  UTIL_DECIMATE_NONE,
+  UTIL_DECIMATE_BOXCAR,
+  UTIL_DECIMATE_CIC,
+  UTIL_DECIMATE_FIR
+} util_decimate_filter_t;
+
+typedef struct {
+  util_decimate_filter_t filter;
+  uint16_t factor;
+  uint16_t phase;               // inputs since the last output
+  uint8_t channel_count;
+  uint8_t input_bits;
+  int8_t shift;                 // output scaling for boxcar/cic
+
+  uint32_t sum[UTIL_DECIMATE_MAX_CHANNELS];
+  uint32_t integrator[UTIL_DECIMATE_MAX_CHANNELS][UTIL_DECIMATE_CIC_ORDER];
+  uint32_t comb[UTIL_DECIMATE_MAX_CHANNELS][UTIL_DECIMATE_CIC_ORDER];
+
+  // each input is stored twice so the last taps samples are always contiguous
+  int16_t history[UTIL_DECIMATE_MAX_CHANNELS][2 * UTIL_DECIMATE_FIR_TAPS];
+  uint16_t history_pos;
+  int16_t coeff[UTIL_DECIMATE_FIR_TAPS];
+} util_decimate_t;
+
+bool util_decimate_init(util_decimate_t * dp, util_decimate_filter_t filter, uint16_t factor, uint8_t channel_count, uint8_t input_bits);
+
+/*! \brief number of output sets the next n input sets will produce */
+static inline size_t util_decimate_count(const util_decimate_t * dp, size_t n)
+{
+  return (dp->phase + n) / dp->factor;
+}
+
+size_t util_decimate_process(util_decimate_t * dp, const uint16_t * in, size_t n, uint16_t * out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+//! @}
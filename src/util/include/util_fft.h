@@ -0,0 +1,52 @@
+/*! \file util_fft.h
+ *
+ * Real FFT and spectrum helpers on the Cortex-M4 FPU
+ *
+ * @addtogroup util_fft
+ * @{
+ */
+
+#ifndef UTIL_FFT_H_
+#define UTIL_FFT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define UTIL_FFT_MIN_SIZE   256
+#define UTIL_FFT_MAX_SIZE   4096
+
+#define UTIL_FFT_MAX_PEAKS  16
+
+// fractional bits of the uint16 magnitudes
+#define UTIL_FFT_MAG_FRAC_BITS 4
+
+typedef enum {
+  UTIL_FFT_WINDOW_NONE,
+  UTIL_FFT_WINDOW_HANN,
+  UTIL_FFT_WINDOW_HAMMING,
+  UTIL_FFT_WINDOW_BLACKMAN
+} util_fft_window_t;
+
+typedef struct {
+  uint16_t bin;
+  uint16_t magnitude;
+} util_fft_peak_t;
+
+bool util_fft_size_valid(uint32_t n);
+float util_fft_window(float * out, const uint16_t * in, uint16_t n, util_fft_window_t window, uint16_t offset);
+void util_fft_real(float * data, uint16_t n);
+void util_fft_magnitude(const float * spectrum, uint16_t n, float gain, uint16_t * out);
+uint8_t util_fft_peaks(const uint16_t * magnitude, uint16_t bins, util_fft_peak_t * peaks, uint8_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+//! @}
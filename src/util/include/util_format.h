@@ -0,0 +1,53 @@
+/*! \file util_format.h
+ *
+ * Integer to text formatting into a caller buffer
+ *
+ * @addtogroup util_format
+ * @{
+ */
+
+#ifndef UTIL_FORMAT_H_
+#define UTIL_FORMAT_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// longest output of each formatter, nothing is 0 terminated
+#define UTIL_FORMAT_UINT32_MAX  10
+#define UTIL_FORMAT_INT32_MAX   11
+
+extern const char util_format_hex_digits[16];
+
+char * util_format_uint32(char * out, uint32_t value);
+char * util_format_int32(char * out, int32_t value);
+
+/*! \brief two upper case hex digits, returns the end of the output */
+static inline char * util_format_hex8(char * out, uint8_t value)
+{
+  out[0] = util_format_hex_digits[value >> 4];
+  out[1] = util_format_hex_digits[value & 0xf];
+  return out + 2;
+}
+
+static inline char * util_format_hex16(char * out, uint16_t value)
+{
+  out = util_format_hex8(out, value >> 8);
+  return util_format_hex8(out, value & 0xff);
+}
+
+static inline char * util_format_hex32(char * out, uint32_t value)
+{
+  out = util_format_hex16(out, value >> 16);
+  return util_format_hex16(out, value & 0xffff);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+//! @}
@@ -30,6 +30,7 @@ extern "C" {
 
 void util_message_begin( BaseSequentialStream * chp);
 void util_message_end( BaseSequentialStream * chp, bool success);
+void util_message_flush( BaseSequentialStream * chp);
 
 void util_message_debug( BaseSequentialStream * chp, char * file, int line, const char * func, char * fmt, ...);
 void util_message_info( BaseSequentialStream * chp, char * fmt, ...);
@@ -0,0 +1,92 @@
+/*! \file util_spsc.h
+  * \defgroup util_spsc Single Producer Single Consumer Ring
+  *
+  * Lock free ring indices for one producer (typically an ISR) and one
+  * consumer thread. The ring only manages the indices, the caller owns an
+  * array of size slots and reads/writes the slots in place.
+  *
+  * head is only written by the producer and tail only by the consumer.
+  * Both run freely and wrap at 2^32, so size must be a power of two.
+  * @{
+  */
+#ifndef UTIL_SPSC_H_
+#define UTIL_SPSC_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  volatile uint32_t head;
+  volatile uint32_t tail;
+  uint32_t mask;
+} util_spsc_t;
+
+static inline void util_spsc_init(util_spsc_t * rp, uint32_t size)
+{
+  rp->head = 0;
+  rp->tail = 0;
+  rp->mask = size - 1;
+}
+
+static inline uint32_t util_spsc_count(const util_spsc_t * rp)
+{
+  return rp->head - rp->tail;
+}
+
+/* producer side */
+
+static inline bool util_spsc_full(const util_spsc_t * rp)
+{
+  return (rp->head - rp->tail) > rp->mask;
+}
+
+/*! \brief index of the slot to fill, only valid when not full */
+static inline uint32_t util_spsc_write_index(const util_spsc_t * rp)
+{
+  return rp->head & rp->mask;
+}
+
+/*! \brief publish the filled slot to the consumer */
+static inline void util_spsc_commit(util_spsc_t * rp)
+{
+  // slot contents must be visible before the new head
+  __DMB();
+  rp->head = rp->head + 1;
+}
+
+/* consumer side */
+
+static inline bool util_spsc_empty(const util_spsc_t * rp)
+{
+  return rp->head == rp->tail;
+}
+
+/*! \brief index of the oldest slot, only valid when not empty */
+static inline uint32_t util_spsc_read_index(const util_spsc_t * rp)
+{
+  // slot reads must not be hoisted above the head check
+  __DMB();
+  return rp->tail & rp->mask;
+}
+
+/*! \brief hand the oldest slot back to the producer */
+static inline void util_spsc_release(util_spsc_t * rp)
+{
+  // finish reading the slot before the producer can reuse it
+  __DMB();
+  rp->tail = rp->tail + 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+//! @}
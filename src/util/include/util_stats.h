@@ -0,0 +1,67 @@
+/*! \file util_stats.h
+ *
+ * Running statistics for interleaved multi channel sample streams
+ *
+ * Samples are up to 12 bits, which keeps the fixed point variance within
+ * 32 bits.
+ *
+ * @addtogroup util_stats
+ * @{
+ */
+
+#ifndef UTIL_STATS_H_
+#define UTIL_STATS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef UTIL_STATS_MAX_CHANNELS
+#define UTIL_STATS_MAX_CHANNELS 7
+#endif
+
+// fractional bits of the fixed point summary values
+#define UTIL_STATS_FRAC_BITS 8
+
+// sets per summary, bounds the 32 bit sums and the 64 bit variance terms
+#define UTIL_STATS_MAX_COUNT 65536
+
+typedef struct {
+  uint16_t min;
+  uint16_t max;
+  uint32_t sum;
+  uint64_t sum_sq;
+} util_stats_acc_t;
+
+typedef struct {
+  uint8_t channel_count;
+  uint32_t count;                 // sets accumulated
+  util_stats_acc_t acc[UTIL_STATS_MAX_CHANNELS];
+} util_stats_t;
+
+/*! \brief summary of one channel, mean, rms and variance are unsigned
+ * fixed point with UTIL_STATS_FRAC_BITS fractional bits
+ */
+typedef struct {
+  uint16_t min;
+  uint16_t max;
+  uint32_t mean;
+  uint32_t rms;
+  uint32_t variance;
+} util_stats_summary_t;
+
+void util_stats_init(util_stats_t * sp, uint8_t channel_count);
+void util_stats_add(util_stats_t * sp, const uint16_t * in, size_t n);
+void util_stats_summary(const util_stats_t * sp, uint8_t channel, util_stats_summary_t * out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+//! @}
@@ -0,0 +1,42 @@
+/*! \file util_timebase.h
+ *
+ * Firmware wide free running 32 bit microsecond timebase
+ *
+ * @addtogroup util_timebase
+ * @{
+ */
+
+#ifndef UTIL_TIMEBASE_H_
+#define UTIL_TIMEBASE_H_
+
+#include <stdint.h>
+
+#include "hal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// needs a 32 bit timer, TIM2 and TIM3 pace the adc devices
+#ifndef UTIL_TIMEBASE_GPTD
+#define UTIL_TIMEBASE_GPTD  GPTD5
+#endif
+
+// ticks per second, wraps after about 71 minutes
+#define UTIL_TIMEBASE_FREQ  1000000
+
+void util_timebase_init(void);
+
+/*! \brief current timebase count, safe to call from any context */
+static inline uint32_t util_timebase_now(void)
+{
+  return UTIL_TIMEBASE_GPTD.tim->CNT;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+//! @}
@@ -0,0 +1,249 @@
+/*! \file util_decimate.c
+ *
+ * Decimation filters for interleaved multi channel sample streams
+ *
+ * Input is unsigned samples of input_bits resolution stored set after set,
+ * channel_count samples per set. Every factor input sets produce one output
+ * set of UTIL_DECIMATE_OUTPUT_BITS unsigned samples on the same full scale,
+ * the extra bits come from averaging.
+ *
+ * boxcar: mean of factor samples
+ * cic:    third order CIC, factor must be a power of two
+ * fir:    windowed sinc low pass at 0.45 of the output rate, Q15, two
+ *         taps per cycle with the Cortex-M4 SMLAD instruction
+ *
+ * @defgroup util_decimate Decimation Filters
+ * @{
+ */
+
+#include "ch.h"
+#include "hal.h"
+
+#include <string.h>
+#include <math.h>
+
+#include "util_general.h"
+#include "util_decimate.h"
+
+static uint8_t log2_exact(uint32_t value)
+{
+  uint8_t n = 0;
+
+  while( value > 1 )
+  {
+    value >>= 1;
+    n++;
+  }
+  return n;
+}
+
+/*! \brief windowed sinc low pass coefficients in Q15 with unity dc gain
+ */
+static void fir_design(int16_t * coeff, uint16_t factor)
+{
+  float h[UTIL_DECIMATE_FIR_TAPS];
+  float fc = 0.45f / factor;   // cutoff in cycles per input sample
+  float center = (UTIL_DECIMATE_FIR_TAPS - 1) / 2.0f;
+  float sum = 0.0f;
+  int32_t total = 0;
+
+  for( int k = 0; k < UTIL_DECIMATE_FIR_TAPS; k++ )
+  {
+    float t = k - center;
+    float window = 0.54f - 0.46f * cosf(2.0f * (float)M_PI * k / (UTIL_DECIMATE_FIR_TAPS - 1));
+    float x = 2.0f * (float)M_PI * fc * t;
+
+    h[k] = 2.0f * fc * ((x == 0.0f) ? 1.0f : sinf(x) / x) * window;
+    sum += h[k];
+  }
+
+  for( int k = 0; k < UTIL_DECIMATE_FIR_TAPS; k++ )
+  {
+    coeff[k] = (int16_t)lrintf(h[k] / sum * 32767.0f);
+    total += coeff[k];
+  }
+
+  // put the rounding error on the center taps so the dc gain is exact
+  coeff[UTIL_DECIMATE_FIR_TAPS / 2] += 32767 - total;
+}
+
+/*! \brief configure a decimator and clear its state
+ * \return false if the factor is not supported by the filter
+ */
+bool util_decimate_init(util_decimate_t * dp, util_decimate_filter_t filter, uint16_t factor, uint8_t channel_count, uint8_t input_bits)
+{
+  if( channel_count == 0 || channel_count > UTIL_DECIMATE_MAX_CHANNELS || input_bits > UTIL_DECIMATE_OUTPUT_BITS )
+  {
+    return false;
+  }
+
+  switch( filter )
+  {
+    case UTIL_DECIMATE_NONE:
+      factor = 1;
+      break;
+    case UTIL_DECIMATE_BOXCAR:
+      if( factor < 2 || factor > UTIL_DECIMATE_MAX_FACTOR )
+      {
+        return false;
+      }
+      break;
+    case UTIL_DECIMATE_CIC:
+      if( factor < 2 || factor > UTIL_DECIMATE_CIC_MAX_FACTOR || (factor & (factor - 1)) != 0 )
+      {
+        return false;
+      }
+      break;
+    case UTIL_DECIMATE_FIR:
+      if( factor < 2 || factor > UTIL_DECIMATE_FIR_MAX_FACTOR )
+      {
+        return false;
+      }
+      fir_design(dp->coeff, factor);
+      break;
+    default:
+      return false;
+  }
+
+  dp->filter = filter;
+  dp->factor = factor;
+  dp->phase = 0;
+  dp->channel_count = channel_count;
+  dp->input_bits = input_bits;
+
+  // cic gain is factor^order, bring it to the output scale
+  dp->shift = UTIL_DECIMATE_CIC_ORDER * log2_exact(factor) - (UTIL_DECIMATE_OUTPUT_BITS - input_bits);
+
+  memset(dp->sum, 0, sizeof(dp->sum));
+  memset(dp->integrator, 0, sizeof(dp->integrator));
+  memset(dp->comb, 0, sizeof(dp->comb));
+  memset(dp->history, 0, sizeof(dp->history));
+  dp->history_pos = 0;
+
+  return true;
+}
+
+static inline int32_t load_q15x2(const int16_t * p)
+{
+  int32_t v;
+  // the history window is not always word aligned
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint16_t fir_output(const util_decimate_t * dp, const int16_t * window)
+{
+  const int16_t * cp = dp->coeff;
+  int32_t acc = 0;
+
+  for( int k = 0; k < UTIL_DECIMATE_FIR_TAPS; k += 2 )
+  {
+    acc = __SMLAD(load_q15x2(&window[k]), load_q15x2(&cp[k]), acc);
+  }
+
+  return (uint16_t)(__SSAT(acc >> 15, 16) + 32768);
+}
+
+/*! \brief filter n input sets
+ *
+ * out may be NULL to only advance the filter state, e.g. when there is no
+ * buffer to put the result in.
+ * \return number of output sets
+ */
+size_t util_decimate_process(util_decimate_t * dp, const uint16_t * in, size_t n, uint16_t * out)
+{
+  uint8_t channels = dp->channel_count;
+  uint8_t extra_bits = UTIL_DECIMATE_OUTPUT_BITS - dp->input_bits;
+  uint16_t midscale = 1 << (dp->input_bits - 1);
+  size_t count = 0;
+
+  for( size_t set = 0; set < n; set++, in += channels )
+  {
+    bool emit = ++dp->phase >= dp->factor;
+    uint16_t pos = dp->history_pos;
+
+    if( emit )
+    {
+      dp->phase = 0;
+      count++;
+    }
+
+    for( uint8_t ch = 0; ch < channels; ch++ )
+    {
+      switch( dp->filter )
+      {
+        case UTIL_DECIMATE_BOXCAR:
+          dp->sum[ch] += in[ch];
+          if( emit )
+          {
+            if( out != NULL )
+            {
+              *out++ = (dp->sum[ch] << extra_bits) / dp->factor;
+            }
+            dp->sum[ch] = 0;
+          }
+          break;
+
+        case UTIL_DECIMATE_CIC:
+        {
+          // wraps modulo 2^32, exact as long as the output fits the register
+          uint32_t * ip = dp->integrator[ch];
+          uint32_t * cp = dp->comb[ch];
+
+          ip[0] += in[ch];
+          ip[1] += ip[0];
+          ip[2] += ip[1];
+
+          if( emit )
+          {
+            uint32_t y = ip[2];
+            for( int stage = 0; stage < UTIL_DECIMATE_CIC_ORDER; stage++ )
+            {
+              uint32_t delayed = cp[stage];
+              cp[stage] = y;
+              y -= delayed;
+            }
+            if( out != NULL )
+            {
+              *out++ = (dp->shift >= 0) ? (y >> dp->shift) : (y << -dp->shift);
+            }
+          }
+          break;
+        }
+
+        case UTIL_DECIMATE_FIR:
+        {
+          int16_t x = (int16_t)((in[ch] - midscale) << (15 - (dp->input_bits - 1)));
+
+          dp->history[ch][pos] = x;
+          dp->history[ch][pos + UTIL_DECIMATE_FIR_TAPS] = x;
+
+          if( emit && out != NULL )
+          {
+            // oldest ... newest sample
+            *out++ = fir_output(dp, &dp->history[ch][pos + 1]);
+          }
+          break;
+        }
+
+        case UTIL_DECIMATE_NONE:
+        default:
+          if( out != NULL )
+          {
+            *out++ = in[ch] << extra_bits;
+          }
+          break;
+      }
+    }
+
+    if( ++pos >= UTIL_DECIMATE_FIR_TAPS )
+    {
+      pos = 0;
+    }
+    dp->history_pos = pos;
+  }
+
+  return count;
+}
+
+//! @}
@@ -0,0 +1,266 @@
+/*! \file util_fft.c
+ *
+ * Real FFT and spectrum helpers on the Cortex-M4 FPU
+ *
+ * util_fft_real() transforms n real samples in place with an n/2 point
+ * complex radix-2 FFT of the even/odd samples and one split pass. The
+ * output is packed like CMSIS-DSP arm_rfft_fast_f32: data[0] is bin 0,
+ * data[1] is bin n/2 (both real), then re/im pairs of bins 1 ... n/2-1.
+ *
+ * All twiddle and window factors come from one quarter wave sine table of
+ * the largest size, smaller sizes step through it.
+ *
+ * @defgroup util_fft FFT
+ * @{
+ */
+
+#include <math.h>
+
+#include "util_fft.h"
+
+#define QUARTER (UTIL_FFT_MAX_SIZE / 4)
+
+static float sin_table[QUARTER + 1];
+static bool sin_table_ready = false;
+
+static void sin_table_init(void)
+{
+  for( uint32_t i = 0; i <= QUARTER; i++ )
+  {
+    sin_table[i] = sinf(2.0f * (float)M_PI * i / UTIL_FFT_MAX_SIZE);
+  }
+  sin_table_ready = true;
+}
+
+/*! \brief sin(2 pi i / UTIL_FFT_MAX_SIZE) */
+static float sin_index(uint32_t i)
+{
+  i &= UTIL_FFT_MAX_SIZE - 1;
+
+  if( i <= QUARTER )
+  {
+    return sin_table[i];
+  }
+  if( i <= 2 * QUARTER )
+  {
+    return sin_table[2 * QUARTER - i];
+  }
+  if( i <= 3 * QUARTER )
+  {
+    return -sin_table[i - 2 * QUARTER];
+  }
+  return -sin_table[UTIL_FFT_MAX_SIZE - i];
+}
+
+static float cos_index(uint32_t i)
+{
+  return sin_index(i + QUARTER);
+}
+
+bool util_fft_size_valid(uint32_t n)
+{
+  return n >= UTIL_FFT_MIN_SIZE && n <= UTIL_FFT_MAX_SIZE && (n & (n - 1)) == 0;
+}
+
+/*! \brief convert n samples to float around offset and apply a window
+ * \return sum of the window coefficients, the coherent gain times n
+ */
+float util_fft_window(float * out, const uint16_t * in, uint16_t n, util_fft_window_t window, uint16_t offset)
+{
+  uint32_t step = UTIL_FFT_MAX_SIZE / n;
+  float sum = 0.0f;
+
+  if( !sin_table_ready )
+  {
+    sin_table_init();
+  }
+
+  for( uint32_t i = 0; i < n; i++ )
+  {
+    float w;
+
+    switch( window )
+    {
+      case UTIL_FFT_WINDOW_HANN:
+        w = 0.5f - 0.5f * cos_index(i * step);
+        break;
+      case UTIL_FFT_WINDOW_HAMMING:
+        w = 0.54f - 0.46f * cos_index(i * step);
+        break;
+      case UTIL_FFT_WINDOW_BLACKMAN:
+        w = 0.42f - 0.5f * cos_index(i * step) + 0.08f * cos_index(2 * i * step);
+        break;
+      case UTIL_FFT_WINDOW_NONE:
+      default:
+        w = 1.0f;
+        break;
+    }
+    out[i] = w * ((float)in[i] - offset);
+    sum += w;
+  }
+  return sum;
+}
+
+/*! \brief in place radix-2 complex FFT of m points, data holds re/im pairs
+ */
+static void fft_complex(float * data, uint16_t m, uint32_t step)
+{
+  // bit reversal permutation
+  for( uint32_t i = 1, j = 0; i < m; i++ )
+  {
+    uint32_t bit = m >> 1;
+
+    for( ; j & bit; bit >>= 1 )
+    {
+      j ^= bit;
+    }
+    j ^= bit;
+
+    if( i < j )
+    {
+      float tr = data[2 * i];
+      float ti = data[2 * i + 1];
+      data[2 * i] = data[2 * j];
+      data[2 * i + 1] = data[2 * j + 1];
+      data[2 * j] = tr;
+      data[2 * j + 1] = ti;
+    }
+  }
+
+  for( uint32_t len = 2; len <= m; len <<= 1 )
+  {
+    uint32_t half = len >> 1;
+    // twiddle exp(-2 pi i k / len) in table steps
+    uint32_t tstep = step * (m / len);
+
+    for( uint32_t k = 0; k < half; k++ )
+    {
+      float wr = cos_index(k * tstep);
+      float wi = -sin_index(k * tstep);
+
+      for( uint32_t i = k; i < m; i += len )
+      {
+        float * a = &data[2 * i];
+        float * b = &data[2 * (i + half)];
+        float tr = wr * b[0] - wi * b[1];
+        float ti = wr * b[1] + wi * b[0];
+
+        b[0] = a[0] - tr;
+        b[1] = a[1] - ti;
+        a[0] += tr;
+        a[1] += ti;
+      }
+    }
+  }
+}
+
+/*! \brief in place real FFT of n points, n must pass util_fft_size_valid()
+ */
+void util_fft_real(float * data, uint16_t n)
+{
+  uint16_t m = n / 2;
+  uint32_t step = UTIL_FFT_MAX_SIZE / n;
+  float r0;
+  float i0;
+
+  if( !sin_table_ready )
+  {
+    sin_table_init();
+  }
+
+  // even samples are the real, odd samples the imaginary parts
+  fft_complex(data, m, 2 * step);
+
+  r0 = data[0];
+  i0 = data[1];
+  data[0] = r0 + i0;
+  data[1] = r0 - i0;
+
+  // X[k] = E + W^k O and X[m-k] = conj(E - W^k O)
+  for( uint32_t k = 1; k <= m / 2; k++ )
+  {
+    float * a = &data[2 * k];
+    float * b = &data[2 * (m - k)];
+    float er = 0.5f * (a[0] + b[0]);
+    float ei = 0.5f * (a[1] - b[1]);
+    float or_ = 0.5f * (a[1] + b[1]);
+    float oi = -0.5f * (a[0] - b[0]);
+    float c = cos_index(k * step);
+    float s = sin_index(k * step);
+    float tr = c * or_ + s * oi;
+    float ti = c * oi - s * or_;
+
+    a[0] = er + tr;
+    a[1] = ei + ti;
+    if( k != m - k )
+    {
+      b[0] = er - tr;
+      b[1] = -(ei - ti);
+    }
+  }
+}
+
+/*! \brief amplitude of bins 0 ... n/2 as unsigned fixed point
+ *
+ * gain is the window sum returned by util_fft_window(), so a sine of
+ * amplitude A reads A at its bin. out holds n / 2 + 1 values.
+ */
+void util_fft_magnitude(const float * spectrum, uint16_t n, float gain, uint16_t * out)
+{
+  float scale = (float)(1 << UTIL_FFT_MAG_FRAC_BITS) / gain;
+  float nyquist = fabsf(spectrum[1]) * scale;
+  uint16_t m = n / 2;
+
+  for( uint32_t k = 0; k < m; k++ )
+  {
+    float mag;
+
+    if( k == 0 )
+    {
+      mag = fabsf(spectrum[0]) * scale;
+    }
+    else
+    {
+      float re = spectrum[2 * k];
+      float im = spectrum[2 * k + 1];
+      mag = 2.0f * sqrtf(re * re + im * im) * scale;
+    }
+    out[k] = (mag > 65535.0f) ? 65535 : (uint16_t)(mag + 0.5f);
+  }
+  out[m] = (nyquist > 65535.0f) ? 65535 : (uint16_t)(nyquist + 0.5f);
+}
+
+/*! \brief largest local maxima of a magnitude spectrum, strongest first
+ * \return number of peaks found, at most count
+ */
+uint8_t util_fft_peaks(const uint16_t * magnitude, uint16_t bins, util_fft_peak_t * peaks, uint8_t count)
+{
+  uint8_t found = 0;
+
+  for( uint32_t k = 1; k + 1 < bins; k++ )
+  {
+    uint16_t mag = magnitude[k];
+    int32_t pos;
+
+    if( mag == 0 || mag <= magnitude[k - 1] || mag < magnitude[k + 1] )
+    {
+      continue;
+    }
+    if( found == count && mag <= peaks[found - 1].magnitude )
+    {
+      continue;
+    }
+
+    // insertion into the sorted list, dropping the weakest when full
+    pos = (found < count) ? found++ : found - 1;
+    for( ; pos > 0 && peaks[pos - 1].magnitude < mag; pos-- )
+    {
+      peaks[pos] = peaks[pos - 1];
+    }
+    peaks[pos].bin = k;
+    peaks[pos].magnitude = mag;
+  }
+  return found;
+}
+
+//! @}
@@ -0,0 +1,93 @@
+/*! \file util_format.c
+ *
+ * Integer to text formatting into a caller buffer
+ *
+ * chprintf parses its format and emits through the stream one character
+ * at a time. These write straight into memory: decimal two digits per
+ * division from a digit pair table, hex one nibble per table lookup. They
+ * use no ChibiOS headers, so the host benchmark in format_bench/ builds
+ * this file as is.
+ *
+ * @defgroup util_format Format
+ * @{
+ */
+
+#include <stdint.h>
+
+#include "util_format.h"
+
+const char util_format_hex_digits[16] = {
+  '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'
+};
+
+static const char digit_pairs[200] = {
+  '0','0','0','1','0','2','0','3','0','4','0','5','0','6','0','7','0','8','0','9',
+  '1','0','1','1','1','2','1','3','1','4','1','5','1','6','1','7','1','8','1','9',
+  '2','0','2','1','2','2','2','3','2','4','2','5','2','6','2','7','2','8','2','9',
+  '3','0','3','1','3','2','3','3','3','4','3','5','3','6','3','7','3','8','3','9',
+  '4','0','4','1','4','2','4','3','4','4','4','5','4','6','4','7','4','8','4','9',
+  '5','0','5','1','5','2','5','3','5','4','5','5','5','6','5','7','5','8','5','9',
+  '6','0','6','1','6','2','6','3','6','4','6','5','6','6','6','7','6','8','6','9',
+  '7','0','7','1','7','2','7','3','7','4','7','5','7','6','7','7','7','8','7','9',
+  '8','0','8','1','8','2','8','3','8','4','8','5','8','6','8','7','8','8','8','9',
+  '9','0','9','1','9','2','9','3','9','4','9','5','9','6','9','7','9','8','9','9'
+};
+
+static inline uint32_t decimal_digits(uint32_t value)
+{
+  if( value < 10 )         return 1;
+  if( value < 100 )        return 2;
+  if( value < 1000 )       return 3;
+  if( value < 10000 )      return 4;
+  if( value < 100000 )     return 5;
+  if( value < 1000000 )    return 6;
+  if( value < 10000000 )   return 7;
+  if( value < 100000000 )  return 8;
+  if( value < 1000000000 ) return 9;
+  return 10;
+}
+
+/*! \brief decimal without leading zeros, returns the end of the output
+ *
+ * The length is known up front, so the digits are written back to front
+ * in place.
+ */
+char * util_format_uint32(char * out, uint32_t value)
+{
+  char * end = out + decimal_digits(value);
+  char * p = end;
+
+  while( value >= 100 )
+  {
+    const char * pair = &digit_pairs[(value % 100) * 2];
+
+    value /= 100;
+    *--p = pair[1];
+    *--p = pair[0];
+  }
+  if( value >= 10 )
+  {
+    *--p = digit_pairs[value * 2 + 1];
+    *--p = digit_pairs[value * 2];
+  }
+  else
+  {
+    *--p = '0' + value;
+  }
+
+  return end;
+}
+
+char * util_format_int32(char * out, int32_t value)
+{
+  if( value < 0 )
+  {
+    *out++ = '-';
+    // through unsigned so INT32_MIN does not overflow
+    return util_format_uint32(out, 0u - (uint32_t)value);
+  }
+
+  return util_format_uint32(out, (uint32_t)value);
+}
+
+//! @}
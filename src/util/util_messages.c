@@ -17,9 +17,179 @@
 
 #include "util_general.h"
 #include "util_strings.h"
+#include "util_format.h"
 
 #include "util_messages.h"
 
+// bytes of the response collected before it is written to the channel
+#ifndef UTIL_MESSAGE_BUFFER_SIZE
+#define UTIL_MESSAGE_BUFFER_SIZE 1024
+#endif
+
+// a message starting with less room left flushes first, so lines go out whole
+#ifndef UTIL_MESSAGE_LINE_RESERVE
+#define UTIL_MESSAGE_LINE_RESERVE 128
+#endif
+
+// longest a response write waits for the host
+#ifndef UTIL_MESSAGE_WRITE_TIMEOUT
+#define UTIL_MESSAGE_WRITE_TIMEOUT MS2ST(500)
+#endif
+
+/*! \brief Response buffer between util_message_begin and util_message_end
+ *
+ * A BaseSequentialStream in RAM. The messages of the thread running the
+ * command format into it without taking mshell_sync_sem, the semaphore is
+ * only held while the buffer is written to the channel. Messages of other
+ * threads or to other streams are written directly as before.
+ */
+typedef struct {
+  const struct BaseSequentialStreamVMT * vmt;
+  BaseSequentialStream * chp;   // stream of the response, NULL between responses
+  thread_t * owner;             // thread running the command
+  uint8_t buffer[UTIL_MESSAGE_BUFFER_SIZE];
+  size_t length;
+  bool failed;                  // host stopped reading, the rest is dropped
+} util_message_response_t;
+
+/*! \brief write the buffer to the channel in one go
+ */
+static void response_flush(util_message_response_t * rp)
+{
+  size_t length = rp->length;
+
+  if( length == 0 )
+  {
+    return;
+  }
+  rp->length = 0;
+  if( rp->failed )
+  {
+    return;
+  }
+
+  chBSemWait( &mshell_sync_sem );
+  if( chnWriteTimeout((BaseChannel *)rp->chp, rp->buffer, length, UTIL_MESSAGE_WRITE_TIMEOUT) != length )
+  {
+    rp->failed = true;
+  }
+  chBSemSignal( &mshell_sync_sem );
+}
+
+static size_t response_write(void * ip, const uint8_t * bp, size_t n)
+{
+  util_message_response_t * rp = (util_message_response_t *)ip;
+  size_t left = n;
+
+  while( left > 0 )
+  {
+    size_t count = sizeof(rp->buffer) - rp->length;
+
+    if( count > left )
+    {
+      count = left;
+    }
+    memcpy(&rp->buffer[rp->length], bp, count);
+    rp->length += count;
+    bp += count;
+    left -= count;
+    if( rp->length == sizeof(rp->buffer) )
+    {
+      response_flush(rp);
+    }
+  }
+
+  return n;
+}
+
+static size_t response_read(void * ip, uint8_t * bp, size_t n)
+{
+  (void)ip;
+  (void)bp;
+  (void)n;
+
+  return 0;
+}
+
+static msg_t response_put(void * ip, uint8_t b)
+{
+  util_message_response_t * rp = (util_message_response_t *)ip;
+
+  rp->buffer[rp->length++] = b;
+  if( rp->length == sizeof(rp->buffer) )
+  {
+    response_flush(rp);
+  }
+
+  return MSG_OK;
+}
+
+static msg_t response_get(void * ip)
+{
+  (void)ip;
+
+  return MSG_RESET;
+}
+
+static const struct BaseSequentialStreamVMT response_vmt = {
+  response_write, response_read, response_put, response_get
+};
+
+static util_message_response_t response = { &response_vmt, NULL, NULL, {0}, 0, false };
+
+/*! \brief stream a message is formatted into
+ *
+ * The response buffer for the command thread writing to its shell stream,
+ * otherwise chp itself under mshell_sync_sem.
+ */
+static BaseSequentialStream * message_acquire(BaseSequentialStream * chp)
+{
+  if( chp != NULL && chp == response.chp && chThdGetSelfX() == response.owner )
+  {
+    if( sizeof(response.buffer) - response.length < UTIL_MESSAGE_LINE_RESERVE )
+    {
+      response_flush(&response);
+    }
+    return (BaseSequentialStream *)&response;
+  }
+
+  chBSemWait( &mshell_sync_sem );
+  return chp;
+}
+
+static void message_release(BaseSequentialStream * chp)
+{
+  if( chp != (BaseSequentialStream *)&response )
+  {
+    chBSemSignal( &mshell_sync_sem );
+  }
+}
+
+// array elements are formatted here and written a chunk at a time
+#define UTIL_MESSAGE_ARRAY_BUFFER 64
+
+// room for one more element and its separator, or the line end
+#define UTIL_MESSAGE_ARRAY_ELEMENT (UTIL_FORMAT_INT32_MAX + 1)
+
+/*! \brief write the formatted elements once the next one might not fit
+ */
+static char * array_room(BaseSequentialStream * chp, char * buffer, char * p)
+{
+  if( p - buffer > UTIL_MESSAGE_ARRAY_BUFFER - UTIL_MESSAGE_ARRAY_ELEMENT )
+  {
+    streamWrite(chp, (const uint8_t *)buffer, p - buffer);
+    return buffer;
+  }
+  return p;
+}
+
+static void array_end(BaseSequentialStream * chp, char * buffer, char * p)
+{
+  *p++ = '\r';
+  *p++ = '\n';
+  streamWrite(chp, (const uint8_t *)buffer, p - buffer);
+}
+
 static bool needs_newline(char * str)
 {
 	if( str == NULL || str[0] == '\0' )
@@ -32,16 +202,29 @@ static bool needs_newline(char * str)
 	return !(str[end] == '\n' || str[end] == '\r');
 }
 
+/*! \brief start a response on the shell stream chp
+ *
+ * Until util_message_end the messages of the calling thread to chp are
+ * collected in RAM and written to the channel in as few writes as
+ * possible. chp must be a channel.
+ */
 void util_message_begin( BaseSequentialStream * chp)
 {
-  chBSemWait( &mshell_sync_sem );
+  response.chp = chp;
+  response.owner = chThdGetSelfX();
+  response.length = 0;
+  response.failed = false;
+
+  chp = message_acquire(chp);
   chprintf(chp, "BEGIN:\r\n");
-  chBSemSignal( &mshell_sync_sem );
+  message_release(chp);
 }
 
+/*! \brief finish the response and write out what is left of it
+ */
 void util_message_end( BaseSequentialStream * chp, bool success )
 {
-  chBSemWait( &mshell_sync_sem );
+  chp = message_acquire(chp);
   if( success )
   {
     chprintf(chp, "END:OK\r\n");
@@ -50,7 +233,27 @@ void util_message_end( BaseSequentialStream * chp, bool success )
   {
     chprintf(chp, "END:ERROR\r\n");
   }
-  chBSemSignal( &mshell_sync_sem );
+  message_release(chp);
+
+  if( response.chp != NULL )
+  {
+    response_flush(&response);
+    response.chp = NULL;
+    response.owner = NULL;
+  }
+}
+
+/*! \brief write out the response collected so far
+ *
+ * For commands that run for a while and want their output seen before
+ * they finish.
+ */
+void util_message_flush( BaseSequentialStream * chp)
+{
+  if( chp == response.chp && chThdGetSelfX() == response.owner )
+  {
+    response_flush(&response);
+  }
 }
 
 void util_message_debug( BaseSequentialStream * chp, char * file, int line, const char * func, char * fmt, ...)
@@ -60,7 +263,7 @@ void util_message_debug( BaseSequentialStream * chp, char * file, int line, cons
 		return;
 	}
 
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
 
 	chprintf(chp, "?:%s:%d:%s:", file, line, func);
 
@@ -73,7 +276,7 @@ void util_message_debug( BaseSequentialStream * chp, char * file, int line, cons
 	{
 		chprintf(chp, "\r\n");
 	}
-	chBSemSignal( &mshell_sync_sem );
+	message_release(chp);
 }
 
 void util_message_info( BaseSequentialStream * chp, char * fmt, ...)
@@ -83,7 +286,7 @@ void util_message_info( BaseSequentialStream * chp, char * fmt, ...)
 		return;
 	}
 
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
 
 	chprintf(chp, "#:");
 
@@ -96,7 +299,7 @@ void util_message_info( BaseSequentialStream * chp, char * fmt, ...)
 	{
 		chprintf(chp, "\r\n");
 	}
-	chBSemSignal( &mshell_sync_sem );
+	message_release(chp);
 }
 
 void util_message_warning( BaseSequentialStream * chp, char * fmt, ...)
@@ -106,7 +309,7 @@ void util_message_warning( BaseSequentialStream * chp, char * fmt, ...)
 		return;
 	}
 
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
 
 	chprintf(chp, "W:");
 
@@ -119,7 +322,7 @@ void util_message_warning( BaseSequentialStream * chp, char * fmt, ...)
 	{
 		chprintf(chp, "\r\n");
 	}
-	chBSemSignal( &mshell_sync_sem );
+	message_release(chp);
 }
 
 void util_message_error( BaseSequentialStream * chp, char * fmt, ...)
@@ -129,7 +332,7 @@ void util_message_error( BaseSequentialStream * chp, char * fmt, ...)
 		return;
 	}
 
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
 
 	chprintf(chp, "E:");
 
@@ -142,7 +345,7 @@ void util_message_error( BaseSequentialStream * chp, char * fmt, ...)
 	{
 		chprintf(chp, "\r\n");
 	}
-	chBSemSignal( &mshell_sync_sem );
+	message_release(chp);
 }
 
 void util_message_bool( BaseSequentialStream * chp, char * name, bool data)
@@ -152,7 +355,7 @@ void util_message_bool( BaseSequentialStream * chp, char * name, bool data)
 		return;
 	}
 
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
   if( data )
   {
 	  chprintf(chp, "B:%s:1\r\n", name);
@@ -161,7 +364,7 @@ void util_message_bool( BaseSequentialStream * chp, char * name, bool data)
   {
     chprintf(chp, "B:%s:0\r\n", name);
   }
-	chBSemSignal( &mshell_sync_sem );
+	message_release(chp);
 }
 
 void util_message_string_format( BaseSequentialStream * chp, char * name, char * fmt, ...)
@@ -171,7 +374,7 @@ void util_message_string_format( BaseSequentialStream * chp, char * name, char *
 		return;
 	}
 
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
 
 	chprintf(chp, "S:%s:", name);
 
@@ -184,7 +387,7 @@ void util_message_string_format( BaseSequentialStream * chp, char * name, char *
 	{
 		chprintf(chp, "\r\n");
 	}
-	chBSemSignal( &mshell_sync_sem );
+	message_release(chp);
 }
 
 void util_message_string_escape( BaseSequentialStream * chp, char * name, char * str, uint32_t str_len )
@@ -195,7 +398,7 @@ void util_message_string_escape( BaseSequentialStream * chp, char * name, char *
 		return;
 	}
 
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
 
 	chprintf(chp, "SE:%s:", name);
 
@@ -213,7 +416,7 @@ void util_message_string_escape( BaseSequentialStream * chp, char * name, char *
 
   chprintf(chp, "\r\n");
 
-	chBSemSignal( &mshell_sync_sem );
+	message_release(chp);
 
 }
 
@@ -225,7 +428,7 @@ void util_message_string_array( BaseSequentialStream * chp, char * name, char *
     return;
   }
 
-  chBSemWait( &mshell_sync_sem );
+  chp = message_acquire(chp);
 	
   chprintf(chp, "SA:%s:", name);
 
@@ -240,7 +443,7 @@ void util_message_string_array( BaseSequentialStream * chp, char * name, char *
 
   chprintf(chp, "\r\n");
 
-  chBSemSignal( &mshell_sync_sem );
+  message_release(chp);
 }
 
 void util_message_double( BaseSequentialStream * chp, char * name, double data)
@@ -250,11 +453,11 @@ void util_message_double( BaseSequentialStream * chp, char * name, double data)
 		return;
 	}
 
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
 
 	chprintf(chp, "F:%s:%f\r\n", name, data);
 
-	chBSemSignal( &mshell_sync_sem );
+	message_release(chp);
 }
 
 void util_message_double_array( BaseSequentialStream * chp, char * name, double * data, uint32_t count)
@@ -264,7 +467,7 @@ void util_message_double_array( BaseSequentialStream * chp, char * name, double
 		return;
 	}
 
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
 
 	chprintf(chp, "F:%s:", name);
 
@@ -279,7 +482,7 @@ void util_message_double_array( BaseSequentialStream * chp, char * name, double
 	}
 
 	chprintf(chp, "\r\n");
-	chBSemSignal( &mshell_sync_sem );
+	message_release(chp);
 }
 
 void util_message_int8( BaseSequentialStream * chp, char * name, int8_t data)
@@ -289,36 +492,39 @@ void util_message_int8( BaseSequentialStream * chp, char * name, int8_t data)
 		return;
 	}
 
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
 
 	chprintf(chp, "S8:%s:%d\r\n", name, data);
 
-	chBSemSignal( &mshell_sync_sem );
+	message_release(chp);
 }
 
 void util_message_int8_array( BaseSequentialStream * chp, char * name, int8_t * data, uint32_t count)
 {
+	char buffer[UTIL_MESSAGE_ARRAY_BUFFER];
+	char * p = buffer;
+
 	if(chp == NULL)
 	{
 		return;
 	}
 
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
 
 	chprintf(chp, "S8:%s:", name);
 
 	for( ; count > 0; count-- )
 	{
-		chprintf(chp, "%d", *(data++));
+		p = util_format_int32(p, *(data++));
 
 		if( count > 1 )
 		{
-			chprintf(chp, ",");
+			*p++ = ',';
 		}
+		p = array_room(chp, buffer, p);
 	}
-
-	chprintf(chp, "\r\n");
-	chBSemSignal( &mshell_sync_sem );
+	array_end(chp, buffer, p);
+	message_release(chp);
 }
 
 void util_message_uint8( BaseSequentialStream * chp, char * name, uint8_t data)
@@ -328,35 +534,39 @@ void util_message_uint8( BaseSequentialStream * chp, char * name, uint8_t data)
 		return;
 	}
 
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
 
 	chprintf(chp, "U8:%s:%u\r\n", name, data);
 
-	chBSemSignal( &mshell_sync_sem );
+	message_release(chp);
 }
 
 void util_message_uint8_array( BaseSequentialStream * chp, char * name, uint8_t * data, uint32_t count)
 {
+	char buffer[UTIL_MESSAGE_ARRAY_BUFFER];
+	char * p = buffer;
+
 	if(chp == NULL)
 	{
 		return;
 	}
 
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
 
 	chprintf(chp, "U8:%s:", name);
 
 	for( ; count > 0; count-- )
 	{
-		chprintf(chp, "%u", *(data++));
+		p = util_format_uint32(p, *(data++));
 
 		if( count > 1 )
 		{
-			chprintf(chp, ",");
+			*p++ = ',';
 		}
+		p = array_room(chp, buffer, p);
 	}
-	chprintf(chp, "\r\n");
-	chBSemSignal( &mshell_sync_sem );
+	array_end(chp, buffer, p);
+	message_release(chp);
 }
 
 void util_message_int16( BaseSequentialStream * chp, char * name, int16_t data)
@@ -366,35 +576,39 @@ void util_message_int16( BaseSequentialStream * chp, char * name, int16_t data)
 		return;
 	}
 
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
 
 	chprintf(chp, "S16:%s:%d\r\n", name, data);
 
-	chBSemSignal( &mshell_sync_sem );
+	message_release(chp);
 }
 
 void util_message_int16_array( BaseSequentialStream * chp, char * name, int16_t * data, uint32_t count)
 {
+	char buffer[UTIL_MESSAGE_ARRAY_BUFFER];
+	char * p = buffer;
+
 	if(chp == NULL)
 	{
 		return;
 	}
 
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
 
 	chprintf(chp, "S16:%s:", name);
 
 	for( ; count > 0; count-- )
 	{
-		chprintf(chp, "%d", *(data++));
+		p = util_format_int32(p, *(data++));
 
 		if( count > 1 )
 		{
-			chprintf(chp, ",");
+			*p++ = ',';
 		}
+		p = array_room(chp, buffer, p);
 	}
-	chprintf(chp, "\r\n");
-	chBSemSignal( &mshell_sync_sem );
+	array_end(chp, buffer, p);
+	message_release(chp);
 }
 
 void util_message_uint16( BaseSequentialStream * chp, char * name, uint16_t data)
@@ -403,34 +617,38 @@ void util_message_uint16( BaseSequentialStream * chp, char * name, uint16_t data
 	{
 		return;
 	}
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
 
 	chprintf(chp, "U16:%s:%u\r\n", name, data);
 
-	chBSemSignal( &mshell_sync_sem );
+	message_release(chp);
 }
 
 void util_message_uint16_array( BaseSequentialStream * chp, char * name, uint16_t * data, uint32_t count)
 {
+	char buffer[UTIL_MESSAGE_ARRAY_BUFFER];
+	char * p = buffer;
+
 	if(chp == NULL)
 	{
 		return;
 	}
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
 
 	chprintf(chp, "U16:%s:", name);
 
 	for( ; count > 0; count-- )
 	{
-		chprintf(chp, "%u", *(data++));
+		p = util_format_uint32(p, *(data++));
 
 		if( count > 1 )
 		{
-			chprintf(chp, ",");
+			*p++ = ',';
 		}
+		p = array_room(chp, buffer, p);
 	}
-	chprintf(chp, "\r\n");
-	chBSemSignal( &mshell_sync_sem );
+	array_end(chp, buffer, p);
+	message_release(chp);
 }
 
 void util_message_int32( BaseSequentialStream * chp, char * name, int32_t data)
@@ -440,35 +658,39 @@ void util_message_int32( BaseSequentialStream * chp, char * name, int32_t data)
 		return;
 	}
 
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
 
 	chprintf(chp, "S32:%s:%d\r\n", name, data);
 
-	chBSemSignal( &mshell_sync_sem );
+	message_release(chp);
 }
 
 void util_message_int32_array( BaseSequentialStream * chp, char * name, int32_t * data, uint32_t count)
 {
+	char buffer[UTIL_MESSAGE_ARRAY_BUFFER];
+	char * p = buffer;
+
 	if(chp == NULL)
 	{
 		return;
 	}
 
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
 
 	chprintf(chp, "S32:%s:", name);
 
 	for( ; count > 0; count-- )
 	{
-		chprintf(chp, "%d", *(data++));
+		p = util_format_int32(p, *(data++));
 
 		if( count > 1 )
 		{
-			chprintf(chp, ",");
+			*p++ = ',';
 		}
+		p = array_room(chp, buffer, p);
 	}
-	chprintf(chp, "\r\n");
-	chBSemSignal( &mshell_sync_sem );
+	array_end(chp, buffer, p);
+	message_release(chp);
 }
 
 void util_message_uint32( BaseSequentialStream * chp, char * name, uint32_t data)
@@ -478,35 +700,39 @@ void util_message_uint32( BaseSequentialStream * chp, char * name, uint32_t data
 		return;
 	}
 
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
 
-	chprintf(chp, "U32:%s:%d\r\n", name, data);
+	chprintf(chp, "U32:%s:%u\r\n", name, data);
 
-	chBSemSignal( &mshell_sync_sem );
+	message_release(chp);
 }
 
 void util_message_uint32_array( BaseSequentialStream * chp, char * name, uint32_t * data, uint32_t count)
 {
+	char buffer[UTIL_MESSAGE_ARRAY_BUFFER];
+	char * p = buffer;
+
 	if(chp == NULL)
 	{
 		return;
 	}
 
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
 
 	chprintf(chp, "U32:%s:", name);
 
 	for( ; count > 0; count-- )
 	{
-		chprintf(chp, "%d", *(data++));
+		p = util_format_uint32(p, *(data++));
 
 		if( count > 1 )
 		{
-			chprintf(chp, ",");
+			*p++ = ',';
 		}
+		p = array_room(chp, buffer, p);
 	}
-	chprintf(chp, "\r\n");
-	chBSemSignal( &mshell_sync_sem );
+	array_end(chp, buffer, p);
+	message_release(chp);
 }
 
 void util_message_hex_uint8( BaseSequentialStream * chp, char * name, uint8_t data)
@@ -516,35 +742,39 @@ void util_message_hex_uint8( BaseSequentialStream * chp, char * name, uint8_t da
 		return;
 	}
 
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
 
 	chprintf(chp, "H8:%s:%02X\r\n", name, data);
 
-	chBSemSignal( &mshell_sync_sem );
+	message_release(chp);
 }
 
 void util_message_hex_uint8_array( BaseSequentialStream * chp, char * name, uint8_t * data, uint32_t count)
 {
+	char buffer[UTIL_MESSAGE_ARRAY_BUFFER];
+	char * p = buffer;
+
 	if(chp == NULL)
 	{
 		return;
 	}
 
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
 
 	chprintf(chp, "H8:%s:", name);
 
 	for( ; count > 0; count-- )
 	{
-		chprintf(chp, "%02X", *(data++));
+		p = util_format_hex8(p, *(data++));
 
 		if( count > 1 )
 		{
-			chprintf(chp, ",");
+			*p++ = ',';
 		}
+		p = array_room(chp, buffer, p);
 	}
-	chprintf(chp, "\r\n");
-	chBSemSignal( &mshell_sync_sem );
+	array_end(chp, buffer, p);
+	message_release(chp);
 }
 
 void util_message_hex_uint16( BaseSequentialStream * chp, char * name, uint16_t data)
@@ -554,35 +784,39 @@ void util_message_hex_uint16( BaseSequentialStream * chp, char * name, uint16_t
 		return;
 	}
 
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
 
 	chprintf(chp, "H16:%s:%04X\r\n", name, data);
 
-	chBSemSignal( &mshell_sync_sem );
+	message_release(chp);
 }
 
 void util_message_hex_uint16_array( BaseSequentialStream * chp, char * name, uint16_t * data, uint32_t count)
 {
+	char buffer[UTIL_MESSAGE_ARRAY_BUFFER];
+	char * p = buffer;
+
 	if(chp == NULL)
 	{
 		return;
 	}
 
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
 
 	chprintf(chp, "H16:%s:", name);
 
 	for( ; count > 0; count-- )
 	{
-		chprintf(chp, "%04X", *(data++));
+		p = util_format_hex16(p, *(data++));
 
 		if( count > 1 )
 		{
-			chprintf(chp, ",");
+			*p++ = ',';
 		}
+		p = array_room(chp, buffer, p);
 	}
-	chprintf(chp, "\r\n");
-	chBSemSignal( &mshell_sync_sem );
+	array_end(chp, buffer, p);
+	message_release(chp);
 }
 
 void util_message_hex_uint32( BaseSequentialStream * chp, char * name, uint32_t data)
@@ -592,35 +826,39 @@ void util_message_hex_uint32( BaseSequentialStream * chp, char * name, uint32_t
 		return;
 	}
 
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
 
 	chprintf(chp, "H32:%s:%08X\r\n", name, data);
 
-	chBSemSignal( &mshell_sync_sem );
+	message_release(chp);
 }
 
 void util_message_hex_uint32_array( BaseSequentialStream * chp, char * name, uint32_t * data, uint32_t count)
 {
+	char buffer[UTIL_MESSAGE_ARRAY_BUFFER];
+	char * p = buffer;
+
 	if(chp == NULL)
 	{
 		return;
 	}
 
-	chBSemWait( &mshell_sync_sem );
+	chp = message_acquire(chp);
 
 	chprintf(chp, "H32:%s:", name);
 
 	for( ; count > 0; count-- )
 	{
-		chprintf(chp, "%08X", *(data++));
+		p = util_format_hex32(p, *(data++));
 
 		if( count > 1 )
 		{
-			chprintf(chp, ",");
+			*p++ = ',';
 		}
+		p = array_room(chp, buffer, p);
 	}
-	chprintf(chp, "\r\n");
-	chBSemSignal( &mshell_sync_sem );
+	array_end(chp, buffer, p);
+	message_release(chp);
 }
 
 //! @}
@@ -0,0 +1,121 @@
+/*! \file util_stats.c
+ *
+ * Running statistics for interleaved multi channel sample streams
+ *
+ * util_stats_add() only does integer compare/add/multiply-accumulate per
+ * sample so it can be fed from an interrupt, the divisions and the square
+ * root are left to util_stats_summary().
+ *
+ * @defgroup util_stats Running Statistics
+ * @{
+ */
+
+#include <string.h>
+
+#include "util_stats.h"
+
+static uint32_t isqrt64(uint64_t value)
+{
+  uint64_t result = 0;
+  uint64_t bit = (uint64_t)1 << 62;
+
+  while( bit > value )
+  {
+    bit >>= 2;
+  }
+
+  while( bit != 0 )
+  {
+    if( value >= result + bit )
+    {
+      value -= result + bit;
+      result = (result >> 1) + bit;
+    }
+    else
+    {
+      result >>= 1;
+    }
+    bit >>= 2;
+  }
+  return (uint32_t)result;
+}
+
+void util_stats_init(util_stats_t * sp, uint8_t channel_count)
+{
+  if( channel_count > UTIL_STATS_MAX_CHANNELS )
+  {
+    channel_count = UTIL_STATS_MAX_CHANNELS;
+  }
+
+  sp->channel_count = channel_count;
+  sp->count = 0;
+
+  for( uint8_t ch = 0; ch < UTIL_STATS_MAX_CHANNELS; ch++ )
+  {
+    sp->acc[ch].min = UINT16_MAX;
+    sp->acc[ch].max = 0;
+    sp->acc[ch].sum = 0;
+    sp->acc[ch].sum_sq = 0;
+  }
+}
+
+/*! \brief accumulate n sets of channel_count samples
+ */
+void util_stats_add(util_stats_t * sp, const uint16_t * in, size_t n)
+{
+  uint8_t channels = sp->channel_count;
+
+  for( uint8_t ch = 0; ch < channels; ch++ )
+  {
+    util_stats_acc_t * ap = &sp->acc[ch];
+    const uint16_t * ip = &in[ch];
+    uint16_t min = ap->min;
+    uint16_t max = ap->max;
+    uint32_t sum = 0;
+    uint64_t sum_sq = 0;
+
+    for( size_t set = 0; set < n; set++, ip += channels )
+    {
+      uint32_t x = *ip;
+
+      min = (x < min) ? x : min;
+      max = (x > max) ? x : max;
+      sum += x;
+      sum_sq += x * x;
+    }
+
+    ap->min = min;
+    ap->max = max;
+    ap->sum += sum;
+    ap->sum_sq += sum_sq;
+  }
+
+  sp->count += n;
+}
+
+/*! \brief fixed point summary of one channel
+ *
+ * variance is the population variance, sum_sq/n - mean^2, computed as
+ * (n * sum_sq - sum^2) / n^2 so it stays exact in integers.
+ */
+void util_stats_summary(const util_stats_t * sp, uint8_t channel, util_stats_summary_t * out)
+{
+  const util_stats_acc_t * ap = &sp->acc[channel];
+  uint64_t n = sp->count;
+
+  if( n == 0 )
+  {
+    memset(out, 0, sizeof(*out));
+    return;
+  }
+
+  out->min = ap->min;
+  out->max = ap->max;
+  out->mean = ((uint64_t)ap->sum << UTIL_STATS_FRAC_BITS) / n;
+  // split the division so the shifted sum of squares can not overflow
+  out->rms = isqrt64(((ap->sum_sq / n) << (2 * UTIL_STATS_FRAC_BITS)) + (((ap->sum_sq % n) << (2 * UTIL_STATS_FRAC_BITS)) / n));
+  // n^2 * variance, at most 2^32 * 2^22 for 12 bit samples, leaves room for the shift
+  out->variance = (((n * ap->sum_sq - (uint64_t)ap->sum * ap->sum) << UTIL_STATS_FRAC_BITS) / n) / n;
+}
+
+//! @}
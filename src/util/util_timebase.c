@@ -0,0 +1,44 @@
+/*! \file util_timebase.c
+ *
+ * Firmware wide free running 32 bit microsecond timebase
+ *
+ * One 32 bit timer counts the full range at UTIL_TIMEBASE_FREQ without
+ * interrupts. The adc trigger timers run from the same timer clock, so
+ * sample timestamps do not drift against it, and the serial capture chunks
+ * and can frames are stamped with util_timebase_now().
+ *
+ * @defgroup util_timebase Timebase
+ * @{
+ */
+
+#include "ch.h"
+#include "hal.h"
+
+#include <string.h>
+
+#include "util_timebase.h"
+
+static GPTConfig util_timebase_cfg;
+
+/*! \brief start the timebase from zero, before any source stamps events
+ */
+void util_timebase_init(void)
+{
+  stm32_tim_t * tim;
+
+  memset(&util_timebase_cfg, 0, sizeof(util_timebase_cfg));
+  util_timebase_cfg.frequency = UTIL_TIMEBASE_FREQ;
+  util_timebase_cfg.callback = NULL;
+
+  // sets up the clock and prescaler, the counter is run by hand as the
+  // gpt interval cannot span all 32 bits
+  gptStart(&UTIL_TIMEBASE_GPTD, &util_timebase_cfg);
+
+  tim = UTIL_TIMEBASE_GPTD.tim;
+  tim->ARR = 0xffffffff;
+  tim->CNT = 0;
+  tim->EGR = STM32_TIM_EGR_UG;
+  tim->CR1 = STM32_TIM_CR1_CEN;
+}
+
+//! @}
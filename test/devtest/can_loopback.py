@@ -0,0 +1,84 @@
+#!/usr/bin/env python
+# file: can_loopback.py
+
+"""
+Check CAN1 without a bus: frames sent with can.tx in silent loopback mode
+come back through the filters and are streamed to mpipe as
+MPIPE_FRAME_CAN_RX (see src/mpipe/include/mpipe_frame.h)
+
+Example:
+
+    ./can_loopback.py --shell /dev/ttyACM0 --mpipe /dev/ttyACM1
+    ./can_loopback.py --shell /dev/ttyACM0 --mpipe /dev/ttyACM1 --bitrate 1000000 --frames 200
+    ./can_loopback.py --shell /dev/ttyACM0 --mpipe /dev/ttyACM1 --mode loopback   # also drives the bus
+"""
+
+from __future__ import print_function
+
+import sys
+import time
+import random
+import argparse
+
+import utils as u
+import mpipe_bench as mb
+import mpipe_decode as md
+
+# accepted by the filter set up below, 0x200 ... 0x2ff
+PASS_ID = 0x200
+PASS_MASK = 0x700
+
+
+def main():
+    parser = argparse.ArgumentParser(description="CAN loopback test")
+    parser.add_argument("--shell", required=True, help="shell serial port")
+    parser.add_argument("--mpipe", required=True, help="mpipe serial port")
+    parser.add_argument("--bitrate", type=int, default=500000)
+    parser.add_argument("--mode", default="silent_loopback", help="silent_loopback | loopback")
+    parser.add_argument("--frames", type=int, default=50, help="frames to send, every other one filtered out")
+    args = parser.parse_args()
+
+    import serial
+    shell = serial.Serial(args.shell, timeout=0.1)
+    mpipe = serial.Serial(args.mpipe, timeout=0.1)
+
+    mb.command(shell, "can.reset")
+    mb.command(shell, "mpipe.format(binary)")
+    mb.command(shell, "can.filter(0, {}, {})".format(PASS_ID, PASS_MASK))
+    mb.command(shell, "can.config({}, {})".format(args.bitrate, args.mode))
+    mb.command(shell, "can.rx(1)")
+    mpipe.reset_input_buffer()
+
+    expected = []
+    for i in range(args.frames):
+        id_ = (PASS_ID if i % 2 == 0 else 0x100) | (i & 0xff)
+        data = [random.randint(0, 255) for _ in range(random.randint(1, 8))]
+        mb.command(shell, "can.tx({}, 0, {})".format(id_, ", ".join(str(b) for b in data)))
+        if i % 2 == 0:
+            expected.append((id_, data))
+
+    decoder = md.Decoder()
+    received = []
+    deadline = time.time() + 2.0
+    while time.time() < deadline and len(received) < len(expected):
+        for frame in decoder.feed(mpipe.read(4096)):
+            if frame.type == md.MPIPE_FRAME_CAN_RX:
+                received += [(r[2], list(bytearray(r[6][:r[5]]))) for r in frame.can_frames]
+
+    mb.command(shell, "can.rx(0)")
+    shell.reset_input_buffer()
+    shell.write(b"can.status\r\n")
+    time.sleep(0.2)
+    sys.stdout.write(shell.read(4096).decode(errors="replace"))
+
+    if received != expected:
+        u.error("sent {} frames through the filter, got {} back, first mismatch at {}\n".format(
+            len(expected), len(received),
+            next((i for i, (a, b) in enumerate(zip(expected, received)) if a != b), min(len(expected), len(received)))))
+        sys.exit(1)
+    u.info("{} of {} frames passed the filter and came back intact, seq_gaps {}\n".format(
+        len(received), args.frames, decoder.gaps))
+
+
+if __name__ == "__main__":
+    main()
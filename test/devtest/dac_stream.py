@@ -0,0 +1,121 @@
+#!/usr/bin/env python
+# file: dac_stream.py
+
+"""
+Stream a waveform to the dacs over the mpipe port (see dac.stream and
+MPIPE_FRAME_DAC_BLOCK in src/mpipe/include/mpipe_frame.h)
+
+The waveform is generated per channel, or read from a text file with one
+set of whitespace separated 12 bit values per line, and sent as DAC frames
+for as long as requested. The firmware holds the host back through usb
+flow control once its queue is full.
+
+Example:
+
+    ./dac_stream.py --shell /dev/ttyACM0 --mpipe /dev/ttyACM1 --channels HS --wave sine --freq 1000
+    ./dac_stream.py --shell /dev/ttyACM0 --mpipe /dev/ttyACM1 --channels 0 1 --wave saw --seconds 60
+    ./dac_stream.py --shell /dev/ttyACM0 --mpipe /dev/ttyACM1 --channels 0 1 --file sets.txt
+"""
+
+from __future__ import division
+from __future__ import print_function
+
+import sys
+import math
+import time
+import struct
+import argparse
+import itertools
+
+import utils as u
+import mpipe_bench as mb
+
+MPIPE_SOURCE_DAC = 0x30
+MPIPE_FRAME_DAC_BLOCK = 0x08
+
+# FETCH_DAC_BLOCK_SAMPLES
+BLOCK_SAMPLES = 256
+
+FULL_SCALE = 0xfff
+
+
+def generate(wave, freq, rate, channels):
+    """ endless sample sets, channel n is shifted by n / channels of a period """
+    for i in itertools.count():
+        sets = []
+        for ch in range(channels):
+            phase = (i * freq / rate + ch / channels) % 1.0
+            if wave == "sine":
+                value = 0.5 + 0.5 * math.sin(2 * math.pi * phase)
+            elif wave == "saw":
+                value = phase
+            elif wave == "triangle":
+                value = 2 * phase if phase < 0.5 else 2 - 2 * phase
+            else:
+                value = 1.0 if phase < 0.5 else 0.0
+            sets.append(int(round(value * FULL_SCALE)))
+        yield sets
+
+
+def from_file(path, channels):
+    with open(path) as f:
+        rows = [[int(v, 0) & FULL_SCALE for v in line.split()] for line in f if line.strip()]
+    for row in rows:
+        if len(row) != channels:
+            u.error("{}: expected {} values per line\n".format(path, channels))
+            sys.exit(1)
+    return itertools.cycle(rows)
+
+
+def dac_frame(sequence, sets):
+    payload = struct.pack("<BH", len(sets[0]), len(sets))
+    payload += struct.pack("<%dH" % (len(sets) * len(sets[0])), *[s for set_ in sets for s in set_])
+    return b"D" + mb.frame(MPIPE_SOURCE_DAC, MPIPE_FRAME_DAC_BLOCK, sequence, payload)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Stream a waveform to the dacs")
+    parser.add_argument("--shell", required=True, help="shell serial port")
+    parser.add_argument("--mpipe", required=True, help="mpipe serial port")
+    parser.add_argument("--channels", nargs="+", default=["HS"], help="0 | 1 | 2 | 3 | HS")
+    parser.add_argument("--rate", type=int, default=20000, help="sets per second")
+    parser.add_argument("--wave", choices=("sine", "saw", "triangle", "square"), default="sine")
+    parser.add_argument("--freq", type=float, default=100.0, help="waveform frequency in Hz")
+    parser.add_argument("--file", help="play sets from a text file instead, looped")
+    parser.add_argument("--seconds", type=float, default=10.0, help="seconds of waveform to send")
+    args = parser.parse_args()
+
+    import serial
+    shell = serial.Serial(args.shell, timeout=0.1)
+    mpipe = serial.Serial(args.mpipe, timeout=0.1)
+
+    channels = len(args.channels)
+    depth = BLOCK_SAMPLES // channels
+    if args.file:
+        sets = from_file(args.file, channels)
+    else:
+        sets = generate(args.wave, args.freq, args.rate, channels)
+
+    mb.command(shell, "dac.stream({}, {})".format(args.rate, ", ".join(args.channels)))
+
+    blocks = int(math.ceil(args.seconds * args.rate / depth))
+    start = time.time()
+    try:
+        for sequence in range(blocks):
+            mpipe.write(dac_frame(sequence, list(itertools.islice(sets, depth))))
+    except KeyboardInterrupt:
+        pass
+    elapsed = time.time() - start
+
+    # let the queued blocks play out before looking at the counters
+    time.sleep(4 * depth / args.rate + 0.2)
+    shell.write(b"dac.status\r\n")
+    time.sleep(0.2)
+    sys.stdout.write(shell.read(4096).decode(errors="replace"))
+    mb.command(shell, "dac.stop")
+
+    u.info("sent {} blocks in {:.1f} s\n".format(blocks, elapsed))
+
+
+if __name__ == "__main__":
+    main()
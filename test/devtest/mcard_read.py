@@ -0,0 +1,222 @@
+#!/usr/bin/env python
+# file: mcard_read.py
+
+"""
+Read a recording written by mcard.record (see src/mcard/include/mcard_format.h)
+
+The index blocks locate a time window without reading the blocks before
+it, so a window of a large recording prints as fast as one of a small one.
+Every block read is checked against its crc.
+
+Example:
+
+    ./mcard_read.py ADC.BIN --info                  # header and sources
+    ./mcard_read.py ADC.BIN --from 10 --to 10.5     # sets between 10 s and 10.5 s into the recording
+    ./mcard_read.py ADC.BIN --stats                 # decode everything, print the counters
+"""
+
+from __future__ import division
+from __future__ import print_function
+
+import sys
+import mmap
+import struct
+import argparse
+
+import utils as u
+from mpipe_decode import Decoder, print_frame, crc16, SOURCE_NAMES
+
+MAGIC_HEADER = 0x474f4c4d
+MAGIC_DATA   = 0x5441444d
+MAGIC_INDEX  = 0x5844494d
+
+FLAG_CLOSED     = 0x0001
+FLAG_CONTIGUOUS = 0x0002
+
+BLOCK_HEADER  = struct.Struct("<IIIHHQQ")
+HEADER_BODY   = struct.Struct("<HHIIIHHHH3IB")
+SOURCE        = struct.Struct("<BBBBIHB1x14s")
+INDEX_ENTRY   = struct.Struct("<IIQQ")
+
+HEADER_FIRMWARE = 80
+HEADER_SOURCES  = 128
+SOURCE_SIZE     = 32
+MODE_NAMES = ["independent", "simultaneous", "interleaved"]
+
+
+class Block(object):
+    def __init__(self, data, offset):
+        (self.magic, self.number, self.length, self.crc, self.flags,
+         self.first_time, self.last_time) = BLOCK_HEADER.unpack_from(data, offset)
+        self.data = data
+        self.offset = offset
+
+    def valid(self, magic, number=None):
+        if self.magic != magic or self.length < BLOCK_HEADER.size:
+            return False
+        if number is not None and self.number != number:
+            return False
+        raw = self.data[self.offset:self.offset + self.length]
+        if len(raw) != self.length:
+            return False
+        return crc16(raw[14:], crc16(raw[:12])) == self.crc
+
+    def body(self):
+        return self.data[self.offset + BLOCK_HEADER.size:self.offset + self.length]
+
+
+class Recording(object):
+    def __init__(self, path):
+        self.file = open(path, "rb")
+        self.data = mmap.mmap(self.file.fileno(), 0, access=mmap.ACCESS_READ)
+        self.crc_errors = 0
+
+        header = Block(self.data, 0)
+        if not header.valid(MAGIC_HEADER, 0):
+            raise ValueError("not an mcard recording or corrupt header")
+        (self.version, self.index_interval, self.block_size, self.timebase_hz, block_count,
+         self.vdda_mv, self.vrefint_cal, self.ts_cal1, self.ts_cal2,
+         id0, id1, id2, source_count) = HEADER_BODY.unpack_from(self.data, BLOCK_HEADER.size)
+        self.chip_id = (id0, id1, id2)
+        self.flags = header.flags
+        self.start_time = header.first_time
+        self.end_time = header.last_time if self.flags & FLAG_CLOSED else None
+        firmware = self.data[HEADER_FIRMWARE:HEADER_SOURCES]
+        self.firmware = firmware.split(b"\x00")[0].decode("ascii", "replace")
+
+        self.sources = []
+        for i in range(source_count):
+            (source, mode, channel_count, bits, sample_rate, factor, filter_,
+             channels) = SOURCE.unpack_from(self.data, HEADER_SOURCES + i * SOURCE_SIZE)
+            self.sources.append(dict(source=source, mode=mode, channel_count=channel_count, bits=bits,
+                                     sample_rate=sample_rate, decimate_factor=factor, decimate_filter=filter_,
+                                     channels=list(bytearray(channels[:channel_count]))))
+
+        # a recording cut short has no block count, take what is on the card
+        if self.flags & FLAG_CLOSED:
+            self.block_count = block_count
+        else:
+            self.block_count = len(self.data) // self.block_size
+
+        self.index_numbers = list(range(self.index_interval - 1, self.block_count, self.index_interval))
+        last = self.block_count - 1
+        if last > 0 and (not self.index_numbers or self.index_numbers[-1] != last) \
+                and self.block(last).magic == MAGIC_INDEX:
+            self.index_numbers.append(last)
+
+    def block(self, number):
+        return Block(self.data, number * self.block_size)
+
+    def index(self, number):
+        """ entries of an index block, None if it is not valid """
+        block = self.block(number)
+        if not block.valid(MAGIC_INDEX, number):
+            self.crc_errors += 1
+            return None
+        body = block.body()
+        return [INDEX_ENTRY.unpack_from(body, i) for i in range(0, len(body), INDEX_ENTRY.size)]
+
+    def find_index(self, t0):
+        """ position in index_numbers of the first index block ending at or after t0 """
+        lo, hi = 0, len(self.index_numbers)
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if self.block(self.index_numbers[mid]).last_time < t0:
+                lo = mid + 1
+            else:
+                hi = mid
+        return lo
+
+    def blocks(self, t0, t1):
+        """ numbers of the data blocks that may hold times in [t0, t1] """
+        i = self.find_index(t0)
+        while i < len(self.index_numbers):
+            entries = self.index(self.index_numbers[i])
+            if entries is None:
+                # fall back on the block headers this index covers
+                first = self.index_numbers[i - 1] + 1 if i > 0 else 1
+                entries = [(n, 0, self.block(n).first_time, self.block(n).last_time)
+                           for n in range(first, self.index_numbers[i])]
+            for number, frames, first_time, last_time in entries:
+                if first_time > t1:
+                    return
+                if last_time >= t0:
+                    yield number
+            i += 1
+
+        # data after the last index block of a recording cut short
+        first = self.index_numbers[-1] + 1 if self.index_numbers else 1
+        for number in range(first, self.block_count):
+            block = self.block(number)
+            if block.magic != MAGIC_DATA:
+                continue
+            if block.first_time > t1:
+                return
+            if block.last_time >= t0:
+                yield number
+
+    def frames(self, t0, t1, decoder):
+        """ decoded frames of the data blocks overlapping [t0, t1] """
+        for number in self.blocks(t0, t1):
+            block = self.block(number)
+            if not block.valid(MAGIC_DATA, number):
+                self.crc_errors += 1
+                continue
+            for frame in decoder.feed(block.body()):
+                yield frame
+
+
+def print_info(rec):
+    print("version {} block_size {} index_interval {} timebase_hz {}".format(
+        rec.version, rec.block_size, rec.index_interval, rec.timebase_hz))
+    print("blocks {} index_blocks {} closed {} contiguous {}".format(
+        rec.block_count, len(rec.index_numbers), bool(rec.flags & FLAG_CLOSED), bool(rec.flags & FLAG_CONTIGUOUS)))
+    if rec.end_time is not None:
+        print("duration {:.6f} s".format((rec.end_time - rec.start_time) / rec.timebase_hz))
+    print("firmware {} chip_id {}".format(rec.firmware, "".join("%08X" % i for i in rec.chip_id)))
+    print("vdda_mv {} vrefint_cal {} ts_cal1 {} ts_cal2 {}".format(rec.vdda_mv, rec.vrefint_cal, rec.ts_cal1, rec.ts_cal2))
+    for s in rec.sources:
+        print("{}: {} rate {} bits {} decimate {} channels {}".format(
+            SOURCE_NAMES.get(s["source"], "%02X" % s["source"]), MODE_NAMES[s["mode"]] if s["mode"] < 3 else s["mode"],
+            s["sample_rate"], s["bits"], s["decimate_factor"], s["channels"]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Read an mcard recording")
+    parser.add_argument("input", help="file written by mcard.record")
+    parser.add_argument("--info", action="store_true", help="print the header only")
+    parser.add_argument("--from", dest="t0", type=float, default=0.0, help="seconds after the start")
+    parser.add_argument("--to", dest="t1", type=float, default=None, help="seconds after the start")
+    parser.add_argument("--stats", action="store_true", help="print counters instead of samples")
+    args = parser.parse_args()
+
+    try:
+        rec = Recording(args.input)
+    except (IOError, ValueError, struct.error) as e:
+        u.error("Error reading {}: {}".format(args.input, e))
+        sys.exit(1)
+
+    if args.info:
+        print_info(rec)
+        return
+
+    t0 = rec.start_time + int(args.t0 * rec.timebase_hz)
+    t1 = rec.start_time + int(args.t1 * rec.timebase_hz) if args.t1 is not None else 1 << 64
+
+    decoder = Decoder()
+    for frame in rec.frames(t0, t1, decoder):
+        if args.stats:
+            continue
+        # the block times are extended past the 32 bit wrap, compare within the wrap
+        if frame.timestamp is not None:
+            offset = (frame.timestamp - (t0 & 0xffffffff)) & 0xffffffff
+            if offset >= (1 << 31) or (args.t1 is not None and offset > t1 - t0):
+                continue
+        print_frame(frame)
+
+    u.info("frames {} samples {} block_crc_errors {} frame_crc_errors {} seq_gaps {} missing_sets {} dropped_sets {}\n".format(
+        decoder.frames, decoder.samples, rec.crc_errors, decoder.errors, decoder.gaps, decoder.missing, decoder.dropped))
+
+
+if __name__ == "__main__":
+    main()
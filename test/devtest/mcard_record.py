@@ -0,0 +1,89 @@
+#!/usr/bin/env python
+# file: mcard_record.py
+
+"""
+Record the adc streams to the sd card with mcard.record for a while and
+check the recorder kept up (see src/mcard/mcard.c)
+
+The card is connected and mounted first. Copy the file off the card and
+read it with mcard_read.py.
+
+Example:
+
+    ./mcard_record.py --shell /dev/ttyACM0 --rate 20000 --seconds 60
+    ./mcard_record.py --shell /dev/ttyACM0 --file RUN1.BIN --seconds 3600
+    ./mcard_record.py --shell /dev/ttyACM0 --size 1000000000 --seconds 3600   # preallocated
+"""
+
+from __future__ import division
+from __future__ import print_function
+
+import sys
+import time
+import argparse
+
+import utils as u
+import mpipe_bench as mb
+
+
+def status(shell):
+    """ mcard.status as a dict of name: value strings """
+    shell.reset_input_buffer()
+    shell.write(b"mcard.status\r\n")
+    time.sleep(0.3)
+    text = shell.read(4096).decode(errors="replace")
+    sys.stdout.write(text)
+    values = {}
+    for line in text.splitlines():
+        name, sep, value = line.partition(":")
+        if sep:
+            values[name.strip()] = value.strip()
+    return values
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Record the adc streams to the sd card")
+    parser.add_argument("--shell", required=True, help="shell serial port")
+    parser.add_argument("--file", default="ADC.BIN", help="file on the card")
+    parser.add_argument("--rate", type=int, default=10000, help="sample sets per second and device")
+    parser.add_argument("--seconds", type=float, default=30.0)
+    parser.add_argument("--size", type=int, default=0, help="preallocate the file contiguously, bytes")
+    args = parser.parse_args()
+
+    import serial
+    shell = serial.Serial(args.shell, timeout=0.1)
+
+    mb.command(shell, "sd.connect")
+    mb.command(shell, "sd.mount")
+    mb.command(shell, "adc.reset")
+    for dev in (0, 1):
+        mb.command(shell, "adc.config({}, {})".format(dev, args.rate))
+    if args.size:
+        # allocating a large file takes a moment
+        shell.write("mcard.record({}, {})\r\n".format(args.file, args.size).encode())
+        time.sleep(5.0)
+        shell.reset_input_buffer()
+    else:
+        mb.command(shell, "mcard.record({})".format(args.file))
+    for dev in (0, 1):
+        mb.command(shell, "adc.start({})".format(dev))
+
+    try:
+        time.sleep(args.seconds)
+    except KeyboardInterrupt:
+        pass
+
+    for dev in (0, 1):
+        mb.command(shell, "adc.stop({})".format(dev))
+    mb.command(shell, "mcard.stop")
+    values = status(shell)
+
+    if values.get("dropped", "0") != "0" or values.get("result", "0") != "0":
+        u.error("recording lost data, dropped {} result {}\n".format(values.get("dropped"), values.get("result")))
+        sys.exit(1)
+    u.info("recorded {} bytes to {}, slowest write {} us\n".format(
+        values.get("bytes"), args.file, values.get("write_max_us")))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,207 @@
+#!/usr/bin/env python
+# file: mpipe_bench.py
+
+"""
+Compare the wire cost of the mpipe stream formats (ascii hex, binary, delta)
+
+Offline the formats are encoded here from a synthetic signal, the same way
+the firmware does (see src/mpipe/mpipe_frame.c), and the bytes per sample
+set and the set rate a link can carry are printed.
+
+With a device attached each format is selected in turn, both adc devices
+stream for a few seconds and the achieved sample rate is measured with the
+decoder from mpipe_decode.py.
+
+Example:
+
+    ./mpipe_bench.py                                   # offline, 7 channels, 1 MB/s link
+    ./mpipe_bench.py --channels 3 --noise 40           # offline, noisier signal
+    ./mpipe_bench.py --shell /dev/ttyACM0 --mpipe /dev/ttyACM1 --rate 20000
+"""
+
+from __future__ import division
+from __future__ import print_function
+
+import sys
+import math
+import time
+import random
+import struct
+import argparse
+
+import utils as u
+import mpipe_decode as md
+
+SET_DEPTH = 32
+
+
+def zigzag(v):
+    return (v << 1) ^ (v >> 31)
+
+
+def varint(v):
+    out = bytearray()
+    while v >= 0x80:
+        out.append((v & 0x7f) | 0x80)
+        v >>= 7
+    out.append(v)
+    return out
+
+
+def frame(source, ftype, sequence, payload):
+    body = struct.pack("<BBI", source, ftype, sequence) + bytes(payload)
+    body += struct.pack("<H", md.crc16(body))
+    return cobs_encode(body) + b"\x00"
+
+
+def cobs_encode(data):
+    out = bytearray()
+    block = bytearray()
+    for b in bytearray(data):
+        if b == 0:
+            out += bytearray([len(block) + 1]) + block
+            block = bytearray()
+        else:
+            block.append(b)
+            if len(block) == 0xfe:
+                out += bytearray([0xff]) + block
+                block = bytearray()
+    out += bytearray([len(block) + 1]) + block
+    return bytes(out)
+
+
+def encode_ascii(sets, sequence):
+    return "".join("A3:%08X%s\r\n" % ((sequence + i) & 0xffffffff, "".join("%04X" % s for s in samples))
+                   for i, samples in enumerate(sets)).encode()
+
+
+def encode_binary(sets, sequence):
+    samples = [s for set_ in sets for s in set_]
+    # timestamps of a 100 kHz stream
+    payload = bytearray([len(sets[0]), len(sets), 12]) + struct.pack("<I", sequence * 10)
+    for i in range(0, len(samples) - 1, 2):
+        a, b = samples[i], samples[i + 1]
+        payload += bytearray([a & 0xff, ((a >> 8) & 0x0f) | ((b << 4) & 0xf0), b >> 4])
+    if len(samples) % 2:
+        payload += bytearray([samples[-1] & 0xff, samples[-1] >> 8])
+    return frame(0, md.MPIPE_FRAME_ADC_BLOCK, sequence, payload)
+
+
+def encode_delta(sets, sequence, last, keyframe):
+    channels = len(sets[0])
+    if keyframe:
+        last[:] = [0] * channels
+    payload = bytearray([channels, len(sets), 12, md.MPIPE_DELTA_FLAG_KEYFRAME if keyframe else 0])
+    payload += struct.pack("<I", sequence * 10)
+    for samples in sets:
+        for ch, s in enumerate(samples):
+            payload += varint(zigzag(s - last[ch]))
+            last[ch] = s
+    return frame(0, md.MPIPE_FRAME_ADC_DELTA, sequence, payload)
+
+
+def synthetic_blocks(channels, blocks, noise):
+    """ slow sines of different frequency per channel plus uniform noise """
+    n = 0
+    for _ in range(blocks):
+        sets = []
+        for _ in range(SET_DEPTH):
+            sets.append([max(0, min(4095, int(2048 + 1500 * math.sin(n * 0.002 * (ch + 1)) +
+                                              random.randint(-noise, noise))))
+                         for ch in range(channels)])
+            n += 1
+        yield sets
+
+
+def offline(args):
+    sizes = {"ascii": 0, "binary": 0, "delta": 0}
+    last = []
+    sequence = 0
+    decoder = md.Decoder()
+    for i, sets in enumerate(synthetic_blocks(args.channels, args.blocks, args.noise)):
+        sizes["ascii"] += len(encode_ascii(sets, sequence))
+        sizes["binary"] += len(encode_binary(sets, sequence))
+        encoded = encode_delta(sets, sequence, last, i % args.keyframe == 0)
+        sizes["delta"] += len(encoded)
+        # the delta stream must decode back to the input
+        decoded = list(decoder.feed(encoded))
+        if len(decoded) != 1 or decoded[0].sets != sets:
+            u.error("delta round trip failed at block {}".format(i))
+            sys.exit(1)
+        sequence += len(sets)
+
+    total_sets = args.blocks * SET_DEPTH
+    u.info("{} channels, noise +/-{} lsb, keyframe every {} blocks, link {} bytes/s\n".format(
+        args.channels, args.noise, args.keyframe, args.link))
+    for name in ("ascii", "binary", "delta"):
+        per_set = sizes[name] / total_sets
+        print("{:8} {:7.2f} bytes/set {:5.2f}x {:10.0f} sets/s".format(
+            name, per_set, sizes["ascii"] / sizes[name], args.link / per_set))
+
+
+def command(port, line):
+    port.write((line + "\r\n").encode())
+    time.sleep(0.2)
+    port.reset_input_buffer()
+
+
+def live(args):
+    import serial
+    shell = serial.Serial(args.shell, timeout=0.1)
+    mpipe = serial.Serial(args.mpipe, timeout=0.1)
+
+    command(shell, "adc.reset")
+    for dev in (0, 1):
+        command(shell, "adc.config({}, {})".format(dev, args.rate))
+
+    for name in ("ascii", "binary", "delta"):
+        command(shell, "mpipe.format({})".format(name))
+        mpipe.reset_input_buffer()
+        for dev in (0, 1):
+            command(shell, "adc.start({})".format(dev))
+
+        decoder = md.Decoder()
+        received = 0
+        lines = 0
+        start = time.time()
+        while time.time() - start < args.seconds:
+            data = mpipe.read(8192)
+            received += len(data)
+            if name == "ascii":
+                lines += data.count(b"\n")
+            else:
+                for _ in decoder.feed(data):
+                    pass
+        elapsed = time.time() - start
+
+        for dev in (0, 1):
+            command(shell, "adc.stop({})".format(dev))
+
+        sets = lines if name == "ascii" else decoder.samples / 7
+        print("{:8} {:10.0f} bytes/s {:10.0f} sets/s crc_errors {} seq_gaps {}".format(
+            name, received / elapsed, sets / elapsed, decoder.errors, decoder.gaps))
+
+    command(shell, "mpipe.reset")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compare mpipe stream formats")
+    parser.add_argument("--channels", type=int, default=7, help="offline: channels per set")
+    parser.add_argument("--blocks", type=int, default=200, help="offline: blocks to encode")
+    parser.add_argument("--noise", type=int, default=4, help="offline: noise amplitude in lsb")
+    parser.add_argument("--keyframe", type=int, default=16, help="offline: delta frames per keyframe")
+    parser.add_argument("--link", type=int, default=1000000, help="offline: link bytes per second")
+    parser.add_argument("--shell", help="live: shell serial port")
+    parser.add_argument("--mpipe", help="live: mpipe serial port")
+    parser.add_argument("--rate", type=int, default=10000, help="live: adc sample rate")
+    parser.add_argument("--seconds", type=float, default=5.0, help="live: seconds per format")
+    args = parser.parse_args()
+
+    if args.shell and args.mpipe:
+        live(args)
+    else:
+        offline(args)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,439 @@
+#!/usr/bin/env python
+# file: mpipe_decode.py
+
+"""
+Decode the binary mpipe stream (see src/mpipe/include/mpipe_frame.h)
+
+Enable it on the shell port first:
+
+    mpipe.format(binary)
+    mpipe.format(delta)         # lossless delta compressed frames
+
+Example:
+
+    ./mpipe_decode.py /dev/ttyACM1            # print sample sets as ascii lines
+    ./mpipe_decode.py /dev/ttyACM1 --stats    # print throughput once a second
+    ./mpipe_decode.py capture.bin             # decode a file of raw captured bytes
+
+Files written by mcard.record are read with mcard_read.py.
+
+With flow control (mpipe.flow(pause) etc.) the firmware only sends what the
+host grants, --credit keeps that many bytes in flight:
+
+    ./mpipe_decode.py /dev/ttyACM1 --credit 16384
+"""
+
+from __future__ import division
+from __future__ import print_function
+
+import sys
+import os
+import time
+import struct
+import argparse
+
+import utils as u
+
+MPIPE_FRAME_ADC_BLOCK = 0x01
+MPIPE_FRAME_ADC_DELTA = 0x02
+MPIPE_FRAME_ADC_CAPTURE = 0x03
+MPIPE_FRAME_ADC_STATS = 0x04
+MPIPE_FRAME_ADC_SPECTRUM = 0x05
+MPIPE_FRAME_ADC_PEAKS = 0x06
+MPIPE_FRAME_GAP = 0x07
+MPIPE_FRAME_SERIAL_DATA = 0x09
+MPIPE_FRAME_CAN_RX = 0x0A
+MPIPE_FRAME_FILE_DATA = 0x0B
+
+CAN_ID_EXT = 0x80000000
+CAN_ID_RTR = 0x40000000
+CAN_RECORD = struct.Struct("<IIIHBB8s")
+
+FFT_WINDOW_NAMES = ("none", "hann", "hamming", "blackman")
+
+MPIPE_DELTA_FLAG_KEYFRAME = 0x01
+
+SERIAL_FLAG_NAMES = ("idle", "overrun", "framing", "parity", "noise", "break")
+
+MPIPE_FILE_FLAG_LAST = 0x01
+MPIPE_FILE_FLAG_ERROR = 0x02
+
+SOURCE_NAMES = {
+    0x00: "A3",   # adc dev 0
+    0x01: "A2",   # adc dev 1
+    0x02: "AD",   # adc dual mode combined stream
+    0x10: "C",
+    0x20: "S0",   # fetch serial dev 0, serial.capture
+    0x21: "S1",
+    0x22: "S2",
+    0x40: "F",    # sd.dump
+}
+
+HEADER = struct.Struct("<BBI")
+
+
+def crc16(data, crc=0xffff):
+    """ CRC-16/CCITT-FALSE """
+    for b in bytearray(data):
+        crc ^= b << 8
+        for _ in range(8):
+            if crc & 0x8000:
+                crc = ((crc << 1) ^ 0x1021) & 0xffff
+            else:
+                crc = (crc << 1) & 0xffff
+    return crc
+
+
+def cobs_decode(data):
+    data = bytearray(data)
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        if code == 0 or i + code > len(data):
+            raise ValueError("bad cobs code")
+        out += data[i + 1:i + code]
+        i += code
+        if code < 0xff and i < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+def unpack_samples(payload, count, bits):
+    payload = bytearray(payload)
+    if bits == 16:
+        return list(struct.unpack("<%dH" % count, bytes(payload[:count * 2])))
+    samples = []
+    i = 0
+    while len(samples) + 2 <= count:
+        samples.append(payload[i] | ((payload[i + 1] & 0x0f) << 8))
+        samples.append((payload[i + 1] >> 4) | (payload[i + 2] << 4))
+        i += 3
+    if len(samples) < count:
+        samples.append(payload[i] | ((payload[i + 1] & 0x0f) << 8))
+    return samples
+
+
+def read_varints(payload, count):
+    """ little endian base 128 varints, zigzag decoded """
+    payload = bytearray(payload)
+    values = []
+    value = shift = 0
+    for b in payload:
+        value |= (b & 0x7f) << shift
+        shift += 7
+        if not b & 0x80:
+            values.append((value >> 1) ^ -(value & 1))
+            value = shift = 0
+            if len(values) == count:
+                return values
+    raise ValueError("short delta payload")
+
+
+class Frame(object):
+    def __init__(self, source, ftype, sequence, payload):
+        self.source   = source
+        self.type     = ftype
+        self.sequence = sequence
+        self.payload  = payload
+        self.sets     = []
+        self.keyframe = False
+        self.timestamp = None
+        if ftype == MPIPE_FRAME_ADC_BLOCK:
+            channels, set_count, bits, self.timestamp = struct.unpack("<BBBI", payload[:7])
+            samples = unpack_samples(payload[7:], channels * set_count, bits)
+            self.sets = [samples[i * channels:(i + 1) * channels] for i in range(set_count)]
+        elif ftype == MPIPE_FRAME_ADC_DELTA:
+            self.channels, self.set_count, self.bits, flags, self.timestamp = struct.unpack("<BBBBI", payload[:8])
+            self.keyframe = bool(flags & MPIPE_DELTA_FLAG_KEYFRAME)
+            self.deltas = read_varints(payload[8:], self.channels * self.set_count)
+        elif ftype == MPIPE_FRAME_ADC_CAPTURE:
+            channels, bits, self.window, self.pre, self.offset, set_count, self.timestamp = struct.unpack(
+                "<BBHHHBI", payload[:13])
+            samples = unpack_samples(payload[13:], channels * set_count, bits)
+            self.sets = [samples[i * channels:(i + 1) * channels] for i in range(set_count)]
+        elif ftype == MPIPE_FRAME_ADC_STATS:
+            channels, frac_bits, self.set_count = struct.unpack("<BBI", payload[:6])
+            scale = float(1 << frac_bits)
+            self.stats = []
+            for ch in range(channels):
+                lo, hi, mean, rms, var = struct.unpack("<HHIII", payload[6 + ch * 16:22 + ch * 16])
+                self.stats.append((lo, hi, mean / scale, rms / scale, var / scale))
+        elif ftype in (MPIPE_FRAME_ADC_SPECTRUM, MPIPE_FRAME_ADC_PEAKS):
+            self.channel, self.window, self.size, self.sample_rate, frac_bits = struct.unpack("<BBHIB", payload[:9])
+            scale = float(1 << frac_bits)
+            if ftype == MPIPE_FRAME_ADC_SPECTRUM:
+                self.offset, count = struct.unpack("<HB", payload[9:12])
+                self.bins = [m / scale for m in struct.unpack("<%dH" % count, payload[12:12 + 2 * count])]
+            else:
+                count = bytearray(payload)[9]
+                values = struct.unpack("<%dH" % (2 * count), payload[10:10 + 4 * count])
+                self.peaks = [(values[2 * i], values[2 * i + 1] / scale) for i in range(count)]
+        elif ftype == MPIPE_FRAME_GAP:
+            self.set_count, self.dropped = struct.unpack("<II", payload[:8])
+        elif ftype == MPIPE_FRAME_SERIAL_DATA:
+            self.flags, self.timestamp = struct.unpack("<BI", payload[:5])
+            self.data = payload[5:]
+        elif ftype == MPIPE_FRAME_FILE_DATA:
+            self.dump, self.flags = struct.unpack("<BB", payload[:2])
+            self.data = payload[2:]
+        elif ftype == MPIPE_FRAME_CAN_RX:
+            # (sequence, timestamp, id, time, filter, dlc, data) per frame
+            count = bytearray(payload)[0]
+            self.can_frames = [CAN_RECORD.unpack(payload[1 + i * CAN_RECORD.size:1 + (i + 1) * CAN_RECORD.size])
+                               for i in range(count)]
+
+    def frequency(self, bin_):
+        return bin_ * self.sample_rate / self.size
+
+    def undelta(self, last):
+        """ rebuild the sets of a delta frame, last holds the previous sample per channel """
+        if self.keyframe:
+            last = [0] * self.channels
+        last = list(last)
+        self.sets = []
+        for i in range(self.set_count):
+            for ch in range(self.channels):
+                last[ch] = (last[ch] + self.deltas[i * self.channels + ch]) & 0xffff
+            self.sets.append(list(last))
+        return last
+
+
+def decode_frame(encoded):
+    """ decode one delimiter stripped frame, raises ValueError on corruption """
+    raw = cobs_decode(encoded)
+    if len(raw) < HEADER.size + 2:
+        raise ValueError("short frame")
+    body, crc = raw[:-2], struct.unpack("<H", raw[-2:])[0]
+    if crc16(body) != crc:
+        raise ValueError("crc mismatch")
+    source, ftype, sequence = HEADER.unpack(body[:HEADER.size])
+    return Frame(source, ftype, sequence, body[HEADER.size:])
+
+
+class Decoder(object):
+    def __init__(self):
+        self.buffer     = bytearray()
+        self.frames     = 0
+        self.errors     = 0
+        self.samples    = 0
+        self.gaps       = 0     # holes the firmware did not announce, lost on the link
+        self.missing    = 0     # sets announced missing by gap frames
+        self.dropped    = 0     # of those, sets the firmware lost
+        self.resyncs    = 0
+        self.next_seq   = {}
+        self.last       = {}    # delta state per source, None until a keyframe
+        self.captures   = 0
+        self.partial    = {}    # capture window or spectrum being assembled per source
+        self.spectra    = 0
+
+    def feed(self, data):
+        """ feed raw stream bytes, yields decoded frames """
+        self.buffer += data
+        while True:
+            end = self.buffer.find(b"\x00")
+            if end < 0:
+                return
+            encoded = bytes(self.buffer[:end])
+            del self.buffer[:end + 1]
+            if not encoded:
+                continue
+            try:
+                frame = decode_frame(encoded)
+            except (ValueError, struct.error):
+                self.errors += 1
+                # the lost frame may have been a delta frame of any source
+                self.last.clear()
+                continue
+            self.frames += 1
+            if frame.type == MPIPE_FRAME_ADC_DELTA:
+                last = self.last.get(frame.source)
+                if not frame.keyframe and last is None:
+                    self.resyncs += 1
+                    continue
+                self.last[frame.source] = frame.undelta(last)
+            if frame.type == MPIPE_FRAME_ADC_CAPTURE:
+                capture = self.assemble(frame)
+                if capture is not None:
+                    yield capture
+                continue
+            if frame.type == MPIPE_FRAME_ADC_SPECTRUM:
+                spectrum = self.assemble_spectrum(frame)
+                if spectrum is not None:
+                    yield spectrum
+                continue
+            if frame.type == MPIPE_FRAME_GAP:
+                self.missing += frame.set_count
+                self.dropped += frame.dropped
+                self.next_seq[frame.source] = (frame.sequence + frame.set_count) & 0xffffffff
+            if frame.type == MPIPE_FRAME_SERIAL_DATA:
+                # the sequence is the byte offset in the capture
+                expected = self.next_seq.get(frame.source)
+                if expected is not None and expected != frame.sequence:
+                    self.gaps += 1
+                self.next_seq[frame.source] = (frame.sequence + len(frame.data)) & 0xffffffff
+            if frame.type == MPIPE_FRAME_CAN_RX:
+                for record in frame.can_frames:
+                    expected = self.next_seq.get(frame.source)
+                    if expected is not None and expected != record[0]:
+                        self.gaps += 1
+                    self.next_seq[frame.source] = (record[0] + 1) & 0xffffffff
+            if frame.type in (MPIPE_FRAME_ADC_BLOCK, MPIPE_FRAME_ADC_DELTA):
+                expected = self.next_seq.get(frame.source)
+                if expected is not None and expected != frame.sequence:
+                    self.gaps += 1
+                self.next_seq[frame.source] = (frame.sequence + len(frame.sets)) & 0xffffffff
+                self.samples += sum(len(s) for s in frame.sets)
+            yield frame
+
+
+    def assemble(self, frame):
+        """ collect the frames of a capture window, returns the first frame with all sets once complete """
+        capture = self.partial.get(frame.source)
+        if frame.offset == 0:
+            capture = self.partial[frame.source] = frame
+        elif capture is None or capture.sequence != frame.sequence or len(capture.sets) != frame.offset:
+            # lost part of the window
+            self.partial.pop(frame.source, None)
+            self.gaps += 1
+            return None
+        else:
+            capture.sets += frame.sets
+        if len(capture.sets) < capture.window:
+            return None
+        del self.partial[frame.source]
+        self.captures += 1
+        self.samples += sum(len(s) for s in capture.sets)
+        return capture
+
+    def assemble_spectrum(self, frame):
+        """ collect the frames of an adc.fft spectrum, returns the first frame with all bins once complete """
+        key = (frame.source, MPIPE_FRAME_ADC_SPECTRUM)
+        spectrum = self.partial.get(key)
+        if frame.offset == 0:
+            spectrum = self.partial[key] = frame
+        elif spectrum is None or spectrum.sequence != frame.sequence or len(spectrum.bins) != frame.offset:
+            self.partial.pop(key, None)
+            self.gaps += 1
+            return None
+        else:
+            spectrum.bins += frame.bins
+        if len(spectrum.bins) < frame.size // 2 + 1:
+            return None
+        del self.partial[key]
+        self.spectra += 1
+        return spectrum
+
+
+def print_frame(frame):
+    name = SOURCE_NAMES.get(frame.source, "%02X" % frame.source)
+    if frame.type in (MPIPE_FRAME_ADC_SPECTRUM, MPIPE_FRAME_ADC_PEAKS):
+        print("{}:spectrum {} input {} size {} window {} bin width {:.3f} Hz".format(
+            name, frame.sequence, frame.channel, frame.size, FFT_WINDOW_NAMES[frame.window],
+            frame.sample_rate / frame.size))
+        if frame.type == MPIPE_FRAME_ADC_PEAKS:
+            for bin_, mag in frame.peaks:
+                print("{}:  {:10.3f} Hz {:9.3f}".format(name, frame.frequency(bin_), mag))
+        else:
+            for bin_, mag in enumerate(frame.bins):
+                print("{}:  {:10.3f} Hz {:9.3f}".format(name, frame.frequency(bin_), mag))
+        return
+    if frame.type == MPIPE_FRAME_GAP:
+        print("{}:gap at {:08X} sets {} dropped {}".format(name, frame.sequence, frame.set_count, frame.dropped))
+        return
+    if frame.type == MPIPE_FRAME_SERIAL_DATA:
+        flags = [n for i, n in enumerate(SERIAL_FLAG_NAMES) if frame.flags & (1 << i)]
+        print("{}:offset {} time {} us {} {!r}".format(name, frame.sequence, frame.timestamp, ",".join(flags) or "-",
+                                                      bytes(frame.data)))
+        return
+    if frame.type == MPIPE_FRAME_FILE_DATA:
+        print("{}:dump {} offset {} bytes {}{}{}".format(name, frame.dump, frame.sequence, len(frame.data),
+                                                    " last" if frame.flags & MPIPE_FILE_FLAG_LAST else "",
+                                                    " error" if frame.flags & MPIPE_FILE_FLAG_ERROR else ""))
+        return
+    if frame.type == MPIPE_FRAME_CAN_RX:
+        for sequence, timestamp, id_, bit_time, filter_, dlc, data in frame.can_frames:
+            print("{}:{} time {} us bit time {:5d} filter {:2d} id {}{}{} [{}] {}".format(
+                name, sequence, timestamp, bit_time, filter_,
+                ("%08X" if id_ & CAN_ID_EXT else "%03X") % (id_ & 0x1fffffff),
+                " ext" if id_ & CAN_ID_EXT else "", " rtr" if id_ & CAN_ID_RTR else "",
+                dlc, " ".join("%02X" % b for b in bytearray(data[:dlc]))))
+        return
+    if frame.type == MPIPE_FRAME_ADC_STATS:
+        print("{}:window {} sets {}".format(name, frame.sequence, frame.set_count))
+        for ch, (lo, hi, mean, rms, var) in enumerate(frame.stats):
+            print("{}:  ch{} min {} max {} mean {:.3f} rms {:.3f} var {:.3f} std {:.3f}".format(
+                name, ch, lo, hi, mean, rms, var, var ** 0.5))
+        return
+    if frame.type == MPIPE_FRAME_ADC_CAPTURE:
+        # one line per set, numbered relative to the trigger set
+        print("{}:capture {} trigger at set {} time {} us".format(name, frame.sequence, frame.pre, frame.timestamp))
+        for i, samples in enumerate(frame.sets):
+            print("{}:{:+6d} {}".format(name, i - frame.pre, "".join("%04X" % s for s in samples)))
+        return
+    if frame.timestamp is not None:
+        print("{}:block {} time {} us".format(name, frame.sequence, frame.timestamp))
+    for i, samples in enumerate(frame.sets):
+        print("{}:{:08X}{}".format(name, frame.sequence + i, "".join("%04X" % s for s in samples)))
+
+
+def open_input(path):
+    if os.path.exists(path) and not path.startswith("/dev/"):
+        return open(path, "rb"), False
+    import serial
+    return serial.Serial(path, timeout=0.1), True
+
+
+def grant(port, count):
+    """ send a K<hex count> credit line """
+    port.write(("K%X\r\n" % count).encode("ascii"))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode binary mpipe stream")
+    parser.add_argument("input", help="serial port or captured file")
+    parser.add_argument("--stats", action="store_true", help="print throughput instead of samples")
+    parser.add_argument("--credit", type=int, default=0, help="bytes to grant ahead with mpipe.flow enabled")
+    args = parser.parse_args()
+
+    try:
+        port, is_serial = open_input(args.input)
+    except Exception as e:
+        u.error("Error opening {}: {}".format(args.input, e))
+        sys.exit(1)
+
+    decoder = Decoder()
+    start = time.time()
+    last = start
+    last_samples = 0
+
+    if is_serial and args.credit > 0:
+        grant(port, args.credit)
+
+    try:
+        while True:
+            data = port.read(4096)
+            if not data and not is_serial:
+                break
+            if is_serial and args.credit > 0 and data:
+                # hand back what was consumed
+                grant(port, len(data))
+            for frame in decoder.feed(data):
+                if not args.stats:
+                    print_frame(frame)
+            now = time.time()
+            if args.stats and now - last >= 1.0:
+                rate = (decoder.samples - last_samples) / (now - last)
+                u.info("frames {} samples/s {:.0f} crc_errors {} seq_gaps {} resync_drops {} missing_sets {} dropped_sets {}\n".format(
+                    decoder.frames, rate, decoder.errors, decoder.gaps, decoder.resyncs, decoder.missing, decoder.dropped))
+                last, last_samples = now, decoder.samples
+    except KeyboardInterrupt:
+        pass
+
+    if args.stats or not is_serial:
+        u.info("total frames {} samples {} crc_errors {} seq_gaps {} resync_drops {} missing_sets {} dropped_sets {}\n".format(
+            decoder.frames, decoder.samples, decoder.errors, decoder.gaps, decoder.resyncs, decoder.missing, decoder.dropped))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,102 @@
+#!/usr/bin/env python
+# file: sd_dump.py
+
+"""
+Copy a file off the sd card over mpipe with sd.dump (see src/fetch/fetch_sd.c)
+
+The card is connected and mounted first. The frames are checked for
+missing or repeated offsets, the firmware report and the rate seen by the
+host are printed at the end.
+
+Example:
+
+    ./sd_dump.py --shell /dev/ttyACM0 --mpipe /dev/ttyACM1 --file ADC.BIN --out adc.bin
+    ./sd_dump.py --shell /dev/ttyACM0 --mpipe /dev/ttyACM1 --file ADC.BIN --offset 16384 --length 1048576
+"""
+
+from __future__ import division
+from __future__ import print_function
+
+import sys
+import time
+import argparse
+
+import utils as u
+import mpipe_bench as mb
+import mpipe_decode as md
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Copy a file off the sd card over mpipe")
+    parser.add_argument("--shell", required=True, help="shell serial port")
+    parser.add_argument("--mpipe", required=True, help="mpipe serial port")
+    parser.add_argument("--file", required=True, help="file on the card")
+    parser.add_argument("--out", help="local file, default the name on the card")
+    parser.add_argument("--offset", type=int, default=0)
+    parser.add_argument("--length", type=int, help="bytes, default to the end of the file")
+    parser.add_argument("--timeout", type=float, default=10.0, help="seconds without data before giving up")
+    args = parser.parse_args()
+
+    import serial
+    shell = serial.Serial(args.shell, timeout=0.1)
+    mpipe = serial.Serial(args.mpipe, timeout=0.1)
+
+    mb.command(shell, "mpipe.format(binary)")
+    mpipe.reset_input_buffer()
+
+    line = "sd.dump({}, {}".format(args.file, args.offset)
+    if args.length is not None:
+        line += ", {}".format(args.length)
+    shell.write((line + ")\r\n").encode())
+
+    decoder = md.Decoder()
+    out = open(args.out or args.file, "wb")
+    expected = args.offset
+    dump = None
+    errors = 0
+    done = False
+    start = time.time()
+    last = start
+
+    while not done:
+        data = mpipe.read(65536)
+        now = time.time()
+        if not data:
+            if now - last > args.timeout:
+                u.error("no data for {:.0f} s\n".format(args.timeout))
+                break
+            continue
+        last = now
+        for frame in decoder.feed(data):
+            if frame.type != md.MPIPE_FRAME_FILE_DATA:
+                continue
+            if dump is None:
+                dump = frame.dump
+            if frame.dump != dump:
+                continue
+            if frame.sequence != expected:
+                u.error("offset {} expected {}\n".format(frame.sequence, expected))
+                errors += 1
+                out.seek(frame.sequence - args.offset)
+            out.write(frame.data)
+            expected = frame.sequence + len(frame.data)
+            if frame.flags & md.MPIPE_FILE_FLAG_ERROR:
+                u.error("the firmware could not read the whole file\n")
+                errors += 1
+            if frame.flags & md.MPIPE_FILE_FLAG_LAST:
+                done = True
+    elapsed = time.time() - start
+    out.close()
+
+    # the firmware reports once the last buffer has gone out
+    time.sleep(0.3)
+    sys.stdout.write(shell.read(4096).decode(errors="replace"))
+
+    count = expected - args.offset
+    u.info("bytes {} in {:.2f} s, {:.0f} bytes/s, offset_errors {} frame_crc_errors {}\n".format(
+        count, elapsed, count / elapsed if elapsed > 0 else 0, errors, decoder.errors))
+    sys.exit(0 if done and errors == 0 and decoder.errors == 0 else 1)
+
+
+if __name__ == "__main__":
+    main()
@@ -11,6 +11,7 @@ MARIONETTE_USB           = $(MARIONETTE_TOP)/src/usb
 MARIONETTE_FETCH         = $(MARIONETTE_TOP)/src/fetch
 MARIONETTE_MSHELL        = $(MARIONETTE_TOP)/src/mshell
 MARIONETTE_MPIPE         = $(MARIONETTE_TOP)/src/mpipe
+MARIONETTE_MCARD         = $(MARIONETTE_TOP)/src/mcard
 MARIONETTE_BOARDS        = $(MARIONETTE_TOP)/src/boards
 
 # make rules